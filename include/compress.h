@@ -0,0 +1,129 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_NONE 0 /* A plain archive */
+#define COMPRESS_GZIP 1 /* A stream of gzip members */
+#define COMPRESS_ZSTD 2 /* A stream of zstd frames */
+#define COMPRESS_BLOCK_SIZE (1024 * 1024) /* Archive bytes compressed as one independent member */
+#define COMPRESS_BLOCKS_PER_THREAD 2 /* Blocks in flight for each compressing thread */
+#define COMPRESS_MAGIC_SIZE 4 /* Bytes needed to recognise a compressed archive */
+#define GZIP_EXTRA_SIZE 8 /* Length of the extra field recording a member's size */
+#define GZIP_EXTRA_OFFSET 16 /* Offset of the member size within a member */
+#define GZIP_TRAILER_SIZE 8 /* CRC-32 and length following the deflate data */
+#define DECOMPRESS_BLOCK_LIMIT (64 * 1024 * 1024) /* Largest member decoded on its own */
+#define DECOMPRESS_READ_SIZE (256 * 1024) /* Compressed bytes read at once */
+
+/* Represents the progress of a block through a pool */
+typedef enum CompressState { BLOCK_FREE, BLOCK_FILLING, BLOCK_QUEUED, BLOCK_WORKING, BLOCK_DONE } CompressState;
+
+/* Represents one independently compressed or decompressed block */
+typedef struct CompressBlock {
+    /* The progress of the block, a CompressState */
+    int state;
+    /* The bytes to transform */
+    unsigned char* in;
+    /* The number of bytes to transform */
+    size_t in_length;
+    /* The capacity of the input */
+    size_t in_capacity;
+    /* The transformed bytes */
+    unsigned char* out;
+    /* The number of transformed bytes */
+    size_t out_length;
+    /* The capacity of the output */
+    size_t out_capacity;
+} CompressBlock;
+
+/* Represents a pool of threads transforming blocks that leave in order */
+typedef struct CompressPool {
+    /* The format of the compressed stream */
+    int format;
+    /* Whether the threads compress blocks rather than decompress them */
+    int compressing;
+    /* The compression level */
+    int level;
+    /* A ring of blocks in stream order */
+    CompressBlock* blocks;
+    /* The number of slots in the ring */
+    size_t capacity;
+    /* The sequence number of the oldest block in use */
+    size_t first;
+    /* The number of blocks in use */
+    size_t count;
+    /* The sequence number of the next block for a thread to take */
+    size_t next_work;
+    /* The number of threads */
+    size_t num_threads;
+    /* The threads */
+    pthread_t* threads;
+    /* The lock guarding the ring */
+    pthread_mutex_t lock;
+    /* Signalled when a block is queued */
+    pthread_cond_t work_cond;
+    /* Signalled when a block is done */
+    pthread_cond_t done_cond;
+    /* Whether the threads should exit */
+    int shutdown;
+} CompressPool;
+
+/* Represents the compressing end of an archive being written */
+typedef struct Compressor {
+    /* The file descriptor the compressed stream is written to */
+    int fd;
+    /* The block being filled, not yet handed to the pool */
+    CompressBlock* filling;
+    /* The threads compressing blocks */
+    CompressPool pool;
+} Compressor;
+
+/* Represents the decompressing end of an archive being read */
+typedef struct Decompressor {
+    /* The file descriptor the compressed stream is read from */
+    int fd;
+    /* The format of the compressed stream */
+    int format;
+    /* Compressed bytes read but not yet consumed */
+    unsigned char* input;
+    /* The index of the first unconsumed byte */
+    size_t input_start;
+    /* The number of valid bytes in the input */
+    size_t input_end;
+    /* The capacity of the input */
+    size_t input_capacity;
+    /* Whether the compressed stream has ended */
+    int input_eof;
+    /* Whether the rest of the stream must be decoded by this thread */
+    int sequential;
+    /* Whether blocks are drained before switching to sequential decoding */
+    int sequential_pending;
+    /* The gzip stream used for sequential decoding */
+    z_stream gzip;
+    /* Whether the gzip stream is initialised */
+    int gzip_active;
+    /* Whether a gzip member has ended, after which zero bytes end the stream */
+    int member_ended;
+#ifdef HAVE_ZSTD
+    /* The zstd stream used for sequential decoding */
+    ZSTD_DStream* zstd;
+#endif
+    /* The number of bytes of the oldest block already returned */
+    size_t out_offset;
+    /* The threads decompressing members */
+    CompressPool pool;
+} Decompressor;
+
+int compressDetect(const unsigned char* bytes, size_t length);
+Compressor* compressOpen(int fd, int format, size_t num_threads);
+void compressWrite(Compressor* compressor, const void* buf, size_t count);
+void compressClose(Compressor* compressor);
+Decompressor* decompressOpen(int fd, int format, const void* initial, size_t initial_length, size_t num_threads);
+ssize_t decompressRead(Decompressor* decompressor, void* buf, size_t count);
+void decompressClose(Decompressor* decompressor);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "safe_alloc.h"
+
+#define DEDUP_INITIAL_SLOTS 64 /* Initial number of slots in a dedup table, a power of two */
+#define DEDUP_INITIAL_FILES 64 /* Initial capacity of the recorded files */
+#define DEDUP_MIN_SIZE 1025 /* Smallest file that takes more room stored than as a marked link, three blocks */
+#define DEDUP_READ_SIZE (1024 * 1024) /* Bytes hashed per read, a multiple of the hash's block */
+#define DEDUP_NONE SIZE_MAX /* Marks the end of a list of files */
+
+/* Represents the progress of hashing a recorded file */
+typedef enum DedupState { DEDUP_UNHASHED, DEDUP_HASHED, DEDUP_CHANGED } DedupState;
+
+/* Represents a file archived with its data, which later identical files may
+ * link to */
+typedef struct DedupFile {
+    /* The path the file was archived under */
+    const char* path;
+    /* The 128-bit hash of the contents, once hashed */
+    uint64_t hash[2];
+    /* The device holding the file */
+    dev_t dev;
+    /* The inode number of the file */
+    ino_t ino;
+    /* The last modification time when the file was archived */
+    struct timespec mtime;
+    /* The last status change time when the file was archived */
+    struct timespec ctime;
+    /* Whether the contents were hashed, or changed before they could be */
+    DedupState state;
+    /* The index of the next file of the same size, or DEDUP_NONE */
+    size_t next;
+} DedupFile;
+
+/* Represents the files recorded with one size */
+typedef struct DedupSlot {
+    /* The size of the files, or 0 if the slot is empty */
+    off_t size;
+    /* The index of the most recent file of this size */
+    size_t first;
+} DedupSlot;
+
+/* Represents an open-addressing map from file sizes to the files archived with
+ * that size. A file is only hashed once another file of its size turns up, so
+ * trees of distinct sizes are never read twice. */
+typedef struct DedupTable {
+    /* The slots of the map */
+    DedupSlot* slots;
+    /* The number of slots, a power of two */
+    size_t capacity;
+    /* The number of slots in use */
+    size_t count;
+    /* The recorded files */
+    DedupFile* files;
+    /* The number of recorded files */
+    size_t num_files;
+    /* The capacity of the recorded files */
+    size_t files_capacity;
+    /* The memory holding the recorded paths */
+    Arena paths;
+    /* The buffer files are hashed through, allocated on first use */
+    unsigned char* buffer;
+} DedupTable;
+
+void dedupInit(DedupTable* table);
+const char* dedupRecord(DedupTable* table, const struct stat* st, const char* path);
+void dedupFree(DedupTable* table);
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "kiwitar.h"
+
+#define EXTRACT_QUEUE_DEPTH 64 /* Files queued per worker before the parser waits */
+#define EXTRACT_BUFFER_LIMIT (8 * 1024 * 1024) /* Largest streamed file handed to a worker */
+#define EXTRACT_INITIAL_DIRS 16 /* Initial capacity of the directory list */
+#define EXTRACT_BATCH_SIZE 32 /* Small files a worker creates, writes and closes together */
+#define EXTRACT_BATCH_FILE_LIMIT (64 * 1024) /* Largest file a worker writes as part of a batch */
+
+/* Represents a regular file waiting to be written */
+typedef struct ExtractJob {
+    /* The next job of the same worker */
+    struct ExtractJob* next;
+    /* The path to create, stored in the same allocation as the job */
+    char* path;
+    /* The permission bits of the file */
+    mode_t mode;
+    /* The last modification time of the file */
+    time_t mtime;
+    /* The size of the file */
+    off_t size;
+    /* The offset of the data in the archive, used when data is NULL */
+    off_t offset;
+    /* The data of the file when the archive cannot be read at an offset */
+    unsigned char* data;
+} ExtractJob;
+
+/* Represents a directory whose metadata is set once everything is written */
+typedef struct ExtractDir {
+    /* The path of the directory; owned by the list */
+    char* path;
+    /* The permission bits of the directory */
+    mode_t mode;
+    /* The last modification time of the directory */
+    time_t mtime;
+} ExtractDir;
+
+/* Represents a thread writing files and the queue feeding it */
+typedef struct ExtractWorker {
+    /* The extractor the worker belongs to */
+    struct Extractor* extractor;
+    /* The thread */
+    pthread_t thread;
+    /* The oldest queued job */
+    ExtractJob* head;
+    /* The newest queued job */
+    ExtractJob* tail;
+    /* The jobs being written, linked through next, or NULL */
+    ExtractJob* current;
+    /* Signalled when a job is queued */
+    pthread_cond_t cond;
+} ExtractWorker;
+
+/* Represents a pool of workers writing the files parsed out of an archive */
+typedef struct Extractor {
+    /* The file descriptor of the archive */
+    int archive_fd;
+    /* The number of worker threads, or 0 to write files inline */
+    size_t num_workers;
+    /* Whether workers write runs of small files in one directory as batches */
+    int batch;
+    /* The workers */
+    ExtractWorker* workers;
+    /* The number of jobs queued across all workers */
+    size_t queued;
+    /* The number of data bytes held by queued jobs */
+    size_t inflight;
+    /* The most data bytes queued jobs may hold */
+    size_t budget;
+    /* The directories extracted so far */
+    ExtractDir* dirs;
+    /* The number of directories extracted */
+    size_t num_dirs;
+    /* The capacity of the directory list */
+    size_t dirs_capacity;
+    /* The lock guarding the queues */
+    pthread_mutex_t lock;
+    /* Signalled when a worker finishes a job */
+    pthread_cond_t space_cond;
+    /* Whether the workers should exit once their queues are empty */
+    int shutdown;
+    /* Whether a member was refused, set atomically */
+    int failed;
+} Extractor;
+
+/* Represents what the archive parser needs while extracting members */
+typedef struct ExtractContext {
+    /* The extractor writing the members */
+    Extractor* extractor;
+    /* The settings of the archive operation */
+    const ArchiveOptions* options;
+} ExtractContext;
+
+Extractor* extractOpen(int archive_fd, size_t num_workers, size_t budget, int batch);
+int extractCreateFile(Extractor* extractor, char* path, mode_t mode, off_t size);
+void extractFinishFile(int fd, time_t mtime);
+void extractFile(Extractor* extractor, ExtractJob* job);
+void extractAwaitPath(Extractor* extractor, const char* path);
+void extractDirectory(Extractor* extractor, char* path, mode_t mode, time_t mtime);
+void extractSymlink(Extractor* extractor, char* path, const char* target);
+void extractHardLink(Extractor* extractor, char* path, const char* target);
+void extractCopy(Extractor* extractor, char* path, const char* target, mode_t mode, time_t mtime);
+void extractRemove(const char* path);
+void extractPrune(const char* path, const char* dumpdir, size_t size);
+int extractClose(Extractor* extractor);
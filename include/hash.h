@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_FIBONACCI 0x9e3779b97f4a7c15ULL /* 2^64 divided by the golden ratio */
+
+/**
+ * Picks the first slot to probe for a key in an open-addressing map. Fibonacci
+ * hashing spreads keys that differ in a few low bits, such as consecutive ids
+ * or inode numbers, over the slots.
+ *
+ * @param key the key to place
+ * @param capacity the number of slots, a power of two
+ * @return the slot to probe first
+ */
+static inline size_t hashSlot(uint64_t key, size_t capacity) {
+  return (size_t)((key * HASH_FIBONACCI) >> 32) & (capacity - 1);
+}
+
+/**
+ * Moves a probe on to the next slot, wrapping around at the end
+ *
+ * @param slot the slot just probed
+ * @param capacity the number of slots, a power of two
+ * @return the slot to probe next
+ */
+static inline size_t hashNextSlot(size_t slot, size_t capacity) { return (slot + 1) & (capacity - 1); }
+
+/**
+ * Tells whether a map must grow before it takes one more key, which keeps it
+ * at most three quarters full so that probes stay short
+ *
+ * @param count the number of slots in use
+ * @param capacity the number of slots
+ * @return nonzero if the map must grow first
+ */
+static inline int hashMustGrow(size_t count, size_t capacity) { return (count + 1) * 4 > capacity * 3; }
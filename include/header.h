@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "kiwitar.h"
+
+#define HEADER_OK 0
+#define HEADER_NONCONFORMING 1 /* A field needed an extension outside of USTAR */
+#define HEADER_CORRUPT 2 /* The checksum or a numeric field is invalid */
+#define HEADER_LONG_PATH 4 /* The path does not fit the name and prefix fields */
+#define HEADER_LONG_LINK 8 /* The link target does not fit the linkname field */
+#define HEADER_PATH_SIZE (ARCHIVE_PREFIX_SIZE + ARCHIVE_NAME_SIZE + 2) /* Longest joined path and its terminator */
+#define PAX_RECORD_OVERHEAD 24 /* Bytes of an extended record besides its key and value */
+#define PAX_RECORDS_LIMIT (1024 * 1024) /* Largest block of extended records accepted */
+#define PAX_HEADERS_DIR "PaxHeaders" /* Directory named in the header holding extended records */
+#define PAX_GLOBAL_NAME "GlobalHead" /* Name described by a header of global records */
+#define PAX_DELETED_KEY "KIWITAR.deleted" /* Global record listing the paths removed since the previous archive */
+#define PAX_DUPLICATE_KEY "KIWITAR.duplicate" /* Record marking a hard link that stands for an identical file */
+
+/* Represents the fields of a header decoded into host form */
+typedef struct ArchiveMember {
+    /* The full name of the member, pointing at header_path or at an extended
+     * record */
+    char* path;
+    /* The target of a link, pointing at header_linkname or at an extended
+     * record */
+    char* linkname;
+    /* The name joined from the prefix and name fields */
+    char header_path[HEADER_PATH_SIZE];
+    /* The target held in the linkname field */
+    char header_linkname[ARCHIVE_LINKNAME_SIZE + NULL_TERMINATOR_SIZE];
+    /* The name of the owner */
+    char uname[ARCHIVE_UNAME_SIZE + NULL_TERMINATOR_SIZE];
+    /* The name of the group */
+    char gname[ARCHIVE_GNAME_SIZE + NULL_TERMINATOR_SIZE];
+    /* The permission bits */
+    mode_t mode;
+    /* The id of the owner */
+    uid_t uid;
+    /* The id of the group */
+    gid_t gid;
+    /* The number of data bytes following the header */
+    off_t size;
+    /* The last modification time */
+    time_t mtime;
+    /* The offset of the header in the archive, set by the reader */
+    off_t header_offset;
+    /* The type of the member, a FileType */
+    char typeflag;
+    /* The size the member expands to if it is sparse, otherwise -1 */
+    off_t sparse_size;
+    /* Whether a hard link stands for an identical copy of its target */
+    int duplicate;
+} ArchiveMember;
+
+/* Represents the extended records of a pax header that apply to the next
+ * member */
+typedef struct PaxAttributes {
+    /* The path of the member, or NULL */
+    char* path;
+    /* The target of a link, or NULL */
+    char* linkpath;
+    /* The number of data bytes following the header, or -1 */
+    off_t size;
+    /* The real name of a sparse member, or NULL */
+    char* sparse_name;
+    /* The size a sparse member expands to, or -1 */
+    off_t sparse_size;
+    /* The major version of the sparse format, or -1 */
+    long long sparse_major;
+    /* The minor version of the sparse format, or -1 */
+    long long sparse_minor;
+    /* The paths removed since the previous archive, each followed by a
+     * newline, or NULL */
+    char* deleted;
+    /* Whether a hard link stands for an identical copy of its target */
+    int duplicate;
+} PaxAttributes;
+
+int buildHeader(USTARHeader* header, const char* path, const struct stat* st, const char* linkname);
+unsigned int headerChecksum(const USTARHeader* header);
+void sealHeader(USTARHeader* header);
+int isEndBlock(const USTARHeader* header);
+size_t headerPath(const USTARHeader* header, char* path);
+int parseHeader(const USTARHeader* header, ArchiveMember* member);
+void headerAuxName(char* name, const char* path, const char* directory);
+size_t paxRecord(char* records, const char* key, const char* value);
+void buildPaxHeader(USTARHeader* header, const char* path, const struct stat* st, size_t length, char typeflag);
+int parsePax(char* records, size_t length, PaxAttributes* pax);
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "path_table.h"
+
+#define INDEX_MAGIC "KWTIDX2" /* Identifies an index file and its layout */
+#define INDEX_SUFFIX ".idx" /* Appended to the archive name to name its index */
+#define INDEX_INITIAL_ENTRIES 64 /* Initial capacity of an index being built */
+#define INDEX_INITIAL_STRINGS 4096 /* Initial capacity of the path table */
+#define INDEX_DAMAGED ((size_t)-1) /* Returned by a lookup that met an entry outside the file */
+#define INDEX_FNV_OFFSET 0xcbf29ce484222325ULL /* Starting value of the header hash */
+#define INDEX_FNV_PRIME 0x100000001b3ULL /* Multiplier of the header hash */
+
+/* Represents the start of an index file. Every field is stored in the byte
+ * order of the machine that wrote the index. */
+typedef struct IndexHeader {
+    /* INDEX_MAGIC followed by a NUL */
+    char magic[8];
+    /* The number of entries */
+    uint64_t count;
+    /* The size of the archive the index describes, used to detect staleness */
+    uint64_t archive_size;
+    /* The offset of the path table from the start of the file */
+    uint64_t strings_offset;
+    /* The seconds of the archive's modification time when it was indexed */
+    int64_t archive_mtime;
+    /* The nanoseconds of the archive's modification time */
+    uint64_t archive_mtime_nsec;
+    /* The offset of the last header the index records */
+    uint64_t last_header;
+    /* A hash of the archive's first block and of its last header, which tell
+     * apart archives of the same size written within one clock tick */
+    uint64_t headers_hash;
+} IndexHeader;
+
+/* Represents one member in an index. Entries follow the header sorted by path,
+ * then by position in the archive. */
+typedef struct IndexEntry {
+    /* The offset of the member's path in the path table */
+    uint64_t path_offset;
+    /* The offset of the member's header in the archive */
+    uint64_t header_offset;
+    /* The size of the member's data */
+    uint64_t size;
+    /* The length of the member's path, without a trailing slash */
+    uint32_t path_length;
+    /* The type of the member, a FileType */
+    char typeflag;
+    /* Unused bytes that keep entries aligned */
+    char reserved[3];
+} IndexEntry;
+
+/* Represents an index being collected while an archive is written or read */
+typedef struct IndexWriter {
+    /* The IndexEntry records collected so far and their paths */
+    PathTable table;
+} IndexWriter;
+
+/* Represents an index mapped into memory */
+typedef struct ArchiveIndex {
+    /* The mapping of the whole file */
+    unsigned char* map;
+    /* The size of the mapping */
+    size_t map_size;
+    /* The sorted entries */
+    const IndexEntry* entries;
+    /* The number of entries */
+    size_t count;
+    /* The path table */
+    const char* strings;
+    /* The size of the path table */
+    size_t strings_size;
+} ArchiveIndex;
+
+char* indexPath(const char* archive_name);
+IndexWriter* indexWriterOpen(void);
+void indexWriterAdd(IndexWriter* writer, const char* path, off_t header_offset, off_t size, char typeflag);
+int indexWriterMerge(IndexWriter* writer, const ArchiveIndex* index);
+void indexWriterSave(IndexWriter* writer, const char* index_path, int archive_fd);
+void indexWriterClose(IndexWriter* writer);
+ArchiveIndex* indexOpen(const char* index_path, int archive_fd);
+size_t indexFind(const ArchiveIndex* index, const char* path, off_t** offsets);
+void indexClose(ArchiveIndex* index);
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "safe_file.h"
+#include "traverse.h"
 
 #define NULL_TERMINATOR_SIZE 1
 #define DEFAULT_PERMISSIONS (S_IRWXU | S_IRWXG | S_IRWXO)
@@ -25,11 +31,19 @@
 #define ARCHIVE_DEVMAJOR_SIZE 8 /* Major device number portion of header */
 #define ARCHIVE_DEVMINOR_SIZE 8 /* Minor device number portion of header */
 #define ARCHIVE_PREFIX_SIZE 155 /* Prefix portion of the header */
+#define ARCHIVE_PADDING_SIZE 12 /* Unused bytes that complete the header block */
+#define ARCHIVE_END_BLOCKS 2 /* Number of zero blocks marking the end of an archive */
+#define DEFAULT_BLOCKING_FACTOR 20 /* Blocks per record, as with tar's -b */
+#define DEFAULT_THREADS 1 /* Threads listing directories while creating an archive */
+#define ARCHIVE_STDIO "-" /* Archive name standing for standard input or output */
 
 #define PERMISSIONS_WIDTH 10
 #define OWNER_GROUP_WIDTH 17
-#define SIZE_WIDTH 8
+#define FILE_SIZE_WIDTH 8
 #define MTIME_WIDTH 16
+#define TIME_CACHE_SIZE 64 /* Formatted minutes kept for verbose output, a power of two */
+#define TIME_CACHE_EMPTY LLONG_MIN /* Marks an unused slot of the time cache */
+#define LISTING_BUFFER_SIZE (64 * 1024) /* Buffer of the stream verbose output is printed to */
 
 /* Begin typedef declarations */
 
@@ -38,8 +52,31 @@ typedef enum ProgramOptions {
   CREATE_ARCHIVE = 'c',
   LIST_CONTENTS = 't',
   EXTRACT_CONTENTS = 'x',
+  APPEND_ARCHIVE = 'r',
+  UPDATE_ARCHIVE = 'u',
   VERBOSE_OUTPUT = 'v',
   SPECIFY_ARCHIVE_NAME = 'f',
+  BLOCKING_FACTOR = 'b',
+  THREAD_COUNT = 'j',
+  READER_COUNT = 256,
+  READ_AHEAD = 257,
+  INFLIGHT_BYTES = 258,
+  USE_IO_URING = 259,
+  BUILD_INDEX = 260,
+  WRITE_INDEX = 261,
+  COMPRESS_THREADS = 262,
+  USE_ZSTD = 263,
+  DEDUPLICATE = 264,
+  STATS_OUTPUT = 265,
+  STATS_INTERVAL = 266,
+  READ_LIMIT = 267,
+  WRITE_LIMIT = 268,
+  READ_OPS = 269,
+  WRITE_OPS = 270,
+  LIMIT_FILE = 271,
+  BYPASS_CACHE = 272,
+  USE_GZIP = 'z',
+  LISTED_INCREMENTAL = 'g',
   STRICT_FORMAT = 'S',
   OUT_OF_OPTIONS = -1
 } ProgramOptions;
@@ -48,8 +85,14 @@ typedef enum ProgramOptions {
 typedef enum FileType {
   REGULAR_FILE = '0',
   REGULAR_FILE_ALTERNATE = '\0',
+  HARD_LINK = '1',
   SYMBOLIC_LINK = '2',
-  DIRECTORY = '5'
+  DIRECTORY = '5',
+  GNU_DUMPDIR = 'D',
+  GNU_LONG_LINK = 'K',
+  GNU_LONG_NAME = 'L',
+  PAX_GLOBAL = 'g',
+  PAX_EXTENDED = 'x'
 } FileType;
 
 /* Represents a header of the POSIX-specified USTAR archive format */
@@ -69,7 +112,7 @@ typedef struct USTARHeader {
     /* Checksum portion of the header */
     char chksum[ARCHIVE_CHKSUM_SIZE];
     /* File type portion of the header */
-    FileType typeflag;
+    char typeflag;
     /* Link name portion of the header */
     char linkname[ARCHIVE_LINKNAME_SIZE];
     /* Magic number portion of the header */
@@ -86,10 +129,53 @@ typedef struct USTARHeader {
     char devminor[ARCHIVE_DEVMINOR_SIZE];
     /* Prefix portion of the header */
     char prefix[ARCHIVE_PREFIX_SIZE];
+    /* Unused bytes that complete the header block */
+    char padding[ARCHIVE_PADDING_SIZE];
 } USTARHeader;
 
+/* Fails to compile if the header no longer fills exactly one archive block */
+typedef char USTARHeaderSizeCheck[(sizeof(USTARHeader) == ARCHIVE_BLOCK_SIZE) ? 1 : -1];
+
+/* Represents the settings shared by every archive operation */
+typedef struct ArchiveOptions {
+    /* Whether to describe each member as it is processed */
+    int verbose;
+    /* The stream member descriptions are printed to */
+    FILE* listing;
+    /* Whether to reject members that do not conform to the USTAR format */
+    int strict;
+    /* The number of blocks per record, the unit the archive is padded to */
+    size_t blocking_factor;
+    /* The number of threads listing directories */
+    size_t threads;
+    /* The number of threads reading files ahead of the writer, or 0 */
+    size_t readers;
+    /* The most entries the readers may work ahead of the writer */
+    size_t read_ahead;
+    /* The most bytes that may be read but not yet written */
+    size_t inflight;
+    /* Whether to batch file operations through io_uring */
+    int io_uring;
+    /* Whether to write a sidecar index next to a new archive */
+    int index;
+    /* The compression of a new archive, a COMPRESS_ format */
+    int compression;
+    /* The number of threads compressing or decompressing an archive */
+    size_t compress_threads;
+    /* The snapshot manifest of an incremental archive, or NULL */
+    char* snapshot;
+    /* Whether files identical to one archived earlier are stored as links */
+    int dedup;
+    /* Whether to keep the archive and the files out of the page cache */
+    int direct;
+} ArchiveOptions;
+
 /* Begin function prototype declarations */
-void createArchive(char* archive_name, int file_count, char* file_names[], int verbose, int strict);
-void createArchiveHelper(int outfile, char* curr_path, int verbose, int strict);
-void listArchive(char* archive_name, int verbose, int strict);
-void extractArchive(char* archive_name, int verbose, int strict);
+void createArchive(char* archive_name, int file_count, char* file_names[], const ArchiveOptions* options);
+void createArchiveHelper(BufferedFile* outfile, TraverseEntry* entry, const ArchiveOptions* options,
+                         IndexWriter* index);
+void appendArchive(char* archive_name, int file_count, char* file_names[], const ArchiveOptions* options,
+                   int update);
+void listArchive(char* archive_name, int name_count, char* names[], const ArchiveOptions* options);
+void extractArchive(char* archive_name, int name_count, char* names[], const ArchiveOptions* options);
+void buildIndex(char* archive_name, const ArchiveOptions* options);
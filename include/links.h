@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "safe_alloc.h"
+
+#define LINKS_INITIAL_SLOTS 64 /* Initial number of slots in a link table, a power of two */
+
+/* Represents the first path archived for an inode with several links */
+typedef struct LinkEntry {
+    /* The device holding the inode */
+    dev_t dev;
+    /* The inode number */
+    ino_t ino;
+    /* The path the inode was first archived under, or NULL if the slot is empty */
+    const char* path;
+} LinkEntry;
+
+/* Represents an open-addressing map from inodes to the paths they were
+ * archived under */
+typedef struct LinkTable {
+    /* The slots of the map */
+    LinkEntry* entries;
+    /* The number of slots, a power of two */
+    size_t capacity;
+    /* The number of slots in use */
+    size_t count;
+    /* The memory holding the recorded paths */
+    Arena paths;
+} LinkTable;
+
+void linksInit(LinkTable* table);
+const char* linksRecord(LinkTable* table, const struct stat* st, const char* path);
+void linksFree(LinkTable* table);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "kiwitar.h"
+
+#define NAMES_INITIAL_SLOTS 64 /* Initial number of slots in an id cache, a power of two */
+#define NAME_SIZE (ARCHIVE_UNAME_SIZE + NULL_TERMINATOR_SIZE) /* A name as stored in a header, terminated */
+
+/* Represents the resolved name of one user or group id */
+typedef struct NameEntry {
+    /* The id */
+    unsigned long id;
+    /* Whether the slot holds an id */
+    int used;
+    /* Whether the id has a name */
+    int known;
+    /* The name, truncated to what a header can hold */
+    char name[NAME_SIZE];
+} NameEntry;
+
+/* Represents an open-addressing map from ids to names */
+typedef struct NameCache {
+    /* The slots of the map */
+    NameEntry* entries;
+    /* The number of slots, a power of two */
+    size_t capacity;
+    /* The number of slots in use */
+    size_t count;
+} NameCache;
+
+int namesUser(uid_t uid, char* name);
+int namesGroup(gid_t gid, char* name);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Represents entries of one fixed size, each naming a path in a table of
+ * paths stored back to back, as sidecar indexes and manifests are collected */
+typedef struct PathTable {
+    /* The entries collected so far */
+    void* entries;
+    /* The size of an entry in bytes */
+    size_t entry_size;
+    /* The number of entries */
+    size_t count;
+    /* The capacity of the entries */
+    size_t capacity;
+    /* The paths of the entries, back to back */
+    char* strings;
+    /* The number of bytes used in the path table */
+    size_t strings_size;
+    /* The capacity of the path table */
+    size_t strings_capacity;
+} PathTable;
+
+/* Orders two entries, given the path table they point into */
+typedef int (*PathTableCompare)(const void* a, const void* b, void* strings);
+
+void pathTableInit(PathTable* table, size_t entry_size, size_t initial_entries, size_t initial_strings);
+void* pathTableAdd(PathTable* table, const char* path, size_t length, uint64_t* path_offset);
+void pathTableSort(PathTable* table, PathTableCompare compare);
+void pathTableWrite(const PathTable* table, int fd, const void* header, size_t header_size);
+void pathTableFree(PathTable* table);
+int pathCompare(const char* a, size_t a_length, const char* b, size_t b_length);
+int pathInBounds(uint64_t path_offset, uint64_t path_length, size_t strings_size);
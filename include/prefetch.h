@@ -0,0 +1,94 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "traverse.h"
+
+#define PREFETCH_CHUNK_SIZE (256 * 1024) /* Largest buffer a reader fills at once */
+#define DEFAULT_READ_AHEAD 64 /* Entries the readers may work ahead of the writer */
+#define DEFAULT_INFLIGHT_BYTES (64 * 1024 * 1024) /* Bytes read but not yet written */
+#define PREFETCH_BATCH_SIZE 32 /* Small files a reader opens, reads and closes together */
+
+/* Represents the progress of a file through the pipeline */
+typedef enum PrefetchState { JOB_QUEUED, JOB_OPENING, JOB_OPENED, JOB_READING, JOB_READ } PrefetchState;
+
+/* Represents a run of bytes read from a file but not yet written */
+typedef struct PrefetchChunk {
+    /* The next chunk of the same file */
+    struct PrefetchChunk* next;
+    /* The number of bytes in the chunk */
+    size_t length;
+    /* The bytes read */
+    unsigned char data[];
+} PrefetchChunk;
+
+/* Represents an entry travelling from the traversal to the writer */
+typedef struct PrefetchJob {
+    /* The entry to archive; its path is held by the job's arena */
+    TraverseEntry entry;
+    /* The directory the entry is opened relative to, held open until the job
+     * is retired, or NULL if it is opened by its path */
+    TraverseDir* parent;
+    /* The memory of the slot's current entry, cleared when the slot is reused */
+    Arena arena;
+    /* The progress of reading the file, a PrefetchState */
+    int state;
+    /* The open file, or -1 */
+    int fd;
+    /* The number of bytes read so far */
+    off_t read_offset;
+    /* The chunks read but not yet taken by the writer */
+    PrefetchChunk* head;
+    /* The last chunk read */
+    PrefetchChunk* tail;
+} PrefetchJob;
+
+/* Represents a pipeline where reader threads fill buffers for upcoming files
+ * while a single writer drains them in traversal order */
+typedef struct Prefetcher {
+    /* The traversal supplying entries */
+    Traversal* traversal;
+    /* A ring of jobs in traversal order */
+    PrefetchJob* jobs;
+    /* The number of slots in the ring */
+    size_t capacity;
+    /* The sequence number of the writer's job */
+    size_t first;
+    /* The number of jobs in the ring */
+    size_t count;
+    /* The sequence number of the next job to read */
+    size_t next_read;
+    /* The sequence number of the next job to open ahead of the readers */
+    size_t next_open;
+    /* Whether the traversal has been exhausted */
+    int walk_done;
+    /* The number of bytes held in chunks */
+    size_t inflight;
+    /* The most bytes that may be held in chunks */
+    size_t budget;
+    /* The thread feeding entries from the traversal */
+    pthread_t walker;
+    /* Whether readers fetch runs of small files as batches */
+    int batch;
+    /* The number of reader threads */
+    size_t num_readers;
+    /* The reader threads */
+    pthread_t* readers;
+    /* The lock guarding the pipeline */
+    pthread_mutex_t lock;
+    /* Signalled when a job is queued or a chunk is read */
+    pthread_cond_t ready_cond;
+    /* Signalled when the writer frees a slot or bytes */
+    pthread_cond_t space_cond;
+    /* Whether the threads should exit */
+    int shutdown;
+} Prefetcher;
+
+Prefetcher* prefetchOpen(Traversal* traversal, size_t num_readers, size_t read_ahead, size_t budget, int batch);
+PrefetchJob* prefetchNext(Prefetcher* prefetcher);
+PrefetchChunk* prefetchChunk(Prefetcher* prefetcher, PrefetchJob* job);
+void prefetchRelease(Prefetcher* prefetcher, PrefetchChunk* chunk);
+void prefetchDone(Prefetcher* prefetcher, PrefetchJob* job);
+void prefetchClose(Prefetcher* prefetcher);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "compress.h"
+#include "header.h"
+#include "kiwitar.h"
+
+#define READER_BUFFER_SIZE (1024 * 1024) /* Bytes read at once from a stream */
+#define READER_MEMBER 1 /* A member header was read */
+#define READER_END 0 /* The end of archive marker was reached */
+#define READER_TRUNCATED -1 /* The archive ended without an end marker */
+
+/* Represents an archive being read one block at a time. Regular files are
+ * mapped into memory so that headers can be reached without reading the
+ * members between them; other inputs, and compressed archives, are read
+ * sequentially. */
+typedef struct ArchiveReader {
+    /* The file descriptor of the archive */
+    int fd;
+    /* The mapping of the archive, or NULL when it is streamed */
+    unsigned char* map;
+    /* The size of the mapping in bytes */
+    size_t map_size;
+    /* The offset of the next unread byte in the archive */
+    off_t offset;
+    /* The buffer holding streamed bytes */
+    unsigned char* buffer;
+    /* The index of the next unread byte in the buffer */
+    size_t buffer_start;
+    /* The number of valid bytes in the buffer */
+    size_t buffer_end;
+    /* Whether lseek works on the archive */
+    int seekable;
+    /* Whether the archive is a pipe, whose data can be spliced out */
+    int pipe;
+    /* The decompressor the archive is read through, or NULL if it is plain */
+    Decompressor* decompressor;
+    /* The extended records of the last pax header, which attributes point into */
+    char* records;
+    /* The capacity of the records buffer */
+    size_t records_capacity;
+    /* The path held by the last GNU long name member */
+    char* long_name;
+    /* The capacity of the long name buffer */
+    size_t long_name_capacity;
+    /* The target held by the last GNU long link member */
+    char* long_link;
+    /* The capacity of the long link buffer */
+    size_t long_link_capacity;
+    /* The records of the last global pax header */
+    char* global;
+    /* The capacity of the global records buffer */
+    size_t global_capacity;
+    /* The paths a global header lists as removed since the previous archive,
+     * each followed by a newline, or NULL */
+    char* deleted;
+} ArchiveReader;
+
+ArchiveReader* readerOpen(int fd, size_t decompress_threads);
+const USTARHeader* readerNextHeader(ArchiveReader* reader);
+int readerNextMember(ArchiveReader* reader, ArchiveMember* member, const char* archive_name, int strict);
+int readerCanSeek(const ArchiveReader* reader);
+void readerSeek(ArchiveReader* reader, off_t offset);
+ssize_t readerRead(ArchiveReader* reader, void* buf, size_t count);
+off_t readerCopy(ArchiveReader* reader, int outfd, off_t count);
+void readerSkip(ArchiveReader* reader, off_t count);
+void readerClose(ArchiveReader* reader);
+
+/* Handles one member of an archive, returning how many of its data bytes it
+ * consumed; the reader skips the rest */
+typedef off_t (*MemberHandler)(ArchiveReader* reader, ArchiveMember* member, void* context);
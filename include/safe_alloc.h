@@ -3,7 +3,48 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#define ARENA_ALIGNMENT 16 /* Alignment of every arena allocation */
+#define ARENA_BLOCK_SIZE (64 * 1024) /* Default size of an arena block */
+
+/* Represents one contiguous region of an arena */
+typedef struct ArenaBlock {
+    /* The block following this one, in use or kept for reuse */
+    struct ArenaBlock* next;
+    /* The number of usable bytes in the block */
+    size_t size;
+    /* The number of bytes handed out from the block */
+    size_t used;
+    /* Pads the header so that the data starts aligned */
+    size_t reserved;
+} ArenaBlock;
+
+/* Represents a bump allocator whose allocations are released together */
+typedef struct Arena {
+    /* The first block, or NULL before anything is allocated */
+    ArenaBlock* first;
+    /* The block allocations are taken from, or NULL if none is in use */
+    ArenaBlock* current;
+    /* The smallest size of a new block */
+    size_t block_size;
+} Arena;
+
+/* Represents a point in an arena that it can be reset to */
+typedef struct ArenaMark {
+    /* The block in use at the mark */
+    ArenaBlock* block;
+    /* The number of bytes used in that block */
+    size_t used;
+} ArenaMark;
+
 void* safeMalloc(size_t size);
 void* safeRealloc(void* ptr, size_t size);
 void* safeCalloc(size_t nmemb, size_t size);
+void* safeAlignedAlloc(size_t alignment, size_t size);
 void safeFree(void* ptr);
+void arenaInit(Arena* arena, size_t block_size);
+void* arenaAlloc(Arena* arena, size_t size);
+char* arenaString(Arena* arena, const char* str, size_t length);
+ArenaMark arenaMark(const Arena* arena);
+void arenaReset(Arena* arena, ArenaMark mark);
+void arenaClear(Arena* arena);
+void arenaFree(Arena* arena);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <dirent.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -8,27 +9,59 @@
 #include <unistd.h>
 
 #include "limits.h"
+#include "safe_alloc.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX 2048 /* Maximum number of characters in a path name */
 #endif
 
 #define DIR_ERROR -1
+#define DIR_READ_SIZE (64 * 1024) /* Initial size of the buffer directory entries are read into */
+#define DIR_RECORD_MAX (sizeof(DirRecord) + NAME_MAX + 1) /* Room for the largest entry */
+
+/* Represents a directory entry as getdents64 returns it */
+typedef struct DirRecord {
+    /* The inode number of the entry */
+    uint64_t d_ino;
+    /* The position of the next record in the directory */
+    int64_t d_off;
+    /* The size of this record, including the name and padding */
+    unsigned short d_reclen;
+    /* The type of the entry, a DT_ value */
+    unsigned char d_type;
+    /* The null-terminated name of the entry */
+    char d_name[];
+} DirRecord;
+
+/* Represents one entry of a directory */
+typedef struct DirEntry {
+    /* The inode number of the entry */
+    uint64_t inode;
+    /* The type of the entry, a DT_ value, or DT_UNKNOWN if the file system did not say */
+    unsigned char type;
+    /* The null-terminated name of the entry */
+    const char* name;
+} DirEntry;
 
 /* Represents the contents of a directory */
 typedef struct DirContent {
     /* The number of entries in the directory */
     ssize_t num_entries;
-    /* The pointer to the directory entries */
-    struct dirent** entries;
+    /* The entries of the directory in the order the file system returned them */
+    DirEntry* entries;
+    /* The total length of the names, excluding their terminators */
+    size_t names_length;
 } DirContent;
 
 DIR* safeOpenDir(const char* path);
-DirContent* safeReadDir(DIR* dir);
+int safeOpenDirAt(int dirfd, const char* name);
+int safeDirRemote(int fd);
+DirContent* safeReadDir(int fd, Arena* arena);
 void safeRewindDir(DIR* dir);
 void safeCloseDir(DIR* dir);
 void safeStat(char* path, struct stat* buf);
 void safeLstat(const char* path, struct stat* buf);
+void safeStatAt(int dirfd, const char* name, struct stat* buf, int remote);
+void safeFstat(int filedes, struct stat* buf);
 void safeChdir(char* path);
-void freeDirContent(DirContent* dir_contents);
 char* safeGetCwd(char* buf, size_t size);
@@ -1,21 +1,112 @@
 #pragma once
 
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #define FILE_ERROR -1
+#define COPY_BUFFER_SIZE (128 * 1024) /* Size of the reusable buffer used to stream file data */
+#define BUFFER_ALIGNMENT 4096 /* Alignment of output buffers */
+#define BUFFERED_OUTPUT_SIZE (1024 * 1024) /* Minimum number of bytes collected before a flush */
+#define BUFFERED_COPY_THRESHOLD (256 * 1024) /* Larger copies bypass the output buffer */
+#define SPLICE_CHUNK_SIZE (1024 * 1024) /* Most bytes moved by one splice */
+#define DROP_CACHE_OVERLAP (2 * 1024 * 1024) /* Bytes a drop reaches back, over large pages the last one split */
 
-/* Represents the contents of a file */
-typedef struct FileContent {
-    /* The length of the file contents in bytes */
-    ssize_t file_size;
-    /* The pointer to the file contents */
-    unsigned char* file_contents;
-} FileContent;
+/* Represents one file operation of a batch */
+typedef struct FileRequest {
+    /* The directory a relative path is opened from, or AT_FDCWD */
+    int dirfd;
+    /* The path to open */
+    char* path;
+    /* The flags to open the file with */
+    int flags;
+    /* The mode to create the file with */
+    mode_t mode;
+    /* The file descriptor operated on, set by an open */
+    int fd;
+    /* The buffer to read into or write from */
+    void* buf;
+    /* The number of bytes to read or write */
+    size_t count;
+    /* The offset in the file to read or write at */
+    off_t offset;
+    /* The outcome of the last operation, such as the number of bytes read */
+    ssize_t result;
+} FileRequest;
+
+struct Compressor;
+
+/* Represents the thread writing the full buffers of an output that bypasses
+ * the page cache, so that filling one buffer overlaps writing the other */
+typedef struct DirectWriter {
+    /* The file descriptor written to */
+    int fd;
+    /* Whether the file descriptor is in O_DIRECT mode; otherwise written
+     * pages are flushed and dropped from the cache after each write */
+    int direct;
+    /* The buffer being written, or NULL while the thread is idle */
+    unsigned char* pending;
+    /* The number of bytes of the pending buffer */
+    size_t length;
+    /* The buffer free for the next swap, or NULL while it is being filled */
+    unsigned char* spare;
+    /* The number of bytes written so far */
+    off_t written;
+    /* Whether the thread should exit once idle */
+    int stopping;
+    /* Guards the fields above */
+    pthread_mutex_t lock;
+    /* Signalled when a buffer is handed over or written */
+    pthread_cond_t cond;
+    /* The thread */
+    pthread_t thread;
+} DirectWriter;
+
+/* Represents an output file that buffers small writes and pads its end to a whole record */
+typedef struct BufferedFile {
+    /* The file descriptor written to */
+    int fd;
+    /* The compressor full buffers are handed to instead of the file descriptor, if any */
+    struct Compressor* compressor;
+    /* Whether the file descriptor is a pipe, which large copies are spliced into */
+    int pipe;
+    /* The size of a record in bytes, the unit the file is padded to */
+    size_t record_size;
+    /* The size of the buffer in bytes, a multiple of the record size */
+    size_t capacity;
+    /* The number of bytes waiting in the buffer */
+    size_t used;
+    /* The number of bytes written through this file so far */
+    off_t offset;
+    /* The buffer holding pending bytes */
+    unsigned char* buffer;
+    /* The thread full buffers are handed to when bypassing the cache, or NULL */
+    DirectWriter* writer;
+} BufferedFile;
 
 int safeOpen(char* filename, int flags, mode_t mode);
-FileContent* safeRead(int fd);
-void safeWrite(int fd, void* buf, size_t count);
+int safeOpenAt(int dirfd, const char* name, int flags, mode_t mode);
+ssize_t safeRead(int fd, void* buf, size_t count);
+void safeWrite(int fd, const void* buf, size_t count);
+off_t safeCopy(int infd, int outfd, off_t count);
+off_t safeSplice(int infd, int outfd, off_t count);
+off_t safeCopyAt(int infd, off_t offset, int outfd, off_t count);
 void safeClose(int fd);
-void freeFileContent(FileContent* file_contents);
+int safeUseUring(int enable);
+void safeDropCaches(int enable);
+void safeDropCache(int fd, off_t offset, off_t length);
+void safeDropWritten(int fd, off_t offset, off_t length);
+void safeOpenBatch(FileRequest* requests, size_t count);
+void safeReadBatch(FileRequest* requests, size_t count);
+void safeWriteBatch(FileRequest* requests, size_t count);
+void safeCloseBatch(FileRequest* requests, size_t count);
+BufferedFile* safeBufferedOpen(int fd, size_t record_size, struct Compressor* compressor);
+void safeBufferedBypassCache(BufferedFile* file);
+void* safeBufferedReserve(BufferedFile* file, size_t count);
+void safeBufferedWrite(BufferedFile* file, const void* buf, size_t count);
+void safeBufferedZero(BufferedFile* file, size_t count);
+off_t safeBufferedCopy(BufferedFile* file, int infd, off_t count);
+void safeBufferedFlush(BufferedFile* file);
+void safeBufferedClose(BufferedFile* file);
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "path_table.h"
+
+#define SNAPSHOT_MAGIC "KWTSNP1" /* Identifies a snapshot manifest and its layout */
+#define SNAPSHOT_INITIAL_ENTRIES 64 /* Initial capacity of a manifest being built */
+#define SNAPSHOT_INITIAL_STRINGS 4096 /* Initial capacity of the path table */
+#define SNAPSHOT_TEMP_SUFFIX ".tmp" /* Appended to a manifest's name while it is written */
+
+/* Represents the start of a manifest file. Every field is stored in the byte
+ * order of the machine that wrote the manifest. */
+typedef struct SnapshotHeader {
+    /* SNAPSHOT_MAGIC followed by a NUL */
+    char magic[8];
+    /* The number of entries */
+    uint64_t count;
+    /* The offset of the path table from the start of the file */
+    uint64_t strings_offset;
+} SnapshotHeader;
+
+/* Represents one file as it was when archived. Entries follow the header
+ * sorted by path. */
+typedef struct SnapshotEntry {
+    /* The offset of the file's path in the path table */
+    uint64_t path_offset;
+    /* The device holding the file */
+    uint64_t dev;
+    /* The inode number of the file */
+    uint64_t ino;
+    /* The size of the file */
+    uint64_t size;
+    /* The seconds of the last modification time */
+    int64_t mtime;
+    /* The seconds of the last status change time */
+    int64_t ctime;
+    /* The nanoseconds of the last modification time */
+    uint32_t mtime_nsec;
+    /* The nanoseconds of the last status change time */
+    uint32_t ctime_nsec;
+    /* The length of the file's path */
+    uint32_t path_length;
+    /* Unused bytes that keep entries aligned */
+    uint32_t reserved;
+} SnapshotEntry;
+
+/* Represents a manifest being collected while an archive is written */
+typedef struct SnapshotWriter {
+    /* The SnapshotEntry records collected so far and their paths */
+    PathTable table;
+} SnapshotWriter;
+
+/* Represents the manifest of a previous run mapped into memory, or the members
+ * of an archive being updated */
+typedef struct Snapshot {
+    /* The mapping of the whole file, or NULL if the manifest was collected */
+    unsigned char* map;
+    /* The collected manifest the entries belong to, or NULL if it was mapped */
+    SnapshotWriter* writer;
+    /* Whether files are compared by modification time alone, so that only
+     * newer ones are archived */
+    int by_mtime;
+    /* The size of the mapping */
+    size_t map_size;
+    /* The sorted entries */
+    const SnapshotEntry* entries;
+    /* The number of entries */
+    size_t count;
+    /* The path table */
+    const char* strings;
+} Snapshot;
+
+SnapshotWriter* snapshotWriterOpen(void);
+void snapshotWriterAdd(SnapshotWriter* writer, const char* path, const struct stat* st);
+void snapshotWriterSave(SnapshotWriter* writer, const char* snapshot_path);
+void snapshotWriterClose(SnapshotWriter* writer);
+Snapshot* snapshotOpen(const char* snapshot_path);
+Snapshot* snapshotFromWriter(SnapshotWriter* writer);
+int snapshotUnchanged(const Snapshot* snapshot, const char* path, const struct stat* st);
+char* snapshotDeleted(const Snapshot* snapshot, SnapshotWriter* writer, size_t* length);
+void snapshotClose(Snapshot* snapshot);
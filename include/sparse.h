@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "reader.h"
+
+#define SPARSE_INITIAL_EXTENTS 16 /* Initial capacity of a sparse map */
+#define SPARSE_FILE_DIR "GNUSparseFile.0" /* Directory named in the header of a sparse member */
+#define SPARSE_NUMBER_SIZE 21 /* Longest decimal number in a sparse map, with its newline */
+
+/* Represents a run of data in a sparse file */
+typedef struct SparseExtent {
+    /* The offset of the data in the file */
+    off_t offset;
+    /* The number of bytes of data */
+    off_t length;
+} SparseExtent;
+
+/* Represents the data runs of a sparse file, in file order */
+typedef struct SparseMap {
+    /* The runs of data */
+    SparseExtent* extents;
+    /* The number of runs */
+    size_t count;
+    /* The capacity of the run list */
+    size_t capacity;
+    /* The total number of data bytes */
+    off_t data_size;
+} SparseMap;
+
+int sparseCandidate(const struct stat* st);
+int sparseScan(int fd, off_t size, SparseMap* map);
+char* sparseFormat(const SparseMap* map, size_t* length);
+int sparseReadMap(ArchiveReader* reader, const ArchiveMember* member, SparseMap* map, off_t* consumed);
+void sparseFree(SparseMap* map);
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define STATS_BUCKETS 48 /* Power-of-two buckets of a histogram, enough for sizes and nanoseconds alike */
+#define STATS_DEFAULT_FD 2 /* File descriptor the statistics go to when --stats names none */
+#define STATS_REPORT_SIZE 8192 /* Largest report written at once */
+
+/* Represents the parts of an operation the time is split between */
+typedef enum StatsPhase {
+  STATS_TRAVERSE,
+  STATS_STAT,
+  STATS_READ,
+  STATS_WRITE,
+  STATS_COPY,
+  STATS_HEADER,
+  STATS_NAMES,
+  STATS_VERBOSE,
+  STATS_NUM_PHASES
+} StatsPhase;
+
+/* Represents the counters every thread adds to. Each is only ever updated
+ * with relaxed atomic additions, so no lock is taken on the hot paths. */
+typedef struct StatsCounters {
+    /* The number of times each phase was entered */
+    uint64_t calls[STATS_NUM_PHASES];
+    /* The nanoseconds spent in each phase, summed over every thread */
+    uint64_t nanoseconds[STATS_NUM_PHASES];
+    /* The bytes moved by each phase */
+    uint64_t bytes[STATS_NUM_PHASES];
+    /* The number of regular files archived or extracted */
+    uint64_t files;
+    /* The files whose size needs 0, 1, 2... bits */
+    uint64_t sizes[STATS_BUCKETS];
+    /* The files whose nanoseconds of handling need 0, 1, 2... bits */
+    uint64_t latencies[STATS_BUCKETS];
+} StatsCounters;
+
+/* Represents the statistics of the run and where they are reported */
+typedef struct Stats {
+    /* Whether statistics are being collected */
+    int enabled;
+    /* The file descriptor the reports are written to */
+    int fd;
+    /* The seconds between periodic reports, or 0 for a single one at exit */
+    size_t interval;
+    /* When collection started, in monotonic nanoseconds */
+    uint64_t start;
+    /* The thread writing periodic reports */
+    pthread_t reporter;
+    /* Guards stopping */
+    pthread_mutex_t lock;
+    /* Signalled when the reporter should stop */
+    pthread_cond_t stop_cond;
+    /* Whether the reporter should stop */
+    int stopping;
+    /* The counters */
+    StatsCounters counters;
+} Stats;
+
+void statsOpen(int fd, size_t interval);
+void statsClose(void);
+
+#ifdef WITH_STATS
+extern Stats global_stats;
+
+/**
+ * Reads the monotonic clock
+ *
+ * @return the time in nanoseconds
+ */
+static inline uint64_t statsNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Starts timing a phase, if statistics are being collected
+ *
+ * @return the current time, or 0 if nothing is collected
+ */
+static inline uint64_t statsStart(void) { return global_stats.enabled ? statsNow() : 0; }
+
+/**
+ * Adds a timed call of a phase to the counters
+ *
+ * @param phase the phase that ran
+ * @param start what statsStart returned when it began
+ * @param bytes the number of bytes it moved
+ */
+static inline void statsEnd(StatsPhase phase, uint64_t start, uint64_t bytes) {
+  if (start == 0) { return; }
+  StatsCounters* counters = &global_stats.counters;
+  __atomic_fetch_add(&counters->calls[phase], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&counters->nanoseconds[phase], statsNow() - start, __ATOMIC_RELAXED);
+  if (bytes != 0) { __atomic_fetch_add(&counters->bytes[phase], bytes, __ATOMIC_RELAXED); }
+}
+
+void statsFile(uint64_t size, uint64_t start);
+
+#define STATS_START(started) uint64_t started = statsStart() /* Starts timing a phase into started */
+#define STATS_END(phase, started, bytes) statsEnd(phase, started, bytes) /* Ends timing a phase */
+#define STATS_FILE(size, started) statsFile(size, started) /* Ends timing a file of a size */
+#else
+#define STATS_START(started) /* Statistics were not compiled in */
+#define STATS_END(phase, started, bytes) ((void)(bytes)) /* Statistics were not compiled in */
+#define STATS_FILE(size, started) /* Statistics were not compiled in */
+#endif
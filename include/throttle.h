@@ -0,0 +1,80 @@
+#pragma once
+
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define THROTTLE_BURST_SECONDS 0.1 /* Most time's worth of budget a bucket saves up while idle */
+#define THROTTLE_CHUNK_SIZE (1024 * 1024) /* Most bytes an in-kernel copy moves at once while throttled */
+#define THROTTLE_LINE_SIZE 256 /* Longest line of a limit file */
+
+/* Represents the direction of the data a budget applies to */
+typedef enum ThrottleDirection { THROTTLE_READ, THROTTLE_WRITE, THROTTLE_NUM_DIRECTIONS } ThrottleDirection;
+
+/* Represents the limits of a run, each 0 when unlimited */
+typedef struct ThrottleLimits {
+    /* The most bytes read and written per second */
+    uint64_t bytes[THROTTLE_NUM_DIRECTIONS];
+    /* The most reads and writes per second */
+    uint64_t ops[THROTTLE_NUM_DIRECTIONS];
+} ThrottleLimits;
+
+/* Represents a token bucket. Callers pay for what they did after doing it and
+ * the balance may go negative; whoever overdraws it sleeps until it is even. */
+typedef struct TokenBucket {
+    /* The tokens added per second, or 0 if the bucket never runs dry */
+    double rate;
+    /* The tokens available */
+    double tokens;
+    /* When the tokens were last topped up, in monotonic nanoseconds */
+    uint64_t updated;
+} TokenBucket;
+
+/* Represents the budgets of every thread doing I/O */
+typedef struct Throttle {
+    /* Whether any budget is enforced, or may be once the limit file is read */
+    int enabled;
+    /* The file the limits are read from on SIGHUP, or NULL */
+    const char* limit_file;
+    /* Guards the buckets and the totals */
+    pthread_mutex_t lock;
+    /* The byte budgets of each direction */
+    TokenBucket bytes[THROTTLE_NUM_DIRECTIONS];
+    /* The operation budgets of each direction */
+    TokenBucket ops[THROTTLE_NUM_DIRECTIONS];
+    /* The bytes moved in each direction */
+    uint64_t moved[THROTTLE_NUM_DIRECTIONS];
+    /* The operations done in each direction */
+    uint64_t done[THROTTLE_NUM_DIRECTIONS];
+    /* When throttling started, in monotonic nanoseconds */
+    uint64_t start;
+} Throttle;
+
+extern Throttle global_throttle;
+
+void throttleOpen(const ThrottleLimits* limits, const char* limit_file);
+void throttleWait(ThrottleDirection direction, uint64_t bytes);
+void throttleClose(void);
+
+/**
+ * Pays for one operation that moved some bytes, sleeping if the budget of its
+ * direction is spent. Costs a single load when nothing is throttled.
+ *
+ * @param direction THROTTLE_READ or THROTTLE_WRITE
+ * @param bytes the number of bytes the operation moved
+ */
+static inline void throttleIO(ThrottleDirection direction, uint64_t bytes) {
+  if (global_throttle.enabled) { throttleWait(direction, bytes); }
+}
+
+/**
+ * Bounds the bytes an in-kernel copy is asked for, so that a throttled copy
+ * of a large file is paid for in steps rather than in one burst
+ *
+ * @param want the bytes left to copy
+ * @return the bytes to copy next
+ */
+static inline size_t throttleChunk(size_t want) {
+  return global_throttle.enabled && want > THROTTLE_CHUNK_SIZE ? THROTTLE_CHUNK_SIZE : want;
+}
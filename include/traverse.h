@@ -0,0 +1,176 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "dedup.h"
+#include "links.h"
+#include "safe_alloc.h"
+#include "snapshot.h"
+
+#define TRAVERSE_MAX_PENDING (1024 * 1024) /* Entries listed ahead of the writer before workers pause */
+#define TRAVERSE_INITIAL_ENTRIES 16 /* Initial capacity of a directory listing */
+#define TRAVERSE_MAX_OPEN_DIRS 256 /* Listed directories kept open for their children to be opened relative to */
+#define TRAVERSE_FD_SHARE 4 /* Fraction of the file descriptor limit open directories may use */
+
+/* Represents the progress of listing a directory */
+typedef enum TraverseState { DIR_PENDING, DIR_CLAIMED, DIR_DONE } TraverseState;
+
+struct TraverseDir;
+struct Traversal;
+
+/* Represents a file found during a traversal */
+typedef struct TraverseEntry {
+    /* The path of the file */
+    char* path;
+    /* The directory name is relative to, or AT_FDCWD when name is the path */
+    int dirfd;
+    /* The name to open the file by relative to dirfd */
+    const char* name;
+    /* The status of the file (symlinks aren't followed) */
+    struct stat st;
+    /* The listing of the file if it is a directory, otherwise NULL */
+    struct TraverseDir* dir;
+    /* The path an earlier entry for the same file, or for an identical file,
+     * was returned under, or NULL */
+    const char* link;
+    /* Whether link names an identical file rather than this one */
+    int duplicate;
+    /* Whether the file need not be archived: it is as the previous snapshot
+     * recorded it, or no newer than its copy in the archive being updated */
+    int unchanged;
+} TraverseEntry;
+
+/* Represents a directory whose children are listed by the traversal */
+typedef struct TraverseDir {
+    /* The path of the directory */
+    char* path;
+    /* The directory holding this one, or NULL for a path being walked */
+    struct TraverseDir* parent;
+    /* The name of the directory within its parent */
+    const char* name;
+    /* The open directory its children are statted and opened relative to, or
+     * -1 if it is not listed yet or too many directories are open */
+    int fd;
+    /* The progress of listing the directory, a TraverseState */
+    int state;
+    /* The number of owners (the tree, possibly a work queue and any readers
+     * holding it open for its entries) */
+    int refs;
+    /* The number of children of the directory */
+    size_t num_entries;
+    /* The children of the directory in the order readdir returned them */
+    TraverseEntry* entries;
+    /* The memory holding the children and their paths, freed in one go */
+    Arena arena;
+} TraverseDir;
+
+/* Represents a double-ended queue of directories waiting to be listed */
+typedef struct TraverseDeque {
+    /* The lock guarding the queue */
+    pthread_mutex_t lock;
+    /* The directories in the queue, stored as a ring */
+    TraverseDir** tasks;
+    /* The index of the oldest directory, where thieves steal from */
+    size_t head;
+    /* The number of directories in the queue */
+    size_t count;
+    /* The number of slots in the ring */
+    size_t capacity;
+} TraverseDeque;
+
+/* Represents an entry waiting to be statted */
+typedef struct StatOrder {
+    /* The inode number of the entry */
+    uint64_t inode;
+    /* The index of the entry in its directory's listing */
+    size_t index;
+} StatOrder;
+
+/* Represents a directory being walked by the writer */
+typedef struct TraverseFrame {
+    /* The directory being walked */
+    TraverseDir* dir;
+    /* The index of the next child to return */
+    size_t index;
+} TraverseFrame;
+
+/* Represents the arguments passed to a worker thread */
+typedef struct TraverseWorker {
+    /* The traversal the worker belongs to */
+    struct Traversal* traversal;
+    /* The index of the worker's own queue */
+    size_t index;
+    /* Scratch memory for reading directories, reset after each one */
+    Arena scratch;
+} TraverseWorker;
+
+/* Represents a depth-first walk of several paths whose directories are listed
+ * by a pool of work-stealing threads */
+typedef struct Traversal {
+    /* The paths to walk */
+    char** roots;
+    /* The number of paths to walk */
+    int num_roots;
+    /* The index of the next path to walk */
+    int next_root;
+    /* The entry describing the path currently being walked */
+    TraverseEntry root_entry;
+    /* The directory the last returned entry was listed in, or NULL for a path
+     * being walked */
+    TraverseDir* parent;
+    /* The directories between the current path and the next entry */
+    TraverseFrame* stack;
+    /* The number of frames on the stack */
+    size_t depth;
+    /* The number of frames the stack can hold */
+    size_t stack_capacity;
+    /* Scratch memory for directories the writer reads itself */
+    Arena scratch;
+    /* The files with several links returned so far */
+    LinkTable links;
+    /* Whether files identical to one returned earlier are linked to it */
+    int dedup;
+    /* The files returned so far by size, when dedup is set */
+    DedupTable contents;
+    /* The manifest of the previous run or archive that entries are compared to,
+     * or NULL */
+    const Snapshot* previous;
+    /* The manifest every returned entry is recorded in, or NULL */
+    SnapshotWriter* snapshot;
+    /* The number of worker threads */
+    size_t num_workers;
+    /* The worker threads */
+    pthread_t* workers;
+    /* The arguments passed to each worker thread */
+    TraverseWorker* worker_args;
+    /* One queue per worker, plus one for directories found by the writer */
+    TraverseDeque* deques;
+    /* The lock guarding the fields below */
+    pthread_mutex_t lock;
+    /* Signalled when a directory is queued or the traversal ends */
+    pthread_cond_t work_cond;
+    /* Signalled when a directory finishes listing */
+    pthread_cond_t done_cond;
+    /* Signalled when the writer releases listed entries */
+    pthread_cond_t budget_cond;
+    /* The number of directories waiting in queues */
+    size_t queued;
+    /* The number of entries listed but not yet released by the writer */
+    size_t pending;
+    /* The number of listed directories kept open, updated atomically */
+    int open_dirs;
+    /* The most listed directories kept open at once */
+    int max_open_dirs;
+    /* Whether the worker threads should exit */
+    int shutdown;
+} Traversal;
+
+Traversal* traverseOpen(char** roots, int num_roots, size_t num_threads, const Snapshot* previous,
+                        SnapshotWriter* snapshot, int dedup);
+TraverseEntry* traverseNext(Traversal* traversal);
+TraverseDir* traverseHold(Traversal* traversal);
+void traverseRelease(Traversal* traversal, TraverseDir* dir);
+void traverseClose(Traversal* traversal);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+#define URING_ENTRIES 64 /* Submission queue entries per ring */
+
+/* Represents an io_uring instance and its memory-mapped queues */
+typedef struct Uring {
+    /* The file descriptor of the ring */
+    int fd;
+    /* The head of the submission queue, advanced by the kernel */
+    unsigned* sq_head;
+    /* The tail of the submission queue, advanced by us */
+    unsigned* sq_tail;
+    /* The mask applied to submission queue indices */
+    unsigned* sq_mask;
+    /* The indirection array of the submission queue */
+    unsigned* sq_array;
+    /* The submission queue entries */
+    struct io_uring_sqe* sqes;
+    /* The head of the completion queue, advanced by us */
+    unsigned* cq_head;
+    /* The tail of the completion queue, advanced by the kernel */
+    unsigned* cq_tail;
+    /* The mask applied to completion queue indices */
+    unsigned* cq_mask;
+    /* The completion queue entries */
+    struct io_uring_cqe* cqes;
+    /* The number of submission queue entries */
+    unsigned sq_entries;
+    /* The number of entries queued but not yet submitted */
+    unsigned queued;
+    /* The mapping holding the submission ring */
+    void* sq_ring;
+    /* The size of the submission ring mapping */
+    size_t sq_ring_size;
+    /* The mapping holding the completion ring, which may be the same */
+    void* cq_ring;
+    /* The size of the completion ring mapping */
+    size_t cq_ring_size;
+    /* The size of the submission queue entry mapping */
+    size_t sqes_size;
+} Uring;
+
+int uringInit(Uring* ring, unsigned entries);
+int uringSupports(Uring* ring, const int* opcodes, size_t count);
+struct io_uring_sqe* uringGetSqe(Uring* ring);
+int uringSubmit(Uring* ring, unsigned wait_nr);
+struct io_uring_cqe* uringPeek(Uring* ring);
+void uringSeen(Uring* ring);
+void uringExit(Uring* ring);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 #define UNIMPLEMENTED                                                                                                  \
   do {                                                                                                                 \
     fprintf(stderr, "%s:%d: %s is not implemented yet\n", __FILE__, __LINE__, __func__);                               \
@@ -14,11 +16,40 @@
 
 #define UNUSED(x) ((void)(x))
 
-#define USAGE_STRING "Usage: %s [ctxvS]f tarfile [ path [ ... ] ]\n" /* Program usage string */
+#define USAGE_STRING /* Program usage string */                                                                        \
+  "Usage: %s [ctxruvzS]f tarfile [options] [ path [ ... ] ]\n"                                                         \
+  "  -r                       append the paths to the end of an existing archive\n"                                    \
+  "  -u                       append only the paths newer than their copies in the archive\n"                          \
+  "  -b, --blocking-factor=N  pad the archive to a multiple of N blocks\n"                                             \
+  "  -j, --threads=N          list directories, or write extracted files, with N threads\n"                            \
+  "      --readers=N          read files ahead of the writer with N threads\n"                                         \
+  "      --read-ahead=N       let the readers work N entries ahead\n"                                                  \
+  "      --inflight=BYTES     hold at most BYTES read but not yet written\n"                                           \
+  "      --io-uring           batch small-file I/O through io_uring\n"                                                 \
+  "      --index              write a sidecar index of the new archive to tarfile.idx\n"                               \
+  "      --build-index        write tarfile.idx from an existing archive\n"                                            \
+  "  -z, --gzip               compress the new archive with gzip\n"                                                    \
+  "      --zstd               compress the new archive with zstd\n"                                                    \
+  "      --dedup              store files identical to one already archived as links to it\n"                          \
+  "      --compress-threads=N compress or decompress with N threads (default: one per CPU)\n"                          \
+  "      --stats[=FD]         write counters and timings as JSON to FD (default: 2) at exit\n"                         \
+  "      --stats-interval=N   also write them every N seconds while running\n"                                         \
+  "      --read-limit=BYTES   read at most BYTES per second\n"                                                         \
+  "      --write-limit=BYTES  write at most BYTES per second\n"                                                        \
+  "      --read-ops=N         make at most N reads per second\n"                                                       \
+  "      --write-ops=N        make at most N writes per second\n"                                                      \
+  "      --limit-file=FILE    read limits such as read-limit=20M from FILE, and again on SIGHUP\n"                     \
+  "      --direct             keep files out of the page cache: write the archive with O_DIRECT and\n"                 \
+  "                           drop the pages of every file once it has been read or written\n"                         \
+  "  -g, --listed-incremental=FILE\n"                                                                                  \
+  "                           archive only what changed since the snapshot in FILE, then update it;\n"                 \
+  "                           when extracting, also remove the paths the archive lists as deleted\n"
 #define MIN_ARGS 1
 #define MAX_ARGS 2
 #define SYSCALL_ERROR -1
+#define MAX_THREADS 4096 /* Most threads any option may ask for */
 
 /* Begin function prototype declarations */
 void panic(char* str);
-void usage(char* prog_name);
\ No newline at end of file
+void usage(char* prog_name);
+size_t parseSize(char* prog_name, const char* str, size_t min, size_t max);
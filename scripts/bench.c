@@ -0,0 +1,250 @@
+/*
+ * bench.c - tree generator and resource meter for the benchmark suite
+ *
+ * The generator builds the input trees from a fixed seed, so every run and
+ every machine archives the same bytes. The meter runs one command and reports
+ its wall time, CPU time and peak resident set size, as wait4 returns them, so
+ the suite needs nothing beyond a C compiler and a shell.
+
+ Usage:
+    bench gen TREE DIR [SCALE]
+    bench run COMMAND [ARG ...]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SEED 0x6b69776974617221ULL /* Seed of every generated tree */
+#define BENCH_CHUNK_SIZE (1024 * 1024) /* Bytes generated and written at once */
+#define BENCH_PATH_SIZE 4096 /* Longest generated path */
+#define BENCH_DIR_MODE 0755 /* Permissions of generated directories */
+#define BENCH_FILE_MODE 0644 /* Permissions of generated files */
+#define BENCH_FILES_PER_DIR 100 /* Files per directory of the tiny tree */
+#define BENCH_LINKS_PER_FILE 4 /* Names of each file of the links tree */
+#define BENCH_MIB (1024 * 1024) /* Bytes in a mebibyte */
+
+/* Represents the state of the splitmix64 generator */
+typedef struct Random {
+    /* The state, advanced by every draw */
+    uint64_t state;
+} Random;
+
+/**
+ * Draws the next 64-bit number
+ *
+ * @param random the generator to advance
+ * @return the number
+ */
+static uint64_t nextRandom(Random* random) {
+  uint64_t z = (random->state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Exits with a message naming the path an operation failed on
+ *
+ * @param what the operation that failed
+ * @param path the path it failed on
+ */
+static void fail(const char* what, const char* path) {
+  fprintf(stderr, "bench: %s %s: %s\n", what, path, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Creates a directory, which may already exist
+ *
+ * @param path the path of the directory
+ */
+static void makeDir(const char* path) {
+  if (mkdir(path, BENCH_DIR_MODE) != 0 && errno != EEXIST) { fail("cannot create", path); }
+}
+
+/**
+ * Writes pseudo-random bytes to a file at an offset. Half of every chunk
+ * repeats, so compressors have something to find, as in real trees.
+ *
+ * @param fd the file descriptor of the file
+ * @param random the generator to draw from
+ * @param offset where to write
+ * @param length the number of bytes to write
+ * @param buffer scratch memory of BENCH_CHUNK_SIZE bytes
+ */
+static void writeRandom(int fd, Random* random, off_t offset, off_t length, unsigned char* buffer) {
+  while (length > 0) {
+    size_t chunk = length < BENCH_CHUNK_SIZE ? (size_t)length : BENCH_CHUNK_SIZE;
+    for (size_t i = 0; i < chunk / 2; i += sizeof(uint64_t)) {
+      uint64_t value = nextRandom(random);
+      memcpy(buffer + i, &value, sizeof(value));
+    }
+    memset(buffer + chunk / 2, buffer[0], chunk - chunk / 2);
+    ssize_t w = pwrite(fd, buffer, chunk, offset);
+    if (w <= 0) { fail("cannot write", "file"); }
+    offset += w;
+    length -= w;
+  }
+}
+
+/**
+ * Creates a file filled with pseudo-random bytes
+ *
+ * @param path the path of the file
+ * @param random the generator to draw from
+ * @param size the size of the file
+ * @param buffer scratch memory of BENCH_CHUNK_SIZE bytes
+ */
+static void makeFile(const char* path, Random* random, off_t size, unsigned char* buffer) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, BENCH_FILE_MODE);
+  if (fd < 0) { fail("cannot create", path); }
+  writeRandom(fd, random, 0, size, buffer);
+  close(fd);
+}
+
+/**
+ * Generates one of the benchmark trees
+ *
+ * @param tree the kind of tree: tiny, huge, deep, wide, sparse or links
+ * @param root the directory to generate it in, which must not exist
+ * @param scale the multiplier of the number or size of the files
+ * @return 0 on success, 1 if the kind of tree is unknown
+ */
+static int generate(const char* tree, const char* root, long scale) {
+  Random random = {.state = BENCH_SEED};
+  unsigned char* buffer = (unsigned char*)malloc(BENCH_CHUNK_SIZE);
+  char path[BENCH_PATH_SIZE];
+  if (buffer == NULL) { fail("cannot allocate", "buffer"); }
+  makeDir(root);
+  if (strcmp(tree, "tiny") == 0) {
+    /* Many files of a few hundred bytes to a few KiB */
+    for (long i = 0; i < 20000 * scale; i++) {
+      if (i % BENCH_FILES_PER_DIR == 0) {
+        snprintf(path, sizeof(path), "%s/d%05ld", root, i / BENCH_FILES_PER_DIR);
+        makeDir(path);
+      }
+      snprintf(path, sizeof(path), "%s/d%05ld/f%05ld", root, i / BENCH_FILES_PER_DIR, i);
+      makeFile(path, &random, nextRandom(&random) % 4096, buffer);
+    }
+  } else if (strcmp(tree, "huge") == 0) {
+    /* A few files far larger than any buffer */
+    for (long i = 0; i < 4; i++) {
+      snprintf(path, sizeof(path), "%s/huge%ld", root, i);
+      makeFile(path, &random, (off_t)64 * BENCH_MIB * scale, buffer);
+    }
+  } else if (strcmp(tree, "deep") == 0) {
+    /* Chains of nested directories with a file at every level */
+    for (long chain = 0; chain < 20 * scale; chain++) {
+      size_t length = (size_t)snprintf(path, sizeof(path), "%s/c%04ld", root, chain);
+      makeDir(path);
+      for (int depth = 0; depth < 100; depth++) {
+        char file[BENCH_PATH_SIZE + sizeof("/file")];
+        snprintf(file, sizeof(file), "%s/file", path);
+        makeFile(file, &random, nextRandom(&random) % 2048, buffer);
+        length += (size_t)snprintf(path + length, sizeof(path) - length, "/n%02d", depth);
+        makeDir(path);
+      }
+    }
+  } else if (strcmp(tree, "wide") == 0) {
+    /* One directory with a great many entries */
+    for (long i = 0; i < 20000 * scale; i++) {
+      snprintf(path, sizeof(path), "%s/entry-%07ld", root, i);
+      makeFile(path, &random, nextRandom(&random) % 1024, buffer);
+    }
+  } else if (strcmp(tree, "sparse") == 0) {
+    /* Large files that are mostly holes, with data runs scattered through */
+    for (long i = 0; i < 8; i++) {
+      snprintf(path, sizeof(path), "%s/image%ld", root, i);
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, BENCH_FILE_MODE);
+      if (fd < 0) { fail("cannot create", path); }
+      off_t size = (off_t)256 * BENCH_MIB * scale;
+      for (int run = 0; run < 16; run++) {
+        off_t offset = (off_t)(nextRandom(&random) % (uint64_t)(size - BENCH_MIB)) & ~(off_t)4095;
+        writeRandom(fd, &random, offset, 64 * 1024, buffer);
+      }
+      if (ftruncate(fd, size) != 0) { fail("cannot size", path); }
+      close(fd);
+    }
+  } else if (strcmp(tree, "links") == 0) {
+    /* Files reached through several hard links each */
+    for (long i = 0; i < 2000 * scale; i++) {
+      if (i % BENCH_FILES_PER_DIR == 0) {
+        for (int l = 0; l < BENCH_LINKS_PER_FILE; l++) {
+          snprintf(path, sizeof(path), "%s/l%d-%04ld", root, l, i / BENCH_FILES_PER_DIR);
+          makeDir(path);
+        }
+      }
+      snprintf(path, sizeof(path), "%s/l0-%04ld/f%05ld", root, i / BENCH_FILES_PER_DIR, i);
+      makeFile(path, &random, 1024 + nextRandom(&random) % 65536, buffer);
+      for (int l = 1; l < BENCH_LINKS_PER_FILE; l++) {
+        char name[BENCH_PATH_SIZE];
+        snprintf(name, sizeof(name), "%s/l%d-%04ld/f%05ld", root, l, i / BENCH_FILES_PER_DIR, i);
+        if (link(path, name) != 0) { fail("cannot link", name); }
+      }
+    }
+  } else {
+    fprintf(stderr, "bench: unknown tree %s\n", tree);
+    free(buffer);
+    return 1;
+  }
+  free(buffer);
+  return 0;
+}
+
+/**
+ * Runs a command with its output discarded and prints its wall time, user and
+ * system CPU time in seconds, peak resident set size in KiB and exit status,
+ * separated by spaces
+ *
+ * @param argv the command and its arguments, terminated by NULL
+ * @return 0 if the command could be run, 1 otherwise
+ */
+static int measure(char* argv[]) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork();
+  if (pid < 0) { fail("cannot fork", argv[0]); }
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) { dup2(null, STDOUT_FILENO); }
+    execvp(argv[0], argv);
+    fprintf(stderr, "bench: cannot run %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) { fail("cannot wait for", argv[0]); }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double wall = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+  double user = (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6;
+  double sys = (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+  printf("%.6f %.6f %.6f %ld %d\n", wall, user, sys, usage.ru_maxrss,
+         WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+  return 0;
+}
+
+/**
+ * @brief Program entry point
+ *
+ * @param argc - the number of command line arguments
+ * @param argv - an array of command line arguments
+ * @return int - the exit status
+ */
+int main(int argc, char* argv[]) {
+  if (argc >= 4 && strcmp(argv[1], "gen") == 0) {
+    long scale = argc >= 5 ? strtol(argv[4], NULL, 10) : 1;
+    return generate(argv[2], argv[3], scale > 0 ? scale : 1);
+  }
+  if (argc >= 3 && strcmp(argv[1], "run") == 0) { return measure(&argv[2]); }
+  fprintf(stderr, "Usage: %s gen TREE DIR [SCALE]\n       %s run COMMAND [ARG ...]\n", argv[0], argv[0]);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,122 @@
+#!/bin/bash
+
+# Benchmark script called by make bench
+# Usage:
+#    bench.sh KIWITAR BENCH
+#
+# Times create, list and extract with kiwitar and the reference tar on every
+# generated tree and appends one JSON object per run to the output file.
+# Settings come from the environment:
+#    BENCH_DIR     scratch directory for trees and archives (target/bench)
+#    BENCH_TREES   trees to run on (tiny huge deep wide sparse links)
+#    BENCH_SCALE   multiplier of the size of every tree (1)
+#    BENCH_RUNS    runs of every operation (3)
+#    BENCH_OUTPUT  file the results are appended to (bench_output.txt)
+#    BENCH_REF     reference tar to compare against (tar)
+
+#
+#  Private Impl
+#
+
+# Prints the number of system calls a command makes, or null without strace
+count_syscalls() {
+  if ! command -v strace >/dev/null 2>&1; then
+    echo null
+    return 0
+  fi
+  local trace
+  trace=$(mktemp)
+  strace -f -c -o "$trace" "$@" >/dev/null 2>&1
+  awk '$NF == "total" { print $3 }' "$trace"
+  rm -f "$trace"
+}
+
+# Runs one operation once, in a directory, and appends its result
+# Usage: record TOOL TREE OP BYTES ARCHIVE DIR COMMAND [ARG ...]
+record() {
+  local tool=$1 tree=$2 op=$3 bytes=$4 archive=$5 dir=$6
+  shift 6
+  local wall user sys rss status
+  read -r wall user sys rss status < <(cd "$dir" && "$bench" run "$@")
+  if [ "$status" -ne 0 ]; then
+    echo "$tool $op on $tree exited with status $status" >&2
+    failed=1
+  fi
+  local syscalls=null
+  # Tracing slows the command down, so it gets a run of its own
+  [ "$run" -eq 1 ] && syscalls=$(cd "$dir" && count_syscalls "$@")
+  [ -n "$syscalls" ] || syscalls=null
+  local archive_bytes
+  archive_bytes=$(stat -c %s "$archive" 2>/dev/null || echo 0)
+  local throughput
+  throughput=$(awk -v b="$bytes" -v w="$wall" 'BEGIN { printf "%.2f", (w > 0 ? b / w / 1048576 : 0) }')
+  printf '{"timestamp":"%s","commit":"%s","tool":"%s","tree":"%s","scale":%s,"op":"%s","run":%s,' \
+    "$timestamp" "$commit" "$tool" "$tree" "$scale" "$op" "$run" >>"$output"
+  printf '"status":%s,"wall_s":%s,"user_s":%s,"sys_s":%s,"max_rss_kb":%s,"syscalls":%s,' \
+    "$status" "$wall" "$user" "$sys" "$rss" "$syscalls" >>"$output"
+  printf '"tree_bytes":%s,"archive_bytes":%s,"mib_per_s":%s}\n' "$bytes" "$archive_bytes" "$throughput" >>"$output"
+  printf '%-8s %-7s %-8s run %s  %8.3fs  %8s MiB/s  %8s KiB\n' "$tool" "$tree" "$op" "$run" "$wall" "$throughput" \
+    "$rss"
+}
+
+# Times every operation of one tool on one tree
+# Usage: bench_tool TOOL TREE BYTES CREATE LIST EXTRACT
+# where CREATE, LIST and EXTRACT are the flags before the archive name
+bench_tool() {
+  local tool=$1 tree=$2 bytes=$3 create=$4 list=$5 extract=$6
+  local exe=$kiwitar
+  [ "$tool" = kiwitar ] || exe=$ref
+  local archive=$work/$tool-$tree.tar
+  for run in $(seq 1 "$runs"); do
+    rm -f "$archive"
+    record "$tool" "$tree" create "$bytes" "$archive" "$trees" "$exe" $create "$archive" "$tree"
+    record "$tool" "$tree" list "$bytes" "$archive" "$trees" "$exe" $list "$archive"
+    rm -rf "$work/out"
+    mkdir -p "$work/out"
+    record "$tool" "$tree" extract "$bytes" "$archive" "$work/out" "$exe" $extract "$archive"
+  done
+  rm -rf "$work/out" "$archive"
+}
+
+# Runs the suite
+bench() {
+  kiwitar=$(realpath "$1")
+  bench=$(realpath "$2")
+  local dir=${BENCH_DIR:-target/bench}
+  scale=${BENCH_SCALE:-1}
+  runs=${BENCH_RUNS:-3}
+  output=$(realpath -m "${BENCH_OUTPUT:-bench_output.txt}")
+  ref=${BENCH_REF:-tar}
+  timestamp=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+  commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+  trees=$(realpath -m "$dir/trees-$scale")
+  work=$(realpath -m "$dir/work")
+  failed=0
+  mkdir -p "$trees" "$work"
+  for tree in ${BENCH_TREES:-tiny huge deep wide sparse links}; do
+    # Trees are generated once per scale and reused, as they never change
+    if [ ! -e "$trees/.$tree-done" ]; then
+      echo "Generating $tree tree..."
+      rm -rf "${trees:?}/$tree"
+      "$bench" gen "$tree" "$trees/$tree" "$scale" || return 1
+      touch "$trees/.$tree-done"
+    fi
+    local bytes
+    bytes=$(du -s -b "$trees/$tree" | cut -f1)
+    bench_tool kiwitar "$tree" "$bytes" -cf -tf -xf
+    # GNU tar only looks for holes when asked to
+    local ref_create=-cf
+    [ "$tree" = sparse ] && ref_create="--sparse -cf"
+    if command -v "$ref" >/dev/null 2>&1; then bench_tool "$(basename "$ref")" "$tree" "$bytes" "$ref_create" -tf -xf; fi
+  done
+  rm -rf "$work"
+  echo "Results appended to $output"
+  return $failed
+}
+
+# Main script logic
+if [ $# -ne 2 ]; then
+  echo "Usage: $0 KIWITAR BENCH"
+  exit 1
+fi
+bench "$1" "$2"
@@ -0,0 +1,371 @@
+#!/bin/bash
+
+# Test script called by make test
+# Usage:
+#    test.sh KIWITAR
+#
+# Extracts archives built with the reference tar and checks what kiwitar does
+# with them. Settings come from the environment:
+#    TEST_DIR      scratch directory for archives and extractions (target/test)
+#    TEST_REF      reference tar used to build the archives (tar)
+
+#
+#  Private Impl
+#
+
+# Reports a failed check
+# Usage: fail MESSAGE
+fail() {
+  echo "FAIL: $1" >&2
+  failed=1
+}
+
+# Checks that a symbolic link extracted earlier cannot redirect a later member
+# outside the extraction
+hostile_symlink() {
+  local dir=$work/hostile
+  rm -rf "$dir"
+  mkdir -p "$dir/build" "$dir/outside"
+  (
+    cd "$dir/build" || exit 1
+    ln -s "$dir/outside" a
+    "$ref" -cf ../hostile.tar a
+    rm a
+    mkdir a
+    echo escaped >a/f
+    "$ref" -rf ../hostile.tar a/f
+  ) || return 1
+  for threads in 1 8; do
+    rm -rf "$dir/out"
+    mkdir "$dir/out"
+    if (cd "$dir/out" && "$kiwitar" -xf ../hostile.tar -j "$threads" 2>/dev/null); then
+      fail "extracting through a symbolic link succeeded with $threads threads"
+    fi
+    [ -e "$dir/outside/f" ] && fail "a member was written outside the extraction with $threads threads"
+    rm -f "$dir/outside/f"
+  done
+}
+
+# Checks that a later member replaces an earlier one with the same path even
+# when the earlier one was handed to a worker
+repeated_members() {
+  local dir=$work/repeated
+  rm -rf "$dir"
+  mkdir -p "$dir/build"
+  (
+    cd "$dir/build" || exit 1
+    for i in $(seq 1 200); do head -c 204800 /dev/zero >"f$i"; done
+    "$ref" -cf ../repeated.tar f*
+    rm f*
+    for i in $(seq 1 200); do ln -s target "f$i"; done
+    "$ref" -rf ../repeated.tar f*
+  ) || return 1
+  for run in 1 2 3; do
+    rm -rf "$dir/out"
+    mkdir "$dir/out"
+    if [ $((run % 2)) -eq 1 ]; then
+      (cd "$dir/out" && "$kiwitar" -xf - -j 8 <../repeated.tar) || fail "extracting repeated members failed"
+    else
+      (cd "$dir/out" && "$kiwitar" -xf ../repeated.tar -j 8) || fail "extracting repeated members failed"
+    fi
+    local files
+    files=$(find "$dir/out" -type f | wc -l)
+    [ "$files" -eq 0 ] || fail "$files earlier copies of repeated members were left in run $run"
+  done
+}
+
+# Checks that small files written in batches through io_uring land with the
+# contents of their last copy in the archive
+batched_extract() {
+  local dir=$work/batched
+  rm -rf "$dir"
+  mkdir -p "$dir/build/d"
+  (
+    cd "$dir/build" || exit 1
+    for i in $(seq 1 100); do echo "old $i" >"d/f$i"; done
+    "$ref" -cf ../batched.tar d
+    for i in $(seq 1 100); do echo "new $i" >"d/f$i"; done
+    "$ref" -rf ../batched.tar d
+  ) || return 1
+  for input in file stdin; do
+    rm -rf "$dir/out"
+    mkdir "$dir/out"
+    local archive=../batched.tar
+    [ "$input" = stdin ] && archive=-
+    (cd "$dir/out" && "$kiwitar" -xf "$archive" -j 4 --io-uring <../batched.tar) ||
+      fail "batched extraction from $input failed"
+    diff -r "$dir/build/d" "$dir/out/d" >/dev/null || fail "batched extraction from $input left earlier copies"
+  done
+}
+
+# Checks that an index whose entries point outside the file is ignored rather
+# than read, both when looking members up and when appending
+damaged_index() {
+  local dir=$work/damaged
+  rm -rf "$dir"
+  mkdir -p "$dir/build" "$dir/out"
+  (
+    cd "$dir/build" || exit 1
+    for i in 1 2 3 4; do echo "$i" >"f$i"; done
+    "$kiwitar" -cf ../damaged.tar --index f1 f2 f3
+  ) || return 1
+  # Entries follow the 64-byte header; the path offset leads each 32-byte entry
+  local entry
+  for entry in 0 1 2; do
+    printf '\377\377\377\377\377\377\377\177' |
+      dd of="$dir/damaged.tar.idx" bs=1 seek=$((64 + entry * 32)) conv=notrunc 2>/dev/null
+  done
+  (cd "$dir/out" && "$kiwitar" -xf ../damaged.tar f2 2>/dev/null) ||
+    fail "looking up a member in a damaged index failed"
+  [ "$(cat "$dir/out/f2" 2>/dev/null)" = 2 ] || fail "a member looked up in a damaged index was not extracted"
+  (cd "$dir/build" && "$kiwitar" -rf ../damaged.tar --index f4 2>/dev/null) ||
+    fail "appending past a damaged index failed"
+  local members
+  members=$("$kiwitar" -tf "$dir/damaged.tar" f1 f4 2>/dev/null | wc -l)
+  [ "$members" -eq 2 ] || fail "the index rebuilt after appending lists $members of 2 members"
+}
+
+# Checks that a manifest whose path offset wraps around past the end of the
+# file is rejected instead of read
+damaged_snapshot() {
+  local dir=$work/snapshot
+  rm -rf "$dir"
+  mkdir -p "$dir/d"
+  echo x >"$dir/d/a"
+  (cd "$dir" && "$kiwitar" -cf full.tar -g snap d) || return 1
+  # The first entry follows the 24-byte header; its path length sits 56 bytes in
+  printf '\000\000\000\374\377\377\377\377' | dd of="$dir/snap" bs=1 seek=24 conv=notrunc 2>/dev/null
+  printf '\000\000\000\004' | dd of="$dir/snap" bs=1 seek=80 conv=notrunc 2>/dev/null
+  (cd "$dir" && "$kiwitar" -cf level1.tar -g snap d 2>/dev/null) || fail "archiving with a damaged snapshot failed"
+}
+
+# Checks that an index is not trusted for an archive of the same size written
+# after it, and that a name the index lacks is still looked for
+stale_index() {
+  local dir=$work/stale
+  rm -rf "$dir"
+  mkdir -p "$dir"
+  (
+    cd "$dir" || exit 1
+    echo 1 >p1
+    echo 2 >p2
+    echo 3 >q1
+    "$kiwitar" -cf s.tar --index p1 p2
+    cp s.tar.idx kept.idx
+    "$kiwitar" -cf s.tar q1 p2
+  ) || return 1
+  [ -e "$dir/s.tar.idx" ] && fail "creating an archive without --index left the old index behind"
+  cp "$dir/kept.idx" "$dir/s.tar.idx"
+  [ "$("$kiwitar" -tf "$dir/s.tar" q1 2>/dev/null)" = q1 ] || fail "a stale index hid a member of the archive"
+  (cd "$dir" && "$ref" -rf s.tar p1 && "$kiwitar" --build-index -f s.tar && rm p1 && "$ref" -rf s.tar q1) || return 1
+  [ "$("$kiwitar" -tf "$dir/s.tar" q1 2>/dev/null | wc -l)" -eq 2 ] || fail "a name appended past the index was missed"
+}
+
+# Checks that zero bytes padding a gzip stream after its last member end the
+# stream instead of being taken for a damaged member
+gzip_padding() {
+  local dir=$work/padding
+  rm -rf "$dir"
+  mkdir -p "$dir/d"
+  echo x >"$dir/d/a"
+  (cd "$dir" && "$ref" -czf ref.tgz d && "$kiwitar" -czf ours.tgz d) || return 1
+  local archive
+  for archive in ref.tgz ours.tgz; do
+    (cat "$dir/$archive" && head -c 1024 /dev/zero) >"$dir/padded.tgz"
+    [ "$("$kiwitar" -tzf - <"$dir/padded.tgz" 2>/dev/null | wc -l)" -eq 2 ] ||
+      fail "listing $archive padded with zeros from a pipe failed"
+    [ "$("$kiwitar" -tf "$dir/padded.tgz" 2>/dev/null | wc -l)" -eq 2 ] ||
+      fail "listing $archive padded with zeros failed"
+  done
+}
+
+# Archives a tree with kiwitar and extracts it with the reference tar, then
+# the other way around, and checks that both extractions match the tree
+# Usage: round_trip NAME TREE KIWITAR_OPTIONS REFERENCE_OPTIONS
+round_trip() {
+  local dir=$work/interop/$1 tree=$2
+  rm -rf "$dir"
+  mkdir -p "$dir/ours" "$dir/theirs"
+  # shellcheck disable=SC2086
+  (cd "$work/interop/trees" && "$kiwitar" -cf "$dir/ours.tar" $3 "$tree") || fail "kiwitar could not archive $1"
+  # The reference tar warns about the pax records only kiwitar reads
+  (cd "$dir/ours" && "$ref" -xf ../ours.tar 2>/dev/null) || fail "$ref could not extract the $1 archive of kiwitar"
+  diff -r "$work/interop/trees/$tree" "$dir/ours/$tree" >/dev/null ||
+    fail "$ref extracted the $1 archive of kiwitar wrongly"
+  # shellcheck disable=SC2086
+  (cd "$work/interop/trees" && "$ref" -cf "$dir/theirs.tar" $4 "$tree") || fail "$ref could not archive $1"
+  (cd "$dir/theirs" && "$kiwitar" -xf ../theirs.tar) || fail "kiwitar could not extract the $1 archive of $ref"
+  diff -r "$work/interop/trees/$tree" "$dir/theirs/$tree" >/dev/null ||
+    fail "kiwitar extracted the $1 archive of $ref wrongly"
+}
+
+# Checks that both extractions of a round trip kept two paths as one file
+# Usage: same_file NAME PATH1 PATH2
+same_file() {
+  local side
+  for side in ours theirs; do
+    [ "$(stat -c %i "$work/interop/$1/$side/$2")" = "$(stat -c %i "$work/interop/$1/$side/$3")" ] ||
+      fail "$3 is not a link to $2 in the $side $1 extraction"
+  done
+}
+
+# Builds the trees the round trips archive
+interop_trees() {
+  local trees=$work/interop/trees
+  rm -rf "$work/interop"
+  mkdir -p "$trees"
+  cd "$trees" || return 1
+  # The first path splits into the prefix and name fields; the second needs a pax header or a GNU long name
+  local component
+  component=$(printf 'd%.0s' $(seq 1 60))
+  mkdir -p "paths/$component/$component" "split/$component/$component"
+  echo split >"split/$component/$component/file"
+  echo split >"paths/$component/$component/file"
+  echo long >"paths/$(printf 'n%.0s' $(seq 1 120))"
+  mkdir -p links/sub
+  echo linked >links/f
+  ln links/f links/f.link
+  ln links/f links/sub/g
+  mkdir sparse
+  truncate -s 16M sparse/holes
+  echo head | dd of=sparse/holes conv=notrunc 2>/dev/null
+  echo middle | dd of=sparse/holes bs=1M seek=8 conv=notrunc 2>/dev/null
+  echo data >sparse/tail
+  truncate -s 4M sparse/tail
+  mkdir dups
+  head -c 100000 /dev/urandom >dups/a
+  cp dups/a dups/b
+  cp dups/a dups/c
+  echo other >dups/d
+  cd - >/dev/null || return 1
+}
+
+# Checks that pax long paths, prefix splitting, hard links, sparse files,
+# compressed archives and deduplicated files survive the round trip
+interop_round_trips() {
+  interop_trees || return 1
+  round_trip paths paths "" ""
+  round_trip pax paths "" --format=posix
+  round_trip split split "" --format=ustar
+  round_trip links links "" ""
+  same_file links links/f links/f.link
+  same_file links links/f links/sub/g
+  round_trip sparse sparse "" "--format=posix --sparse --sparse-version=1.0"
+  local used
+  used=$(du -k "$work/interop/sparse/theirs/sparse/holes" | cut -f1)
+  [ "$used" -lt 1024 ] || fail "kiwitar filled in the holes of a sparse member with $used KiB"
+  round_trip gzip links -z -z
+  round_trip dedup dups --dedup ""
+}
+
+# Archives a tree, changes it, then adds to the archive with -r and -u
+# Usage: append_round NAME TAR ARCHIVE
+append_round() {
+  local tree=$work/interop/$1
+  rm -rf "$tree"
+  mkdir -p "$tree/t"
+  (
+    cd "$tree" || exit 1
+    echo old >t/changed
+    echo same >t/kept
+    touch -d '2000-01-01' t/changed t/kept
+    "$2" -cf "$3" t
+    echo new >t/changed
+    echo added >t/added
+    "$2" -uf "$3" t
+    echo appended >t/appended
+    "$2" -rf "$3" t/appended
+  )
+}
+
+# Checks that archives grown with -r and -u by one tar extract with the other
+interop_append() {
+  local dir=$work/interop/append-ours
+  append_round append-ours "$kiwitar" ours.tar || fail "kiwitar could not append"
+  mkdir -p "$dir/out"
+  (cd "$dir/out" && "$ref" -xf ../ours.tar) || fail "$ref could not extract an appended archive"
+  diff -r "$dir/t" "$dir/out/t" >/dev/null || fail "$ref extracted an archive kiwitar appended to wrongly"
+  dir=$work/interop/append-theirs
+  append_round append-theirs "$ref" theirs.tar || fail "$ref could not append"
+  mkdir -p "$dir/out"
+  (cd "$dir/out" && "$kiwitar" -xf ../theirs.tar) || fail "kiwitar could not extract an appended archive"
+  diff -r "$dir/t" "$dir/out/t" >/dev/null || fail "kiwitar extracted an archive $ref appended to wrongly"
+  (cd "$dir" && "$kiwitar" -uf theirs.tar t) || fail "kiwitar could not update an archive of $ref"
+}
+
+# Takes a full and a level-one incremental archive of a tree with one tar,
+# removing, adding and changing files in between
+# Usage: incremental_round NAME TAR
+incremental_round() {
+  local tree=$work/interop/$1
+  rm -rf "$tree"
+  mkdir -p "$tree/t/gone" "$tree/t/sub"
+  (
+    cd "$tree" || exit 1
+    echo a >t/a
+    echo b >t/b
+    echo c >t/sub/c
+    echo g >t/gone/g
+    "$2" -cf full.tar -g snap t
+    sleep 1
+    rm -r t/b t/gone
+    echo new >t/sub/new
+    echo changed >t/a
+    "$2" -cf level1.tar -g snap t
+  )
+}
+
+# Checks that incremental archives of each tar restore with the other,
+# deletions included where the extracting tar understands how they are recorded
+interop_incremental() {
+  local dir=$work/interop/incr-theirs
+  incremental_round incr-theirs "$ref" || fail "$ref could not take incremental archives"
+  mkdir -p "$dir/out"
+  (cd "$dir/out" && "$kiwitar" -xf ../full.tar -g /dev/null && "$kiwitar" -xf ../level1.tar -g /dev/null) ||
+    fail "kiwitar could not restore the incremental archives of $ref"
+  diff -r "$dir/t" "$dir/out/t" >/dev/null || fail "kiwitar restored the incremental archives of $ref wrongly"
+  dir=$work/interop/incr-ours
+  incremental_round incr-ours "$kiwitar" || fail "kiwitar could not take incremental archives"
+  mkdir -p "$dir/out" "$dir/ref"
+  (cd "$dir/out" && "$kiwitar" -xf ../full.tar -g /dev/null && "$kiwitar" -xf ../level1.tar -g /dev/null) ||
+    fail "kiwitar could not restore its own incremental archives"
+  diff -r "$dir/t" "$dir/out/t" >/dev/null || fail "kiwitar restored its own incremental archives wrongly"
+  # The reference tar restores the changes but keeps what kiwitar records as deleted in a pax record it ignores
+  (cd "$dir/ref" && "$ref" -xf ../full.tar 2>/dev/null && "$ref" -xf ../level1.tar 2>/dev/null) ||
+    fail "$ref could not restore the incremental archives of kiwitar"
+  rm -r "$dir/ref/t/b" "$dir/ref/t/gone"
+  diff -r "$dir/t" "$dir/ref/t" >/dev/null || fail "$ref restored the incremental archives of kiwitar wrongly"
+}
+
+# Runs the suite
+run_tests() {
+  kiwitar=$(realpath "$1")
+  ref=${TEST_REF:-tar}
+  work=$(realpath -m "${TEST_DIR:-target/test}")
+  failed=0
+  if ! command -v "$ref" >/dev/null 2>&1; then
+    echo "$ref not found; skipping tests"
+    return 0
+  fi
+  mkdir -p "$work"
+  hostile_symlink || fail "could not build the hostile archive"
+  repeated_members || fail "could not build the archive of repeated members"
+  batched_extract || fail "could not build the archive of small files"
+  damaged_index || fail "could not build the indexed archive"
+  damaged_snapshot || fail "could not build the snapshot"
+  stale_index || fail "could not build the indexed archives"
+  gzip_padding || fail "could not build the compressed archives"
+  interop_round_trips || fail "could not build the trees to round-trip"
+  interop_append
+  interop_incremental
+  rm -rf "$work"
+  [ $failed -eq 0 ] && echo "All tests passed"
+  return $failed
+}
+
+# Main script logic
+if [ $# -ne 1 ]; then
+  echo "Usage: $0 KIWITAR"
+  exit 1
+fi
+run_tests "$1"
@@ -0,0 +1,650 @@
+/*
+ * compress.c - block-parallel gzip and zstd streams
+ *
+ * The archive is cut into fixed-size blocks that are compressed independently
+ on a pool of threads and written out in order. Every gzip block is a complete
+ gzip member carrying its own compressed size in an extra field, and every zstd
+ block is a complete frame, so the result is a standard stream that any gzip or
+ zstd can read. When reading, those sizes let members be handed to the pool
+ without decoding them first; streams written by other tools are decoded on the
+ reading thread instead.
+ */
+#include "../include/compress.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/safe_alloc.h"
+#include "../include/safe_file.h"
+#include "../include/stats.h"
+#include "../include/throttle.h"
+
+#define GZIP_ID1 0x1f
+#define GZIP_ID2 0x8b
+#define GZIP_DEFLATE 8 /* Compression method of every gzip member */
+#define GZIP_FEXTRA 0x04 /* Flag marking an extra field */
+#define GZIP_OS_UNIX 3
+#define GZIP_WINDOW_BITS (15 + 16) /* A 32 KiB window with a gzip wrapper */
+#define GZIP_SUBFIELD_ID1 'K' /* Identifies the member size subfield */
+#define GZIP_SUBFIELD_ID2 'W'
+#define GZIP_HEADER_SIZE (GZIP_EXTRA_OFFSET + 4) /* Bytes up to the end of the member size */
+#define ZSTD_MAGIC 0xfd2fb528U
+#define ZSTD_LEVEL 3
+#define ZSTD_HEADER_LIMIT 18 /* The largest zstd frame header */
+
+/**
+ * Reads a little-endian 32-bit number
+ *
+ * @param bytes the bytes to read
+ * @return the number
+ */
+static uint32_t loadLittle32(const unsigned char* bytes) {
+  return bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+/**
+ * Recognises a compressed archive by its first bytes
+ *
+ * @param bytes the start of the archive
+ * @param length the number of bytes available
+ * @return COMPRESS_GZIP, COMPRESS_ZSTD or COMPRESS_NONE
+ */
+int compressDetect(const unsigned char* bytes, size_t length) {
+  if (length >= 2 && bytes[0] == GZIP_ID1 && bytes[1] == GZIP_ID2) { return COMPRESS_GZIP; }
+  if (length >= COMPRESS_MAGIC_SIZE && loadLittle32(bytes) == ZSTD_MAGIC) { return COMPRESS_ZSTD; }
+  return COMPRESS_NONE;
+}
+
+/**
+ * Reports a failure of the compression library and exits
+ *
+ * @param message the message to print
+ */
+static void compressFailure(const char* message) {
+  fprintf(stderr, "%s\n", message);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Finds the block holding a sequence number
+ *
+ * @param pool the pool holding the block
+ * @param seq the sequence number of the block
+ * @return a pointer to the block
+ */
+static CompressBlock* blockAt(CompressPool* pool, size_t seq) { return &pool->blocks[seq % pool->capacity]; }
+
+/**
+ * Compresses a block into one gzip member whose extra field records the size
+ * of the whole member
+ *
+ * @param stream the thread's deflate stream
+ * @param block the block to compress
+ */
+static void deflateBlock(z_stream* stream, CompressBlock* block) {
+  unsigned char extra[GZIP_EXTRA_SIZE] = {GZIP_SUBFIELD_ID1, GZIP_SUBFIELD_ID2, 4, 0, 0, 0, 0, 0};
+  gz_header header;
+  memset(&header, 0, sizeof(header));
+  header.extra = extra;
+  header.extra_len = sizeof(extra);
+  header.os = GZIP_OS_UNIX;
+  if (deflateReset(stream) != Z_OK || deflateSetHeader(stream, &header) != Z_OK) {
+    compressFailure("Error starting gzip member.");
+  }
+  size_t bound = deflateBound(stream, block->in_length) + GZIP_EXTRA_SIZE;
+  if (block->out_capacity < bound) {
+    block->out = (unsigned char*)safeRealloc(block->out, bound);
+    block->out_capacity = bound;
+  }
+  stream->next_in = block->in;
+  stream->avail_in = block->in_length;
+  stream->next_out = block->out;
+  stream->avail_out = block->out_capacity;
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END) { compressFailure("Error compressing gzip member."); }
+  block->out_length = block->out_capacity - stream->avail_out;
+  /* The size is only known now, so it is patched into the header */
+  uint32_t size = block->out_length;
+  for (int i = 0; i < 4; i++) { block->out[GZIP_EXTRA_OFFSET + i] = size >> (8 * i); }
+}
+
+/**
+ * Decompresses one gzip member written by deflateBlock
+ *
+ * @param stream the thread's inflate stream
+ * @param block the block to decompress, whose output is already sized
+ */
+static void inflateBlock(z_stream* stream, CompressBlock* block) {
+  if (inflateReset(stream) != Z_OK) { compressFailure("Error starting gzip member."); }
+  stream->next_in = block->in;
+  stream->avail_in = block->in_length;
+  stream->next_out = block->out;
+  stream->avail_out = block->out_length;
+  if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_out != 0) {
+    compressFailure("Compressed archive is damaged.");
+  }
+}
+
+/**
+ * The body of a pool thread: take queued blocks in order and transform them
+ *
+ * @param arg the pool the thread belongs to
+ * @return NULL
+ */
+static void* poolWorker(void* arg) {
+  CompressPool* pool = (CompressPool*)arg;
+  int compressing = pool->compressing;
+  z_stream gzip;
+  memset(&gzip, 0, sizeof(gzip));
+  if (pool->format == COMPRESS_GZIP) {
+    int r = compressing ? deflateInit2(&gzip, pool->level, Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY)
+                        : inflateInit2(&gzip, GZIP_WINDOW_BITS);
+    if (r != Z_OK) { compressFailure("Error initialising zlib."); }
+  }
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx* cctx = compressing ? ZSTD_createCCtx() : NULL;
+  ZSTD_DCtx* dctx = compressing ? NULL : ZSTD_createDCtx();
+#endif
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->shutdown &&
+           (pool->next_work == pool->first + pool->count || blockAt(pool, pool->next_work)->state != BLOCK_QUEUED)) {
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+    }
+    if (pool->shutdown) { break; }
+    CompressBlock* block = blockAt(pool, pool->next_work++);
+    block->state = BLOCK_WORKING;
+    pthread_mutex_unlock(&pool->lock);
+    if (pool->format == COMPRESS_GZIP) {
+      if (compressing) {
+        deflateBlock(&gzip, block);
+      } else {
+        inflateBlock(&gzip, block);
+      }
+    }
+#ifdef HAVE_ZSTD
+    if (pool->format == COMPRESS_ZSTD && compressing) {
+      size_t bound = ZSTD_compressBound(block->in_length);
+      if (block->out_capacity < bound) {
+        block->out = (unsigned char*)safeRealloc(block->out, bound);
+        block->out_capacity = bound;
+      }
+      size_t r = ZSTD_compressCCtx(cctx, block->out, block->out_capacity, block->in, block->in_length, pool->level);
+      if (ZSTD_isError(r)) { compressFailure("Error compressing zstd frame."); }
+      block->out_length = r;
+    } else if (pool->format == COMPRESS_ZSTD) {
+      size_t r = ZSTD_decompressDCtx(dctx, block->out, block->out_length, block->in, block->in_length);
+      if (ZSTD_isError(r) || r != block->out_length) { compressFailure("Compressed archive is damaged."); }
+    }
+#endif
+    pthread_mutex_lock(&pool->lock);
+    block->state = BLOCK_DONE;
+    pthread_cond_broadcast(&pool->done_cond);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if (pool->format == COMPRESS_GZIP) {
+    if (compressing) {
+      deflateEnd(&gzip);
+    } else {
+      inflateEnd(&gzip);
+    }
+  }
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(cctx);
+  ZSTD_freeDCtx(dctx);
+#endif
+  return NULL;
+}
+
+/**
+ * Starts the threads of a pool
+ *
+ * @param pool the pool to start
+ * @param format the format of the stream
+ * @param compressing nonzero to compress blocks, zero to decompress them
+ * @param level the compression level
+ * @param num_threads the number of threads
+ */
+static void poolOpen(CompressPool* pool, int format, int compressing, int level, size_t num_threads) {
+  memset(pool, 0, sizeof(*pool));
+  pool->format = format;
+  pool->compressing = compressing;
+  pool->level = level;
+  pool->num_threads = num_threads > 0 ? num_threads : 1;
+  pool->capacity = pool->num_threads * COMPRESS_BLOCKS_PER_THREAD;
+  pool->blocks = (CompressBlock*)safeCalloc(pool->capacity, sizeof(CompressBlock));
+  pool->threads = (pthread_t*)safeMalloc(pool->num_threads * sizeof(pthread_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  for (size_t i = 0; i < pool->num_threads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, poolWorker, pool) != 0) {
+      perror("Failed to start compression thread.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/**
+ * Hands a filled block to the pool
+ *
+ * @param pool the pool to queue on
+ * @param block the block to queue
+ */
+static void poolQueue(CompressPool* pool, CompressBlock* block) {
+  pthread_mutex_lock(&pool->lock);
+  block->state = BLOCK_QUEUED;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Waits for the oldest block of a pool to be transformed
+ *
+ * @param pool the pool to wait on, which must have a block in use
+ * @return the oldest block
+ */
+static CompressBlock* poolWait(CompressPool* pool) {
+  CompressBlock* block = blockAt(pool, pool->first);
+  pthread_mutex_lock(&pool->lock);
+  while (block->state != BLOCK_DONE) { pthread_cond_wait(&pool->done_cond, &pool->lock); }
+  pthread_mutex_unlock(&pool->lock);
+  return block;
+}
+
+/**
+ * Returns the oldest block of a pool to the free slots
+ *
+ * @param pool the pool the block belongs to
+ */
+static void poolRetire(CompressPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  blockAt(pool, pool->first)->state = BLOCK_FREE;
+  pool->first++;
+  pool->count--;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Stops the threads of a pool and frees its blocks
+ *
+ * @param pool the pool to stop
+ */
+static void poolClose(CompressPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->num_threads; i++) { pthread_join(pool->threads[i], NULL); }
+  for (size_t i = 0; i < pool->capacity; i++) {
+    safeFree(pool->blocks[i].in);
+    safeFree(pool->blocks[i].out);
+  }
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->lock);
+  safeFree(pool->threads);
+  safeFree(pool->blocks);
+}
+
+/**
+ * Starts compressing an archive into a file
+ *
+ * @param fd the file descriptor to write the compressed stream to
+ * @param format COMPRESS_GZIP or COMPRESS_ZSTD
+ * @param num_threads the number of threads compressing blocks
+ * @return a pointer to the compressor
+ */
+Compressor* compressOpen(int fd, int format, size_t num_threads) {
+#ifndef HAVE_ZSTD
+  if (format == COMPRESS_ZSTD) { compressFailure("zstd support was not compiled in."); }
+#endif
+  Compressor* compressor = (Compressor*)safeMalloc(sizeof(Compressor));
+  compressor->fd = fd;
+  compressor->filling = NULL;
+  poolOpen(&compressor->pool, format, 1, format == COMPRESS_GZIP ? Z_DEFAULT_COMPRESSION : ZSTD_LEVEL, num_threads);
+  return compressor;
+}
+
+/**
+ * Writes the compressed blocks at the head of the ring
+ *
+ * @param compressor the compressor to drain
+ * @param wait nonzero to wait for the oldest block rather than stop at it
+ */
+static void emitBlocks(Compressor* compressor, int wait) {
+  CompressPool* pool = &compressor->pool;
+  while (pool->count > 0) {
+    CompressBlock* block = blockAt(pool, pool->first);
+    pthread_mutex_lock(&pool->lock);
+    int state = block->state;
+    pthread_mutex_unlock(&pool->lock);
+    if (block == compressor->filling || (state != BLOCK_DONE && !wait)) { return; }
+    poolWait(pool);
+    safeWrite(compressor->fd, block->out, block->out_length);
+    poolRetire(pool);
+  }
+}
+
+/**
+ * Appends archive bytes to the compressed stream. Full blocks are queued for
+ * the pool, and finished blocks are written in order as room is needed.
+ *
+ * @param compressor the compressor to write to
+ * @param buf the bytes to write
+ * @param count the number of bytes to write
+ */
+void compressWrite(Compressor* compressor, const void* buf, size_t count) {
+  CompressPool* pool = &compressor->pool;
+  const unsigned char* bytes = (const unsigned char*)buf;
+  while (count > 0) {
+    CompressBlock* block = compressor->filling;
+    if (block == NULL) {
+      emitBlocks(compressor, 0);
+      if (pool->count == pool->capacity) { emitBlocks(compressor, 1); }
+      block = blockAt(pool, pool->first + pool->count);
+      if (block->in == NULL) {
+        block->in = (unsigned char*)safeMalloc(COMPRESS_BLOCK_SIZE);
+        block->in_capacity = COMPRESS_BLOCK_SIZE;
+      }
+      block->in_length = 0;
+      pthread_mutex_lock(&pool->lock);
+      block->state = BLOCK_FILLING;
+      pool->count++;
+      pthread_mutex_unlock(&pool->lock);
+      compressor->filling = block;
+    }
+    size_t chunk = block->in_capacity - block->in_length;
+    if (chunk > count) { chunk = count; }
+    memcpy(block->in + block->in_length, bytes, chunk);
+    block->in_length += chunk;
+    bytes += chunk;
+    count -= chunk;
+    if (block->in_length == block->in_capacity) {
+      poolQueue(pool, block);
+      compressor->filling = NULL;
+    }
+  }
+}
+
+/**
+ * Compresses and writes whatever is left, then frees the compressor; the
+ * file descriptor is left open
+ *
+ * @param compressor the compressor to close
+ */
+void compressClose(Compressor* compressor) {
+  CompressPool* pool = &compressor->pool;
+  if (compressor->filling != NULL) {
+    poolQueue(pool, compressor->filling);
+    compressor->filling = NULL;
+  }
+  emitBlocks(compressor, 1);
+  poolClose(pool);
+  safeFree(compressor);
+}
+
+/**
+ * Makes sure at least a number of compressed bytes are buffered, unless the
+ * stream ends first
+ *
+ * @param decompressor the decompressor to fill
+ * @param count the number of bytes wanted
+ * @return the number of bytes buffered
+ */
+static size_t fillInput(Decompressor* decompressor, size_t count) {
+  size_t available = decompressor->input_end - decompressor->input_start;
+  if (available >= count || decompressor->input_eof) { return available; }
+  memmove(decompressor->input, decompressor->input + decompressor->input_start, available);
+  decompressor->input_start = 0;
+  decompressor->input_end = available;
+  size_t wanted = count > DECOMPRESS_READ_SIZE ? count : DECOMPRESS_READ_SIZE;
+  if (decompressor->input_capacity < wanted) {
+    decompressor->input = (unsigned char*)safeRealloc(decompressor->input, wanted);
+    decompressor->input_capacity = wanted;
+  }
+  while (decompressor->input_end < count) {
+    STATS_START(started);
+    ssize_t r = read(decompressor->fd, decompressor->input + decompressor->input_end,
+                     decompressor->input_capacity - decompressor->input_end);
+    STATS_END(STATS_READ, started, r > 0 ? r : 0);
+    if (r == FILE_ERROR && errno == EINTR) { continue; }
+    if (r == FILE_ERROR) {
+      perror("Error reading file.\n");
+      exit(EXIT_FAILURE);
+    }
+    throttleIO(THROTTLE_READ, r);
+    if (r == 0) {
+      decompressor->input_eof = 1;
+      break;
+    }
+    decompressor->input_end += r;
+  }
+  return decompressor->input_end - decompressor->input_start;
+}
+
+/**
+ * Measures the next member of the stream without decoding it
+ *
+ * @param decompressor the decompressor reading the stream
+ * @param in_length where to store the compressed size of the member
+ * @param out_length where to store the decompressed size of the member
+ * @return nonzero if the member can be decoded on its own, zero if it must be
+ * decoded sequentially
+ */
+static int measureMember(Decompressor* decompressor, size_t* in_length, size_t* out_length) {
+  if (decompressor->format == COMPRESS_GZIP) {
+    if (fillInput(decompressor, GZIP_HEADER_SIZE) < GZIP_HEADER_SIZE) { return 0; }
+    const unsigned char* header = decompressor->input + decompressor->input_start;
+    /* Only members carrying their size, as written by deflateBlock, qualify */
+    if (header[0] != GZIP_ID1 || header[1] != GZIP_ID2 || header[2] != GZIP_DEFLATE || !(header[3] & GZIP_FEXTRA) ||
+        header[10] != GZIP_EXTRA_SIZE || header[11] != 0 || header[12] != GZIP_SUBFIELD_ID1 ||
+        header[13] != GZIP_SUBFIELD_ID2 || header[14] != 4 || header[15] != 0) {
+      return 0;
+    }
+    *in_length = loadLittle32(header + GZIP_EXTRA_OFFSET);
+    if (*in_length < GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE || fillInput(decompressor, *in_length) < *in_length) {
+      return 0;
+    }
+    *out_length = loadLittle32(decompressor->input + decompressor->input_start + *in_length - 4);
+    return *out_length <= DECOMPRESS_BLOCK_LIMIT;
+  }
+#ifdef HAVE_ZSTD
+  size_t available = fillInput(decompressor, ZSTD_HEADER_LIMIT);
+  const unsigned char* frame = decompressor->input + decompressor->input_start;
+  unsigned long long content = ZSTD_getFrameContentSize(frame, available);
+  if (content == ZSTD_CONTENTSIZE_UNKNOWN || content == ZSTD_CONTENTSIZE_ERROR || content > DECOMPRESS_BLOCK_LIMIT) {
+    return 0;
+  }
+  /* A frame holding at most the limit compresses to at most its bound */
+  available = fillInput(decompressor, ZSTD_compressBound(content));
+  size_t size = ZSTD_findFrameCompressedSize(decompressor->input + decompressor->input_start, available);
+  if (ZSTD_isError(size)) { return 0; }
+  *in_length = size;
+  *out_length = content;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Queues upcoming members on the pool until it is full or the stream ends
+ *
+ * @param decompressor the decompressor to fill
+ */
+static void queueMembers(Decompressor* decompressor) {
+  CompressPool* pool = &decompressor->pool;
+  while (!decompressor->sequential_pending && pool->count < pool->capacity) {
+    if (fillInput(decompressor, 1) == 0) { return; }
+    size_t in_length, out_length;
+    if (!measureMember(decompressor, &in_length, &out_length)) {
+      /* Other tools' streams are decoded on this thread once the queued
+       * members have been returned */
+      decompressor->sequential_pending = 1;
+      return;
+    }
+    CompressBlock* block = blockAt(pool, pool->first + pool->count);
+    if (block->in_capacity < in_length) {
+      block->in = (unsigned char*)safeRealloc(block->in, in_length);
+      block->in_capacity = in_length;
+    }
+    if (block->out_capacity < out_length) {
+      block->out = (unsigned char*)safeRealloc(block->out, out_length);
+      block->out_capacity = out_length;
+    }
+    memcpy(block->in, decompressor->input + decompressor->input_start, in_length);
+    decompressor->input_start += in_length;
+    block->in_length = in_length;
+    block->out_length = out_length;
+    decompressor->member_ended = 1;
+    pthread_mutex_lock(&pool->lock);
+    pool->count++;
+    block->state = BLOCK_QUEUED;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+/**
+ * Decodes the stream on the calling thread. Tools that pad a compressed
+ * archive to a whole record leave zero bytes after the last gzip member,
+ * which end the stream rather than start another member.
+ *
+ * @param decompressor the decompressor reading the stream
+ * @param buf the buffer to decode into
+ * @param count the most bytes to decode
+ * @return the number of bytes decoded, zero at the end of the stream
+ */
+static size_t decodeSequential(Decompressor* decompressor, unsigned char* buf, size_t count) {
+  size_t done = 0;
+  while (done < count) {
+    size_t available = fillInput(decompressor, 1);
+    if (available == 0 && decompressor->gzip_active && decompressor->gzip.total_in > 0) {
+      compressFailure("Compressed archive is truncated.");
+    }
+    if (available == 0) { break; }
+    unsigned char* in = decompressor->input + decompressor->input_start;
+    if (decompressor->format == COMPRESS_GZIP) {
+      z_stream* stream = &decompressor->gzip;
+      int between = !decompressor->gzip_active || stream->total_in == 0;
+      if (between && decompressor->member_ended && in[0] == 0) {
+        decompressor->input_start = decompressor->input_end;
+        decompressor->input_eof = 1;
+        break;
+      }
+      if (!decompressor->gzip_active) {
+        if (inflateInit2(stream, GZIP_WINDOW_BITS) != Z_OK) { compressFailure("Error initialising zlib."); }
+        decompressor->gzip_active = 1;
+      }
+      stream->next_in = in;
+      stream->avail_in = available;
+      stream->next_out = buf + done;
+      stream->avail_out = count - done;
+      int r = inflate(stream, Z_NO_FLUSH);
+      if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) { compressFailure("Compressed archive is damaged."); }
+      decompressor->input_start += available - stream->avail_in;
+      done = count - stream->avail_out;
+      /* Each member ends its own stream; the next one starts afresh */
+      if (r == Z_STREAM_END) {
+        inflateReset(stream);
+        decompressor->member_ended = 1;
+      }
+    }
+#ifdef HAVE_ZSTD
+    if (decompressor->format == COMPRESS_ZSTD) {
+      if (decompressor->zstd == NULL) { decompressor->zstd = ZSTD_createDStream(); }
+      ZSTD_inBuffer input = {in, available, 0};
+      ZSTD_outBuffer output = {buf + done, count - done, 0};
+      size_t r = ZSTD_decompressStream(decompressor->zstd, &output, &input);
+      if (ZSTD_isError(r)) { compressFailure("Compressed archive is damaged."); }
+      decompressor->input_start += input.pos;
+      done += output.pos;
+    }
+#endif
+  }
+  return done;
+}
+
+/**
+ * Starts decompressing an archive
+ *
+ * @param fd the file descriptor to read the compressed stream from
+ * @param format COMPRESS_GZIP or COMPRESS_ZSTD
+ * @param initial compressed bytes already read from fd
+ * @param initial_length the number of bytes already read
+ * @param num_threads the number of threads decompressing members
+ * @return a pointer to the decompressor
+ */
+Decompressor* decompressOpen(int fd, int format, const void* initial, size_t initial_length, size_t num_threads) {
+#ifndef HAVE_ZSTD
+  if (format == COMPRESS_ZSTD) { compressFailure("zstd support was not compiled in."); }
+#endif
+  Decompressor* decompressor = (Decompressor*)safeCalloc(1, sizeof(Decompressor));
+  decompressor->fd = fd;
+  decompressor->format = format;
+  decompressor->input_capacity = initial_length > DECOMPRESS_READ_SIZE ? initial_length : DECOMPRESS_READ_SIZE;
+  decompressor->input = (unsigned char*)safeMalloc(decompressor->input_capacity);
+  memcpy(decompressor->input, initial, initial_length);
+  decompressor->input_end = initial_length;
+  poolOpen(&decompressor->pool, format, 0, 0, num_threads);
+  return decompressor;
+}
+
+/**
+ * Reads decompressed archive bytes
+ *
+ * @param decompressor the decompressor to read from
+ * @param buf the buffer to read into
+ * @param count the number of bytes to read
+ * @return the number of bytes read, less than count only at the end of the
+ * stream
+ */
+ssize_t decompressRead(Decompressor* decompressor, void* buf, size_t count) {
+  CompressPool* pool = &decompressor->pool;
+  unsigned char* out = (unsigned char*)buf;
+  size_t done = 0;
+  while (done < count) {
+    if (decompressor->sequential) {
+      size_t r = decodeSequential(decompressor, out + done, count - done);
+      if (r == 0) { break; }
+      done += r;
+      continue;
+    }
+    queueMembers(decompressor);
+    if (pool->count == 0) {
+      if (!decompressor->sequential_pending) { break; }
+      decompressor->sequential = 1;
+      continue;
+    }
+    CompressBlock* block = poolWait(pool);
+    size_t chunk = block->out_length - decompressor->out_offset;
+    if (chunk > count - done) { chunk = count - done; }
+    memcpy(out + done, block->out + decompressor->out_offset, chunk);
+    done += chunk;
+    decompressor->out_offset += chunk;
+    if (decompressor->out_offset == block->out_length) {
+      decompressor->out_offset = 0;
+      poolRetire(pool);
+    }
+  }
+  return done;
+}
+
+/**
+ * Stops a decompressor and frees it; the file descriptor is left open
+ *
+ * @param decompressor the decompressor to close
+ */
+void decompressClose(Decompressor* decompressor) {
+  poolClose(&decompressor->pool);
+  if (decompressor->gzip_active) { inflateEnd(&decompressor->gzip); }
+#ifdef HAVE_ZSTD
+  ZSTD_freeDStream(decompressor->zstd);
+#endif
+  safeFree(decompressor->input);
+  safeFree(decompressor);
+}
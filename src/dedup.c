@@ -0,0 +1,354 @@
+/*
+ * dedup.c - detection of identical files that are not hard links
+ *
+ * Files are grouped by size as they are walked. The first file of a size is
+ only recorded; when another file of the same size turns up, both are hashed
+ with the 128-bit MurmurHash3. MurmurHash3 is fast but not collision
+ resistant, so files whose hashes match are also compared byte for byte, and
+ only then is the later one stored as a link to the copy archived first. A
+ recorded file is read lazily from disk, so its status is checked first and a
+ file that changed since it was archived is never linked to.
+ */
+#include "../include/dedup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/hash.h"
+#include "../include/kiwitar.h"
+#include "../include/throttle.h"
+
+#define MURMUR_C1 0x87c37b91114253d5ULL /* First multiplier of MurmurHash3 x64 128 */
+#define MURMUR_C2 0x4cf5ad432745937fULL /* Second multiplier of MurmurHash3 x64 128 */
+#define MURMUR_BLOCK_SIZE 16 /* Bytes mixed in at once */
+
+/**
+ * Rotates a 64-bit word left
+ *
+ * @param x the word to rotate
+ * @param r the number of bits to rotate by
+ * @return the rotated word
+ */
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+/**
+ * Scrambles the bits of a 64-bit word, the finalizer of MurmurHash3
+ *
+ * @param k the word to scramble
+ * @return the scrambled word
+ */
+static uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+/**
+ * Reads a little-endian 64-bit word
+ *
+ * @param p the bytes to read
+ * @return the word
+ */
+static uint64_t load64(const unsigned char* p) {
+  uint64_t x = 0;
+  for (int i = 7; i >= 0; i--) { x = x << 8 | p[i]; }
+  return x;
+}
+
+/**
+ * Mixes whole blocks into the state of a MurmurHash3 x64 128 hash
+ *
+ * @param h the two words of the state
+ * @param data the blocks to mix in
+ * @param num_blocks the number of blocks
+ */
+static void murmurBlocks(uint64_t h[2], const unsigned char* data, size_t num_blocks) {
+  uint64_t h1 = h[0], h2 = h[1];
+  for (size_t i = 0; i < num_blocks; i++) {
+    uint64_t k1 = load64(data + i * MURMUR_BLOCK_SIZE);
+    uint64_t k2 = load64(data + i * MURMUR_BLOCK_SIZE + 8);
+    k1 *= MURMUR_C1;
+    k1 = rotl64(k1, 31);
+    k1 *= MURMUR_C2;
+    h1 ^= k1;
+    h1 = rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+    k2 *= MURMUR_C2;
+    k2 = rotl64(k2, 33);
+    k2 *= MURMUR_C1;
+    h2 ^= k2;
+    h2 = rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+  h[0] = h1;
+  h[1] = h2;
+}
+
+/**
+ * Mixes the last partial block and the length into a MurmurHash3 x64 128
+ * hash, completing it
+ *
+ * @param h the two words of the state, which become the hash
+ * @param tail the bytes after the last whole block
+ * @param tail_length the number of those bytes, less than a block
+ * @param length the total number of bytes hashed
+ */
+static void murmurFinish(uint64_t h[2], const unsigned char* tail, size_t tail_length, uint64_t length) {
+  uint64_t k1 = 0, k2 = 0;
+  for (size_t i = tail_length; i > 8; i--) { k2 = k2 << 8 | tail[i - 1]; }
+  for (size_t i = tail_length < 8 ? tail_length : 8; i > 0; i--) { k1 = k1 << 8 | tail[i - 1]; }
+  if (tail_length > 8) {
+    k2 *= MURMUR_C2;
+    k2 = rotl64(k2, 33);
+    k2 *= MURMUR_C1;
+    h[1] ^= k2;
+  }
+  if (tail_length > 0) {
+    k1 *= MURMUR_C1;
+    k1 = rotl64(k1, 31);
+    k1 *= MURMUR_C2;
+    h[0] ^= k1;
+  }
+  h[0] ^= length;
+  h[1] ^= length;
+  h[0] += h[1];
+  h[1] += h[0];
+  h[0] = fmix64(h[0]);
+  h[1] = fmix64(h[1]);
+  h[0] += h[1];
+  h[1] += h[0];
+}
+
+/**
+ * Opens a file, provided it is still as it was recorded
+ *
+ * @param file the file to open
+ * @param size the size the file was recorded with
+ * @return a file descriptor of the file, or FILE_ERROR if it could not be
+ * opened or has changed
+ */
+static int openRecorded(const DedupFile* file, off_t size) {
+  int fd = open(file->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd == FILE_ERROR) { return FILE_ERROR; }
+  struct stat st;
+  if (fstat(fd, &st) == FILE_ERROR || st.st_dev != file->dev || st.st_ino != file->ino || st.st_size != size ||
+      st.st_mtim.tv_sec != file->mtime.tv_sec || st.st_mtim.tv_nsec != file->mtime.tv_nsec ||
+      st.st_ctim.tv_sec != file->ctime.tv_sec || st.st_ctim.tv_nsec != file->ctime.tv_nsec) {
+    close(fd);
+    return FILE_ERROR;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  return fd;
+}
+
+/**
+ * Reads until a buffer is full or the file ends
+ *
+ * @param fd the file descriptor to read from
+ * @param buf the buffer to read into
+ * @param count the size of the buffer
+ * @return the number of bytes read, or FILE_ERROR on failure
+ */
+static ssize_t readFull(int fd, unsigned char* buf, size_t count) {
+  size_t total = 0;
+  while (total < count) {
+    ssize_t r = read(fd, buf + total, count - total);
+    if (r == FILE_ERROR && errno == EINTR) { continue; }
+    if (r == FILE_ERROR) { return FILE_ERROR; }
+    if (r == 0) { break; }
+    throttleIO(THROTTLE_READ, r);
+    total += r;
+  }
+  return total;
+}
+
+/**
+ * Compares the contents of two files whose hashes match, provided both are
+ * still as they were recorded
+ *
+ * @param table the table whose buffer to read through
+ * @param a the first file
+ * @param b the second file
+ * @param size the size of both files
+ * @return nonzero if both files could be read and hold the same bytes
+ */
+static int sameContents(DedupTable* table, const DedupFile* a, const DedupFile* b, off_t size) {
+  int fd_a = openRecorded(a, size);
+  if (fd_a == FILE_ERROR) { return 0; }
+  int fd_b = openRecorded(b, size);
+  if (fd_b == FILE_ERROR) {
+    close(fd_a);
+    return 0;
+  }
+  if (table->buffer == NULL) { table->buffer = (unsigned char*)safeMalloc(DEDUP_READ_SIZE); }
+  /* Each file is read through its own half of the buffer */
+  unsigned char* buf_a = table->buffer;
+  unsigned char* buf_b = table->buffer + DEDUP_READ_SIZE / 2;
+  off_t total = 0;
+  int same = 1;
+  while (same && total < size) {
+    ssize_t r_a = readFull(fd_a, buf_a, DEDUP_READ_SIZE / 2);
+    ssize_t r_b = readFull(fd_b, buf_b, DEDUP_READ_SIZE / 2);
+    same = r_a > 0 && r_a == r_b && memcmp(buf_a, buf_b, r_a) == 0;
+    total += r_a;
+  }
+  close(fd_a);
+  close(fd_b);
+  return same && total == size;
+}
+
+/**
+ * Hashes the contents of a file, provided it is still as it was recorded
+ *
+ * @param table the table whose buffer to read through
+ * @param file the file to hash, whose hash is filled in
+ * @param size the size of the file
+ * @return nonzero if the file was hashed, zero if it could not be read or
+ * has changed
+ */
+static int hashFile(DedupTable* table, DedupFile* file, off_t size) {
+  int fd = openRecorded(file, size);
+  if (fd == FILE_ERROR) { return 0; }
+  if (table->buffer == NULL) { table->buffer = (unsigned char*)safeMalloc(DEDUP_READ_SIZE); }
+  uint64_t h[2] = {0, 0};
+  off_t total = 0;
+  size_t used = 0;
+  for (;;) {
+    /* Fill the buffer completely, so only the final read leaves a tail */
+    ssize_t r = read(fd, table->buffer + used, DEDUP_READ_SIZE - used);
+    if (r == FILE_ERROR && errno == EINTR) { continue; }
+    if (r == FILE_ERROR) { break; }
+    throttleIO(THROTTLE_READ, r);
+    used += r;
+    total += r;
+    if (r == 0 || used == DEDUP_READ_SIZE) {
+      murmurBlocks(h, table->buffer, used / MURMUR_BLOCK_SIZE);
+      if (r == 0) { break; }
+      used = 0;
+    }
+  }
+  close(fd);
+  if (total != size) { return 0; }
+  murmurFinish(h, table->buffer + used / MURMUR_BLOCK_SIZE * MURMUR_BLOCK_SIZE, used % MURMUR_BLOCK_SIZE, total);
+  file->hash[0] = h[0];
+  file->hash[1] = h[1];
+  return 1;
+}
+
+/**
+ * Finds the slot of a size, which is either the slot holding it or the empty
+ * slot where it belongs
+ *
+ * @param table the table to search
+ * @param size the size to look for
+ * @return a pointer to the slot
+ */
+static DedupSlot* findSlot(DedupTable* table, off_t size) {
+  size_t slot = hashSlot(size, table->capacity);
+  while (table->slots[slot].size != 0 && table->slots[slot].size != size) {
+    slot = hashNextSlot(slot, table->capacity);
+  }
+  return &table->slots[slot];
+}
+
+/**
+ * Doubles the number of slots of a table
+ *
+ * @param table the table to grow
+ */
+static void growTable(DedupTable* table) {
+  DedupSlot* old = table->slots;
+  size_t old_capacity = table->capacity;
+  table->capacity = old_capacity * 2;
+  table->slots = (DedupSlot*)safeCalloc(table->capacity, sizeof(DedupSlot));
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].size != 0) { *findSlot(table, old[i].size) = old[i]; }
+  }
+  safeFree(old);
+}
+
+/**
+ * Prepares an empty dedup table
+ *
+ * @param table the table to initialise
+ */
+void dedupInit(DedupTable* table) {
+  table->capacity = DEDUP_INITIAL_SLOTS;
+  table->count = 0;
+  table->slots = (DedupSlot*)safeCalloc(table->capacity, sizeof(DedupSlot));
+  table->files_capacity = DEDUP_INITIAL_FILES;
+  table->num_files = 0;
+  table->files = (DedupFile*)safeMalloc(table->files_capacity * sizeof(DedupFile));
+  arenaInit(&table->paths, 0);
+  table->buffer = NULL;
+}
+
+/**
+ * Looks for an archived file with the same contents as a file about to be
+ * archived, recording the file if there is none
+ *
+ * @param table the table to search
+ * @param st the status of the file
+ * @param path the path the file is archived under
+ * @return the path of the identical file, valid until the table is freed, or
+ * NULL if the file must be archived with its data
+ */
+const char* dedupRecord(DedupTable* table, const struct stat* st, const char* path) {
+  if (!S_ISREG(st->st_mode) || st->st_size < DEDUP_MIN_SIZE) { return NULL; }
+  DedupFile file = {.path = path,
+                    .dev = st->st_dev,
+                    .ino = st->st_ino,
+                    .mtime = st->st_mtim,
+                    .ctime = st->st_ctim,
+                    .state = DEDUP_UNHASHED,
+                    .next = DEDUP_NONE};
+  if (hashMustGrow(table->count, table->capacity)) { growTable(table); }
+  DedupSlot* slot = findSlot(table, st->st_size);
+  if (slot->size != 0) {
+    /* Another file has this size, so the contents have to be compared */
+    if (!hashFile(table, &file, st->st_size)) { return NULL; }
+    file.state = DEDUP_HASHED;
+    for (size_t i = slot->first; i != DEDUP_NONE; i = table->files[i].next) {
+      DedupFile* other = &table->files[i];
+      if (other->state == DEDUP_UNHASHED) {
+        other->state = hashFile(table, other, st->st_size) ? DEDUP_HASHED : DEDUP_CHANGED;
+      }
+      /* Matching hashes only make identical contents likely */
+      if (other->state == DEDUP_HASHED && other->hash[0] == file.hash[0] && other->hash[1] == file.hash[1] &&
+          sameContents(table, &file, other, st->st_size)) {
+        return other->path;
+      }
+    }
+    file.next = slot->first;
+  } else {
+    slot->size = st->st_size;
+    table->count++;
+  }
+  if (table->num_files == table->files_capacity) {
+    table->files_capacity *= 2;
+    table->files = (DedupFile*)safeRealloc(table->files, table->files_capacity * sizeof(DedupFile));
+  }
+  file.path = arenaString(&table->paths, path, strlen(path));
+  slot->first = table->num_files;
+  table->files[table->num_files++] = file;
+  return NULL;
+}
+
+/**
+ * Frees the slots, files and paths of a dedup table
+ *
+ * @param table the table to free
+ */
+void dedupFree(DedupTable* table) {
+  safeFree(table->slots);
+  safeFree(table->files);
+  safeFree(table->buffer);
+  arenaFree(&table->paths);
+}
@@ -0,0 +1,823 @@
+/*
+ * extract.c - a pool of workers writing the members of an archive
+ *
+ * The thread parsing the archive creates directories and links itself and
+ hands regular files to workers, so that the latency of creating, writing
+ and closing many small files overlaps. A file always goes to the same worker
+ as earlier members with the same path, so a later copy still wins, and a
+ member the parser creates itself first waits for that worker to finish any
+ file queued under its path. Files are
+ preallocated to their final size before their data is written, and directory
+ permissions and times are set in a final pass once nothing more will be
+ created inside them. When batching, a worker takes the run of small files in
+ one directory at the head of its queue and opens, writes and closes them
+ together, which the safe_file layer submits through io_uring.
+
+ Members are created relative to their parent directory, which is opened one
+ component at a time without following symbolic links. A link the archive
+ created earlier therefore cannot lead a later member outside the extraction;
+ such members are refused. Each thread keeps the last parent it opened, so
+ members sharing a directory resolve it once.
+ */
+#include "../include/extract.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/kiwitar.h"
+#include "../include/safe_alloc.h"
+#include "../include/safe_file.h"
+#include "../include/stats.h"
+
+/* The parent directory the calling thread last opened, its path and the
+ * capacity of the path's buffer */
+static __thread int cached_fd = FILE_ERROR;
+static __thread char* cached_path = NULL;
+static __thread size_t cached_length = 0;
+static __thread size_t cached_capacity = 0;
+
+/**
+ * Splits a member's path into its parent directory and its last component
+ *
+ * @param path the path of the member
+ * @param name where to store the last component
+ * @return the length of the parent's part of the path, or 0 if the member has
+ * no parent
+ */
+static size_t splitPath(const char* path, const char** name) {
+  size_t end = strlen(path);
+  /* Only a directory's path may end with a slash, which does not start a component */
+  while (end > 1 && path[end - 1] == '/') { end--; }
+  size_t start = end;
+  while (start > 0 && path[start - 1] != '/') { start--; }
+  *name = path + start;
+  return start;
+}
+
+/**
+ * Opens a member's parent directory one component at a time from the current
+ * directory without following symbolic links, creating the missing ones as
+ * mkdir -p would when asked to
+ *
+ * @param path the path of the member
+ * @param length the length of the parent's part of the path
+ * @param create nonzero to create missing directories
+ * @return a file descriptor of the parent, AT_FDCWD if the member has none, or
+ * FILE_ERROR with errno set
+ */
+static int openParent(const char* path, size_t length, int create) {
+  int dirfd = AT_FDCWD;
+  char component[NAME_MAX + 1];
+  for (size_t start = 0, end; start < length; start = end + 1) {
+    for (end = start; end < length && path[end] != '/'; end++) {}
+    if (end == start) { continue; }
+    int next = FILE_ERROR;
+    errno = ENAMETOOLONG;
+    if (end - start <= NAME_MAX) {
+      memcpy(component, path + start, end - start);
+      component[end - start] = '\0';
+      next = openat(dirfd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (next == FILE_ERROR && errno == ENOENT && create &&
+          (mkdirat(dirfd, component, DEFAULT_PERMISSIONS) == 0 || errno == EEXIST)) {
+        next = openat(dirfd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      }
+    }
+    int error = errno;
+    if (dirfd != AT_FDCWD) { close(dirfd); }
+    errno = error;
+    if (next == FILE_ERROR) { return FILE_ERROR; }
+    dirfd = next;
+  }
+  return dirfd;
+}
+
+/**
+ * Closes a directory opened by openParent
+ *
+ * @param dirfd what openParent returned
+ */
+static void closeParent(int dirfd) {
+  if (dirfd >= 0) { close(dirfd); }
+}
+
+/**
+ * Closes the parent directory the calling thread keeps open and frees its path
+ */
+static void forgetParent(void) {
+  closeParent(cached_fd);
+  cached_fd = FILE_ERROR;
+  safeFree(cached_path);
+  cached_path = NULL;
+  cached_capacity = 0;
+}
+
+/**
+ * Opens a member's parent directory, creating it if it is missing, reusing
+ * the one the calling thread opened last if the member shares it
+ *
+ * @param path the path of the member
+ * @param name where to store the last component of the path
+ * @return a file descriptor of the parent, which stays open until the thread's
+ * next call, AT_FDCWD if the member has none, or FILE_ERROR with errno set
+ */
+static int cachedParent(const char* path, const char** name) {
+  size_t length = splitPath(path, name);
+  if (length == 0) { return AT_FDCWD; }
+  if (cached_fd != FILE_ERROR && cached_length == length && memcmp(cached_path, path, length) == 0) {
+    return cached_fd;
+  }
+  closeParent(cached_fd);
+  cached_fd = openParent(path, length, 1);
+  if (cached_fd == FILE_ERROR) { return FILE_ERROR; }
+  if (length > cached_capacity) {
+    cached_path = (char*)safeRealloc(cached_path, length);
+    cached_capacity = length;
+  }
+  memcpy(cached_path, path, length);
+  cached_length = length;
+  return cached_fd;
+}
+
+/**
+ * Reports a member whose parent directory could not be opened, such as one
+ * whose path leads through a symbolic link, and fails the extraction
+ *
+ * @param extractor the extractor writing the member
+ * @param path the path of the member
+ */
+static void refuseMember(Extractor* extractor, const char* path) {
+  fprintf(stderr, "%s: cannot open parent directory: %s; not extracted\n", path, strerror(errno));
+  __atomic_store_n(&extractor->failed, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Creates a regular file, replacing whatever was at its path, and reserves
+ * space for all of its data
+ *
+ * @param extractor the extractor writing the file
+ * @param path the path of the file
+ * @param mode the permission bits of the file
+ * @param size the size the file will have
+ * @return a file descriptor to the new file, or FILE_ERROR if it was refused
+ */
+int extractCreateFile(Extractor* extractor, char* path, mode_t mode, off_t size) {
+  const char* name;
+  int dirfd = cachedParent(path, &name);
+  if (dirfd == FILE_ERROR) {
+    refuseMember(extractor, path);
+    return FILE_ERROR;
+  }
+  int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+  int fd = openat(dirfd, name, flags, mode);
+  if (fd == FILE_ERROR && errno == EEXIST) {
+    /* Unlinking first also keeps a symbolic link from redirecting the write */
+    unlinkat(dirfd, name, 0);
+    fd = openat(dirfd, name, flags, mode);
+  }
+  if (fd == FILE_ERROR) {
+    perror("Error creating file.\n");
+    exit(EXIT_FAILURE);
+  }
+  /* Filesystems that cannot preallocate simply grow the file as it is written */
+  if (size > 0 && fallocate(fd, 0, 0, size) == FILE_ERROR && errno != EOPNOTSUPP && errno != ENOSYS) {
+    perror("Error allocating file.\n");
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+/**
+ * Sets the modification time of a written file
+ *
+ * @param fd the file descriptor of the file
+ * @param mtime the modification time to set
+ */
+static void setFileTime(int fd, time_t mtime) {
+  safeDropWritten(fd, 0, 0);
+  struct timespec times[2] = {{.tv_sec = 0, .tv_nsec = UTIME_NOW}, {.tv_sec = mtime, .tv_nsec = 0}};
+  if (futimens(fd, times) == FILE_ERROR) {
+    perror("Error setting file times.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Sets the modification time of a written file and closes it
+ *
+ * @param fd the file descriptor of the file
+ * @param mtime the modification time to set
+ */
+void extractFinishFile(int fd, time_t mtime) {
+  setFileTime(fd, mtime);
+  safeClose(fd);
+}
+
+/**
+ * Writes a regular file and frees its data; the job itself, which holds the
+ * path, is freed by the caller
+ *
+ * @param extractor the extractor the job belongs to
+ * @param job the file to write
+ */
+static void writeJob(Extractor* extractor, ExtractJob* job) {
+  STATS_START(started);
+  int fd = extractCreateFile(extractor, job->path, job->mode, job->size);
+  if (fd == FILE_ERROR) {
+    safeFree(job->data);
+    job->data = NULL;
+    return;
+  }
+  if (job->data != NULL) {
+    safeWrite(fd, job->data, job->size);
+  } else {
+    off_t copied = safeCopyAt(extractor->archive_fd, job->offset, fd, job->size);
+    safeDropCache(extractor->archive_fd, job->offset, job->size);
+    if (copied < job->size) {
+      fprintf(stderr, "%s: archive ended %lld bytes early\n", job->path, (long long)(job->size - copied));
+    }
+  }
+  extractFinishFile(fd, job->mtime);
+  STATS_FILE(job->size, started);
+  safeFree(job->data);
+  job->data = NULL;
+}
+
+/**
+ * Writes a run of small files in one directory, opening, writing and closing
+ * them together, and frees their data; the jobs are freed by the caller
+ *
+ * @param extractor the extractor the jobs belong to
+ * @param jobs the files to write, linked through next, all with distinct paths
+ * @param count the number of files
+ */
+static void writeBatch(Extractor* extractor, ExtractJob* jobs, size_t count) {
+  STATS_START(started);
+  ExtractJob* batch[EXTRACT_BATCH_SIZE];
+  FileRequest requests[EXTRACT_BATCH_SIZE];
+  FileRequest reads[EXTRACT_BATCH_SIZE];
+  /* The file each read belongs to */
+  size_t owners[EXTRACT_BATCH_SIZE];
+  size_t num_reads = 0;
+  const char* name;
+  int dirfd = cachedParent(jobs->path, &name);
+  for (size_t i = 0; i < count; i++, jobs = jobs->next) {
+    batch[i] = jobs;
+    if (dirfd == FILE_ERROR) {
+      refuseMember(extractor, jobs->path);
+      continue;
+    }
+    splitPath(jobs->path, &name);
+    requests[i].dirfd = dirfd;
+    requests[i].path = (char*)name;
+    requests[i].flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+    requests[i].mode = jobs->mode;
+    requests[i].count = jobs->size;
+    requests[i].offset = 0;
+    /* Files still in the archive are read into memory first, in one batch */
+    if (jobs->data == NULL) {
+      jobs->data = (unsigned char*)safeMalloc(jobs->size > 0 ? jobs->size : 1);
+      reads[num_reads].fd = extractor->archive_fd;
+      reads[num_reads].buf = jobs->data;
+      reads[num_reads].count = jobs->size;
+      reads[num_reads].offset = jobs->offset;
+      owners[num_reads++] = i;
+    }
+    requests[i].buf = jobs->data;
+  }
+  if (dirfd == FILE_ERROR) {
+    for (size_t i = 0; i < count; i++) {
+      safeFree(batch[i]->data);
+      batch[i]->data = NULL;
+    }
+    return;
+  }
+  safeReadBatch(reads, num_reads);
+  for (size_t i = 0; i < num_reads; i++) {
+    FileRequest* request = &requests[owners[i]];
+    safeDropCache(extractor->archive_fd, reads[i].offset, reads[i].count);
+    if ((size_t)reads[i].result < reads[i].count) {
+      fprintf(stderr, "%s: archive ended %lld bytes early\n", batch[owners[i]]->path,
+              (long long)(reads[i].count - reads[i].result));
+      request->count = reads[i].result;
+    }
+  }
+  safeOpenBatch(requests, count);
+  for (size_t i = 0; i < count; i++) {
+    if (requests[i].fd != FILE_ERROR) { continue; }
+    /* Unlinking first also keeps a symbolic link from redirecting the write */
+    unlinkat(dirfd, requests[i].path, 0);
+    requests[i].fd = openat(dirfd, requests[i].path, requests[i].flags, requests[i].mode);
+    if (requests[i].fd == FILE_ERROR) {
+      perror("Error creating file.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  safeWriteBatch(requests, count);
+  for (size_t i = 0; i < count; i++) {
+    setFileTime(requests[i].fd, batch[i]->mtime);
+    STATS_FILE(batch[i]->size, started);
+    safeFree(batch[i]->data);
+    batch[i]->data = NULL;
+  }
+  safeCloseBatch(requests, count);
+}
+
+/**
+ * Checks whether a file may be written as part of a batch
+ *
+ * @param job the file to check
+ * @return nonzero if the file is small enough
+ */
+static int isBatchable(const ExtractJob* job) { return job->size <= EXTRACT_BATCH_FILE_LIMIT; }
+
+/**
+ * Moves the job at the head of a worker's queue to the jobs being written,
+ * along with the small files in the same directory that follow it when
+ * batching. A path already taken ends the run, so a later copy still wins.
+ * Must be called with the lock held.
+ *
+ * @param extractor the extractor the worker belongs to
+ * @param worker the worker whose queue to take from
+ * @return the number of jobs taken
+ */
+static size_t takeJobs(Extractor* extractor, ExtractWorker* worker) {
+  ExtractJob* first = worker->head;
+  ExtractJob* last = first;
+  size_t count = 1;
+  if (extractor->batch && isBatchable(first)) {
+    const char* name;
+    size_t length = splitPath(first->path, &name);
+    for (ExtractJob* job = first->next; job != NULL && count < EXTRACT_BATCH_SIZE; job = job->next) {
+      if (!isBatchable(job) || splitPath(job->path, &name) != length || memcmp(job->path, first->path, length) != 0) {
+        break;
+      }
+      int repeated = 0;
+      for (const ExtractJob* taken = first; taken != job && !repeated; taken = taken->next) {
+        repeated = strcmp(taken->path, job->path) == 0;
+      }
+      if (repeated) { break; }
+      last = job;
+      count++;
+    }
+  }
+  worker->head = last->next;
+  if (worker->head == NULL) { worker->tail = NULL; }
+  last->next = NULL;
+  worker->current = first;
+  return count;
+}
+
+/**
+ * The body of a worker thread: write the files of its queue in order
+ *
+ * @param arg the ExtractWorker the thread runs
+ * @return NULL
+ */
+static void* extractWorker(void* arg) {
+  ExtractWorker* worker = (ExtractWorker*)arg;
+  Extractor* extractor = worker->extractor;
+  pthread_mutex_lock(&extractor->lock);
+  for (;;) {
+    while (worker->head == NULL && !extractor->shutdown) { pthread_cond_wait(&worker->cond, &extractor->lock); }
+    if (worker->head == NULL) { break; }
+    size_t count = takeJobs(extractor, worker);
+    pthread_mutex_unlock(&extractor->lock);
+    size_t held = 0;
+    for (const ExtractJob* job = worker->current; job != NULL; job = job->next) {
+      if (job->data != NULL) { held += job->size; }
+    }
+    if (count > 1) {
+      writeBatch(extractor, worker->current, count);
+    } else {
+      writeJob(extractor, worker->current);
+    }
+    pthread_mutex_lock(&extractor->lock);
+    /* The parser may be comparing the paths, so the jobs are freed under the lock */
+    while (worker->current != NULL) {
+      ExtractJob* job = worker->current;
+      worker->current = job->next;
+      safeFree(job);
+    }
+    extractor->queued -= count;
+    extractor->inflight -= held;
+    pthread_cond_signal(&extractor->space_cond);
+  }
+  pthread_mutex_unlock(&extractor->lock);
+  forgetParent();
+  return NULL;
+}
+
+/**
+ * Starts the workers that extract files
+ *
+ * @param archive_fd the file descriptor of the archive, which jobs without
+ * data are copied from
+ * @param num_workers the number of worker threads, or 0 to write inline
+ * @param budget the most data bytes that queued jobs may hold
+ * @param batch nonzero for workers to write runs of small files as batches
+ * @return a pointer to the extractor
+ */
+Extractor* extractOpen(int archive_fd, size_t num_workers, size_t budget, int batch) {
+  Extractor* extractor = (Extractor*)safeCalloc(1, sizeof(Extractor));
+  extractor->archive_fd = archive_fd;
+  extractor->num_workers = num_workers;
+  extractor->batch = batch;
+  extractor->budget = budget;
+  extractor->dirs_capacity = EXTRACT_INITIAL_DIRS;
+  extractor->dirs = (ExtractDir*)safeMalloc(extractor->dirs_capacity * sizeof(ExtractDir));
+  extractor->workers = (ExtractWorker*)safeCalloc(num_workers, sizeof(ExtractWorker));
+  pthread_mutex_init(&extractor->lock, NULL);
+  pthread_cond_init(&extractor->space_cond, NULL);
+  for (size_t i = 0; i < num_workers; i++) {
+    extractor->workers[i].extractor = extractor;
+    pthread_cond_init(&extractor->workers[i].cond, NULL);
+    if (pthread_create(&extractor->workers[i].thread, NULL, extractWorker, &extractor->workers[i]) != 0) {
+      perror("Failed to start worker thread.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return extractor;
+}
+
+/**
+ * Hashes a path to choose the worker that writes it
+ *
+ * @param path the path to hash
+ * @param length the length of the path
+ * @return the FNV-1a hash of the path
+ */
+static uint64_t hashPath(const char* path, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const unsigned char* c = (const unsigned char*)path; c < (const unsigned char*)path + length; c++) {
+    hash ^= *c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Checks whether a worker is writing or has queued a file at a path. Must be
+ * called with the lock held.
+ *
+ * @param worker the worker the path belongs to
+ * @param path the path to look for
+ * @param length the length of the path, without trailing slashes
+ * @return nonzero if a job for the path is not finished yet
+ */
+static int pathBusy(const ExtractWorker* worker, const char* path, size_t length) {
+  for (const ExtractJob* job = worker->current; job != NULL; job = job->next) {
+    if (strncmp(job->path, path, length) == 0 && job->path[length] == '\0') { return 1; }
+  }
+  for (const ExtractJob* job = worker->head; job != NULL; job = job->next) {
+    if (strncmp(job->path, path, length) == 0 && job->path[length] == '\0') { return 1; }
+  }
+  return 0;
+}
+
+/**
+ * Waits until the files queued earlier at a path have been written, so that a
+ * member the parser creates at the same path lands after them
+ *
+ * @param extractor the extractor writing the files
+ * @param path the path about to be created
+ */
+void extractAwaitPath(Extractor* extractor, const char* path) {
+  if (extractor->num_workers == 0) { return; }
+  size_t length = strlen(path);
+  while (length > 1 && path[length - 1] == '/') { length--; }
+  ExtractWorker* worker = &extractor->workers[hashPath(path, length) % extractor->num_workers];
+  pthread_mutex_lock(&extractor->lock);
+  while (pathBusy(worker, path, length)) { pthread_cond_wait(&extractor->space_cond, &extractor->lock); }
+  pthread_mutex_unlock(&extractor->lock);
+}
+
+/**
+ * Queues a regular file for a worker, waiting while the queues are full. The
+ * extractor takes ownership of the job.
+ *
+ * @param extractor the extractor to write the file
+ * @param job the file to write
+ */
+void extractFile(Extractor* extractor, ExtractJob* job) {
+  if (extractor->num_workers == 0) {
+    writeJob(extractor, job);
+    safeFree(job);
+    return;
+  }
+  size_t held = job->data != NULL ? (size_t)job->size : 0;
+  job->next = NULL;
+  pthread_mutex_lock(&extractor->lock);
+  /* A job larger than the budget is let through once nothing else is held */
+  while (extractor->queued >= extractor->num_workers * EXTRACT_QUEUE_DEPTH ||
+         (held > 0 && extractor->inflight > 0 && extractor->inflight + held > extractor->budget)) {
+    pthread_cond_wait(&extractor->space_cond, &extractor->lock);
+  }
+  ExtractWorker* worker = &extractor->workers[hashPath(job->path, strlen(job->path)) % extractor->num_workers];
+  if (worker->tail != NULL) {
+    worker->tail->next = job;
+  } else {
+    worker->head = job;
+  }
+  worker->tail = job;
+  extractor->queued++;
+  extractor->inflight += held;
+  pthread_cond_signal(&worker->cond);
+  pthread_mutex_unlock(&extractor->lock);
+}
+
+/**
+ * Creates a directory and remembers its metadata for the final pass. It stays
+ * writable until then so that its members can be created inside it.
+ *
+ * @param extractor the extractor to record the directory in
+ * @param path the path of the directory
+ * @param mode the permission bits of the directory
+ * @param mtime the last modification time of the directory
+ */
+void extractDirectory(Extractor* extractor, char* path, mode_t mode, time_t mtime) {
+  extractAwaitPath(extractor, path);
+  /* Without its trailing slashes the last component is never followed */
+  const char* name;
+  size_t length = splitPath(path, &name);
+  length += strcspn(name, "/");
+  char* copy = (char*)safeMalloc(length + 1);
+  memcpy(copy, path, length);
+  copy[length] = '\0';
+  int dirfd = cachedParent(copy, &name);
+  if (dirfd == FILE_ERROR) {
+    refuseMember(extractor, path);
+    safeFree(copy);
+    return;
+  }
+  int r = mkdirat(dirfd, name, S_IRWXU);
+  struct stat st;
+  if (r == FILE_ERROR && errno == EEXIST && fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+      !S_ISDIR(st.st_mode)) {
+    /* Whatever is in the way, such as a symbolic link, is replaced */
+    unlinkat(dirfd, name, 0);
+    r = mkdirat(dirfd, name, S_IRWXU);
+  }
+  if (r == FILE_ERROR && errno != EEXIST) {
+    perror("Error creating directory.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (extractor->num_dirs == extractor->dirs_capacity) {
+    extractor->dirs_capacity *= 2;
+    extractor->dirs = (ExtractDir*)safeRealloc(extractor->dirs, extractor->dirs_capacity * sizeof(ExtractDir));
+  }
+  ExtractDir* dir = &extractor->dirs[extractor->num_dirs++];
+  dir->path = copy;
+  dir->mode = mode;
+  dir->mtime = mtime;
+}
+
+/**
+ * Creates a symbolic link, replacing whatever was at its path
+ *
+ * @param extractor the extractor writing the files
+ * @param path the path of the link
+ * @param target the target of the link
+ */
+void extractSymlink(Extractor* extractor, char* path, const char* target) {
+  extractAwaitPath(extractor, path);
+  const char* name;
+  int dirfd = cachedParent(path, &name);
+  if (dirfd == FILE_ERROR) {
+    refuseMember(extractor, path);
+    return;
+  }
+  int r = symlinkat(target, dirfd, name);
+  if (r == FILE_ERROR && errno == EEXIST) {
+    unlinkat(dirfd, name, 0);
+    r = symlinkat(target, dirfd, name);
+  }
+  if (r == FILE_ERROR) {
+    perror("Error creating symbolic link.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Waits until the workers have written every queued file
+ *
+ * @param extractor the extractor to drain
+ */
+static void drainWorkers(Extractor* extractor) {
+  pthread_mutex_lock(&extractor->lock);
+  while (extractor->queued > 0) { pthread_cond_wait(&extractor->space_cond, &extractor->lock); }
+  pthread_mutex_unlock(&extractor->lock);
+}
+
+/**
+ * Creates a hard link to a file extracted earlier, replacing whatever was at
+ * its path. The file may still be queued, so the workers are drained first.
+ *
+ * @param extractor the extractor writing the files
+ * @param path the path of the link
+ * @param target the path of the file to link to
+ */
+void extractHardLink(Extractor* extractor, char* path, const char* target) {
+  drainWorkers(extractor);
+  const char* target_name;
+  int target_dirfd = openParent(target, splitPath(target, &target_name), 0);
+  const char* name;
+  int dirfd = target_dirfd == FILE_ERROR ? FILE_ERROR : cachedParent(path, &name);
+  if (dirfd == FILE_ERROR) {
+    refuseMember(extractor, path);
+    closeParent(target_dirfd);
+    return;
+  }
+  int r = linkat(target_dirfd, target_name, dirfd, name, 0);
+  if (r == FILE_ERROR && errno == EEXIST) {
+    unlinkat(dirfd, name, 0);
+    r = linkat(target_dirfd, target_name, dirfd, name, 0);
+  }
+  /* The target may have been left out of the extraction, which is not fatal */
+  if (r == FILE_ERROR) { fprintf(stderr, "%s: cannot hard link to %s: %s\n", path, target, strerror(errno)); }
+  closeParent(target_dirfd);
+}
+
+/**
+ * Creates an independent copy of a file extracted earlier, for a member that
+ * was stored as a link only because its contents were identical. The copy is
+ * made with copy_file_range, which filesystems that share extents can satisfy
+ * without duplicating the data.
+ *
+ * @param extractor the extractor writing the files
+ * @param path the path of the copy
+ * @param target the path of the file to copy
+ * @param mode the permission bits of the copy
+ * @param mtime the modification time of the copy
+ */
+void extractCopy(Extractor* extractor, char* path, const char* target, mode_t mode, time_t mtime) {
+  drainWorkers(extractor);
+  const char* target_name;
+  int target_dirfd = openParent(target, splitPath(target, &target_name), 0);
+  if (target_dirfd == FILE_ERROR) {
+    refuseMember(extractor, path);
+    return;
+  }
+  int infd = openat(target_dirfd, target_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  struct stat st;
+  if (infd == FILE_ERROR || fstat(infd, &st) == FILE_ERROR) {
+    /* The target may have been left out of the extraction, which is not fatal */
+    fprintf(stderr, "%s: cannot copy %s: %s\n", path, target, strerror(errno));
+    if (infd != FILE_ERROR) { safeClose(infd); }
+    closeParent(target_dirfd);
+    return;
+  }
+  closeParent(target_dirfd);
+  int fd = extractCreateFile(extractor, path, mode, st.st_size);
+  if (fd == FILE_ERROR) {
+    safeClose(infd);
+    return;
+  }
+  off_t copied = safeCopyAt(infd, 0, fd, st.st_size);
+  if (copied < st.st_size) {
+    fprintf(stderr, "%s: %s shrank by %lld bytes while copied\n", path, target, (long long)(st.st_size - copied));
+  }
+  extractFinishFile(fd, mtime);
+  safeClose(infd);
+}
+
+/**
+ * Removes a path an incremental archive lists as deleted, without following
+ * symbolic links on the way to it
+ *
+ * @param path the path to remove
+ */
+void extractRemove(const char* path) {
+  const char* name;
+  int dirfd = openParent(path, splitPath(path, &name), 0);
+  int r = dirfd == FILE_ERROR ? FILE_ERROR : unlinkat(dirfd, name, 0);
+  if (r == FILE_ERROR && errno == EISDIR) { r = unlinkat(dirfd, name, AT_REMOVEDIR); }
+  if (r == FILE_ERROR && errno != ENOENT) { fprintf(stderr, "%s: cannot remove: %s\n", path, strerror(errno)); }
+  closeParent(dirfd);
+}
+
+/**
+ * Orders two names of a dumpdir
+ *
+ * @param a the first name
+ * @param b the second name
+ * @return less than, equal to or greater than zero as a sorts before, with or
+ * after b
+ */
+static int compareNames(const void* a, const void* b) {
+  return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/**
+ * Removes an entry of a directory along with everything under it, without
+ * following symbolic links
+ *
+ * @param parent the directory holding the entry
+ * @param name the name of the entry
+ * @param path the path of the directory being pruned, for messages
+ */
+static void removeTree(int parent, const char* name, const char* path) {
+  int r = unlinkat(parent, name, 0);
+  if (r == FILE_ERROR && errno == EISDIR) {
+    int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* dir = fd == FILE_ERROR ? NULL : fdopendir(fd);
+    if (dir == NULL && fd != FILE_ERROR) { close(fd); }
+    for (struct dirent* entry; dir != NULL && (entry = readdir(dir)) != NULL;) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) { continue; }
+      removeTree(dirfd(dir), entry->d_name, path);
+    }
+    if (dir != NULL) { closedir(dir); }
+    r = unlinkat(parent, name, AT_REMOVEDIR);
+  }
+  if (r == FILE_ERROR && errno != ENOENT) {
+    fprintf(stderr, "%s: cannot remove %s: %s\n", path, name, strerror(errno));
+  }
+}
+
+/**
+ * Removes what an extracted directory holds beyond the entries listed in the
+ * dumpdir a GNU incremental archive stores for it, which names everything the
+ * directory held when the archive was made
+ *
+ * @param path the path of the directory
+ * @param dumpdir the entries, each led by a flag byte and terminated by a NUL,
+ * ending with an empty one
+ * @param size the size of the dumpdir in bytes, the last of which is a NUL
+ */
+void extractPrune(const char* path, const char* dumpdir, size_t size) {
+  const char* name;
+  int parent = openParent(path, splitPath(path, &name), 0);
+  int fd = parent == FILE_ERROR ? FILE_ERROR : openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  closeParent(parent);
+  DIR* dir = fd == FILE_ERROR ? NULL : fdopendir(fd);
+  if (dir == NULL) {
+    if (fd != FILE_ERROR) { close(fd); }
+    if (errno != ENOENT) { fprintf(stderr, "%s: cannot prune: %s\n", path, strerror(errno)); }
+    return;
+  }
+  /* Sorting the names lets each entry of the directory be looked up */
+  size_t count = 0, capacity = 16;
+  const char** names = (const char**)safeMalloc(capacity * sizeof(char*));
+  for (size_t i = 0; i < size && dumpdir[i] != '\0'; i += strlen(dumpdir + i) + 1) {
+    if (count == capacity) { names = (const char**)safeRealloc(names, (capacity *= 2) * sizeof(char*)); }
+    names[count++] = dumpdir + i + 1;
+  }
+  qsort(names, count, sizeof(char*), compareNames);
+  for (struct dirent* entry; (entry = readdir(dir)) != NULL;) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) { continue; }
+    const char* key = entry->d_name;
+    if (bsearch(&key, names, count, sizeof(char*), compareNames) == NULL) { removeTree(dirfd(dir), key, path); }
+  }
+  safeFree(names);
+  closedir(dir);
+}
+
+/**
+ * Waits for every queued file to be written, then sets the permissions and
+ * times of the extracted directories, deepest first, and frees the extractor
+ *
+ * @param extractor the extractor to close
+ * @return nonzero if a member was refused
+ */
+int extractClose(Extractor* extractor) {
+  pthread_mutex_lock(&extractor->lock);
+  extractor->shutdown = 1;
+  for (size_t i = 0; i < extractor->num_workers; i++) { pthread_cond_signal(&extractor->workers[i].cond); }
+  pthread_mutex_unlock(&extractor->lock);
+  for (size_t i = 0; i < extractor->num_workers; i++) {
+    pthread_join(extractor->workers[i].thread, NULL);
+    pthread_cond_destroy(&extractor->workers[i].cond);
+  }
+  /* Directories follow their parents in an archive, so walking the list
+   * backwards finishes a directory before the one containing it */
+  for (size_t i = extractor->num_dirs; i > 0; i--) {
+    ExtractDir* dir = &extractor->dirs[i - 1];
+    struct timespec times[2] = {{.tv_sec = 0, .tv_nsec = UTIME_NOW}, {.tv_sec = dir->mtime, .tv_nsec = 0}};
+    const char* name;
+    int dirfd = cachedParent(dir->path, &name);
+    int fd = dirfd == FILE_ERROR ? FILE_ERROR : openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == FILE_ERROR) {
+      /* A later member replaced the directory, so it is not followed */
+      refuseMember(extractor, dir->path);
+    } else if (fchmod(fd, dir->mode) == FILE_ERROR || futimens(fd, times) == FILE_ERROR) {
+      perror("Error setting directory metadata.\n");
+      exit(EXIT_FAILURE);
+    }
+    if (fd != FILE_ERROR) { safeClose(fd); }
+    safeFree(dir->path);
+  }
+  forgetParent();
+  int failed = extractor->failed;
+  pthread_cond_destroy(&extractor->space_cond);
+  pthread_mutex_destroy(&extractor->lock);
+  safeFree(extractor->dirs);
+  safeFree(extractor->workers);
+  safeFree(extractor);
+  return failed;
+}
@@ -0,0 +1,618 @@
+/*
+ * header.c - construction and parsing of POSIX-specified USTAR headers
+ *
+ * Every header is assembled in place inside a single block-sized USTARHeader,
+ so a member costs one buffer rather than one allocation per field. Parsing
+ works on the block where it lies, so a mapped archive is never copied.
+ Checksums are summed with SSE2 or AVX2 when the processor has them, and
+ numeric fields are decoded eight digits at a time within a 64-bit word.
+ */
+#include "../include/header.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/names.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEADER_SIMD 1
+#endif
+
+#define OCTAL_DIGIT_MASK 0xf8f8f8f8f8f8f8f8ULL /* The bits that are the same in every octal digit */
+#define OCTAL_DIGIT_BITS 0x3030303030303030ULL /* Those bits' value, eight '0' characters */
+
+/* Sums the bytes of a block */
+typedef unsigned int (*BlockSum)(const unsigned char* bytes);
+
+static unsigned int sumBlockResolve(const unsigned char* bytes);
+
+/* The implementation chosen for this processor, resolved on first use */
+static BlockSum sum_block = sumBlockResolve;
+
+/**
+ * Loads eight bytes of a header in string order, so that the first byte is
+ * the least significant
+ *
+ * @param bytes the bytes to load
+ * @return the bytes as a little-endian word
+ */
+static uint64_t loadWord(const unsigned char* bytes) {
+  uint64_t word;
+  memcpy(&word, bytes, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+/**
+ * Decodes GNU's base-256 form: the high bit of the first byte is set and the
+ * rest of the field is a big-endian binary number
+ *
+ * @param field the header field to read, whose first byte has the high bit set
+ * @param size the size of the field in bytes, at least 8
+ * @param value where to store the number
+ * @return HEADER_NONCONFORMING, or HEADER_CORRUPT if the number is negative
+ * or does not fit in 64 bits
+ */
+static int decodeBase256(const unsigned char* field, size_t size, unsigned long long* value) {
+  /* Bit 6 is the sign */
+  if (field[0] & 0x40) { return HEADER_CORRUPT; }
+  uint64_t high = field[0] & 0x3f;
+  for (size_t i = 1; i + sizeof(uint64_t) < size; i++) { high |= field[i]; }
+  /* Only the last eight bytes may be nonzero for the value to fit */
+  uint64_t low = __builtin_bswap64(loadWord(field + size - sizeof(uint64_t)));
+  if (size == sizeof(uint64_t)) {
+    low &= ~(0xffULL << 56);
+    low |= (uint64_t)(field[0] & 0x3f) << 56;
+  } else if (high != 0) {
+    return HEADER_CORRUPT;
+  }
+  *value = low;
+  return HEADER_NONCONFORMING;
+}
+
+/**
+ * Decodes up to eight octal digits held in a word, the first digit in the
+ * least significant byte. The digits are combined pairwise, so the whole word
+ * takes three steps instead of eight.
+ *
+ * @param word the digits, '0' padded on the left to eight
+ * @param value where to store the number
+ * @return nonzero if every byte was an octal digit
+ */
+static int decodeOctalWord(uint64_t word, uint64_t* value) {
+  if ((word & OCTAL_DIGIT_MASK) != OCTAL_DIGIT_BITS) { return 0; }
+  word -= OCTAL_DIGIT_BITS;
+  /* Each 16-bit lane holds two digits, then each 32-bit lane four */
+  word = ((word & 0x00ff00ff00ff00ffULL) << 3) + ((word >> 8) & 0x00ff00ff00ff00ffULL);
+  word = ((word & 0x0000ffff0000ffffULL) << 6) + ((word >> 16) & 0x0000ffff0000ffffULL);
+  *value = ((word & 0xffffffffULL) << 12) + (word >> 32);
+  return 1;
+}
+
+/**
+ * Loads the first digits of a field into a word, '0' padded on the left
+ *
+ * @param field the digits, followed by at least 8 - count readable bytes
+ * @param count the number of digits, from 1 to 8
+ * @return the word holding the digits
+ */
+static uint64_t loadDigits(const unsigned char* field, size_t count) {
+  size_t pad = (sizeof(uint64_t) - count) * 8;
+  uint64_t word = loadWord(field);
+  return pad == 0 ? word : (word << pad) | (OCTAL_DIGIT_BITS >> (64 - pad));
+}
+
+/**
+ * Decodes a numeric field written the usual way: octal digits filling the
+ * field up to one or two terminators
+ *
+ * @param field the header field to read
+ * @param size the size of the field in bytes, at least 8
+ * @param value where to store the number
+ * @return nonzero if the field had that form, zero if it has to be parsed the
+ * slow way
+ */
+static int decodeOctalFast(const unsigned char* field, size_t size, unsigned long long* value) {
+  size_t digits = size;
+  while (digits > 0 && (field[digits - 1] == '\0' || field[digits - 1] == ' ')) { digits--; }
+  if (digits == 0 || digits + 2 < size) { return 0; }
+  uint64_t high = 0, low;
+  if (digits > sizeof(uint64_t)) {
+    if (!decodeOctalWord(loadDigits(field, digits - sizeof(uint64_t)), &high)) { return 0; }
+    field += digits - sizeof(uint64_t);
+    digits = sizeof(uint64_t);
+  }
+  if (!decodeOctalWord(loadDigits(field, digits), &low)) { return 0; }
+  *value = (high << 24) | low;
+  return 1;
+}
+
+/**
+ * Writes a zero-padded, NUL-terminated octal number into a header field
+ *
+ * @param field the header field to write to
+ * @param size the size of the field in bytes, including the terminator
+ * @param value the value to write
+ * @return 0 if the value fit in the field, nonzero otherwise
+ */
+static int formatOctal(char* field, size_t size, unsigned long long value) {
+  if ((size - 1) * 3 < sizeof(value) * 8 && value >> ((size - 1) * 3)) { return 1; }
+  /* Digits are written from the right so the field is filled in one pass */
+  field[size - 1] = '\0';
+  for (size_t i = size - 1; i > 0; i--) {
+    field[i - 1] = '0' + (value & 7);
+    value >>= 3;
+  }
+  return 0;
+}
+
+/**
+ * Writes a number into a header field, falling back to GNU's base-256 form
+ * when it does not fit in octal: the high bit of the first byte is set and the
+ * rest of the field holds the number in big-endian order
+ *
+ * @param field the header field to write to
+ * @param size the size of the field in bytes, at least nine for 64-bit values
+ * @param value the value to write
+ * @return HEADER_OK if the value was written as octal, HEADER_NONCONFORMING
+ * otherwise
+ */
+static int formatNumber(char* field, size_t size, unsigned long long value) {
+  if (formatOctal(field, size, value) == 0) { return HEADER_OK; }
+  memset(field, 0, size);
+  for (size_t i = size; i > 1 && value != 0; i--) {
+    field[i - 1] = (char)(value & 0xff);
+    value >>= 8;
+  }
+  field[0] = (char)(0x80 | (value & 0x3f));
+  return HEADER_NONCONFORMING;
+}
+
+/**
+ * Finds where to split a path between the prefix and name fields
+ *
+ * @param path the path to split
+ * @param length the length of the path as stored, including a directory's
+ * trailing slash
+ * @return the index of the slash replaced by the split, or 0 if the path
+ * cannot be split
+ */
+static size_t splitPath(const char* path, size_t length) {
+  size_t split = length - 1 < ARCHIVE_PREFIX_SIZE ? length - 1 : ARCHIVE_PREFIX_SIZE;
+  /* The latest slash leaves the shortest name; an empty prefix or name is not
+   * a split */
+  while (split > 0 && path[split] != '/') { split--; }
+  if (split == 0 || length - split - 1 > ARCHIVE_NAME_SIZE || path[split + 1] == '\0' || path[split + 1] == '/') {
+    return 0;
+  }
+  return split;
+}
+
+/**
+ * Fills in a USTAR header describing a file. A path longer than the name
+ * field is split across the prefix and name fields where it can be; what
+ * does not fit at all is truncated and flagged, so that the caller can store
+ * it in an extended header.
+ *
+ * @param header the header to fill in
+ * @param path the name to store for the member
+ * @param st the status of the file
+ * @param linkname the target of a symbolic link, the member a regular file is
+ * a hard link to, or NULL
+ * @return HEADER_OK if the header conforms to USTAR, otherwise
+ * HEADER_NONCONFORMING if a number needed the base-256 form, combined with
+ * HEADER_LONG_PATH or HEADER_LONG_LINK for names that were truncated
+ */
+int buildHeader(USTARHeader* header, const char* path, const struct stat* st, const char* linkname) {
+  int status = HEADER_OK;
+  memset(header, 0, sizeof(*header));
+  /* Directories are stored with a trailing slash, as other tars do */
+  size_t name_length = strlen(path);
+  int slash = S_ISDIR(st->st_mode) && name_length > 0 && path[name_length - 1] != '/';
+  size_t stored_length = name_length + slash;
+  size_t split = stored_length > ARCHIVE_NAME_SIZE ? splitPath(path, stored_length) : 0;
+  if (stored_length <= ARCHIVE_NAME_SIZE) {
+    memcpy(header->name, path, name_length);
+    if (slash) { header->name[name_length] = '/'; }
+  } else if (split > 0) {
+    memcpy(header->prefix, path, split);
+    memcpy(header->name, path + split + 1, name_length - split - 1);
+    if (slash) { header->name[name_length - split - 1] = '/'; }
+  } else {
+    memcpy(header->name, path, ARCHIVE_NAME_SIZE);
+    status |= HEADER_LONG_PATH;
+  }
+  formatOctal(header->mode, ARCHIVE_MODE_SIZE, st->st_mode & DEFAULT_PERMISSIONS);
+  status |= formatNumber(header->uid, ARCHIVE_UID_SIZE, st->st_uid);
+  status |= formatNumber(header->gid, ARCHIVE_GID_SIZE, st->st_gid);
+  /* A hard link carries no data; it is read from the member it names */
+  int has_data = S_ISREG(st->st_mode) && linkname == NULL;
+  status |= formatNumber(header->size, ARCHIVE_SIZE_SIZE, has_data ? (unsigned long long)st->st_size : 0);
+  /* Times before 1970 have no octal form, and are stored as the epoch */
+  if (st->st_mtime < 0) { status |= HEADER_NONCONFORMING; }
+  status |= formatNumber(header->mtime, ARCHIVE_MTIME_SIZE, st->st_mtime < 0 ? 0 : (unsigned long long)st->st_mtime);
+  if (S_ISREG(st->st_mode) && linkname != NULL) {
+    header->typeflag = HARD_LINK;
+  } else if (S_ISREG(st->st_mode)) {
+    header->typeflag = REGULAR_FILE;
+  } else if (S_ISLNK(st->st_mode)) {
+    header->typeflag = SYMBOLIC_LINK;
+  } else {
+    header->typeflag = DIRECTORY;
+  }
+  if (linkname != NULL) {
+    strncpy(header->linkname, linkname, ARCHIVE_LINKNAME_SIZE);
+    if (strlen(linkname) > ARCHIVE_LINKNAME_SIZE) { status |= HEADER_LONG_LINK; }
+  }
+  memcpy(header->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+  memcpy(header->version, ARCHIVE_VERSION, ARCHIVE_VERSION_SIZE);
+  /* Unknown ids leave the names empty, and readers fall back to the ids */
+  char name[NAME_SIZE];
+  namesUser(st->st_uid, name);
+  memcpy(header->uname, name, ARCHIVE_UNAME_SIZE);
+  namesGroup(st->st_gid, name);
+  memcpy(header->gname, name, ARCHIVE_GNAME_SIZE);
+  formatOctal(header->devmajor, ARCHIVE_DEVMAJOR_SIZE, 0);
+  formatOctal(header->devminor, ARCHIVE_DEVMINOR_SIZE, 0);
+  sealHeader(header);
+  return status;
+}
+
+/**
+ * Sums the bytes of a block one word at a time
+ *
+ * @param bytes the block to sum
+ * @return the sum of the bytes
+ */
+static unsigned int sumBlockScalar(const unsigned char* bytes) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < ARCHIVE_BLOCK_SIZE; i += sizeof(uint64_t)) {
+    /* Spread the bytes over 16-bit lanes so that eight of them add at once */
+    uint64_t word = loadWord(bytes + i);
+    sum += (word & 0x00ff00ff00ff00ffULL) + ((word >> 8) & 0x00ff00ff00ff00ffULL);
+  }
+  /* No lane can overflow: 64 words add at most 64 * 2 * 255 to each */
+  sum = (sum & 0x0000ffff0000ffffULL) + ((sum >> 16) & 0x0000ffff0000ffffULL);
+  return (sum & 0xffffffffULL) + (sum >> 32);
+}
+
+#ifdef HEADER_SIMD
+/**
+ * Sums the bytes of a block sixteen at a time with SSE2
+ *
+ * @param bytes the block to sum
+ * @return the sum of the bytes
+ */
+__attribute__((target("sse2"))) static unsigned int sumBlockSse2(const unsigned char* bytes) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i sum = zero;
+  for (size_t i = 0; i < ARCHIVE_BLOCK_SIZE; i += sizeof(__m128i)) {
+    /* The sum of absolute differences from zero adds eight bytes per lane */
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(bytes + i)), zero));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, sum);
+  return lanes[0] + lanes[1];
+}
+
+/**
+ * Sums the bytes of a block thirty-two at a time with AVX2
+ *
+ * @param bytes the block to sum
+ * @return the sum of the bytes
+ */
+__attribute__((target("avx2"))) static unsigned int sumBlockAvx2(const unsigned char* bytes) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i sum = zero;
+  for (size_t i = 0; i < ARCHIVE_BLOCK_SIZE; i += sizeof(__m256i)) {
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(bytes + i)), zero));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, sum);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#endif
+
+/**
+ * Picks the fastest way of summing a block that the processor supports, then
+ * sums the block with it
+ *
+ * @param bytes the block to sum
+ * @return the sum of the bytes
+ */
+static unsigned int sumBlockResolve(const unsigned char* bytes) {
+  BlockSum sum = sumBlockScalar;
+#ifdef HEADER_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    sum = sumBlockAvx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    sum = sumBlockSse2;
+  }
+#endif
+  __atomic_store_n(&sum_block, sum, __ATOMIC_RELAXED);
+  return sum(bytes);
+}
+
+/**
+ * Computes the checksum of a header, which is the sum of all of its bytes
+ * with the checksum field itself counted as spaces
+ *
+ * @param header the header to checksum
+ * @return the checksum of the header
+ */
+unsigned int headerChecksum(const USTARHeader* header) {
+  BlockSum sum = __atomic_load_n(&sum_block, __ATOMIC_RELAXED);
+  unsigned int total = sum((const unsigned char*)header);
+  for (size_t i = 0; i < ARCHIVE_CHKSUM_SIZE; i++) { total += ' ' - (unsigned char)header->chksum[i]; }
+  return total;
+}
+
+/**
+ * Stores the checksum of a header in its checksum field
+ *
+ * @param header the header to seal
+ */
+void sealHeader(USTARHeader* header) {
+  /* Six octal digits, a NUL and a space, as the format specifies */
+  formatOctal(header->chksum, ARCHIVE_CHKSUM_SIZE - 1, headerChecksum(header));
+  header->chksum[ARCHIVE_CHKSUM_SIZE - 1] = ' ';
+}
+
+/**
+ * Checks whether a block is all zeros, as the end of an archive is
+ *
+ * @param header the block to check
+ * @return nonzero if every byte of the block is zero
+ */
+int isEndBlock(const USTARHeader* header) {
+  const unsigned char* bytes = (const unsigned char*)header;
+  for (size_t i = 0; i < sizeof(*header); i++) {
+    if (bytes[i] != 0) { return 0; }
+  }
+  return 1;
+}
+
+/**
+ * Reads a numeric header field, which is octal digits optionally surrounded by
+ * spaces and NULs, or GNU's binary form when its high bit is set
+ *
+ * @param field the header field to read
+ * @param size the size of the field in bytes
+ * @param value where to store the number
+ * @return HEADER_OK for an octal field, HEADER_NONCONFORMING for a binary one
+ * and HEADER_CORRUPT if the field cannot be read
+ */
+static int parseNumber(const char* field, size_t size, unsigned long long* value) {
+  const unsigned char* bytes = (const unsigned char*)field;
+  if (bytes[0] & 0x80) { return decodeBase256(bytes, size, value); }
+  if (decodeOctalFast(bytes, size, value)) { return HEADER_OK; }
+  /* Leading spaces or short runs of digits are rare, so they take the slow
+   * path */
+  *value = 0;
+  size_t i = 0;
+  while (i < size && bytes[i] == ' ') { i++; }
+  for (; i < size && bytes[i] >= '0' && bytes[i] <= '7'; i++) {
+    if (*value >> (sizeof(*value) * 8 - 3)) { return HEADER_CORRUPT; }
+    *value = (*value << 3) | (bytes[i] - '0');
+  }
+  /* Only terminators may follow the digits */
+  for (; i < size; i++) {
+    if (bytes[i] != ' ' && bytes[i] != '\0') { return HEADER_CORRUPT; }
+  }
+  return HEADER_OK;
+}
+
+/**
+ * Copies a header string, which is only NUL-terminated when it is shorter than
+ * its field
+ *
+ * @param dest the buffer to copy to, at least size + 1 bytes long
+ * @param field the header field to copy
+ * @param size the size of the field in bytes
+ * @return the length of the string
+ */
+static size_t copyField(char* dest, const char* field, size_t size) {
+  size_t length = strnlen(field, size);
+  memcpy(dest, field, length);
+  dest[length] = '\0';
+  return length;
+}
+
+/**
+ * Joins the prefix and name fields of a header into the member's full path.
+ * GNU headers, marked by "ustar  " in place of the magic and version, keep
+ * access and change times where the prefix would be, so only the name counts.
+ *
+ * @param header the header to read
+ * @param path the buffer to write to, at least HEADER_PATH_SIZE bytes long
+ * @return the length of the path
+ */
+size_t headerPath(const USTARHeader* header, char* path) {
+  size_t length = 0;
+  int has_prefix = memcmp(header->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) == 0;
+  if (has_prefix && header->prefix[0] != '\0') {
+    length = copyField(path, header->prefix, ARCHIVE_PREFIX_SIZE);
+    path[length++] = '/';
+  }
+  return length + copyField(path + length, header->name, ARCHIVE_NAME_SIZE);
+}
+
+/**
+ * Decodes a header after validating its checksum
+ *
+ * @param header the header to decode
+ * @param member where to store the decoded fields
+ * @return HEADER_OK if the header conforms to USTAR, HEADER_NONCONFORMING if
+ * it uses an extension and HEADER_CORRUPT if it cannot be decoded
+ */
+int parseHeader(const USTARHeader* header, ArchiveMember* member) {
+  unsigned long long chksum, mode, uid, gid, size, mtime;
+  int status = parseNumber(header->chksum, ARCHIVE_CHKSUM_SIZE, &chksum);
+  if (status != HEADER_OK || chksum != headerChecksum(header)) { return HEADER_CORRUPT; }
+  status |= parseNumber(header->mode, ARCHIVE_MODE_SIZE, &mode);
+  status |= parseNumber(header->uid, ARCHIVE_UID_SIZE, &uid);
+  status |= parseNumber(header->gid, ARCHIVE_GID_SIZE, &gid);
+  status |= parseNumber(header->size, ARCHIVE_SIZE_SIZE, &size);
+  status |= parseNumber(header->mtime, ARCHIVE_MTIME_SIZE, &mtime);
+  if (status & HEADER_CORRUPT || size > (unsigned long long)INT64_MAX) { return HEADER_CORRUPT; }
+  /* GNU tar writes "ustar  " in place of the magic and version */
+  if (memcmp(header->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 ||
+      memcmp(header->version, ARCHIVE_VERSION, ARCHIVE_VERSION_SIZE) != 0) {
+    status = HEADER_NONCONFORMING;
+  }
+  headerPath(header, member->header_path);
+  copyField(member->header_linkname, header->linkname, ARCHIVE_LINKNAME_SIZE);
+  member->path = member->header_path;
+  member->linkname = member->header_linkname;
+  copyField(member->uname, header->uname, ARCHIVE_UNAME_SIZE);
+  copyField(member->gname, header->gname, ARCHIVE_GNAME_SIZE);
+  member->mode = mode & DEFAULT_PERMISSIONS;
+  member->uid = uid;
+  member->gid = gid;
+  member->size = size;
+  member->mtime = mtime;
+  member->typeflag = header->typeflag;
+  member->sparse_size = -1;
+  member->duplicate = 0;
+  return status;
+}
+
+/**
+ * Builds the name stored in the header of an auxiliary member, such as a
+ * block of extended records, by inserting a directory before the last
+ * component of the path it describes. The name is truncated to what a header
+ * can hold, which is harmless as readers that understand the member ignore it.
+ *
+ * @param name the buffer to write to, at least ARCHIVE_NAME_SIZE + 1 bytes long
+ * @param path the path the member describes
+ * @param directory the directory to insert
+ */
+void headerAuxName(char* name, const char* path, const char* directory) {
+  const char* base = strrchr(path, '/');
+  int dir_length = base != NULL ? (int)(base - path) : 1;
+  snprintf(name, ARCHIVE_NAME_SIZE + NULL_TERMINATOR_SIZE, "%.*s/%s/%s", dir_length, base != NULL ? path : ".",
+           directory, base != NULL ? base + 1 : path);
+}
+
+/**
+ * Appends one extended record, "<length> <key>=<value>\n", where the length
+ * counts the whole record including its own digits
+ *
+ * @param records where to write the record, with room for its key, its value
+ * and PAX_RECORD_OVERHEAD more bytes
+ * @param key the keyword of the record
+ * @param value the value of the record
+ * @return the length of the record
+ */
+size_t paxRecord(char* records, const char* key, const char* value) {
+  size_t body = strlen(key) + strlen(value) + 3;
+  size_t length = body;
+  /* Adding the digits may carry the length into one more digit */
+  for (size_t digits = 1, limit = 10;; digits++, limit *= 10) {
+    if (body + digits < limit) {
+      length = body + digits;
+      break;
+    }
+  }
+  snprintf(records, length + NULL_TERMINATOR_SIZE, "%zu %s=%s\n", length, key, value);
+  return length;
+}
+
+/**
+ * Fills in the header of a block of extended records, which apply to the
+ * member following it or, for global records, to the rest of the archive
+ *
+ * @param header the header to fill in
+ * @param path the path of the member the records describe
+ * @param st the status of that member
+ * @param length the number of bytes of records
+ * @param typeflag PAX_EXTENDED or PAX_GLOBAL
+ */
+void buildPaxHeader(USTARHeader* header, const char* path, const struct stat* st, size_t length, char typeflag) {
+  char name[ARCHIVE_NAME_SIZE + NULL_TERMINATOR_SIZE];
+  headerAuxName(name, path, PAX_HEADERS_DIR);
+  struct stat records;
+  memset(&records, 0, sizeof(records));
+  records.st_mode = S_IFREG | (st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+  records.st_uid = st->st_uid;
+  records.st_gid = st->st_gid;
+  records.st_size = length;
+  records.st_mtime = st->st_mtime;
+  buildHeader(header, name, &records, NULL);
+  header->typeflag = typeflag;
+  sealHeader(header);
+}
+
+/**
+ * Reads a decimal number from an extended record
+ *
+ * @param text the value of the record
+ * @param value where to store the number
+ * @return nonzero if the whole value is a number that fits
+ */
+static int parseDecimal(const char* text, long long* value) {
+  *value = 0;
+  if (*text == '\0') { return 0; }
+  for (; *text != '\0'; text++) {
+    if (*text < '0' || *text > '9' || *value > (INT64_MAX - 9) / 10) { return 0; }
+    *value = *value * 10 + (*text - '0');
+  }
+  return 1;
+}
+
+/**
+ * Decodes a block of extended records, keeping those this program uses. The
+ * records are terminated in place, so the attributes point into them.
+ *
+ * @param records the records to decode
+ * @param length the number of bytes of records
+ * @param pax where to store the attributes found
+ * @return HEADER_OK, or HEADER_CORRUPT if the records are malformed
+ */
+int parsePax(char* records, size_t length, PaxAttributes* pax) {
+  size_t offset = 0;
+  while (offset < length) {
+    char* record = records + offset;
+    size_t record_length = 0, i = 0;
+    while (offset + i < length && record[i] >= '0' && record[i] <= '9' && record_length < length) {
+      record_length = record_length * 10 + (record[i++] - '0');
+    }
+    if (i == 0 || record[i] != ' ' || record_length <= i + 1 || record_length > length - offset ||
+        record[record_length - 1] != '\n') {
+      return HEADER_CORRUPT;
+    }
+    record[record_length - 1] = '\0';
+    char* key = record + i + 1;
+    char* value = strchr(key, '=');
+    if (value == NULL) { return HEADER_CORRUPT; }
+    *value++ = '\0';
+    long long number;
+    if (strcmp(key, "path") == 0) {
+      pax->path = value;
+    } else if (strcmp(key, "linkpath") == 0) {
+      pax->linkpath = value;
+    } else if (strcmp(key, "size") == 0) {
+      if (!parseDecimal(value, &number)) { return HEADER_CORRUPT; }
+      pax->size = number;
+    } else if (strcmp(key, PAX_DELETED_KEY) == 0) {
+      pax->deleted = value;
+    } else if (strcmp(key, PAX_DUPLICATE_KEY) == 0) {
+      pax->duplicate = strcmp(value, "1") == 0;
+    } else if (strcmp(key, "GNU.sparse.name") == 0) {
+      pax->sparse_name = value;
+    } else if (strcmp(key, "GNU.sparse.realsize") == 0) {
+      if (!parseDecimal(value, &number)) { return HEADER_CORRUPT; }
+      pax->sparse_size = number;
+    } else if (strcmp(key, "GNU.sparse.major") == 0) {
+      if (!parseDecimal(value, &pax->sparse_major)) { return HEADER_CORRUPT; }
+    } else if (strcmp(key, "GNU.sparse.minor") == 0) {
+      if (!parseDecimal(value, &pax->sparse_minor)) { return HEADER_CORRUPT; }
+    }
+    offset += record_length;
+  }
+  return HEADER_OK;
+}
@@ -0,0 +1,300 @@
+/*
+ * index.c - a sidecar index mapping member paths to header offsets
+ *
+ * The index is a fixed header, an array of fixed-size entries sorted by path
+ and a table of the paths themselves. It is searched in place with a binary
+ search over the mapped file, so finding a member costs a handful of page
+ faults however large the archive is.
+ */
+#include "../include/index.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/kiwitar.h"
+#include "../include/safe_alloc.h"
+#include "../include/safe_dir.h"
+#include "../include/safe_file.h"
+
+/**
+ * Builds the name of the index belonging to an archive
+ *
+ * @param archive_name the name of the archive
+ * @return the name of the index, to be freed by the caller
+ */
+char* indexPath(const char* archive_name) {
+  size_t length = strlen(archive_name);
+  char* path = (char*)safeMalloc(length + sizeof(INDEX_SUFFIX));
+  memcpy(path, archive_name, length);
+  memcpy(path + length, INDEX_SUFFIX, sizeof(INDEX_SUFFIX));
+  return path;
+}
+
+/**
+ * Returns the length of a path without its trailing slashes, which only
+ * directories carry
+ *
+ * @param path the path to measure
+ * @return the length of the path as it is keyed in the index
+ */
+static size_t keyLength(const char* path) {
+  size_t length = strlen(path);
+  while (length > 1 && path[length - 1] == '/') { length--; }
+  return length;
+}
+
+/**
+ * Starts collecting an index
+ *
+ * @return a pointer to the empty index
+ */
+IndexWriter* indexWriterOpen(void) {
+  IndexWriter* writer = (IndexWriter*)safeMalloc(sizeof(IndexWriter));
+  pathTableInit(&writer->table, sizeof(IndexEntry), INDEX_INITIAL_ENTRIES, INDEX_INITIAL_STRINGS);
+  return writer;
+}
+
+/**
+ * Records a member in an index
+ *
+ * @param writer the index to add to
+ * @param path the path of the member as stored in its header
+ * @param header_offset the offset of the member's header in the archive
+ * @param size the size of the member's data
+ * @param typeflag the type of the member
+ */
+void indexWriterAdd(IndexWriter* writer, const char* path, off_t header_offset, off_t size, char typeflag) {
+  size_t length = keyLength(path);
+  uint64_t path_offset;
+  IndexEntry* entry = (IndexEntry*)pathTableAdd(&writer->table, path, length, &path_offset);
+  entry->path_offset = path_offset;
+  entry->path_length = length;
+  entry->header_offset = header_offset;
+  entry->size = size;
+  entry->typeflag = typeflag;
+}
+
+/**
+ * Checks that the path of an entry lies inside the mapped path table
+ *
+ * @param index the index holding the entry
+ * @param entry the entry to check
+ * @return nonzero if the path can be read
+ */
+static int entryInBounds(const ArchiveIndex* index, const IndexEntry* entry) {
+  return pathInBounds(entry->path_offset, entry->path_length, index->strings_size);
+}
+
+/**
+ * Copies every member of a mapped index into an index being collected, so that
+ * members appended to an archive can be added to its existing index
+ *
+ * @param writer the index to add to
+ * @param index the index to copy
+ * @return nonzero if an entry of the index was damaged; the entries before it
+ * have been copied
+ */
+int indexWriterMerge(IndexWriter* writer, const ArchiveIndex* index) {
+  for (size_t i = 0; i < index->count; i++) {
+    const IndexEntry* entry = &index->entries[i];
+    if (!entryInBounds(index, entry)) { return 1; }
+    uint64_t path_offset;
+    const char* path = index->strings + entry->path_offset;
+    IndexEntry* copy = (IndexEntry*)pathTableAdd(&writer->table, path, entry->path_length, &path_offset);
+    *copy = *entry;
+    copy->path_offset = path_offset;
+  }
+  return 0;
+}
+
+/**
+ * Orders two entries by path, then by position in the archive
+ *
+ * @param a the first entry
+ * @param b the second entry
+ * @param strings the path table of the entries
+ * @return a negative, zero or positive number as a sorts before, with or
+ * after b
+ */
+static int compareEntries(const void* a, const void* b, void* strings) {
+  const IndexEntry* x = (const IndexEntry*)a;
+  const IndexEntry* y = (const IndexEntry*)b;
+  const char* table = (const char*)strings;
+  int c = pathCompare(table + x->path_offset, x->path_length, table + y->path_offset, y->path_length);
+  if (c != 0) { return c; }
+  return (x->header_offset > y->header_offset) - (x->header_offset < y->header_offset);
+}
+
+/**
+ * Hashes the first block of an archive and the header at an offset with
+ * FNV-1a, so that an index can tell whether it still describes the archive
+ *
+ * @param fd the file descriptor of the archive, open for reading
+ * @param last_header the offset of the last header the index records
+ * @param hash where to store the hash
+ * @return nonzero if both blocks could be read
+ */
+static int hashHeaders(int fd, uint64_t last_header, uint64_t* hash) {
+  unsigned char block[ARCHIVE_BLOCK_SIZE];
+  off_t offsets[] = {0, (off_t)last_header};
+  *hash = INDEX_FNV_OFFSET;
+  for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+    if (pread(fd, block, sizeof(block), offsets[i]) != (ssize_t)sizeof(block)) { return 0; }
+    for (size_t j = 0; j < sizeof(block); j++) { *hash = (*hash ^ block[j]) * INDEX_FNV_PRIME; }
+  }
+  return 1;
+}
+
+/**
+ * Sorts a collected index and writes it to a file, along with the size, time
+ * and first and last headers of the archive it describes
+ *
+ * @param writer the index to write
+ * @param index_path the name of the file to write
+ * @param archive_fd the file descriptor of the finished archive, open for
+ * reading
+ */
+void indexWriterSave(IndexWriter* writer, const char* index_path, int archive_fd) {
+  pathTableSort(&writer->table, compareEntries);
+  const IndexEntry* entries = (const IndexEntry*)writer->table.entries;
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  header.count = writer->table.count;
+  struct stat st;
+  safeFstat(archive_fd, &st);
+  header.archive_size = st.st_size;
+  header.archive_mtime = st.st_mtim.tv_sec;
+  header.archive_mtime_nsec = st.st_mtim.tv_nsec;
+  for (size_t i = 0; i < writer->table.count; i++) {
+    uint64_t offset = entries[i].header_offset;
+    if (offset > header.last_header) { header.last_header = offset; }
+  }
+  /* An empty archive has no headers to hash and keeps a hash of zero */
+  if (writer->table.count > 0 && !hashHeaders(archive_fd, header.last_header, &header.headers_hash)) {
+    perror("Error reading the archive.\n");
+    exit(EXIT_FAILURE);
+  }
+  header.strings_offset = sizeof(header) + writer->table.count * sizeof(IndexEntry);
+  int fd = safeOpen((char*)index_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  pathTableWrite(&writer->table, fd, &header, sizeof(header));
+  safeClose(fd);
+}
+
+/**
+ * Frees an index being collected
+ *
+ * @param writer the index to free
+ */
+void indexWriterClose(IndexWriter* writer) {
+  pathTableFree(&writer->table);
+  safeFree(writer);
+}
+
+/**
+ * Maps the index of an archive, checking that its header is well formed and
+ * was written for the archive as it is now: the same size and modification
+ * time, and the same first and last headers. The paths of the entries are
+ * only checked as lookups reach them, so opening never touches every entry.
+ *
+ * @param index_path the name of the index
+ * @param archive_fd the file descriptor of the archive, open for reading
+ * @return the index, or NULL if there is no usable index
+ */
+ArchiveIndex* indexOpen(const char* index_path, int archive_fd) {
+  struct stat archive;
+  safeFstat(archive_fd, &archive);
+  int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+  if (fd == FILE_ERROR) { return NULL; }
+  struct stat st;
+  safeFstat(fd, &st);
+  void* map = MAP_FAILED;
+  if ((size_t)st.st_size >= sizeof(IndexHeader)) { map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0); }
+  safeClose(fd);
+  if (map == MAP_FAILED) { return NULL; }
+  const IndexHeader* header = (const IndexHeader*)map;
+  size_t size = st.st_size;
+  int valid = memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+              header->archive_size == (uint64_t)archive.st_size && header->archive_mtime == archive.st_mtim.tv_sec &&
+              header->archive_mtime_nsec == (uint64_t)archive.st_mtim.tv_nsec &&
+              header->count <= (size - sizeof(IndexHeader)) / sizeof(IndexEntry) &&
+              header->strings_offset == sizeof(IndexHeader) + header->count * sizeof(IndexEntry);
+  uint64_t hash = 0;
+  if (valid && header->count > 0) { valid = hashHeaders(archive_fd, header->last_header, &hash); }
+  valid = valid && hash == header->headers_hash;
+  if (!valid) {
+    fprintf(stderr, "%s: index is stale or damaged; ignoring it\n", index_path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  ArchiveIndex* index = (ArchiveIndex*)safeMalloc(sizeof(ArchiveIndex));
+  index->map = (unsigned char*)map;
+  index->map_size = st.st_size;
+  index->entries = (const IndexEntry*)(header + 1);
+  index->count = header->count;
+  index->strings = (const char*)map + header->strings_offset;
+  index->strings_size = size - header->strings_offset;
+  return index;
+}
+
+/**
+ * Finds the members with a path, or inside a directory with that path
+ *
+ * @param index the index to search
+ * @param path the path to look for
+ * @param offsets where to store an array of the header offsets found, sorted
+ * by path; the caller frees it
+ * @return the number of members found, or INDEX_DAMAGED if an entry the
+ * search reached points outside the file
+ */
+size_t indexFind(const ArchiveIndex* index, const char* path, off_t** offsets) {
+  size_t length = keyLength(path);
+  /* Binary search for the first entry not sorting before the path */
+  size_t low = 0, high = index->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    const IndexEntry* entry = &index->entries[mid];
+    if (!entryInBounds(index, entry)) { return INDEX_DAMAGED; }
+    if (pathCompare(index->strings + entry->path_offset, entry->path_length, path, length) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  /* Every entry starting with the path follows; keep the exact match and
+   * those below it, skipping siblings such as "path.txt" */
+  size_t found = 0, capacity = 0;
+  *offsets = NULL;
+  for (size_t i = low; i < index->count; i++) {
+    const IndexEntry* entry = &index->entries[i];
+    if (!entryInBounds(index, entry)) {
+      safeFree(*offsets);
+      *offsets = NULL;
+      return INDEX_DAMAGED;
+    }
+    const char* name = index->strings + entry->path_offset;
+    if (entry->path_length < length || memcmp(name, path, length) != 0) { break; }
+    if (entry->path_length != length && name[length] != '/') { continue; }
+    if (found == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : INDEX_INITIAL_ENTRIES;
+      *offsets = (off_t*)safeRealloc(*offsets, capacity * sizeof(off_t));
+    }
+    (*offsets)[found++] = entry->header_offset;
+  }
+  return found;
+}
+
+/**
+ * Unmaps an index
+ *
+ * @param index the index to close
+ */
+void indexClose(ArchiveIndex* index) {
+  munmap(index->map, index->map_size);
+  safeFree(index);
+}
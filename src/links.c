@@ -0,0 +1,93 @@
+/*
+ * links.c - detection of files reached through several hard links
+ *
+ * A regular file with more than one link may be met again under another path.
+ The first path archived for each such inode is remembered, so that later
+ occurrences are stored as hard link members naming it instead of repeating
+ the data. Files with a single link cannot recur and are never recorded.
+ */
+#include "../include/links.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../include/hash.h"
+
+/**
+ * Finds the slot of an inode, which is either the slot holding it or the empty
+ * slot where it belongs
+ *
+ * @param table the table to search
+ * @param dev the device holding the inode
+ * @param ino the inode number
+ * @return a pointer to the slot
+ */
+static LinkEntry* findSlot(LinkTable* table, dev_t dev, ino_t ino) {
+  /* The device goes in the high bits, out of the way of the inode numbers */
+  uint64_t key = (uint64_t)ino ^ ((uint64_t)dev << 32 | (uint64_t)dev >> 32);
+  size_t slot = hashSlot(key, table->capacity);
+  while (table->entries[slot].path != NULL && (table->entries[slot].dev != dev || table->entries[slot].ino != ino)) {
+    slot = hashNextSlot(slot, table->capacity);
+  }
+  return &table->entries[slot];
+}
+
+/**
+ * Doubles the number of slots of a table
+ *
+ * @param table the table to grow
+ */
+static void growTable(LinkTable* table) {
+  LinkEntry* old = table->entries;
+  size_t old_capacity = table->capacity;
+  table->capacity = old_capacity * 2;
+  table->entries = (LinkEntry*)safeCalloc(table->capacity, sizeof(LinkEntry));
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].path != NULL) { *findSlot(table, old[i].dev, old[i].ino) = old[i]; }
+  }
+  safeFree(old);
+}
+
+/**
+ * Prepares an empty link table
+ *
+ * @param table the table to initialise
+ */
+void linksInit(LinkTable* table) {
+  table->capacity = LINKS_INITIAL_SLOTS;
+  table->count = 0;
+  table->entries = (LinkEntry*)safeCalloc(table->capacity, sizeof(LinkEntry));
+  arenaInit(&table->paths, 0);
+}
+
+/**
+ * Looks up the inode of a file about to be archived, recording its path if the
+ * inode has not been met before
+ *
+ * @param table the table to search
+ * @param st the status of the file
+ * @param path the path the file is archived under
+ * @return the path the inode was first archived under, valid until the table
+ * is freed, or NULL if the file must be archived with its data
+ */
+const char* linksRecord(LinkTable* table, const struct stat* st, const char* path) {
+  if (!S_ISREG(st->st_mode) || st->st_nlink < 2) { return NULL; }
+  if (hashMustGrow(table->count, table->capacity)) { growTable(table); }
+  LinkEntry* entry = findSlot(table, st->st_dev, st->st_ino);
+  if (entry->path != NULL) { return entry->path; }
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->path = arenaString(&table->paths, path, strlen(path));
+  table->count++;
+  return NULL;
+}
+
+/**
+ * Frees the slots and paths of a link table
+ *
+ * @param table the table to free
+ */
+void linksFree(LinkTable* table) {
+  safeFree(table->entries);
+  arenaFree(&table->paths);
+}
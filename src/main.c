@@ -1,10 +1,43 @@
 #include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "../include/compress.h"
 #include "../include/kiwitar.h"
+#include "../include/prefetch.h"
+#include "../include/stats.h"
+#include "../include/throttle.h"
 #include "../include/utils.h"
 
+/* The options that have a long form; the rest are single letters only */
+static const struct option long_options[] = {
+    {"blocking-factor", required_argument, NULL, BLOCKING_FACTOR},
+    {"threads", required_argument, NULL, THREAD_COUNT},
+    {"readers", required_argument, NULL, READER_COUNT},
+    {"read-ahead", required_argument, NULL, READ_AHEAD},
+    {"inflight", required_argument, NULL, INFLIGHT_BYTES},
+    {"io-uring", no_argument, NULL, USE_IO_URING},
+    {"index", no_argument, NULL, WRITE_INDEX},
+    {"build-index", no_argument, NULL, BUILD_INDEX},
+    {"gzip", no_argument, NULL, USE_GZIP},
+    {"zstd", no_argument, NULL, USE_ZSTD},
+    {"compress-threads", required_argument, NULL, COMPRESS_THREADS},
+    {"listed-incremental", required_argument, NULL, LISTED_INCREMENTAL},
+    {"dedup", no_argument, NULL, DEDUPLICATE},
+    {"stats", optional_argument, NULL, STATS_OUTPUT},
+    {"stats-interval", required_argument, NULL, STATS_INTERVAL},
+    {"read-limit", required_argument, NULL, READ_LIMIT},
+    {"write-limit", required_argument, NULL, WRITE_LIMIT},
+    {"read-ops", required_argument, NULL, READ_OPS},
+    {"write-ops", required_argument, NULL, WRITE_OPS},
+    {"limit-file", required_argument, NULL, LIMIT_FILE},
+    {"direct", no_argument, NULL, BYPASS_CACHE},
+    {NULL, 0, NULL, 0}};
+
 /**
  * @brief Program entry point
  *
@@ -14,27 +47,111 @@
  */
 int main(int argc, char* argv[]) {
   enum ProgramOptions opt = 0;
-  int create = 0, list = 0, extract = 0, verbose = 0, strict = 0;
+  int create = 0, append = 0, update = 0, list = 0, extract = 0, index = 0;
   char* archive_name = NULL;
-  while ((opt = getopt(argc, argv, "ctxvSf:")) != OUT_OF_OPTIONS) {
+  int stats_fd = -1;
+  size_t stats_interval = 0;
+  ThrottleLimits limits = {{0, 0}, {0, 0}};
+  char* limit_file = NULL;
+  ArchiveOptions options = {.verbose = 0,
+                            .listing = stdout,
+                            .strict = 0,
+                            .blocking_factor = DEFAULT_BLOCKING_FACTOR,
+                            .threads = DEFAULT_THREADS,
+                            .readers = 0,
+                            .read_ahead = DEFAULT_READ_AHEAD,
+                            .inflight = DEFAULT_INFLIGHT_BYTES,
+                            .io_uring = 0,
+                            .index = 0,
+                            .compression = COMPRESS_NONE,
+                            .compress_threads = 0,
+                            .snapshot = NULL,
+                            .dedup = 0,
+                            .direct = 0};
+  while ((opt = getopt_long(argc, argv, "ctxruvzSf:b:j:g:", long_options, NULL)) != OUT_OF_OPTIONS) {
     switch (opt) {
       case CREATE_ARCHIVE: create = 1; break;
       case LIST_CONTENTS: list = 1; break;
       case EXTRACT_CONTENTS: extract = 1; break;
-      case VERBOSE_OUTPUT: verbose = 1; break;
+      case APPEND_ARCHIVE: append = 1; break;
+      case UPDATE_ARCHIVE: update = 1; break;
+      case VERBOSE_OUTPUT: options.verbose = 1; break;
       case SPECIFY_ARCHIVE_NAME: archive_name = optarg; break;
-      case STRICT_FORMAT: strict = 1; break;
+      case STRICT_FORMAT: options.strict = 1; break;
+      case BLOCKING_FACTOR: options.blocking_factor = parseSize(*argv, optarg, 1, SIZE_MAX); break;
+      case THREAD_COUNT: options.threads = parseSize(*argv, optarg, 1, MAX_THREADS); break;
+      case READER_COUNT: options.readers = parseSize(*argv, optarg, 0, MAX_THREADS); break;
+      case READ_AHEAD: options.read_ahead = parseSize(*argv, optarg, 1, SIZE_MAX); break;
+      case INFLIGHT_BYTES: options.inflight = parseSize(*argv, optarg, 1, SIZE_MAX); break;
+      case USE_IO_URING: options.io_uring = 1; break;
+      case WRITE_INDEX: options.index = 1; break;
+      case BUILD_INDEX: index = 1; break;
+      case USE_GZIP: options.compression = COMPRESS_GZIP; break;
+      case USE_ZSTD: options.compression = COMPRESS_ZSTD; break;
+      case COMPRESS_THREADS: options.compress_threads = parseSize(*argv, optarg, 1, MAX_THREADS); break;
+      case LISTED_INCREMENTAL: options.snapshot = optarg; break;
+      case DEDUPLICATE: options.dedup = 1; break;
+      case STATS_OUTPUT:
+        stats_fd = optarg != NULL ? (int)parseSize(*argv, optarg, 0, INT_MAX) : STATS_DEFAULT_FD;
+        break;
+      case STATS_INTERVAL: stats_interval = parseSize(*argv, optarg, 1, SIZE_MAX); break;
+      case READ_LIMIT: limits.bytes[THROTTLE_READ] = parseSize(*argv, optarg, 0, SIZE_MAX); break;
+      case WRITE_LIMIT: limits.bytes[THROTTLE_WRITE] = parseSize(*argv, optarg, 0, SIZE_MAX); break;
+      case READ_OPS: limits.ops[THROTTLE_READ] = parseSize(*argv, optarg, 0, SIZE_MAX); break;
+      case WRITE_OPS: limits.ops[THROTTLE_WRITE] = parseSize(*argv, optarg, 0, SIZE_MAX); break;
+      case LIMIT_FILE: limit_file = optarg; break;
+      case BYPASS_CACHE: options.direct = 1; break;
       default: usage(*argv);
     }
   } /* Ensure only one operation and the archive name are specified. */
-  if ((create + list + extract) != 1 || archive_name == NULL) { usage(*argv); }
+  if ((create + append + update + list + extract + index) != 1 || archive_name == NULL) { usage(*argv); }
+  /* Appending seeks back over the end of an uncompressed archive file, and
+   * snapshots only describe archives created from scratch */
+  if ((append || update) && (options.compression != COMPRESS_NONE || options.snapshot != NULL ||
+                             strcmp(archive_name, ARCHIVE_STDIO) == 0)) {
+    usage(*argv);
+  }
+#ifndef HAVE_ZSTD
+  /* Refused before the archive is opened, which would truncate it */
+  if (options.compression == COMPRESS_ZSTD) { panic("zstd support was not compiled in."); }
+#endif
+  /* Copies are marked with a pax record, which strict archives cannot hold */
+  if (options.dedup && options.strict) { usage(*argv); }
+  /* Index offsets refer to the uncompressed archive, which cannot be seeked */
+  if (options.index && options.compression != COMPRESS_NONE) { usage(*argv); }
+  if (strcmp(archive_name, ARCHIVE_STDIO) == 0) {
+    /* A streamed archive has no name to put an index next to */
+    if (options.index || index) { usage(*argv); }
+    /* The archive itself goes to standard output */
+    if (create) { options.listing = stderr; }
+  }
+  /* Verbose output leaves in large writes unless someone is watching it */
+  if (!isatty(fileno(options.listing))) { setvbuf(options.listing, NULL, _IOFBF, LISTING_BUFFER_SIZE); }
+  if (options.compress_threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    options.compress_threads = online > 0 ? (size_t)online : 1;
+  }
+  /* An interval only says how often to report, so it implies --stats */
+  if (stats_interval > 0 && stats_fd < 0) { stats_fd = STATS_DEFAULT_FD; }
+  if (stats_fd >= 0) { statsOpen(stats_fd, stats_interval); }
+  throttleOpen(&limits, limit_file);
+  safeDropCaches(options.direct);
 
-  if (create) { createArchive(archive_name, argc - optind, &argv[optind], verbose, strict); }
-  // else if (list) {
-  //   listArchive(archive_name, verbose, strict);
-  // } else if (extract) {
-  //   extractArchive(archive_name, verbose, strict);
-  // }
+  if (create) {
+    createArchive(archive_name, argc - optind, &argv[optind], &options);
+  } else if (append || update) {
+    appendArchive(archive_name, argc - optind, &argv[optind], &options, update);
+  } else if (list) {
+    listArchive(archive_name, argc - optind, &argv[optind], &options);
+  } else if (extract) {
+    extractArchive(archive_name, argc - optind, &argv[optind], &options);
+  } else if (index) {
+    buildIndex(archive_name, &options);
+  }
+  /* The listing may share a descriptor with the report, which comes last */
+  fflush(options.listing);
+  statsClose();
+  throttleClose();
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,107 @@
+/*
+ * names.c - cached user and group name lookups
+ *
+ * Resolving an id goes through NSS, which may ask a directory server and take
+ milliseconds. A tree is usually owned by a handful of users and groups, so
+ each id is resolved once and kept in a small hash map for the rest of the run.
+ */
+#include "../include/names.h"
+
+#include <grp.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../include/hash.h"
+#include "../include/safe_alloc.h"
+#include "../include/stats.h"
+
+/* The caches are shared by every thread and guarded by one lock */
+static NameCache user_cache = {NULL, 0, 0};
+static NameCache group_cache = {NULL, 0, 0};
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Finds the slot of an id, which is either the slot holding it or the empty
+ * slot where it belongs
+ *
+ * @param cache the cache to search
+ * @param id the id to look for
+ * @return a pointer to the slot
+ */
+static NameEntry* findSlot(NameCache* cache, unsigned long id) {
+  size_t slot = hashSlot(id, cache->capacity);
+  while (cache->entries[slot].used && cache->entries[slot].id != id) { slot = hashNextSlot(slot, cache->capacity); }
+  return &cache->entries[slot];
+}
+
+/**
+ * Doubles the number of slots of a cache, or creates its first slots
+ *
+ * @param cache the cache to grow
+ */
+static void growCache(NameCache* cache) {
+  NameEntry* old = cache->entries;
+  size_t old_capacity = cache->capacity;
+  cache->capacity = old_capacity > 0 ? old_capacity * 2 : NAMES_INITIAL_SLOTS;
+  cache->entries = (NameEntry*)safeCalloc(cache->capacity, sizeof(NameEntry));
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].used) { *findSlot(cache, old[i].id) = old[i]; }
+  }
+  safeFree(old);
+}
+
+/**
+ * Looks an id up in a cache, resolving it on a miss
+ *
+ * @param cache the cache to search
+ * @param id the id to look up
+ * @param group nonzero if the id is a group id
+ * @param name where to copy the name, NAME_SIZE bytes
+ * @return nonzero if the id has a name, zero if it is unknown
+ */
+static int lookupName(NameCache* cache, unsigned long id, int group, char* name) {
+  STATS_START(started);
+  pthread_mutex_lock(&names_lock);
+  if (hashMustGrow(cache->count, cache->capacity)) { growCache(cache); }
+  NameEntry* entry = findSlot(cache, id);
+  if (!entry->used) {
+    const char* found = NULL;
+    if (group) {
+      struct group* grp = getgrgid(id);
+      found = grp != NULL ? grp->gr_name : NULL;
+    } else {
+      struct passwd* pwd = getpwuid(id);
+      found = pwd != NULL ? pwd->pw_name : NULL;
+    }
+    entry->used = 1;
+    entry->id = id;
+    entry->known = found != NULL;
+    memset(entry->name, 0, NAME_SIZE);
+    if (found != NULL) { strncpy(entry->name, found, NAME_SIZE - NULL_TERMINATOR_SIZE); }
+    cache->count++;
+  }
+  memcpy(name, entry->name, NAME_SIZE);
+  int known = entry->known;
+  pthread_mutex_unlock(&names_lock);
+  STATS_END(STATS_NAMES, started, 0);
+  return known;
+}
+
+/**
+ * Returns the name of a user
+ *
+ * @param uid the id of the user
+ * @param name where to copy the name, NAME_SIZE bytes; empty if it is unknown
+ * @return nonzero if the user has a name
+ */
+int namesUser(uid_t uid, char* name) { return lookupName(&user_cache, uid, 0, name); }
+
+/**
+ * Returns the name of a group
+ *
+ * @param gid the id of the group
+ * @param name where to copy the name, NAME_SIZE bytes; empty if it is unknown
+ * @return nonzero if the group has a name
+ */
+int namesGroup(gid_t gid, char* name) { return lookupName(&group_cache, gid, 1, name); }
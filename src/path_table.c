@@ -0,0 +1,124 @@
+/*
+ * path_table.c - sorted tables of paths shared by indexes and manifests
+ *
+ * Sidecar indexes and snapshot manifests share one layout: a fixed header, an
+ array of fixed-size entries sorted by path and a table of the paths
+ themselves. Entries are collected in memory as members or files are met,
+ sorted once and written out in three writes; readers map the file and binary
+ search the entries in place.
+ */
+#include "../include/path_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/safe_alloc.h"
+#include "../include/safe_file.h"
+
+/**
+ * Prepares an empty table
+ *
+ * @param table the table to initialise
+ * @param entry_size the size of an entry in bytes
+ * @param initial_entries the number of entries to make room for
+ * @param initial_strings the number of path bytes to make room for
+ */
+void pathTableInit(PathTable* table, size_t entry_size, size_t initial_entries, size_t initial_strings) {
+  table->entry_size = entry_size;
+  table->count = 0;
+  table->capacity = initial_entries;
+  table->entries = safeMalloc(table->capacity * entry_size);
+  table->strings_size = 0;
+  table->strings_capacity = initial_strings;
+  table->strings = (char*)safeMalloc(table->strings_capacity);
+}
+
+/**
+ * Appends a zeroed entry and copies its path into the path table
+ *
+ * @param table the table to add to
+ * @param path the path of the entry, which need not be terminated
+ * @param length the length of the path
+ * @param path_offset where to store the offset of the path in the path table
+ * @return a pointer to the entry, valid until the next addition
+ */
+void* pathTableAdd(PathTable* table, const char* path, size_t length, uint64_t* path_offset) {
+  if (table->count == table->capacity) {
+    table->capacity *= 2;
+    table->entries = safeRealloc(table->entries, table->capacity * table->entry_size);
+  }
+  while (table->strings_size + length > table->strings_capacity) {
+    table->strings_capacity *= 2;
+    table->strings = (char*)safeRealloc(table->strings, table->strings_capacity);
+  }
+  void* entry = (char*)table->entries + table->count++ * table->entry_size;
+  memset(entry, 0, table->entry_size);
+  *path_offset = table->strings_size;
+  memcpy(table->strings + table->strings_size, path, length);
+  table->strings_size += length;
+  return entry;
+}
+
+/**
+ * Sorts the entries of a table
+ *
+ * @param table the table to sort
+ * @param compare orders two entries, given the path table
+ */
+void pathTableSort(PathTable* table, PathTableCompare compare) {
+  qsort_r(table->entries, table->count, table->entry_size, compare, table->strings);
+}
+
+/**
+ * Writes a header followed by the entries and the path table of a table
+ *
+ * @param table the table to write
+ * @param fd the file descriptor to write to
+ * @param header the header, which records where the path table starts
+ * @param header_size the size of the header in bytes
+ */
+void pathTableWrite(const PathTable* table, int fd, const void* header, size_t header_size) {
+  safeWrite(fd, header, header_size);
+  safeWrite(fd, table->entries, table->count * table->entry_size);
+  safeWrite(fd, table->strings, table->strings_size);
+}
+
+/**
+ * Frees the entries and paths of a table
+ *
+ * @param table the table to free
+ */
+void pathTableFree(PathTable* table) {
+  safeFree(table->entries);
+  safeFree(table->strings);
+}
+
+/**
+ * Orders two paths bytewise, a shorter path first when one is a prefix of the
+ * other, so that a directory sorts before everything inside it
+ *
+ * @param a the first path
+ * @param a_length the length of the first path
+ * @param b the second path
+ * @param b_length the length of the second path
+ * @return a negative, zero or positive number as a sorts before, with or
+ * after b
+ */
+int pathCompare(const char* a, size_t a_length, const char* b, size_t b_length) {
+  int c = memcmp(a, b, a_length < b_length ? a_length : b_length);
+  if (c != 0) { return c; }
+  return (a_length > b_length) - (a_length < b_length);
+}
+
+/**
+ * Checks that a path read from a mapped file lies inside its path table. The
+ * check is written so that a huge offset or length cannot wrap around.
+ *
+ * @param path_offset the offset of the path in the path table
+ * @param path_length the length of the path
+ * @param strings_size the size of the path table
+ * @return nonzero if the path can be read
+ */
+int pathInBounds(uint64_t path_offset, uint64_t path_length, size_t strings_size) {
+  return path_offset <= strings_size && path_length <= strings_size - path_offset;
+}
@@ -0,0 +1,432 @@
+/*
+ * prefetch.c - read-ahead pipeline feeding the archive writer
+ *
+ * A walker thread copies entries from the traversal into a window of jobs.
+ Reader threads claim the regular files in that window in order, read them
+ into chunks and hand the chunks to the writer, which drains them strictly in
+ traversal order. The bytes held in chunks never exceed a fixed budget, except
+ for the file the writer is waiting on, which is always allowed to stream.
+ While a reader waits for budget it opens upcoming files and asks the kernel
+ to start reading them with posix_fadvise(POSIX_FADV_WILLNEED). Runs of small
+ files can instead be fetched as batches, which the safe_file layer submits
+ through io_uring when it is enabled.
+ */
+#include "../include/prefetch.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/safe_alloc.h"
+#include "../include/safe_dir.h"
+#include "../include/safe_file.h"
+#include "../include/sparse.h"
+
+/**
+ * Finds the job holding a sequence number
+ *
+ * @param prefetcher the pipeline holding the job
+ * @param seq the sequence number of the job
+ * @return a pointer to the job
+ */
+static PrefetchJob* jobAt(Prefetcher* prefetcher, size_t seq) { return &prefetcher->jobs[seq % prefetcher->capacity]; }
+
+/**
+ * Checks whether a job has data for the readers to fetch
+ *
+ * @param job the job to check
+ * @return nonzero if the job is a regular file with a nonzero size
+ */
+static int needsRead(const PrefetchJob* job) {
+  /* A hard link to a file archived earlier is stored without its data, an
+   * unchanged file is not stored at all, and the writer reads the data runs
+   * of a file with holes itself */
+  return S_ISREG(job->entry.st.st_mode) && job->entry.st.st_size > 0 && job->entry.link == NULL &&
+         !job->entry.unchanged && !sparseCandidate(&job->entry.st);
+}
+
+/**
+ * Opens a file and asks the kernel to start reading all of it
+ *
+ * @param job the job whose file to open
+ * @return the file descriptor of the opened file
+ */
+static int openJob(PrefetchJob* job) {
+  int fd = safeOpenAt(job->entry.dirfd, job->entry.name, O_RDONLY, 0);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, 0, job->entry.st.st_size, POSIX_FADV_WILLNEED);
+  return fd;
+}
+
+/**
+ * Opens the next file in the window that no reader has reached yet. Must be
+ * called with the lock held; the lock is released while the file is opened.
+ *
+ * @param prefetcher the pipeline to work ahead in
+ * @return nonzero if a file was opened
+ */
+static int openAhead(Prefetcher* prefetcher) {
+  size_t end = prefetcher->first + prefetcher->count;
+  if (prefetcher->next_open < prefetcher->next_read) { prefetcher->next_open = prefetcher->next_read; }
+  while (prefetcher->next_open < end && !needsRead(jobAt(prefetcher, prefetcher->next_open))) {
+    prefetcher->next_open++;
+  }
+  if (prefetcher->next_open >= end) { return 0; }
+  PrefetchJob* job = jobAt(prefetcher, prefetcher->next_open++);
+  job->state = JOB_OPENING;
+  pthread_mutex_unlock(&prefetcher->lock);
+  int fd = openJob(job);
+  pthread_mutex_lock(&prefetcher->lock);
+  job->fd = fd;
+  job->state = JOB_OPENED;
+  pthread_cond_broadcast(&prefetcher->ready_cond);
+  return 1;
+}
+
+/**
+ * Reads a claimed file into chunks for the writer. Must be called with the
+ * lock held; the lock is released while reading.
+ *
+ * @param prefetcher the pipeline the job belongs to
+ * @param seq the sequence number of the job
+ */
+static void readJob(Prefetcher* prefetcher, size_t seq) {
+  PrefetchJob* job = jobAt(prefetcher, seq);
+  while (job->state == JOB_OPENING) { pthread_cond_wait(&prefetcher->ready_cond, &prefetcher->lock); }
+  int fd = job->fd;
+  job->state = JOB_READING;
+  pthread_mutex_unlock(&prefetcher->lock);
+  if (fd < 0) { fd = openJob(job); }
+  off_t remaining = job->entry.st.st_size;
+  while (remaining > 0) {
+    size_t want = remaining < PREFETCH_CHUNK_SIZE ? (size_t)remaining : PREFETCH_CHUNK_SIZE;
+    pthread_mutex_lock(&prefetcher->lock);
+    /* The writer's own file may always stream, so the budget cannot deadlock */
+    while (seq != prefetcher->first && prefetcher->inflight + want > prefetcher->budget) {
+      if (!openAhead(prefetcher)) { pthread_cond_wait(&prefetcher->space_cond, &prefetcher->lock); }
+    }
+    prefetcher->inflight += want;
+    pthread_mutex_unlock(&prefetcher->lock);
+    PrefetchChunk* chunk = (PrefetchChunk*)safeMalloc(sizeof(PrefetchChunk) + want);
+    chunk->next = NULL;
+    size_t length = safeRead(fd, chunk->data, want);
+    chunk->length = length;
+    /* The last chunk drops through to the end, taking the partial page too */
+    safeDropCache(fd, job->entry.st.st_size - remaining, remaining > (off_t)want ? (off_t)length : 0);
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->inflight -= want - length;
+    if (length > 0) {
+      /* Once published the chunk belongs to the writer */
+      if (job->tail != NULL) {
+        job->tail->next = chunk;
+      } else {
+        job->head = chunk;
+      }
+      job->tail = chunk;
+      job->read_offset += length;
+      pthread_cond_broadcast(&prefetcher->ready_cond);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    if (length < want) {
+      /* The file shrank; the writer pads what is missing */
+      if (length == 0) { safeFree(chunk); }
+      break;
+    }
+    remaining -= want;
+  }
+  safeClose(fd);
+  pthread_mutex_lock(&prefetcher->lock);
+  job->fd = -1;
+  job->state = JOB_READ;
+  pthread_cond_broadcast(&prefetcher->ready_cond);
+}
+
+/**
+ * Checks whether a job can join a batch of small files
+ *
+ * @param job the job to check
+ * @return nonzero if the job fits in a single chunk and has not been opened
+ */
+static int isBatchable(const PrefetchJob* job) {
+  return needsRead(job) && job->state == JOB_QUEUED && job->entry.st.st_size <= PREFETCH_CHUNK_SIZE;
+}
+
+/**
+ * Opens, reads and closes a run of small files together, each into a single
+ * chunk. Must be called with the lock held and the job at next_read
+ * batchable; the lock is released while reading.
+ *
+ * @param prefetcher the pipeline the jobs belong to
+ */
+static void readBatch(Prefetcher* prefetcher) {
+  PrefetchJob* jobs[PREFETCH_BATCH_SIZE];
+  PrefetchChunk* chunks[PREFETCH_BATCH_SIZE];
+  FileRequest requests[PREFETCH_BATCH_SIZE];
+  size_t seq = prefetcher->next_read++;
+  size_t want = jobAt(prefetcher, seq)->entry.st.st_size;
+  while (seq != prefetcher->first && prefetcher->inflight + want > prefetcher->budget) {
+    if (!openAhead(prefetcher)) { pthread_cond_wait(&prefetcher->space_cond, &prefetcher->lock); }
+  }
+  size_t count = 0;
+  jobs[count++] = jobAt(prefetcher, seq);
+  prefetcher->inflight += want;
+  /* Extend the batch with the files that follow while the budget allows */
+  size_t end = prefetcher->first + prefetcher->count;
+  while (count < PREFETCH_BATCH_SIZE && prefetcher->next_read < end) {
+    PrefetchJob* job = jobAt(prefetcher, prefetcher->next_read);
+    if (needsRead(job)) {
+      if (!isBatchable(job) || prefetcher->inflight + job->entry.st.st_size > prefetcher->budget) { break; }
+      prefetcher->inflight += job->entry.st.st_size;
+      jobs[count++] = job;
+    }
+    prefetcher->next_read++;
+  }
+  for (size_t i = 0; i < count; i++) { jobs[i]->state = JOB_READING; }
+  pthread_mutex_unlock(&prefetcher->lock);
+  for (size_t i = 0; i < count; i++) {
+    size_t size = jobs[i]->entry.st.st_size;
+    chunks[i] = (PrefetchChunk*)safeMalloc(sizeof(PrefetchChunk) + size);
+    chunks[i]->next = NULL;
+    requests[i].dirfd = jobs[i]->entry.dirfd;
+    requests[i].path = (char*)jobs[i]->entry.name;
+    requests[i].flags = O_RDONLY;
+    requests[i].mode = 0;
+    requests[i].buf = chunks[i]->data;
+    requests[i].count = size;
+    requests[i].offset = 0;
+  }
+  safeOpenBatch(requests, count);
+  safeReadBatch(requests, count);
+  for (size_t i = 0; i < count; i++) { safeDropCache(requests[i].fd, 0, 0); }
+  /* Closing overwrites the results, so keep the lengths in the chunks */
+  for (size_t i = 0; i < count; i++) { chunks[i]->length = requests[i].result; }
+  safeCloseBatch(requests, count);
+  pthread_mutex_lock(&prefetcher->lock);
+  for (size_t i = 0; i < count; i++) {
+    size_t length = chunks[i]->length;
+    prefetcher->inflight -= requests[i].count - length;
+    if (length > 0) {
+      jobs[i]->head = chunks[i];
+      jobs[i]->tail = chunks[i];
+    } else {
+      safeFree(chunks[i]);
+    }
+    jobs[i]->read_offset = length;
+    jobs[i]->state = JOB_READ;
+  }
+  pthread_cond_broadcast(&prefetcher->ready_cond);
+}
+
+/**
+ * The body of a reader thread: claim regular files in traversal order and
+ * read them
+ *
+ * @param arg the Prefetcher the thread belongs to
+ * @return NULL
+ */
+static void* prefetchReader(void* arg) {
+  Prefetcher* prefetcher = (Prefetcher*)arg;
+  pthread_mutex_lock(&prefetcher->lock);
+  for (;;) {
+    size_t end = prefetcher->first + prefetcher->count;
+    if (prefetcher->next_read < prefetcher->first) { prefetcher->next_read = prefetcher->first; }
+    while (prefetcher->next_read < end && !needsRead(jobAt(prefetcher, prefetcher->next_read))) {
+      prefetcher->next_read++;
+    }
+    if (prefetcher->next_read < end && prefetcher->batch && isBatchable(jobAt(prefetcher, prefetcher->next_read))) {
+      readBatch(prefetcher);
+    } else if (prefetcher->next_read < end) {
+      readJob(prefetcher, prefetcher->next_read++);
+    } else if (prefetcher->walk_done || prefetcher->shutdown) {
+      break;
+    } else {
+      pthread_cond_wait(&prefetcher->ready_cond, &prefetcher->lock);
+    }
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+  return NULL;
+}
+
+/**
+ * The body of the walker thread: copy entries from the traversal into the
+ * window, waiting while it is full
+ *
+ * @param arg the Prefetcher the thread belongs to
+ * @return NULL
+ */
+static void* prefetchWalker(void* arg) {
+  Prefetcher* prefetcher = (Prefetcher*)arg;
+  TraverseEntry* entry;
+  while ((entry = traverseNext(prefetcher->traversal)) != NULL) {
+    pthread_mutex_lock(&prefetcher->lock);
+    while (prefetcher->count == prefetcher->capacity && !prefetcher->shutdown) {
+      pthread_cond_wait(&prefetcher->space_cond, &prefetcher->lock);
+    }
+    if (prefetcher->shutdown) {
+      pthread_mutex_unlock(&prefetcher->lock);
+      break;
+    }
+    PrefetchJob* job = jobAt(prefetcher, prefetcher->first + prefetcher->count);
+    /* The traversal frees its entries as it moves on, so keep a copy in the
+     * slot, reusing the memory of the slot's previous entry */
+    arenaClear(&job->arena);
+    size_t length = strlen(entry->path);
+    job->entry.path = arenaString(&job->arena, entry->path, length);
+    /* The walk may leave the entry's directory before the copy is read, so
+     * the directory is held open until the job is retired */
+    job->parent = traverseHold(prefetcher->traversal);
+    job->entry.dirfd = job->parent != NULL ? entry->dirfd : AT_FDCWD;
+    job->entry.name = job->parent != NULL ? job->entry.path + length - strlen(entry->name) : job->entry.path;
+    job->entry.st = entry->st;
+    job->entry.dir = NULL;
+    job->entry.link = entry->link;
+    job->entry.duplicate = entry->duplicate;
+    job->entry.unchanged = entry->unchanged;
+    job->state = JOB_QUEUED;
+    job->fd = -1;
+    job->read_offset = 0;
+    job->head = NULL;
+    job->tail = NULL;
+    prefetcher->count++;
+    pthread_cond_broadcast(&prefetcher->ready_cond);
+    pthread_mutex_unlock(&prefetcher->lock);
+  }
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->walk_done = 1;
+  pthread_cond_broadcast(&prefetcher->ready_cond);
+  pthread_mutex_unlock(&prefetcher->lock);
+  return NULL;
+}
+
+/**
+ * Starts a pipeline reading the files of a traversal ahead of the writer
+ *
+ * @param traversal the traversal supplying entries
+ * @param num_readers the number of reader threads
+ * @param read_ahead the most entries that may be queued ahead of the writer
+ * @param budget the most bytes that may be read but not yet written
+ * @param batch nonzero to fetch runs of small files as batches
+ * @return a pointer to the pipeline
+ */
+Prefetcher* prefetchOpen(Traversal* traversal, size_t num_readers, size_t read_ahead, size_t budget, int batch) {
+  Prefetcher* prefetcher = (Prefetcher*)safeCalloc(1, sizeof(Prefetcher));
+  prefetcher->traversal = traversal;
+  prefetcher->capacity = read_ahead > 0 ? read_ahead : 1;
+  prefetcher->jobs = (PrefetchJob*)safeCalloc(prefetcher->capacity, sizeof(PrefetchJob));
+  for (size_t i = 0; i < prefetcher->capacity; i++) { arenaInit(&prefetcher->jobs[i].arena, PATH_MAX); }
+  prefetcher->budget = budget;
+  prefetcher->batch = batch;
+  prefetcher->num_readers = num_readers;
+  prefetcher->readers = (pthread_t*)safeMalloc(num_readers * sizeof(pthread_t));
+  pthread_mutex_init(&prefetcher->lock, NULL);
+  pthread_cond_init(&prefetcher->ready_cond, NULL);
+  pthread_cond_init(&prefetcher->space_cond, NULL);
+  if (pthread_create(&prefetcher->walker, NULL, prefetchWalker, prefetcher) != 0) {
+    perror("Failed to start walker thread.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < num_readers; i++) {
+    if (pthread_create(&prefetcher->readers[i], NULL, prefetchReader, prefetcher) != 0) {
+      perror("Failed to start reader thread.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return prefetcher;
+}
+
+/**
+ * Waits for the next entry in traversal order
+ *
+ * @param prefetcher the pipeline to take from
+ * @return the next job, or NULL once the traversal is exhausted
+ */
+PrefetchJob* prefetchNext(Prefetcher* prefetcher) {
+  PrefetchJob* job = NULL;
+  pthread_mutex_lock(&prefetcher->lock);
+  while (prefetcher->count == 0 && !prefetcher->walk_done) {
+    pthread_cond_wait(&prefetcher->ready_cond, &prefetcher->lock);
+  }
+  if (prefetcher->count > 0) { job = jobAt(prefetcher, prefetcher->first); }
+  pthread_mutex_unlock(&prefetcher->lock);
+  return job;
+}
+
+/**
+ * Waits for the next chunk of the writer's file
+ *
+ * @param prefetcher the pipeline the job belongs to
+ * @param job the writer's job
+ * @return the next chunk, or NULL once the whole file has been taken
+ */
+PrefetchChunk* prefetchChunk(Prefetcher* prefetcher, PrefetchJob* job) {
+  if (!needsRead(job)) { return NULL; }
+  pthread_mutex_lock(&prefetcher->lock);
+  while (job->head == NULL && job->state != JOB_READ) {
+    pthread_cond_wait(&prefetcher->ready_cond, &prefetcher->lock);
+  }
+  PrefetchChunk* chunk = job->head;
+  if (chunk != NULL) {
+    job->head = chunk->next;
+    if (job->head == NULL) { job->tail = NULL; }
+  }
+  pthread_mutex_unlock(&prefetcher->lock);
+  return chunk;
+}
+
+/**
+ * Returns a written chunk's bytes to the budget and frees it
+ *
+ * @param prefetcher the pipeline the chunk belongs to
+ * @param chunk the chunk to release
+ */
+void prefetchRelease(Prefetcher* prefetcher, PrefetchChunk* chunk) {
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->inflight -= chunk->length;
+  pthread_cond_broadcast(&prefetcher->space_cond);
+  pthread_mutex_unlock(&prefetcher->lock);
+  safeFree(chunk);
+}
+
+/**
+ * Retires the writer's job once it has been written, freeing its slot
+ *
+ * @param prefetcher the pipeline the job belongs to
+ * @param job the writer's job
+ */
+void prefetchDone(Prefetcher* prefetcher, PrefetchJob* job) {
+  if (job->parent != NULL) { traverseRelease(prefetcher->traversal, job->parent); }
+  job->parent = NULL;
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->first++;
+  prefetcher->count--;
+  pthread_cond_broadcast(&prefetcher->space_cond);
+  pthread_mutex_unlock(&prefetcher->lock);
+}
+
+/**
+ * Stops the threads of a pipeline and frees it
+ *
+ * @param prefetcher the pipeline to close
+ */
+void prefetchClose(Prefetcher* prefetcher) {
+  pthread_mutex_lock(&prefetcher->lock);
+  prefetcher->shutdown = 1;
+  pthread_cond_broadcast(&prefetcher->ready_cond);
+  pthread_cond_broadcast(&prefetcher->space_cond);
+  pthread_mutex_unlock(&prefetcher->lock);
+  pthread_join(prefetcher->walker, NULL);
+  for (size_t i = 0; i < prefetcher->num_readers; i++) { pthread_join(prefetcher->readers[i], NULL); }
+  pthread_cond_destroy(&prefetcher->space_cond);
+  pthread_cond_destroy(&prefetcher->ready_cond);
+  pthread_mutex_destroy(&prefetcher->lock);
+  safeFree(prefetcher->readers);
+  /* Jobs the writer never retired still hold their directories */
+  for (size_t seq = prefetcher->first; seq < prefetcher->first + prefetcher->count; seq++) {
+    PrefetchJob* job = jobAt(prefetcher, seq);
+    if (job->parent != NULL) { traverseRelease(prefetcher->traversal, job->parent); }
+  }
+  for (size_t i = 0; i < prefetcher->capacity; i++) { arenaFree(&prefetcher->jobs[i].arena); }
+  safeFree(prefetcher->jobs);
+  safeFree(prefetcher);
+}
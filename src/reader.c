@@ -0,0 +1,429 @@
+/*
+ * reader.c - block-by-block access to an archive being read
+ *
+ * A regular archive is mapped, so reaching the next header costs a page fault
+ on the block holding it and the members in between are never read. Pipes and
+ other inputs fall back to a buffer that is refilled as the archive is consumed.
+ A compressed archive is recognised by its first bytes and read through a
+ decompressor into the same buffer.
+ */
+#include "../include/reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/safe_alloc.h"
+#include "../include/safe_dir.h"
+#include "../include/safe_file.h"
+#include "../include/stats.h"
+#include "../include/throttle.h"
+
+/**
+ * Reads bytes of a streamed archive, decompressing them if needed
+ *
+ * @param reader the reader to read from
+ * @param buf the buffer to read into
+ * @param count the most bytes to read
+ * @return the number of bytes read, zero at the end of the archive
+ */
+static ssize_t readSource(ArchiveReader* reader, void* buf, size_t count) {
+  if (reader->decompressor != NULL) { return decompressRead(reader->decompressor, buf, count); }
+  for (;;) {
+    STATS_START(started);
+    ssize_t r = read(reader->fd, buf, count);
+    STATS_END(STATS_READ, started, r > 0 ? r : 0);
+    if (r != FILE_ERROR) {
+      throttleIO(THROTTLE_READ, r);
+      return r;
+    }
+    if (errno != EINTR) {
+      perror("read");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/**
+ * Reads as many bytes of a streamed archive as are available, up to a count
+ *
+ * @param reader the reader to read from
+ * @param buf the buffer to read into
+ * @param count the number of bytes to read
+ * @return the number of bytes read, less than count only at the end of the
+ * archive
+ */
+static size_t readSourceFully(ArchiveReader* reader, void* buf, size_t count) {
+  size_t done = 0;
+  while (done < count) {
+    ssize_t r = readSource(reader, (unsigned char*)buf + done, count - done);
+    if (r == 0) { break; }
+    done += r;
+  }
+  return done;
+}
+
+/**
+ * Prepares an open archive for reading
+ *
+ * @param fd the file descriptor of the archive
+ * @param decompress_threads the number of threads decompressing a compressed
+ * archive
+ * @return the reader
+ */
+ArchiveReader* readerOpen(int fd, size_t decompress_threads) {
+  ArchiveReader* reader = (ArchiveReader*)safeCalloc(1, sizeof(ArchiveReader));
+  struct stat st;
+  reader->fd = fd;
+  safeFstat(fd, &st);
+  if (S_ISREG(st.st_mode) && st.st_size > 0 && (unsigned long long)st.st_size <= SIZE_MAX) {
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED && compressDetect(map, st.st_size) != COMPRESS_NONE) {
+      /* Compressed data cannot be addressed by archive offset, so the file
+       * is streamed through a decompressor instead */
+      munmap(map, st.st_size);
+    } else if (map != MAP_FAILED) {
+      /* Headers are visited far apart, so read-around would only fetch data
+       * that is skipped */
+      madvise(map, st.st_size, MADV_RANDOM);
+      reader->map = (unsigned char*)map;
+      reader->map_size = st.st_size;
+      return reader;
+    }
+  }
+  reader->seekable = lseek(fd, 0, SEEK_CUR) != FILE_ERROR;
+  reader->pipe = S_ISFIFO(st.st_mode);
+  reader->buffer = (unsigned char*)safeMalloc(READER_BUFFER_SIZE);
+  /* A stream can only be recognised by consuming its first bytes, which are
+   * then handed to the decompressor */
+  reader->buffer_end = readSourceFully(reader, reader->buffer, COMPRESS_MAGIC_SIZE);
+  int format = compressDetect(reader->buffer, reader->buffer_end);
+  if (format != COMPRESS_NONE) {
+    reader->decompressor = decompressOpen(fd, format, reader->buffer, reader->buffer_end, decompress_threads);
+    reader->buffer_end = 0;
+    reader->seekable = 0;
+    reader->pipe = 0;
+  }
+  return reader;
+}
+
+/**
+ * Makes sure the buffer of a streamed archive holds at least a number of bytes
+ *
+ * @param reader the reader to fill
+ * @param count the number of bytes needed, at most READER_BUFFER_SIZE
+ * @return nonzero if the bytes are available, zero at the end of the archive
+ */
+static int fillBuffer(ArchiveReader* reader, size_t count) {
+  if (reader->buffer_end - reader->buffer_start >= count) { return 1; }
+  memmove(reader->buffer, reader->buffer + reader->buffer_start, reader->buffer_end - reader->buffer_start);
+  reader->buffer_end -= reader->buffer_start;
+  reader->buffer_start = 0;
+  while (reader->buffer_end < count) {
+    ssize_t r = readSource(reader, reader->buffer + reader->buffer_end, READER_BUFFER_SIZE - reader->buffer_end);
+    if (r == 0) { return 0; }
+    reader->buffer_end += r;
+  }
+  return 1;
+}
+
+/**
+ * Returns the next block of an archive, which is expected to be a header
+ *
+ * @param reader the reader to take the block from
+ * @return the block, valid until the reader is next used, or NULL at the end
+ * of the archive
+ */
+const USTARHeader* readerNextHeader(ArchiveReader* reader) {
+  const USTARHeader* header;
+  if (reader->map != NULL) {
+    if (reader->offset < 0 || (size_t)reader->offset + ARCHIVE_BLOCK_SIZE > reader->map_size) { return NULL; }
+    header = (const USTARHeader*)(reader->map + reader->offset);
+  } else {
+    if (!fillBuffer(reader, ARCHIVE_BLOCK_SIZE)) { return NULL; }
+    header = (const USTARHeader*)(reader->buffer + reader->buffer_start);
+    reader->buffer_start += ARCHIVE_BLOCK_SIZE;
+  }
+  reader->offset += ARCHIVE_BLOCK_SIZE;
+  return header;
+}
+
+/**
+ * Reads the data of an auxiliary member, such as the records of a pax header,
+ * into a buffer and terminates it with a NUL
+ *
+ * @param reader the reader positioned at the data
+ * @param length the number of bytes of data
+ * @param buffer the buffer to read into, grown as needed
+ * @param capacity the capacity of the buffer
+ * @return nonzero if all of the data was read
+ */
+static int readAux(ArchiveReader* reader, size_t length, char** buffer, size_t* capacity) {
+  if (length + NULL_TERMINATOR_SIZE > *capacity) {
+    *capacity = length + NULL_TERMINATOR_SIZE;
+    *buffer = (char*)safeRealloc(*buffer, *capacity);
+  }
+  if ((size_t)readerRead(reader, *buffer, length) < length) { return 0; }
+  (*buffer)[length] = '\0';
+  readerSkip(reader, (ARCHIVE_BLOCK_SIZE - length % ARCHIVE_BLOCK_SIZE) % ARCHIVE_BLOCK_SIZE);
+  return 1;
+}
+
+/**
+ * Checks whether a member only carries metadata for the member after it
+ *
+ * @param typeflag the type of the member
+ * @return nonzero for pax headers and GNU long names
+ */
+static int isAux(char typeflag) {
+  return typeflag == PAX_EXTENDED || typeflag == PAX_GLOBAL || typeflag == GNU_LONG_NAME || typeflag == GNU_LONG_LINK;
+}
+
+/**
+ * Reads and decodes the next member header of an archive, exiting if it is
+ * damaged or, in strict mode, not plain USTAR. Pax headers and GNU long names
+ * before the member are consumed and applied to it; the names they supply
+ * stay valid until the reader is next used.
+ *
+ * @param reader the reader to take the header from
+ * @param member where to store the decoded header
+ * @param archive_name the name of the archive, for messages
+ * @param strict nonzero to reject headers that use extensions
+ * @return READER_MEMBER, READER_END or READER_TRUNCATED
+ */
+int readerNextMember(ArchiveReader* reader, ArchiveMember* member, const char* archive_name, int strict) {
+  const USTARHeader* header = readerNextHeader(reader);
+  if (header == NULL) { return READER_TRUNCATED; }
+  if (isEndBlock(header)) { return READER_END; }
+  off_t header_offset = reader->offset - ARCHIVE_BLOCK_SIZE;
+  PaxAttributes pax = {.path = NULL,
+                       .linkpath = NULL,
+                       .size = -1,
+                       .sparse_name = NULL,
+                       .sparse_size = -1,
+                       .sparse_major = -1,
+                       .sparse_minor = -1,
+                       .deleted = NULL,
+                       .duplicate = 0};
+  char* long_name = NULL;
+  char* long_link = NULL;
+  int status;
+  for (;;) {
+    STATS_START(started);
+    status = parseHeader(header, member);
+    STATS_END(STATS_HEADER, started, 0);
+    if (status == HEADER_CORRUPT) {
+      fprintf(stderr, "%s: bad header at offset %lld\n", archive_name,
+              (long long)(reader->offset - ARCHIVE_BLOCK_SIZE));
+      exit(EXIT_FAILURE);
+    }
+    if (!isAux(member->typeflag)) { break; }
+    if (strict) {
+      fprintf(stderr, "%s: %s is not a USTAR header\n", archive_name, member->path);
+      exit(EXIT_FAILURE);
+    }
+    if (member->size > PAX_RECORDS_LIMIT) {
+      fprintf(stderr, "%s: extended header at offset %lld is too large\n", archive_name,
+              (long long)(reader->offset - ARCHIVE_BLOCK_SIZE));
+      exit(EXIT_FAILURE);
+    }
+    int complete = 1;
+    if (member->typeflag == PAX_EXTENDED) {
+      complete = readAux(reader, member->size, &reader->records, &reader->records_capacity);
+      if (complete && parsePax(reader->records, member->size, &pax) != HEADER_OK) {
+        fprintf(stderr, "%s: bad extended header at offset %lld\n", archive_name, (long long)header_offset);
+        exit(EXIT_FAILURE);
+      }
+    } else if (member->typeflag == GNU_LONG_NAME) {
+      complete = readAux(reader, member->size, &reader->long_name, &reader->long_name_capacity);
+      long_name = reader->long_name;
+    } else if (member->typeflag == GNU_LONG_LINK) {
+      complete = readAux(reader, member->size, &reader->long_link, &reader->long_link_capacity);
+      long_link = reader->long_link;
+    } else {
+      /* Of the global records, only the list of removed paths is used */
+      PaxAttributes global = {.deleted = NULL};
+      complete = readAux(reader, member->size, &reader->global, &reader->global_capacity);
+      if (complete && parsePax(reader->global, member->size, &global) != HEADER_OK) {
+        fprintf(stderr, "%s: bad global header at offset %lld\n", archive_name, (long long)header_offset);
+        exit(EXIT_FAILURE);
+      }
+      reader->deleted = complete ? global.deleted : NULL;
+    }
+    if (!complete) { return READER_TRUNCATED; }
+    header = readerNextHeader(reader);
+    if (header == NULL) { return READER_TRUNCATED; }
+    /* Global records may close an archive, but other headers need a member */
+    if (isEndBlock(header)) { return member->typeflag == PAX_GLOBAL ? READER_END : READER_TRUNCATED; }
+    /* Global records belong to the archive rather than the member after them */
+    if (member->typeflag == PAX_GLOBAL) { header_offset = reader->offset - ARCHIVE_BLOCK_SIZE; }
+  }
+  member->header_offset = header_offset;
+  if (status != HEADER_OK && strict) {
+    fprintf(stderr, "%s: %s is not a USTAR header\n", archive_name, member->path);
+    exit(EXIT_FAILURE);
+  }
+  /* Pax records take precedence over GNU long names, as in GNU tar */
+  if (long_name != NULL) { member->path = long_name; }
+  if (long_link != NULL) { member->linkname = long_link; }
+  if (pax.path != NULL) { member->path = pax.path; }
+  if (pax.linkpath != NULL) { member->linkname = pax.linkpath; }
+  if (pax.size >= 0) { member->size = pax.size; }
+  member->duplicate = pax.duplicate;
+  /* Only the 1.0 sparse format keeps its map with the data, where it is read */
+  if (pax.sparse_major == 1 && pax.sparse_minor == 0 && pax.sparse_name != NULL && pax.sparse_size >= 0) {
+    member->path = pax.sparse_name;
+    member->sparse_size = pax.sparse_size;
+  }
+  return READER_MEMBER;
+}
+
+/**
+ * Checks whether a reader can move to an arbitrary offset
+ *
+ * @param reader the reader to check
+ * @return nonzero if readerSeek may be used
+ */
+int readerCanSeek(const ArchiveReader* reader) { return reader->map != NULL || reader->seekable; }
+
+/**
+ * Moves a seekable reader to an offset in the archive
+ *
+ * @param reader the reader to move
+ * @param offset the offset of the next block to read
+ */
+void readerSeek(ArchiveReader* reader, off_t offset) {
+  reader->offset = offset;
+  if (reader->map != NULL) { return; }
+  reader->buffer_start = 0;
+  reader->buffer_end = 0;
+  if (lseek(reader->fd, offset, SEEK_SET) == FILE_ERROR) {
+    perror("lseek");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Reads bytes from an archive into a buffer
+ *
+ * @param reader the reader to read from
+ * @param buf the buffer to read into
+ * @param count the number of bytes to read
+ * @return the number of bytes read, less than count only at the end of the
+ * archive
+ */
+ssize_t readerRead(ArchiveReader* reader, void* buf, size_t count) {
+  size_t done = 0;
+  if (reader->map != NULL) {
+    if ((size_t)reader->offset < reader->map_size) {
+      done = reader->map_size - reader->offset < count ? reader->map_size - reader->offset : count;
+      memcpy(buf, reader->map + reader->offset, done);
+    }
+  } else {
+    size_t buffered = reader->buffer_end - reader->buffer_start;
+    done = buffered < count ? buffered : count;
+    memcpy(buf, reader->buffer + reader->buffer_start, done);
+    reader->buffer_start += done;
+    if (done < count) { done += readSourceFully(reader, (unsigned char*)buf + done, count - done); }
+  }
+  reader->offset += done;
+  return done;
+}
+
+/**
+ * Copies bytes from an archive to a file descriptor. Data coming straight
+ * from a pipe is spliced once the buffered bytes are written.
+ *
+ * @param reader the reader to read from
+ * @param outfd the file descriptor to write to
+ * @param count the number of bytes to copy
+ * @return the number of bytes copied, less than count only at the end of the
+ * archive
+ */
+off_t readerCopy(ArchiveReader* reader, int outfd, off_t count) {
+  off_t done = 0;
+  if (reader->map == NULL) {
+    size_t buffered = reader->buffer_end - reader->buffer_start;
+    done = (off_t)buffered < count ? (off_t)buffered : count;
+    safeWrite(outfd, reader->buffer + reader->buffer_start, done);
+    reader->buffer_start += done;
+    reader->offset += done;
+    if (reader->pipe && done < count) {
+      off_t spliced = safeSplice(reader->fd, outfd, count - done);
+      reader->offset += spliced;
+      return done + spliced;
+    }
+  }
+  while (done < count) {
+    size_t chunk = count - done < READER_BUFFER_SIZE ? (size_t)(count - done) : READER_BUFFER_SIZE;
+    unsigned char* data = reader->map != NULL ? reader->map + reader->offset : reader->buffer;
+    if (reader->map != NULL) {
+      if ((size_t)reader->offset >= reader->map_size) { break; }
+      if (chunk > reader->map_size - reader->offset) { chunk = reader->map_size - reader->offset; }
+    } else {
+      chunk = readSourceFully(reader, reader->buffer, chunk);
+    }
+    if (chunk == 0) { break; }
+    safeWrite(outfd, data, chunk);
+    reader->offset += chunk;
+    done += chunk;
+  }
+  return done;
+}
+
+/**
+ * Moves past bytes of an archive without reading them where possible
+ *
+ * @param reader the reader to advance
+ * @param count the number of bytes to skip
+ */
+void readerSkip(ArchiveReader* reader, off_t count) {
+  if (reader->map != NULL) {
+    reader->offset += count;
+    return;
+  }
+  size_t buffered = reader->buffer_end - reader->buffer_start;
+  size_t from_buffer = (off_t)buffered < count ? buffered : (size_t)count;
+  reader->buffer_start += from_buffer;
+  reader->offset += from_buffer;
+  count -= from_buffer;
+  if (count == 0) { return; }
+  if (reader->seekable) {
+    reader->offset += count;
+    if (lseek(reader->fd, count, SEEK_CUR) == FILE_ERROR) {
+      perror("lseek");
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+  /* A pipe or a compressed archive can only be skipped by draining it */
+  while (count > 0) {
+    size_t chunk = count < READER_BUFFER_SIZE ? (size_t)count : READER_BUFFER_SIZE;
+    size_t r = readSourceFully(reader, reader->buffer, chunk);
+    reader->offset += r;
+    count -= r;
+    if (r < chunk) { return; }
+  }
+}
+
+/**
+ * Releases a reader; the archive itself is left open
+ *
+ * @param reader the reader to release
+ */
+void readerClose(ArchiveReader* reader) {
+  if (reader->map != NULL) { munmap(reader->map, reader->map_size); }
+  if (reader->decompressor != NULL) { decompressClose(reader->decompressor); }
+  safeFree(reader->records);
+  safeFree(reader->long_name);
+  safeFree(reader->long_link);
+  safeFree(reader->global);
+  safeFree(reader->buffer);
+  safeFree(reader);
+}
@@ -11,8 +11,12 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 
+/* Fails to compile if arena data would not start aligned after its block header */
+typedef char ArenaBlockSizeCheck[(sizeof(ArenaBlock) % ARENA_ALIGNMENT == 0) ? 1 : -1];
+
 /**
  * A safe version of malloc that validates memory allocation and exits on
  failure
@@ -59,6 +63,22 @@ void* safeCalloc(size_t nmemb, size_t size) {
   return ptr;
 }
 
+/**
+ * A safe version of posix_memalign that validates memory allocation and exits
+ on failure
+ * @param alignment the alignment of the memory in bytes, a power of two
+ * @param size the number of bytes to allocate in the heap
+ * @return a pointer to the successfully allocated memory
+ */
+void* safeAlignedAlloc(size_t alignment, size_t size) {
+  void* ptr;
+  if (posix_memalign(&ptr, alignment, size) != 0) {
+    perror("Memory allocation error.\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
 /**
  * A safe version of free that validates memory allocation and exits on failure
  * @param ptr a pointer to the memory to free
@@ -69,3 +89,111 @@ void safeFree(void* ptr) {
     ptr = NULL;
   }
 }
+
+/**
+ * Prepares an empty arena; no memory is allocated until it is first used
+ *
+ * @param arena the arena to prepare
+ * @param block_size the smallest size of a block, 0 for ARENA_BLOCK_SIZE
+ */
+void arenaInit(Arena* arena, size_t block_size) {
+  arena->first = NULL;
+  arena->current = NULL;
+  arena->block_size = block_size > 0 ? block_size : ARENA_BLOCK_SIZE;
+}
+
+/**
+ * Allocates memory from an arena by bumping a pointer. Blocks left behind by
+ * arenaReset are reused before new ones are allocated.
+ *
+ * @param arena the arena to allocate from
+ * @param size the number of bytes to allocate
+ * @return a pointer to the memory, aligned to ARENA_ALIGNMENT and valid until
+ * the arena is reset past it or freed
+ */
+void* arenaAlloc(Arena* arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  ArenaBlock* block = arena->current;
+  if (block == NULL || block->size - block->used < size) {
+    ArenaBlock* next = block != NULL ? block->next : arena->first;
+    if (next == NULL || next->size < size) {
+      /* Insert a fresh block, keeping any smaller spare ones after it */
+      size_t block_size = size > arena->block_size ? size : arena->block_size;
+      ArenaBlock* fresh = (ArenaBlock*)safeMalloc(sizeof(ArenaBlock) + block_size);
+      fresh->next = next;
+      fresh->size = block_size;
+      if (block != NULL) {
+        block->next = fresh;
+      } else {
+        arena->first = fresh;
+      }
+      next = fresh;
+    }
+    next->used = 0;
+    arena->current = block = next;
+  }
+  void* ptr = (unsigned char*)(block + 1) + block->used;
+  block->used += size;
+  return ptr;
+}
+
+/**
+ * Copies a string into an arena
+ *
+ * @param arena the arena to allocate from
+ * @param str the string to copy
+ * @param length the length of the string
+ * @return the null-terminated copy
+ */
+char* arenaString(Arena* arena, const char* str, size_t length) {
+  char* copy = (char*)arenaAlloc(arena, length + 1);
+  memcpy(copy, str, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+/**
+ * Records the current position of an arena
+ *
+ * @param arena the arena to mark
+ * @return the mark, to be passed to arenaReset
+ */
+ArenaMark arenaMark(const Arena* arena) {
+  ArenaMark mark = {arena->current, arena->current != NULL ? arena->current->used : 0};
+  return mark;
+}
+
+/**
+ * Releases every allocation made since a mark in constant time. The blocks
+ * stay with the arena for later allocations.
+ *
+ * @param arena the arena to reset
+ * @param mark a mark of the arena taken earlier
+ */
+void arenaReset(Arena* arena, ArenaMark mark) {
+  arena->current = mark.block;
+  if (mark.block != NULL) { mark.block->used = mark.used; }
+}
+
+/**
+ * Releases every allocation of an arena in constant time, keeping its blocks
+ *
+ * @param arena the arena to clear
+ */
+void arenaClear(Arena* arena) { arena->current = NULL; }
+
+/**
+ * Frees every block of an arena, leaving it empty and ready for reuse
+ *
+ * @param arena the arena to free
+ */
+void arenaFree(Arena* arena) {
+  ArenaBlock* block = arena->first;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    safeFree(block);
+    block = next;
+  }
+  arena->first = NULL;
+  arena->current = NULL;
+}
@@ -13,11 +13,36 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "safe_alloc.h"
+#include "stats.h"
+
+/* The fields of a status the archive uses; the rest are not asked for */
+static const unsigned int stat_fields = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_MTIME |
+                                        STATX_CTIME | STATX_INO | STATX_SIZE | STATX_BLOCKS;
+
+/* The magic numbers of network file systems, whose cached status is trusted
+ * rather than fetched again from the server */
+static const long remote_magics[] = {
+    0x6969,     /* NFS */
+    0x517B,     /* SMB */
+    0xFF534D42, /* CIFS */
+    0xFE534D42, /* SMB2 */
+    0x00C36400, /* Ceph */
+    0x5346414F, /* AFS */
+    0x73757245, /* Coda */
+    0x01021997, /* 9P */
+};
+
+/* Set once statx has been found missing, so that fstatat is used instead */
+static int statx_unsupported = 0;
 
 /**
  * A safe version of opendir that validates the directory stream and exits on
@@ -47,24 +72,89 @@ DIR* safeOpenDir(const char* path) {
 }
 
 /**
- * A safe version of readdir that validates the directory contents and exits on
- * failure
+ * Opens a directory relative to another, so that only its own name has to be
+ * resolved, and exits on failure. Symbolic links are not followed.
  *
- * @param dir The directory stream to read from.
- * @return A pointer to the directory contents.
+ * @param dirfd The directory the name is relative to, or AT_FDCWD.
+ * @param name The name of the directory to open.
+ * @return A file descriptor for the directory.
  */
-DirContent* safeReadDir(DIR* dir) {
-  DirContent* dir_contents = safeMalloc(sizeof(DirContent));
-  dir_contents->entries = NULL;
-  dir_contents->num_entries = 0;
-  struct dirent* entry;
-  while ((entry = readdir(dir)) != NULL) {
-    dir_contents->entries =
-        (struct dirent**)safeRealloc(dir_contents->entries, (dir_contents->num_entries + 1) * sizeof(struct dirent*));
+int safeOpenDirAt(int dirfd, const char* name) {
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == DIR_ERROR) {
+    if (errno == ENOENT) {
+      perror("Directory does not exist.\n");
+    } else if (errno == EACCES) {
+      perror("Permission denied.\n");
+    } else {
+      perror("Failed to open directory.\n");
+    }
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
 
-    dir_contents->entries[dir_contents->num_entries] = entry;
+/**
+ * Checks whether a directory lives on a network file system
+ *
+ * @param fd A file descriptor for the directory.
+ * @return Nonzero if the directory is on a network file system.
+ */
+int safeDirRemote(int fd) {
+  struct statfs fs;
+  if (fstatfs(fd, &fs) == DIR_ERROR) { return 0; }
+  for (size_t i = 0; i < sizeof(remote_magics) / sizeof(remote_magics[0]); i++) {
+    if ((unsigned long)fs.f_type == (unsigned long)remote_magics[i]) { return 1; }
+  }
+  return 0;
+}
+
+/**
+ * Reads every entry of a directory in large getdents64 batches. The records
+ * are kept packed in one buffer that doubles as it fills, so a directory of
+ * any size is read in linear time, and the type and inode number of each
+ * entry are kept.
+ *
+ * @param fd A file descriptor for the directory to read.
+ * @param arena The arena the contents are allocated from.
+ * @return A pointer to the directory contents, valid until the arena is reset.
+ */
+DirContent* safeReadDir(int fd, Arena* arena) {
+  size_t capacity = DIR_READ_SIZE, used = 0;
+  unsigned char* buffer = (unsigned char*)arenaAlloc(arena, capacity);
+  for (;;) {
+    if (capacity - used < DIR_RECORD_MAX) {
+      /* The old buffer stays in the arena until it is reset */
+      unsigned char* larger = (unsigned char*)arenaAlloc(arena, capacity * 2);
+      memcpy(larger, buffer, used);
+      buffer = larger;
+      capacity *= 2;
+    }
+    long n = syscall(SYS_getdents64, fd, buffer + used, capacity - used);
+    if (n == DIR_ERROR && errno == EINTR) { continue; }
+    if (n == DIR_ERROR) {
+      perror("Failed to read directory.\n");
+      exit(EXIT_FAILURE);
+    }
+    if (n == 0) { break; }
+    used += n;
+  }
+  DirContent* dir_contents = (DirContent*)arenaAlloc(arena, sizeof(DirContent));
+  dir_contents->num_entries = 0;
+  dir_contents->names_length = 0;
+  for (size_t offset = 0; offset < used; offset += ((DirRecord*)(buffer + offset))->d_reclen) {
     dir_contents->num_entries++;
   }
+  dir_contents->entries = (DirEntry*)arenaAlloc(arena, dir_contents->num_entries * sizeof(DirEntry));
+  size_t i = 0;
+  for (size_t offset = 0; offset < used; i++) {
+    const DirRecord* record = (const DirRecord*)(buffer + offset);
+    dir_contents->entries[i].inode = record->d_ino;
+    dir_contents->entries[i].type = record->d_type;
+    dir_contents->entries[i].name = record->d_name;
+    dir_contents->names_length += strlen(record->d_name);
+    offset += record->d_reclen;
+  }
   return dir_contents;
 }
 
@@ -120,10 +210,60 @@ void safeFstat(int filedes, struct stat* buf) {
  * @param buf The buffer to store the file status in.
  */
 void safeLstat(const char* path, struct stat* buf) {
+  STATS_START(started);
   if (lstat(path, buf) == DIR_ERROR) {
     perror("Failed to stat file.\n");
     exit(EXIT_FAILURE);
   }
+  STATS_END(STATS_STAT, started, 0);
+}
+
+/**
+ * Stats a file relative to a directory, so that the cost does not grow with
+ * the depth of the directory, and exits on failure. Symbolic links are not
+ * followed. Only the fields the archive uses are asked for, and on a network
+ * file system the status the client has cached is accepted as it is.
+ *
+ * @param dirfd The directory the name is relative to, or AT_FDCWD.
+ * @param name The name of the file to stat.
+ * @param buf The buffer to store the file status in.
+ * @param remote Nonzero if the directory is on a network file system.
+ */
+void safeStatAt(int dirfd, const char* name, struct stat* buf, int remote) {
+  STATS_START(started);
+  struct statx stx;
+  int flags = AT_SYMLINK_NOFOLLOW | (remote ? AT_STATX_DONT_SYNC : AT_STATX_SYNC_AS_STAT);
+  int status = statx_unsupported ? DIR_ERROR : statx(dirfd, name, flags, stat_fields, &stx);
+  if (status == DIR_ERROR && (statx_unsupported || errno == ENOSYS)) {
+    /* Kernels older than statx get the whole status */
+    statx_unsupported = 1;
+    if (fstatat(dirfd, name, buf, AT_SYMLINK_NOFOLLOW) == DIR_ERROR) {
+      perror("Failed to stat file.\n");
+      exit(EXIT_FAILURE);
+    }
+    STATS_END(STATS_STAT, started, 0);
+    return;
+  }
+  if (status == DIR_ERROR) {
+    perror("Failed to stat file.\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(buf, 0, sizeof(*buf));
+  buf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  buf->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+  buf->st_ino = stx.stx_ino;
+  buf->st_mode = stx.stx_mode;
+  buf->st_nlink = stx.stx_nlink;
+  buf->st_uid = stx.stx_uid;
+  buf->st_gid = stx.stx_gid;
+  buf->st_size = (off_t)stx.stx_size;
+  buf->st_blksize = stx.stx_blksize;
+  buf->st_blocks = (blkcnt_t)stx.stx_blocks;
+  buf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+  buf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+  buf->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+  buf->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+  STATS_END(STATS_STAT, started, 0);
 }
 
 /**
@@ -139,16 +279,6 @@ void safeChdir(char* path) {
   }
 }
 
-/**
- * Frees the memory allocated for DirContent
- *
- * @param dir_contents The DirContent to free.
- */
-void freeDirContent(DirContent* dir_contents) {
-  safeFree(dir_contents->entries);
-  safeFree(dir_contents);
-}
-
 /**
  * A safe version of getcwd that validates the current working directory and
  * exits on failsure
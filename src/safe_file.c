@@ -8,12 +8,41 @@
  */
 #include "../include/safe_file.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 
+#include "../include/compress.h"
 #include "../include/safe_alloc.h"
+#include "../include/stats.h"
+#include "../include/throttle.h"
+#include "../include/uring.h"
+
+/* Set once the kernel has told us an in-kernel copy is not possible, so that
+ * every later file goes straight to the next strategy */
+static int copy_file_range_unsupported = 0;
+static int sendfile_unsupported = 0;
+
+/* Whether batches go through io_uring, and the key owning each thread's ring */
+static int uring_enabled = 0;
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+
+/* Each thread's ring: unset until first used, then ready or unavailable */
+static __thread Uring* thread_ring = NULL;
+static __thread int thread_ring_failed = 0;
+
+/* Whether file pages are dropped from the page cache once they are used */
+static int drop_caches = 0;
+
+/* The reusable buffer used when the kernel cannot copy on our behalf */
+static __thread unsigned char copy_buffer[COPY_BUFFER_SIZE];
 
 /**
  * A safe version of fopen that validates file opening and exits on failure
@@ -32,42 +61,242 @@ int safeOpen(char* filename, int flags, mode_t mode) {
 }
 
 /**
- * Opens a file and stores the contents in a FileContent
+ * A safe version of openat that opens a file relative to a directory, so that
+ * only its own name has to be resolved, and exits on failure
  *
- * @param fd the file pointer to read from
+ * @param dirfd the directory the name is relative to, or AT_FDCWD
+ * @param name the name of the file to open
+ * @param flags the flags to open the file with
+ * @param mode the mode to create the file with
+ * @return a file descriptor to the successfully opened file
  */
-FileContent* safeRead(int fd) {
-  struct stat file_info;
-  if (fstat(fd, &file_info) == FILE_ERROR) {
-    perror("Error getting file information.\n");
-    close(fd);
+int safeOpenAt(int dirfd, const char* name, int flags, mode_t mode) {
+  int fd = openat(dirfd, name, flags, mode);
+  if (fd == FILE_ERROR) {
+    perror("Error opening file.\n");
     exit(EXIT_FAILURE);
-  } else {
-    FileContent* file_content = (FileContent*)safeCalloc(sizeof(FileContent), 1);
-    file_content->file_size = file_info.st_size;
-    file_content->file_contents = (unsigned char*)safeCalloc(sizeof(unsigned char), file_content->file_size);
-    if (read(fd, file_content->file_contents, file_content->file_size) == FILE_ERROR) {
+  }
+  return fd;
+}
+
+/**
+ * A safe version of read that keeps reading until the buffer is full or the
+ * end of the file is reached, and exits on failure
+ *
+ * @param fd the file descriptor to read from
+ * @param buf the buffer to read into
+ * @param count the number of bytes to read
+ * @return the number of bytes read, which is only less than count at the end
+ * of the file
+ */
+ssize_t safeRead(int fd, void* buf, size_t count) {
+  STATS_START(started);
+  size_t total = 0;
+  while (total < count) {
+    ssize_t r = read(fd, (unsigned char*)buf + total, count - total);
+    if (r == FILE_ERROR) {
+      if (errno == EINTR) { continue; }
       perror("Error reading file.\n");
-      freeFileContent(file_content);
-      close(fd);
       exit(EXIT_FAILURE);
-    } else {
-      return file_content;
+    } else if (r == 0) {
+      break;
     }
+    total += r;
   }
+  STATS_END(STATS_READ, started, total);
+  throttleIO(THROTTLE_READ, total);
+  return total;
 }
 
 /**
- * A safe version of write that validates writing to files and exits on failure
- * @param path the path to the file to open
- * @param mode the mode to open the file in
- * @return a pointer to the successfully opened file
+ * A safe version of write that retries short writes until every byte has been
+ * written and exits on failure
+ *
+ * @param fd the file descriptor to write to
+ * @param buf the buffer to write from
+ * @param count the number of bytes to write
  */
-void safeWrite(int fd, void* buf, size_t count) {
-  if (write(fd, buf, count) == FILE_ERROR) {
-    perror("Error writing to file.\n");
-    exit(EXIT_FAILURE);
+void safeWrite(int fd, const void* buf, size_t count) {
+  STATS_START(started);
+  size_t total = 0;
+  while (total < count) {
+    ssize_t w = write(fd, (const unsigned char*)buf + total, count - total);
+    if (w == FILE_ERROR) {
+      if (errno == EINTR) { continue; }
+      perror("Error writing to file.\n");
+      exit(EXIT_FAILURE);
+    }
+    total += w;
+  }
+  STATS_END(STATS_WRITE, started, total);
+  throttleIO(THROTTLE_WRITE, total);
+}
+
+/**
+ * Checks whether an in-kernel copy failed because the pair of files does not
+ * support it, as opposed to a genuine I/O error
+ *
+ * @param err the errno left behind by the failed copy
+ * @return nonzero if the caller should fall back to another strategy
+ */
+static int isCopyUnsupported(int err) {
+  return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EBADF || err == ESPIPE;
+}
+
+/**
+ * Pays the read and the write budgets for bytes the kernel copied
+ *
+ * @param count the number of bytes copied
+ */
+static void throttleCopied(ssize_t count) {
+  throttleIO(THROTTLE_READ, count);
+  throttleIO(THROTTLE_WRITE, count);
+}
+
+/**
+ * Copies bytes from one file descriptor to another starting at their current
+ * offsets. The kernel is asked to move the data without a user-space copy
+ * (copy_file_range, then sendfile), falling back to a fixed-size buffer so
+ * that memory use is independent of the number of bytes copied. Exits on
+ * failure.
+ *
+ * @param infd the file descriptor to copy from
+ * @param outfd the file descriptor to copy to
+ * @param count the number of bytes to copy
+ * @return the number of bytes copied, which is only less than count if the
+ * input ended early
+ */
+off_t safeCopy(int infd, int outfd, off_t count) {
+  off_t total = 0;
+  while (total < count && !copy_file_range_unsupported) {
+    STATS_START(started);
+    ssize_t c = copy_file_range(infd, NULL, outfd, NULL, throttleChunk(count - total), 0);
+    STATS_END(STATS_COPY, started, c > 0 ? c : 0);
+    if (c == FILE_ERROR) {
+      if (errno == EINTR) { continue; }
+      /* Nothing has been written yet, so another strategy can take over */
+      if (total == 0 && isCopyUnsupported(errno)) {
+        copy_file_range_unsupported = errno != EXDEV;
+        break;
+      }
+      perror("Error copying file.\n");
+      exit(EXIT_FAILURE);
+    } else if (c == 0) {
+      return total;
+    }
+    total += c;
+    throttleCopied(c);
+  }
+  while (total < count && !sendfile_unsupported) {
+    STATS_START(started);
+    ssize_t c = sendfile(outfd, infd, NULL, throttleChunk(count - total));
+    STATS_END(STATS_COPY, started, c > 0 ? c : 0);
+    if (c == FILE_ERROR) {
+      if (errno == EINTR || errno == EAGAIN) { continue; }
+      if (total == 0 && isCopyUnsupported(errno)) {
+        sendfile_unsupported = 1;
+        break;
+      }
+      perror("Error copying file.\n");
+      exit(EXIT_FAILURE);
+    } else if (c == 0) {
+      return total;
+    }
+    total += c;
+    throttleCopied(c);
   }
+  while (total < count) {
+    size_t chunk = (count - total) < COPY_BUFFER_SIZE ? (size_t)(count - total) : COPY_BUFFER_SIZE;
+    ssize_t r = safeRead(infd, copy_buffer, chunk);
+    if (r == 0) { break; }
+    safeWrite(outfd, copy_buffer, r);
+    total += r;
+  }
+  return total;
+}
+
+/**
+ * Copies bytes between file descriptors when one of them is a pipe, letting
+ * splice move the pages without a user-space copy. Falls back to safeCopy
+ * if the kernel cannot splice the pair.
+ *
+ * @param infd the file descriptor to copy from
+ * @param outfd the file descriptor to copy to
+ * @param count the number of bytes to copy
+ * @return the number of bytes copied, which is only less than count if the
+ * input ended early
+ */
+off_t safeSplice(int infd, int outfd, off_t count) {
+  off_t total = 0;
+  while (total < count) {
+    size_t chunk = (count - total) < SPLICE_CHUNK_SIZE ? (size_t)(count - total) : SPLICE_CHUNK_SIZE;
+    STATS_START(started);
+    ssize_t c = splice(infd, NULL, outfd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+    STATS_END(STATS_COPY, started, c > 0 ? c : 0);
+    if (c == FILE_ERROR) {
+      if (errno == EINTR) { continue; }
+      if (total == 0 && isCopyUnsupported(errno)) { return safeCopy(infd, outfd, count); }
+      perror("Error copying file.\n");
+      exit(EXIT_FAILURE);
+    } else if (c == 0) {
+      break;
+    }
+    total += c;
+    throttleCopied(c);
+  }
+  return total;
+}
+
+/**
+ * Copies bytes from a fixed offset of one file to the current offset of
+ * another. The offset of the input is not moved, so several threads may copy
+ * out of the same file at once. Exits on failure.
+ *
+ * @param infd the file descriptor to copy from
+ * @param offset the offset in the input to start at
+ * @param outfd the file descriptor to copy to
+ * @param count the number of bytes to copy
+ * @return the number of bytes copied, which is only less than count if the
+ * input ended early
+ */
+off_t safeCopyAt(int infd, off_t offset, int outfd, off_t count) {
+  off_t total = 0;
+  while (total < count && !copy_file_range_unsupported) {
+    loff_t in_offset = offset + total;
+    STATS_START(started);
+    ssize_t c = copy_file_range(infd, &in_offset, outfd, NULL, throttleChunk(count - total), 0);
+    STATS_END(STATS_COPY, started, c > 0 ? c : 0);
+    if (c == FILE_ERROR) {
+      if (errno == EINTR) { continue; }
+      if (total == 0 && isCopyUnsupported(errno)) {
+        copy_file_range_unsupported = errno != EXDEV;
+        break;
+      }
+      perror("Error copying file.\n");
+      exit(EXIT_FAILURE);
+    } else if (c == 0) {
+      return total;
+    }
+    total += c;
+    throttleCopied(c);
+  }
+  while (total < count) {
+    size_t chunk = (count - total) < COPY_BUFFER_SIZE ? (size_t)(count - total) : COPY_BUFFER_SIZE;
+    STATS_START(started);
+    ssize_t r = pread(infd, copy_buffer, chunk, offset + total);
+    STATS_END(STATS_READ, started, r > 0 ? r : 0);
+    if (r == FILE_ERROR) {
+      if (errno == EINTR) { continue; }
+      perror("Error reading file.\n");
+      exit(EXIT_FAILURE);
+    } else if (r == 0) {
+      break;
+    }
+    throttleIO(THROTTLE_READ, r);
+    safeWrite(outfd, copy_buffer, r);
+    total += r;
+  }
+  return total;
 }
 
 /**
@@ -82,11 +311,580 @@ void safeClose(int fd) {
 }
 
 /**
- * Frees the memory allocated for FileContent
+ * Tears down a thread's ring when the thread exits
+ *
+ * @param ring the ring owned by the exiting thread
+ */
+static void freeThreadRing(void* ring) {
+  uringExit((Uring*)ring);
+  safeFree(ring);
+}
+
+/**
+ * Creates the key that tears down rings at thread exit
+ */
+static void createUringKey(void) { pthread_key_create(&uring_key, freeThreadRing); }
+
+/**
+ * Returns the calling thread's ring, setting it up on first use
+ *
+ * @return the ring, or NULL if batches must use blocking calls
+ */
+static Uring* threadRing(void) {
+  static const int opcodes[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+  if (!uring_enabled || thread_ring_failed) { return NULL; }
+  if (thread_ring == NULL) {
+    Uring* ring = (Uring*)safeMalloc(sizeof(Uring));
+    if (uringInit(ring, URING_ENTRIES) != 0) {
+      safeFree(ring);
+      thread_ring_failed = 1;
+      return NULL;
+    }
+    if (!uringSupports(ring, opcodes, sizeof(opcodes) / sizeof(*opcodes))) {
+      freeThreadRing(ring);
+      thread_ring_failed = 1;
+      return NULL;
+    }
+    pthread_once(&uring_once, createUringKey);
+    pthread_setspecific(uring_key, ring);
+    thread_ring = ring;
+  }
+  return thread_ring;
+}
+
+/**
+ * Turns the io_uring backend for batches on or off. Threads that cannot set up
+ * a ring fall back to blocking calls on their own.
+ *
+ * @param enable nonzero to submit batches through io_uring
+ * @return nonzero if io_uring is available to the calling thread
+ */
+int safeUseUring(int enable) {
+  uring_enabled = enable;
+  return threadRing() != NULL;
+}
+
+/**
+ * Turns dropping used file pages from the page cache on or off, so that a run
+ * over a large tree does not evict everything else the host has cached
+ *
+ * @param enable nonzero to drop pages once they are used
+ */
+void safeDropCaches(int enable) { drop_caches = enable; }
+
+/**
+ * Drops the cached pages of a range of a file that has been read, if pages
+ * are being dropped
+ *
+ * @param fd the file descriptor of the file
+ * @param offset the start of the range
+ * @param length the length of the range, or 0 for the rest of the file
+ */
+void safeDropCache(int fd, off_t offset, off_t length) {
+  if (!drop_caches) { return; }
+  /* A page is only dropped if the range covers all of it, and large pages
+   * can straddle the end of the previous range */
+  off_t back = offset > DROP_CACHE_OVERLAP ? DROP_CACHE_OVERLAP : offset;
+  posix_fadvise(fd, offset - back, length == 0 ? 0 : length + back, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * Writes a range of a file back to the disk and drops its cached pages, if
+ * pages are being dropped. Dirty pages cannot be dropped, so the range is
+ * written back first.
+ *
+ * @param fd the file descriptor of the file
+ * @param offset the start of the range
+ * @param length the length of the range, or 0 for the rest of the file
+ */
+void safeDropWritten(int fd, off_t offset, off_t length) {
+  if (!drop_caches) { return; }
+  sync_file_range(fd, offset, length,
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+  safeDropCache(fd, offset, length);
+}
+
+/**
+ * Submits one operation per request through the calling thread's ring and
+ * stores each completion's result in its request
+ *
+ * @param requests the requests to submit
+ * @param count the number of requests
+ * @param opcode the IORING_OP_ value of the operation
+ * @return 0 if the ring ran the batch, -1 if the caller must use blocking calls
+ */
+static int submitBatch(FileRequest* requests, size_t count, int opcode) {
+  Uring* ring = threadRing();
+  if (ring == NULL) { return FILE_ERROR; }
+  for (size_t base = 0; base < count; base += ring->sq_entries) {
+    size_t n = (count - base) < ring->sq_entries ? (count - base) : ring->sq_entries;
+    for (size_t i = 0; i < n; i++) {
+      FileRequest* request = &requests[base + i];
+      struct io_uring_sqe* sqe = uringGetSqe(ring);
+      sqe->opcode = opcode;
+      sqe->user_data = base + i;
+      if (opcode == IORING_OP_OPENAT) {
+        sqe->fd = request->dirfd;
+        sqe->addr = (uintptr_t)request->path;
+        sqe->len = request->mode;
+        sqe->open_flags = request->flags;
+      } else if (opcode == IORING_OP_CLOSE) {
+        sqe->fd = request->fd;
+      } else {
+        sqe->fd = request->fd;
+        sqe->addr = (uintptr_t)request->buf;
+        sqe->len = request->count;
+        sqe->off = request->offset;
+      }
+    }
+    if (uringSubmit(ring, n) == FILE_ERROR) {
+      perror("Error submitting to io_uring.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t reaped = 0; reaped < n;) {
+      struct io_uring_cqe* cqe = uringPeek(ring);
+      if (cqe == NULL) {
+        uringSubmit(ring, 1);
+        continue;
+      }
+      requests[cqe->user_data].result = cqe->res;
+      uringSeen(ring);
+      reaped++;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Reports the failure of a batched operation and exits
+ *
+ * @param result the negated errno of the operation
+ * @param message the message to print
+ */
+static void batchFailure(ssize_t result, const char* message) {
+  errno = -result;
+  perror(message);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Opens many files at once, storing each file descriptor in its request. A
+ * request that fails because its O_EXCL file exists gets FILE_ERROR, so that
+ * the caller can clear the path and open it again; any other failure exits.
+ *
+ * @param requests the requests holding the directories, paths, flags and modes
+ * @param count the number of requests
+ */
+void safeOpenBatch(FileRequest* requests, size_t count) {
+  if (submitBatch(requests, count, IORING_OP_OPENAT) == FILE_ERROR) {
+    for (size_t i = 0; i < count; i++) {
+      FileRequest* request = &requests[i];
+      request->fd = openat(request->dirfd, request->path, request->flags, request->mode);
+      request->result = request->fd != FILE_ERROR ? request->fd : -errno;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (requests[i].result == -EEXIST && (requests[i].flags & O_EXCL)) {
+      requests[i].fd = FILE_ERROR;
+      continue;
+    }
+    if (requests[i].result < 0) { batchFailure(requests[i].result, "Error opening file.\n"); }
+    requests[i].fd = requests[i].result;
+  }
+}
+
+/**
+ * Reads from many files at once, at each request's offset. Each result is
+ * only less than the requested count if the file ended first.
+ *
+ * @param requests the requests holding the file descriptors and buffers
+ * @param count the number of requests
+ */
+void safeReadBatch(FileRequest* requests, size_t count) {
+  STATS_START(started);
+  int batched = submitBatch(requests, count, IORING_OP_READ) == 0;
+  uint64_t moved = 0;
+  for (size_t i = 0; i < count; i++) {
+    FileRequest* request = &requests[i];
+    size_t total = 0;
+    if (batched) {
+      if (request->result < 0) { batchFailure(request->result, "Error reading file.\n"); }
+      total = request->result;
+      /* Only finish the read by hand if the file did not simply end */
+      if (total == 0 || total == request->count) {
+        request->result = total;
+        moved += total;
+        throttleIO(THROTTLE_READ, total);
+        continue;
+      }
+    }
+    while (total < request->count) {
+      ssize_t r = pread(request->fd, (unsigned char*)request->buf + total, request->count - total,
+                        request->offset + total);
+      if (r == FILE_ERROR) {
+        if (errno == EINTR) { continue; }
+        perror("Error reading file.\n");
+        exit(EXIT_FAILURE);
+      } else if (r == 0) {
+        break;
+      }
+      total += r;
+    }
+    request->result = total;
+    moved += total;
+    throttleIO(THROTTLE_READ, total);
+  }
+  STATS_END(STATS_READ, started, moved);
+}
+
+/**
+ * Writes to many files at once, at each request's offset
+ *
+ * @param requests the requests holding the file descriptors and buffers
+ * @param count the number of requests
+ */
+void safeWriteBatch(FileRequest* requests, size_t count) {
+  STATS_START(started);
+  int batched = submitBatch(requests, count, IORING_OP_WRITE) == 0;
+  uint64_t moved = 0;
+  for (size_t i = 0; i < count; i++) {
+    FileRequest* request = &requests[i];
+    size_t total = 0;
+    if (batched) {
+      if (request->result < 0) { batchFailure(request->result, "Error writing to file.\n"); }
+      total = request->result;
+    }
+    while (total < request->count) {
+      ssize_t w = pwrite(request->fd, (const unsigned char*)request->buf + total, request->count - total,
+                         request->offset + total);
+      if (w == FILE_ERROR) {
+        if (errno == EINTR) { continue; }
+        perror("Error writing to file.\n");
+        exit(EXIT_FAILURE);
+      }
+      total += w;
+    }
+    request->result = total;
+    moved += total;
+    throttleIO(THROTTLE_WRITE, total);
+  }
+  STATS_END(STATS_WRITE, started, moved);
+}
+
+/**
+ * Closes many files at once
+ *
+ * @param requests the requests holding the file descriptors
+ * @param count the number of requests
+ */
+void safeCloseBatch(FileRequest* requests, size_t count) {
+  if (submitBatch(requests, count, IORING_OP_CLOSE) == FILE_ERROR) {
+    for (size_t i = 0; i < count; i++) { safeClose(requests[i].fd); }
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (requests[i].result < 0) { batchFailure(requests[i].result, "Error closing file.\n"); }
+  }
+}
+
+/**
+ * Wraps a file descriptor in an output buffer. Bytes reach the file in
+ * whatever sizes suit how they were written: full buffers, large writes and
+ * kernel copies each go out as they are. The record size only sets what the
+ * file is padded to when it is closed.
+ *
+ * @param fd the file descriptor to write to
+ * @param record_size the size of a record in bytes
+ * @param compressor the compressor to write through, or NULL to write fd
+ * directly
+ * @return a pointer to the buffered file
+ */
+BufferedFile* safeBufferedOpen(int fd, size_t record_size, struct Compressor* compressor) {
+  BufferedFile* file = (BufferedFile*)safeMalloc(sizeof(BufferedFile));
+  file->fd = fd;
+  file->compressor = compressor;
+  struct stat st;
+  file->pipe = fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+  file->record_size = record_size;
+  /* Flush at least a megabyte at a time */
+  file->capacity = ((BUFFERED_OUTPUT_SIZE + record_size - 1) / record_size) * record_size;
+  file->used = 0;
+  file->offset = 0;
+  file->buffer = (unsigned char*)safeAlignedAlloc(BUFFER_ALIGNMENT, file->capacity);
+  file->writer = NULL;
+  return file;
+}
+
+/**
+ * The body of a buffered file's writer thread: write each buffer handed over
+ * and return it as the spare
+ *
+ * @param arg the DirectWriter the thread runs
+ * @return NULL
+ */
+static void* directWriter(void* arg) {
+  DirectWriter* writer = (DirectWriter*)arg;
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    while (writer->pending == NULL && !writer->stopping) { pthread_cond_wait(&writer->cond, &writer->lock); }
+    if (writer->pending == NULL) { break; }
+    unsigned char* pending = writer->pending;
+    size_t length = writer->length;
+    off_t offset = writer->written;
+    pthread_mutex_unlock(&writer->lock);
+    safeWrite(writer->fd, pending, length);
+    /* O_DIRECT writes leave nothing behind in the cache */
+    if (!writer->direct) { safeDropWritten(writer->fd, offset, length); }
+    pthread_mutex_lock(&writer->lock);
+    writer->written += length;
+    writer->spare = pending;
+    writer->pending = NULL;
+    pthread_cond_broadcast(&writer->cond);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  return NULL;
+}
+
+/**
+ * Makes a new uncompressed file bypass the page cache. Records are gathered
+ * into two aligned buffers: one is filled while a writer thread writes the
+ * other with O_DIRECT. Where the file system refuses O_DIRECT, the thread
+ * writes through the cache and drops each buffer's pages once they are on
+ * disk. Must be called before anything is written.
+ *
+ * @param file the buffered file to change
+ */
+void safeBufferedBypassCache(BufferedFile* file) {
+  struct stat st;
+  if (file->compressor != NULL || fstat(file->fd, &st) == FILE_ERROR || !S_ISREG(st.st_mode)) { return; }
+  DirectWriter* writer = (DirectWriter*)safeMalloc(sizeof(DirectWriter));
+  writer->fd = file->fd;
+  int flags = fcntl(file->fd, F_GETFL);
+  writer->direct = flags != FILE_ERROR && fcntl(file->fd, F_SETFL, flags | O_DIRECT) != FILE_ERROR;
+  /* Direct writes must cover whole aligned blocks, so the buffers hold a
+   * multiple of both the record and the alignment */
+  size_t unit = file->record_size;
+  while (unit % BUFFER_ALIGNMENT != 0) { unit += file->record_size; }
+  safeFree(file->buffer);
+  file->capacity = ((BUFFERED_OUTPUT_SIZE + unit - 1) / unit) * unit;
+  file->buffer = (unsigned char*)safeAlignedAlloc(BUFFER_ALIGNMENT, file->capacity);
+  writer->spare = (unsigned char*)safeAlignedAlloc(BUFFER_ALIGNMENT, file->capacity);
+  writer->pending = NULL;
+  writer->length = 0;
+  writer->written = 0;
+  writer->stopping = 0;
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+  if (pthread_create(&writer->thread, NULL, directWriter, writer) != 0) {
+    perror("Error creating thread.\n");
+    exit(EXIT_FAILURE);
+  }
+  file->writer = writer;
+}
+
+/**
+ * Hands the aligned part of a buffered file's buffer to its writer thread and
+ * carries the rest over to the start of the spare buffer
+ *
+ * @param file the buffered file to flush
+ */
+static void directHandOver(BufferedFile* file) {
+  DirectWriter* writer = file->writer;
+  size_t aligned = writer->direct ? file->used / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT : file->used;
+  if (aligned == 0) { return; }
+  pthread_mutex_lock(&writer->lock);
+  while (writer->pending != NULL) { pthread_cond_wait(&writer->cond, &writer->lock); }
+  unsigned char* full = file->buffer;
+  file->buffer = writer->spare;
+  writer->spare = NULL;
+  writer->pending = full;
+  writer->length = aligned;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+  /* The writer only reads the aligned part, so the rest can be copied out */
+  file->used -= aligned;
+  memcpy(file->buffer, full + aligned, file->used);
+}
+
+/**
+ * Waits for a buffered file's writer thread to finish, then writes the bytes
+ * left over through the cache, as they no longer fill an aligned block
+ *
+ * @param file the buffered file whose writer to stop
+ */
+static void directClose(BufferedFile* file) {
+  DirectWriter* writer = file->writer;
+  directHandOver(file);
+  pthread_mutex_lock(&writer->lock);
+  writer->stopping = 1;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+  if (file->used > 0) {
+    if (writer->direct) { fcntl(file->fd, F_SETFL, fcntl(file->fd, F_GETFL) & ~O_DIRECT); }
+    safeWrite(file->fd, file->buffer, file->used);
+    file->used = 0;
+  }
+  safeDropWritten(file->fd, 0, 0);
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->cond);
+  safeFree(writer->spare);
+  safeFree(writer);
+  file->writer = NULL;
+}
+
+/**
+ * Passes bytes on to the compressor of a buffered file, or to its file
+ * descriptor when it has none
  *
- * @param file_contents the FileContent to free
+ * @param file the buffered file to write through
+ * @param buf the bytes to write
+ * @param count the number of bytes to write
  */
-void freeFileContent(FileContent* file_contents) {
-  safeFree(file_contents->file_contents);
-  free(file_contents);
+static void bufferedEmit(BufferedFile* file, const void* buf, size_t count) {
+  if (file->compressor != NULL) {
+    compressWrite(file->compressor, buf, count);
+  } else {
+    safeWrite(file->fd, buf, count);
+  }
+}
+
+/**
+ * Writes every pending byte of a buffered file to its file descriptor
+ *
+ * @param file the buffered file to flush
+ */
+void safeBufferedFlush(BufferedFile* file) {
+  if (file->writer != NULL) {
+    directHandOver(file);
+  } else if (file->used > 0) {
+    bufferedEmit(file, file->buffer, file->used);
+    file->used = 0;
+  }
+}
+
+/**
+ * Reserves contiguous space in the buffer so that the caller can build data
+ * in place. The space counts as written once this returns.
+ *
+ * @param file the buffered file to reserve space in
+ * @param count the number of bytes to reserve, at most one record
+ * @return a pointer to the reserved space
+ */
+void* safeBufferedReserve(BufferedFile* file, size_t count) {
+  if (file->capacity - file->used < count) { safeBufferedFlush(file); }
+  void* space = file->buffer + file->used;
+  file->used += count;
+  file->offset += count;
+  return space;
+}
+
+/**
+ * Appends bytes to a buffered file, flushing whenever the buffer fills. Large
+ * writes flush the buffer and go straight to the file descriptor.
+ *
+ * @param file the buffered file to write to
+ * @param buf the bytes to write
+ * @param count the number of bytes to write
+ */
+void safeBufferedWrite(BufferedFile* file, const void* buf, size_t count) {
+  const unsigned char* bytes = (const unsigned char*)buf;
+  if (count >= BUFFERED_COPY_THRESHOLD && file->writer == NULL) {
+    /* Large writes gain nothing from a copy into the buffer */
+    safeBufferedFlush(file);
+    bufferedEmit(file, buf, count);
+    file->offset += count;
+    return;
+  }
+  while (count > 0) {
+    size_t room = file->capacity - file->used;
+    size_t chunk = count < room ? count : room;
+    memcpy(file->buffer + file->used, bytes, chunk);
+    file->used += chunk;
+    file->offset += chunk;
+    bytes += chunk;
+    count -= chunk;
+    if (file->used == file->capacity) { safeBufferedFlush(file); }
+  }
+}
+
+/**
+ * Appends zero bytes to a buffered file
+ *
+ * @param file the buffered file to write to
+ * @param count the number of zero bytes to write
+ */
+void safeBufferedZero(BufferedFile* file, size_t count) {
+  while (count > 0) {
+    size_t room = file->capacity - file->used;
+    size_t chunk = count < room ? count : room;
+    memset(file->buffer + file->used, 0, chunk);
+    file->used += chunk;
+    file->offset += chunk;
+    count -= chunk;
+    if (file->used == file->capacity) { safeBufferedFlush(file); }
+  }
+}
+
+/**
+ * Copies bytes from a file descriptor into a buffered file. Small copies are
+ * read straight into the buffer; large ones flush it and let the kernel move
+ * the data.
+ *
+ * @param file the buffered file to write to
+ * @param infd the file descriptor to copy from
+ * @param count the number of bytes to copy
+ * @return the number of bytes copied, which is only less than count if the
+ * input ended early
+ */
+off_t safeBufferedCopy(BufferedFile* file, int infd, off_t count) {
+  off_t total = 0;
+  /* The kernel can only move data that needs no compressing, and cannot be
+   * told to leave the pages it copies out of the cache */
+  if (count >= BUFFERED_COPY_THRESHOLD && file->compressor == NULL && file->writer == NULL && !drop_caches) {
+    safeBufferedFlush(file);
+    total = file->pipe ? safeSplice(infd, file->fd, count) : safeCopy(infd, file->fd, count);
+    file->offset += total;
+    return total;
+  }
+  /* Pages are dropped a buffer at a time, up to the last whole page read */
+  off_t start = drop_caches ? lseek(infd, 0, SEEK_CUR) : 0;
+  off_t dropped = start;
+  while (total < count) {
+    size_t room = file->capacity - file->used;
+    size_t chunk = (count - total) < (off_t)room ? (size_t)(count - total) : room;
+    ssize_t r = safeRead(infd, file->buffer + file->used, chunk);
+    file->used += r;
+    file->offset += r;
+    total += r;
+    if (file->used == file->capacity) {
+      safeBufferedFlush(file);
+      off_t end = (start + total) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+      if (end > dropped) { safeDropCache(infd, dropped, end - dropped); }
+      dropped = end > dropped ? end : dropped;
+    }
+    if ((size_t)r < chunk) { break; }
+  }
+  /* The last page goes too, even if the copy ended partway through it */
+  off_t end = (start + total + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+  if (end > dropped) { safeDropCache(infd, dropped, end - dropped); }
+  return total;
+}
+
+/**
+ * Pads a buffered file to a whole number of records, flushes it, and frees
+ * the buffer. The underlying file descriptor is left open.
+ *
+ * @param file the buffered file to close
+ */
+void safeBufferedClose(BufferedFile* file) {
+  size_t partial = file->offset % file->record_size;
+  if (partial > 0) { safeBufferedZero(file, file->record_size - partial); }
+  if (file->writer != NULL) {
+    directClose(file);
+  } else {
+    safeBufferedFlush(file);
+  }
+  safeFree(file->buffer);
+  safeFree(file);
 }
@@ -0,0 +1,279 @@
+/*
+ * snapshot.c - manifests of archived files for incremental archives
+ *
+ * A manifest records the path, device, inode, size and times of every file an
+ archive run saw, in the same layout as the sidecar index: a fixed header, an
+ array of fixed-size entries sorted by path and a table of the paths. The next
+ run maps the previous manifest and binary searches it as it walks the tree,
+ so deciding whether a file changed costs a few page faults next to its lstat.
+ */
+#include "../include/snapshot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../include/kiwitar.h"
+#include "../include/safe_alloc.h"
+#include "../include/safe_dir.h"
+#include "../include/safe_file.h"
+
+/**
+ * Starts collecting a manifest
+ *
+ * @return the manifest, to be freed with snapshotWriterClose
+ */
+SnapshotWriter* snapshotWriterOpen(void) {
+  SnapshotWriter* writer = (SnapshotWriter*)safeMalloc(sizeof(SnapshotWriter));
+  pathTableInit(&writer->table, sizeof(SnapshotEntry), SNAPSHOT_INITIAL_ENTRIES, SNAPSHOT_INITIAL_STRINGS);
+  return writer;
+}
+
+/**
+ * Records a file in a manifest being collected
+ *
+ * @param writer the manifest to add to
+ * @param path the path of the file
+ * @param st the status of the file
+ */
+void snapshotWriterAdd(SnapshotWriter* writer, const char* path, const struct stat* st) {
+  size_t length = strlen(path);
+  uint64_t path_offset;
+  SnapshotEntry* entry = (SnapshotEntry*)pathTableAdd(&writer->table, path, length, &path_offset);
+  entry->path_offset = path_offset;
+  entry->path_length = length;
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = st->st_mtim.tv_sec;
+  entry->mtime_nsec = st->st_mtim.tv_nsec;
+  entry->ctime = st->st_ctim.tv_sec;
+  entry->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/**
+ * Orders two entries by path
+ *
+ * @param a the first entry
+ * @param b the second entry
+ * @param strings the path table of the entries
+ * @return a negative, zero or positive number as a sorts before, with or
+ * after b
+ */
+static int compareEntries(const void* a, const void* b, void* strings) {
+  const SnapshotEntry* x = (const SnapshotEntry*)a;
+  const SnapshotEntry* y = (const SnapshotEntry*)b;
+  const char* table = (const char*)strings;
+  return pathCompare(table + x->path_offset, x->path_length, table + y->path_offset, y->path_length);
+}
+
+/**
+ * Sorts a collected manifest and writes it to a file. The manifest is written
+ * under a temporary name and renamed over the old one, so an interrupted run
+ * leaves the previous manifest in place.
+ *
+ * @param writer the manifest to write
+ * @param snapshot_path the name of the file to write
+ */
+void snapshotWriterSave(SnapshotWriter* writer, const char* snapshot_path) {
+  pathTableSort(&writer->table, compareEntries);
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header.count = writer->table.count;
+  header.strings_offset = sizeof(header) + writer->table.count * sizeof(SnapshotEntry);
+  size_t length = strlen(snapshot_path);
+  char* temp_path = (char*)safeMalloc(length + sizeof(SNAPSHOT_TEMP_SUFFIX));
+  memcpy(temp_path, snapshot_path, length);
+  memcpy(temp_path + length, SNAPSHOT_TEMP_SUFFIX, sizeof(SNAPSHOT_TEMP_SUFFIX));
+  int fd = safeOpen(temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  pathTableWrite(&writer->table, fd, &header, sizeof(header));
+  safeClose(fd);
+  if (rename(temp_path, snapshot_path) == FILE_ERROR) {
+    perror("Error replacing snapshot.\n");
+    exit(EXIT_FAILURE);
+  }
+  safeFree(temp_path);
+}
+
+/**
+ * Frees a manifest being collected
+ *
+ * @param writer the manifest to free
+ */
+void snapshotWriterClose(SnapshotWriter* writer) {
+  pathTableFree(&writer->table);
+  safeFree(writer);
+}
+
+/**
+ * Maps the manifest of a previous run, checking that it is well formed
+ *
+ * @param snapshot_path the name of the manifest
+ * @return the manifest, or NULL if there is none and every file must be
+ * archived
+ */
+Snapshot* snapshotOpen(const char* snapshot_path) {
+  int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+  if (fd == FILE_ERROR) { return NULL; }
+  struct stat st;
+  safeFstat(fd, &st);
+  void* map = MAP_FAILED;
+  if ((size_t)st.st_size >= sizeof(SnapshotHeader)) { map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0); }
+  safeClose(fd);
+  if (map == MAP_FAILED) {
+    /* An empty file, as GNU tar users pass for a full dump, starts afresh */
+    if (st.st_size > 0) { fprintf(stderr, "%s: snapshot is damaged; archiving everything\n", snapshot_path); }
+    return NULL;
+  }
+  const SnapshotHeader* header = (const SnapshotHeader*)map;
+  size_t size = st.st_size;
+  int valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+              header->count <= (size - sizeof(SnapshotHeader)) / sizeof(SnapshotEntry) &&
+              header->strings_offset == sizeof(SnapshotHeader) + header->count * sizeof(SnapshotEntry);
+  const SnapshotEntry* entries = (const SnapshotEntry*)(header + 1);
+  /* Every path must lie inside the file, so lookups never fault */
+  size_t strings_size = valid ? size - header->strings_offset : 0;
+  for (uint64_t i = 0; valid && i < header->count; i++) {
+    valid = pathInBounds(entries[i].path_offset, entries[i].path_length, strings_size);
+  }
+  if (!valid) {
+    fprintf(stderr, "%s: snapshot is damaged; archiving everything\n", snapshot_path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  Snapshot* snapshot = (Snapshot*)safeMalloc(sizeof(Snapshot));
+  snapshot->map = (unsigned char*)map;
+  snapshot->writer = NULL;
+  snapshot->by_mtime = 0;
+  snapshot->map_size = st.st_size;
+  snapshot->entries = entries;
+  snapshot->count = header->count;
+  snapshot->strings = (const char*)map + header->strings_offset;
+  return snapshot;
+}
+
+/**
+ * Turns a collected manifest into one that can be searched, for updating an
+ * archive with the files that are newer than their archived copies. A path
+ * archived more than once keeps its newest time.
+ *
+ * @param writer the manifest of the members already archived, which the
+ * result takes over
+ * @return the manifest, to be freed with snapshotClose
+ */
+Snapshot* snapshotFromWriter(SnapshotWriter* writer) {
+  pathTableSort(&writer->table, compareEntries);
+  SnapshotEntry* entries = (SnapshotEntry*)writer->table.entries;
+  size_t unique = 0;
+  for (size_t i = 0; i < writer->table.count; i++) {
+    SnapshotEntry* entry = &entries[i];
+    SnapshotEntry* last = unique > 0 ? &entries[unique - 1] : NULL;
+    if (last != NULL && compareEntries(last, entry, writer->table.strings) == 0) {
+      if (entry->mtime > last->mtime) { last->mtime = entry->mtime; }
+    } else {
+      entries[unique++] = *entry;
+    }
+  }
+  writer->table.count = unique;
+  Snapshot* snapshot = (Snapshot*)safeMalloc(sizeof(Snapshot));
+  snapshot->map = NULL;
+  snapshot->map_size = 0;
+  snapshot->writer = writer;
+  snapshot->by_mtime = 1;
+  snapshot->entries = entries;
+  snapshot->count = unique;
+  snapshot->strings = writer->table.strings;
+  return snapshot;
+}
+
+/**
+ * Checks whether a file is exactly as a previous run recorded it: the same
+ * inode on the same device, with the same size and times. Directories always
+ * count as changed so that a restore recreates them. When updating an archive,
+ * only whether the file is newer than its archived copy matters.
+ *
+ * @param snapshot the manifest of the previous run
+ * @param path the path of the file
+ * @param st the status of the file
+ * @return nonzero if the file need not be archived again
+ */
+int snapshotUnchanged(const Snapshot* snapshot, const char* path, const struct stat* st) {
+  if (S_ISDIR(st->st_mode) && !snapshot->by_mtime) { return 0; }
+  size_t length = strlen(path);
+  size_t low = 0, high = snapshot->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    const SnapshotEntry* entry = &snapshot->entries[mid];
+    int c = pathCompare(snapshot->strings + entry->path_offset, entry->path_length, path, length);
+    if (c == 0) {
+      /* Archive headers hold whole seconds */
+      if (snapshot->by_mtime) { return st->st_mtim.tv_sec <= entry->mtime; }
+      return entry->dev == (uint64_t)st->st_dev && entry->ino == (uint64_t)st->st_ino &&
+             entry->size == (uint64_t)st->st_size && entry->mtime == st->st_mtim.tv_sec &&
+             entry->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec && entry->ctime == st->st_ctim.tv_sec &&
+             entry->ctime_nsec == (uint32_t)st->st_ctim.tv_nsec;
+    }
+    if (c < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Lists the paths of a previous run that are missing from the current one.
+ * Both manifests are walked in path order, and the paths are returned last
+ * first, so that the contents of a removed directory precede it.
+ *
+ * @param snapshot the manifest of the previous run
+ * @param writer the manifest of the current run, which is sorted
+ * @param length where to store the length of the list
+ * @return the paths, each followed by a newline, to be freed by the caller, or
+ * NULL if nothing was removed
+ */
+char* snapshotDeleted(const Snapshot* snapshot, SnapshotWriter* writer, size_t* length) {
+  pathTableSort(&writer->table, compareEntries);
+  char* list = NULL;
+  size_t capacity = 0;
+  *length = 0;
+  const SnapshotEntry* entries = (const SnapshotEntry*)writer->table.entries;
+  size_t current = writer->table.count;
+  for (size_t i = snapshot->count; i > 0; i--) {
+    const SnapshotEntry* old = &snapshot->entries[i - 1];
+    const char* path = snapshot->strings + old->path_offset;
+    int c = 1;
+    while (current > 0) {
+      const SnapshotEntry* entry = &entries[current - 1];
+      c = pathCompare(writer->table.strings + entry->path_offset, entry->path_length, path, old->path_length);
+      if (c <= 0) { break; }
+      current--;
+    }
+    /* A newline would split the path when the list is read back */
+    if ((current > 0 && c == 0) || memchr(path, '\n', old->path_length) != NULL) { continue; }
+    while (*length + old->path_length + 1 > capacity) {
+      capacity = capacity > 0 ? capacity * 2 : SNAPSHOT_INITIAL_STRINGS;
+      list = (char*)safeRealloc(list, capacity);
+    }
+    memcpy(list + *length, path, old->path_length);
+    list[*length + old->path_length] = '\n';
+    *length += old->path_length + 1;
+  }
+  return list;
+}
+
+/**
+ * Unmaps or frees the manifest of a previous run
+ *
+ * @param snapshot the manifest to close
+ */
+void snapshotClose(Snapshot* snapshot) {
+  if (snapshot->map != NULL) { munmap(snapshot->map, snapshot->map_size); }
+  if (snapshot->writer != NULL) { snapshotWriterClose(snapshot->writer); }
+  safeFree(snapshot);
+}
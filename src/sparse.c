@@ -0,0 +1,157 @@
+/*
+ * sparse.c - detection and storage of files with holes
+ *
+ * The data runs of a file are found with SEEK_DATA and SEEK_HOLE, so a mostly
+ empty image is scanned by asking the filesystem for its extents rather than by
+ reading its zeros. Sparse members use the 1.0 format of GNU tar: a pax header
+ names the real file and its size, and the member's data starts with a map of
+ decimal offsets and lengths, padded to a block, followed by the data runs.
+ */
+#include "../include/sparse.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/kiwitar.h"
+#include "../include/safe_alloc.h"
+
+/**
+ * Checks whether a file occupies less space than its size, which only a file
+ * with holes can
+ *
+ * @param st the status of the file
+ * @return nonzero if the file may be sparse
+ */
+int sparseCandidate(const struct stat* st) {
+  return S_ISREG(st->st_mode) && st->st_size > 0 && (off_t)st->st_blocks * ARCHIVE_BLOCK_SIZE < st->st_size;
+}
+
+/**
+ * Appends a run of data to a sparse map
+ *
+ * @param map the map to append to
+ * @param offset the offset of the data in the file
+ * @param length the number of bytes of data
+ */
+static void addExtent(SparseMap* map, off_t offset, off_t length) {
+  if (map->count == map->capacity) {
+    map->capacity = map->capacity > 0 ? map->capacity * 2 : SPARSE_INITIAL_EXTENTS;
+    map->extents = (SparseExtent*)safeRealloc(map->extents, map->capacity * sizeof(SparseExtent));
+  }
+  map->extents[map->count].offset = offset;
+  map->extents[map->count].length = length;
+  map->count++;
+  map->data_size += length;
+}
+
+/**
+ * Finds the data runs of a file. A file that ends in a hole gets a final empty
+ * run at its end, as GNU tar writes.
+ *
+ * @param fd the file descriptor of the file
+ * @param size the size of the file
+ * @param map where to store the runs, which must be freed with sparseFree
+ * @return nonzero if the file has holes, zero if it is all data or the
+ * filesystem cannot report holes
+ */
+int sparseScan(int fd, off_t size, SparseMap* map) {
+  memset(map, 0, sizeof(*map));
+  off_t offset = 0;
+  while (offset < size) {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data == FILE_ERROR && errno == ENXIO) { break; }
+    if (data == FILE_ERROR) { return 0; }
+    if (data >= size) { break; }
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if (hole == FILE_ERROR || hole > size) { hole = size; }
+    addExtent(map, data, hole - data);
+    offset = hole;
+  }
+  if (map->count == 1 && map->extents[0].offset == 0 && map->extents[0].length == size) { return 0; }
+  if (map->count == 0 || map->extents[map->count - 1].offset + map->extents[map->count - 1].length < size) {
+    addExtent(map, size, 0);
+  }
+  return 1;
+}
+
+/**
+ * Writes a sparse map as the decimal text stored before a member's data
+ *
+ * @param map the map to write
+ * @param length where to store the length of the text, before padding
+ * @return the text, to be freed by the caller
+ */
+char* sparseFormat(const SparseMap* map, size_t* length) {
+  size_t capacity = (map->count * 2 + 1) * SPARSE_NUMBER_SIZE + NULL_TERMINATOR_SIZE;
+  char* text = (char*)safeMalloc(capacity);
+  size_t used = snprintf(text, capacity, "%zu\n", map->count);
+  for (size_t i = 0; i < map->count; i++) {
+    used += snprintf(text + used, capacity - used, "%lld\n%lld\n", (long long)map->extents[i].offset,
+                     (long long)map->extents[i].length);
+  }
+  *length = used;
+  return text;
+}
+
+/**
+ * Reads the map at the start of a sparse member's data, one block at a time
+ *
+ * @param reader the reader positioned at the member's data
+ * @param member the decoded header of the member
+ * @param map where to store the runs, which must be freed with sparseFree
+ * @param consumed where to store the number of data bytes read
+ * @return nonzero if the map is well formed and fits the member
+ */
+int sparseReadMap(ArchiveReader* reader, const ArchiveMember* member, SparseMap* map, off_t* consumed) {
+  memset(map, 0, sizeof(*map));
+  *consumed = 0;
+  char block[ARCHIVE_BLOCK_SIZE];
+  size_t position = ARCHIVE_BLOCK_SIZE;
+  /* The count comes first, then an offset and a length for every run */
+  long long count = -1, offset = 0;
+  size_t numbers = 0;
+  while (count < 0 || numbers < 1 + 2 * (size_t)count) {
+    long long value = 0;
+    size_t digits = 0;
+    for (;;) {
+      if (position == ARCHIVE_BLOCK_SIZE) {
+        if (*consumed + ARCHIVE_BLOCK_SIZE > member->size ||
+            readerRead(reader, block, ARCHIVE_BLOCK_SIZE) < ARCHIVE_BLOCK_SIZE) {
+          return 0;
+        }
+        *consumed += ARCHIVE_BLOCK_SIZE;
+        position = 0;
+      }
+      char c = block[position++];
+      if (c == '\n') { break; }
+      if (c < '0' || c > '9' || value > (INT64_MAX - 9) / 10) { return 0; }
+      value = value * 10 + (c - '0');
+      digits++;
+    }
+    if (digits == 0) { return 0; }
+    if (count < 0) {
+      /* Each run takes at least four characters of the member */
+      if (value > member->size / 4) { return 0; }
+      count = value;
+    } else if (numbers % 2 == 1) {
+      if (value < offset || value > member->sparse_size) { return 0; }
+      offset = value;
+    } else {
+      if (value > member->sparse_size - offset) { return 0; }
+      addExtent(map, offset, value);
+      offset += value;
+    }
+    numbers++;
+  }
+  return map->data_size <= member->size - *consumed;
+}
+
+/**
+ * Frees the runs of a sparse map
+ *
+ * @param map the map to free
+ */
+void sparseFree(SparseMap* map) { safeFree(map->extents); }
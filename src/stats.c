@@ -0,0 +1,209 @@
+/*
+ * stats.c - opt-in counters, phase timings and histograms
+ *
+ * The hot paths time themselves through the STATS_ macros, which add to one
+ set of relaxed atomic counters and cost a single load of the enabled flag when
+ --stats was not given. Building without WITH_STATS removes the macros, and
+ with them every trace of the instrumentation, from the hot paths. Reports are
+ JSON objects, one per line, written at exit and, with an interval, by a
+ thread of their own while the run goes on.
+ */
+#include "../include/stats.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef WITH_STATS
+Stats global_stats = {.enabled = 0,
+                      .fd = STATS_DEFAULT_FD,
+                      .interval = 0,
+                      .lock = PTHREAD_MUTEX_INITIALIZER,
+                      .stopping = 0};
+
+/* The names the phases are reported under */
+static const char* phase_names[STATS_NUM_PHASES] = {"traverse", "stat",   "read",  "write",
+                                                    "copy",     "header", "names", "verbose"};
+
+/**
+ * Returns the histogram bucket of a value: the number of bits it needs
+ *
+ * @param value the value to place
+ * @return the bucket, at most STATS_BUCKETS - 1
+ */
+static size_t bucketOf(uint64_t value) {
+  size_t bucket = value == 0 ? 0 : 64 - (size_t)__builtin_clzll(value);
+  return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+/**
+ * Adds a handled regular file to the histograms
+ *
+ * @param size the size of the file
+ * @param start what statsStart returned when its handling began
+ */
+void statsFile(uint64_t size, uint64_t start) {
+  if (start == 0) { return; }
+  StatsCounters* counters = &global_stats.counters;
+  __atomic_fetch_add(&counters->files, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&counters->sizes[bucketOf(size)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&counters->latencies[bucketOf(statsNow() - start)], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Appends formatted text to a report, dropping what does not fit
+ *
+ * @param report the report
+ * @param length the number of bytes of the report so far, advanced
+ * @param format the printf format of the text
+ */
+static void appendReport(char* report, size_t* length, const char* format, ...) {
+  if (*length >= STATS_REPORT_SIZE) { return; }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(report + *length, STATS_REPORT_SIZE - *length, format, args);
+  va_end(args);
+  if (n > 0) { *length += (size_t)n; }
+}
+
+/**
+ * Appends a histogram as an array of [upper bound, count] pairs, leaving out
+ * the empty buckets. A bucket holds the values below its bound and at least
+ * half of it.
+ *
+ * @param report the report
+ * @param length the number of bytes of the report so far, advanced
+ * @param name the key of the histogram
+ * @param buckets the counts of the buckets
+ */
+static void appendHistogram(char* report, size_t* length, const char* name, uint64_t* buckets) {
+  appendReport(report, length, ",\"%s\":[", name);
+  const char* separator = "";
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    uint64_t count = __atomic_load_n(&buckets[i], __ATOMIC_RELAXED);
+    if (count == 0) { continue; }
+    appendReport(report, length, "%s[%llu,%llu]", separator, 1ULL << i, (unsigned long long)count);
+    separator = ",";
+  }
+  appendReport(report, length, "]");
+}
+
+/**
+ * Writes a report of the counters so far as one line of JSON
+ *
+ * @param final whether this is the report written at exit
+ */
+static void writeReport(int final) {
+  StatsCounters* counters = &global_stats.counters;
+  char report[STATS_REPORT_SIZE];
+  size_t length = 0;
+  uint64_t bytes_in = __atomic_load_n(&counters->bytes[STATS_READ], __ATOMIC_RELAXED) +
+                      __atomic_load_n(&counters->bytes[STATS_COPY], __ATOMIC_RELAXED);
+  uint64_t bytes_out = __atomic_load_n(&counters->bytes[STATS_WRITE], __ATOMIC_RELAXED) +
+                       __atomic_load_n(&counters->bytes[STATS_COPY], __ATOMIC_RELAXED);
+  appendReport(report, &length, "{\"final\":%s,\"elapsed_s\":%.6f,\"bytes_in\":%llu,\"bytes_out\":%llu,\"files\":%llu",
+               final ? "true" : "false", (double)(statsNow() - global_stats.start) / 1e9,
+               (unsigned long long)bytes_in, (unsigned long long)bytes_out,
+               (unsigned long long)__atomic_load_n(&counters->files, __ATOMIC_RELAXED));
+  appendReport(report, &length, ",\"phases\":{");
+  for (size_t i = 0; i < STATS_NUM_PHASES; i++) {
+    appendReport(report, &length, "%s\"%s\":{\"calls\":%llu,\"seconds\":%.6f,\"bytes\":%llu}", i == 0 ? "" : ",",
+                 phase_names[i], (unsigned long long)__atomic_load_n(&counters->calls[i], __ATOMIC_RELAXED),
+                 (double)__atomic_load_n(&counters->nanoseconds[i], __ATOMIC_RELAXED) / 1e9,
+                 (unsigned long long)__atomic_load_n(&counters->bytes[i], __ATOMIC_RELAXED));
+  }
+  appendReport(report, &length, "}");
+  appendHistogram(report, &length, "file_size_bytes", counters->sizes);
+  appendHistogram(report, &length, "file_latency_ns", counters->latencies);
+  appendReport(report, &length, "}\n");
+  if (length > STATS_REPORT_SIZE - 1) { length = STATS_REPORT_SIZE - 1; }
+  /* Reports go straight to the descriptor, so they are not counted as output */
+  for (size_t written = 0; written < length;) {
+    ssize_t w = write(global_stats.fd, report + written, length - written);
+    if (w < 0 && errno == EINTR) { continue; }
+    if (w < 0) {
+      perror("Error writing statistics.\n");
+      return;
+    }
+    written += (size_t)w;
+  }
+}
+
+/**
+ * The body of the reporter thread: write a report every interval until told
+ * to stop
+ *
+ * @param arg unused
+ * @return NULL
+ */
+static void* statsReporter(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&global_stats.lock);
+  while (!global_stats.stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)global_stats.interval;
+    while (!global_stats.stopping &&
+           pthread_cond_timedwait(&global_stats.stop_cond, &global_stats.lock, &deadline) != ETIMEDOUT) {}
+    if (!global_stats.stopping) { writeReport(0); }
+  }
+  pthread_mutex_unlock(&global_stats.lock);
+  return NULL;
+}
+#endif
+
+/**
+ * Starts collecting statistics. Exits if they were not compiled in.
+ *
+ * @param fd the file descriptor to write the reports to
+ * @param interval the seconds between periodic reports, or 0 for a single
+ * report at exit
+ */
+void statsOpen(int fd, size_t interval) {
+#ifdef WITH_STATS
+  global_stats.fd = fd;
+  global_stats.interval = interval;
+  global_stats.start = statsNow();
+  __atomic_store_n(&global_stats.enabled, 1, __ATOMIC_RELEASE);
+  if (interval > 0) {
+    /* The reporter waits on the monotonic clock, so clock changes do not
+     * stretch or shrink the interval */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&global_stats.stop_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&global_stats.reporter, NULL, statsReporter, NULL) != 0) {
+      perror("Error creating thread.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+#else
+  (void)fd;
+  (void)interval;
+  fprintf(stderr, "Statistics support was not compiled in.\n");
+  exit(EXIT_FAILURE);
+#endif
+}
+
+/**
+ * Stops collecting statistics and writes the final report, if they were
+ * being collected
+ */
+void statsClose(void) {
+#ifdef WITH_STATS
+  if (!global_stats.enabled) { return; }
+  if (global_stats.interval > 0) {
+    pthread_mutex_lock(&global_stats.lock);
+    global_stats.stopping = 1;
+    pthread_cond_signal(&global_stats.stop_cond);
+    pthread_mutex_unlock(&global_stats.lock);
+    pthread_join(global_stats.reporter, NULL);
+    pthread_cond_destroy(&global_stats.stop_cond);
+  }
+  writeReport(1);
+  global_stats.enabled = 0;
+#endif
+}
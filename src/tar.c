@@ -1,353 +1,1102 @@
 #include "../include/kiwitar.h"
 
-#include <arpa/inet.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <grp.h>
-#include <pwd.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "../include/compress.h"
+#include "../include/extract.h"
+#include "../include/header.h"
+#include "../include/index.h"
+#include "../include/names.h"
+#include "../include/prefetch.h"
+#include "../include/reader.h"
 #include "../include/safe_alloc.h"
 #include "../include/safe_dir.h"
 #include "../include/safe_file.h"
+#include "../include/snapshot.h"
+#include "../include/sparse.h"
+#include "../include/stats.h"
+#include "../include/traverse.h"
+#include "../include/utils.h"
 
-/* For interoperability with GNU tar. GNU seems to
- * set the high–order bit of the first byte, then
- * treat the rest of the field as a binary integer
- * in network byte order.
- * I don’t know for sure if it’s a 32 or 64–bit int, but for
- * this version, we’ll only support 32. (well, 31)
- * returns the integer on success, –1 on failure.
- * In spite of the name of htonl(), it converts int32_t
- */
-uint32_t extract_special_int(char* where, int len) {
-  int32_t val = -1;
-  if (((long unsigned int)len >= sizeof(val)) && (where[0] & 0x80)) {
-    /* the top bit is set and we have space
-     * extract the last four bytes */
-    val = *(int32_t*)(where + len - sizeof(val));
-    val = ntohl(val); /* convert to host byte order */
-  }
-  return val;
-}
-
-/* For interoperability with GNU tar. GNU seems to
- * set the high–order bit of the first byte, then
- * treat the rest of the field as a binary integer
- * in network byte order.
- * Insert the given integer into the given field
- * using this technique. Returns 0 on success, nonzero
- * otherwise
- */
-int insert_special_int(char* where, size_t size, int32_t val) {
-  int err = 0;
-  if (val < 0 || (size < sizeof(val))) {
-    /* if it’s negative, bit 31 is set and we can’t use the flag
-     * if len is too small, we can’t write it. Either way, we’re
-     * done.
-     */
-    err++;
-  } else {
-    /* game on....*/
-    memset(where, 0, size); /* Clear out the buffer */
-    *(int32_t*)(where + size - sizeof(val)) = htonl(val); /* place the int */
-    *where |= 0x80; /* set that high–order bit */
-  }
-  return err;
-}
-
-void handleFileContents(int outfile, char* curr_path) {
-  struct stat* stat = safeMalloc(sizeof(struct stat));
-  safeLstat(curr_path, stat);
-  /* Process regular file */
-  size_t file_size = stat->st_size;
-  int infile = safeOpen(curr_path, O_RDONLY, 0);
-  FileContent* file_contents = safeRead(infile);
-  safeWrite(outfile, file_contents->file_contents, file_size);
-  size_t padding_bytes = file_size % ARCHIVE_BLOCK_SIZE;
-  if (padding_bytes > 0) {
-    char* padding = (char*)safeCalloc(sizeof(char), padding_bytes);
-    safeWrite(outfile, padding, padding_bytes);
-    safeFree(padding);
-  }
-  freeFileContent(file_contents);
+/**
+ * Returns the number of bytes a member's data occupies, including the padding
+ * that completes its last block
+ *
+ * @param size the size of the member's data
+ * @return the size rounded up to a whole number of blocks
+ */
+static off_t paddedSize(off_t size) {
+  return (size + ARCHIVE_BLOCK_SIZE - 1) / ARCHIVE_BLOCK_SIZE * ARCHIVE_BLOCK_SIZE;
+}
+
+/**
+ * Streams the contents of a regular file into the archive followed by the
+ * zero padding that completes its last block. The data is moved in bounded
+ * chunks, so memory use does not depend on the size of the file.
+ *
+ * @param outfile the archive being written
+ * @param entry the file to archive
+ */
+void handleFileContents(BufferedFile* outfile, const TraverseEntry* entry) {
+  off_t file_size = entry->st.st_size;
+  int infile = safeOpenAt(entry->dirfd, entry->name, O_RDONLY, 0);
+  off_t copied = safeBufferedCopy(outfile, infile, file_size);
+  if (copied < file_size) {
+    /* The file shrank after its header was written, so keep the archive
+     * consistent by filling the remainder with zeros */
+    fprintf(stderr, "%s: file shrank by %lld bytes; padding with zeros\n", entry->path,
+            (long long)(file_size - copied));
+    safeBufferedZero(outfile, file_size - copied);
+  }
+  safeBufferedZero(outfile, (ARCHIVE_BLOCK_SIZE - file_size % ARCHIVE_BLOCK_SIZE) % ARCHIVE_BLOCK_SIZE);
   safeClose(infile);
-  safeFree(stat);
-}
-
-void handleDirContents(int outfile, char* curr_path, int verbose, int strict) {
-  /* Process directory */
-  DIR* dir = safeOpenDir(curr_path);
-  DirContent* dir_contents = safeReadDir(dir);
-  for (int i = 0; i < dir_contents->num_entries; i++) {
-    struct dirent* entry = dir_contents->entries[i];
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) { continue; }
-    char* new_path = (char*)safeCalloc(sizeof(char), strlen(curr_path) + strlen(entry->d_name) + 2);
-    // if (strlen(curr_path) + strlen(entry->d_name) + 2 > PATH_MAX) {
-    //   printf("Path too long: %s/%s\n", curr_path, entry->d_name);
-    //   exit(EXIT_FAILURE);
-    // }
-    // snprintf(new_path, PATH_MAX, "%s/%s", curr_path, entry->d_name);
-    snprintf(new_path, strlen(curr_path) + strlen(entry->d_name) + 2, "%s/%s", curr_path, entry->d_name);
-    createArchiveHelper(outfile, new_path, verbose, strict);
-    safeFree(new_path);
-  }
-  // struct dirent* entry;
-  // while ((entry = safeReadDir(dir)) != NULL) {
-  //   if (strcmp(entry->d_name, ".") == 0 ||
-  //       strcmp(entry->d_name, "..") == 0) {
-  //     continue;
-  //   }
-  //   char* new_path = (char*)safeCalloc(sizeof(char), PATH_MAX);
-  //   snprintf(new_path, PATH_MAX, "%s/%s", curr_path, entry->d_name);
-  //   createArchiveHelper(outfile, new_path, verbose, strict);
-  //   safeFree(new_path);
-  // }
-  safeCloseDir(dir);
-  freeDirContent(dir_contents);
-}
-
-void handleLinkContents(int outfile, char* curr_path, int verbose, int strict) {
-  // Process symbolic link
+}
+
+/**
+ * Formats a modification time to the minute. Members tend to share their
+ * minutes, so recent results are kept and most calls skip localtime and
+ * strftime.
+ *
+ * @param mtime the time to format
+ * @param time_str where to store the text, MTIME_WIDTH + 1 bytes
+ */
+static void formatMtime(time_t mtime, char* time_str) {
+  static struct {
+      /* The minute the text describes, or TIME_CACHE_EMPTY */
+      long long minute;
+      /* The formatted minute */
+      char text[MTIME_WIDTH + 1];
+  } cache[TIME_CACHE_SIZE];
+  static int cache_ready = 0;
+  if (!cache_ready) {
+    for (size_t i = 0; i < TIME_CACHE_SIZE; i++) { cache[i].minute = TIME_CACHE_EMPTY; }
+    cache_ready = 1;
+  }
+  /* Round towards negative infinity so that times before 1970 share minutes too */
+  long long minute = (long long)mtime >= 0 ? (long long)mtime / 60 : -((59 - (long long)mtime) / 60);
+  size_t slot = (size_t)minute & (TIME_CACHE_SIZE - 1);
+  if (cache[slot].minute != minute) {
+    struct tm tm;
+    memset(cache[slot].text, 0, sizeof(cache[slot].text));
+    if (localtime_r(&mtime, &tm) != NULL) { strftime(cache[slot].text, MTIME_WIDTH + 1, "%Y-%m-%d %H:%M", &tm); }
+    cache[slot].minute = minute;
+  }
+  memcpy(time_str, cache[slot].text, MTIME_WIDTH + 1);
+}
+
+/**
+ * Prints a member the way ls -l would: its permissions, the owner/group, the
+ * size, last modification time and the filename
+ *
+ * @param stream the stream to print to
+ * @param type the character standing for the type of the member
+ * @param mode the permission bits of the member
+ * @param owner_group the owner and group, separated by a slash
+ * @param size the size of the member's data
+ * @param mtime the last modification time of the member
+ * @param curr_path the path of the member
+ * @param link the member a hard link points to, or NULL
+ */
+static void printMember(FILE* stream, char type, mode_t mode, const char* owner_group, unsigned long long size,
+                        time_t mtime, const char* curr_path, const char* link) {
+  static const mode_t bits[] = {S_IRUSR, S_IWUSR, S_IXUSR, S_IRGRP, S_IWGRP, S_IXGRP, S_IROTH, S_IWOTH, S_IXOTH};
+  char permissions[PERMISSIONS_WIDTH + 1];
+  permissions[0] = type;
+  for (int i = 0; i < PERMISSIONS_WIDTH - 1; i++) { permissions[i + 1] = (mode & bits[i]) ? "rwx"[i % 3] : '-'; }
+  permissions[PERMISSIONS_WIDTH] = '\0';
+  char time_str[MTIME_WIDTH + 1];
+  formatMtime(mtime, time_str);
+  fprintf(stream, "%s %-*s %*llu %-*s %s%s%s\n", permissions, OWNER_GROUP_WIDTH, owner_group, FILE_SIZE_WIDTH, size,
+          MTIME_WIDTH, time_str, curr_path, link != NULL ? " link to " : "", link != NULL ? link : "");
+}
+
+/**
+ * Joins an owner and group for printing, using the ids for unnamed ones
+ *
+ * @param owner_group where to store the text, NAME_SIZE * 2 bytes
+ * @param uname the name of the owner, or an empty string
+ * @param uid the id of the owner
+ * @param gname the name of the group, or an empty string
+ * @param gid the id of the group
+ */
+static void formatOwnerGroup(char* owner_group, const char* uname, unsigned long uid, const char* gname,
+                             unsigned long gid) {
+  char owner[NAME_SIZE], group[NAME_SIZE];
+  if (uname[0] == '\0') {
+    snprintf(owner, sizeof(owner), "%lu", uid);
+  } else {
+    snprintf(owner, sizeof(owner), "%s", uname);
+  }
+  if (gname[0] == '\0') {
+    snprintf(group, sizeof(group), "%lu", gid);
+  } else {
+    snprintf(group, sizeof(group), "%s", gname);
+  }
+  snprintf(owner_group, NAME_SIZE * 2, "%s/%s", owner, group);
+}
+
+/**
+ * Prints a file being archived from its status, with names from the cache
+ *
+ * @param stream the stream to print to
+ * @param curr_path the path of the member
+ * @param stat the status of the member
+ * @param link the member the file is a hard link to, or NULL
+ */
+static void printVerbose(FILE* stream, const char* curr_path, const struct stat* stat, const char* link) {
+  STATS_START(started);
+  char uname[NAME_SIZE], gname[NAME_SIZE], owner_group[NAME_SIZE * 2];
+  namesUser(stat->st_uid, uname);
+  namesGroup(stat->st_gid, gname);
+  formatOwnerGroup(owner_group, uname, stat->st_uid, gname, stat->st_gid);
+  char type = S_ISDIR(stat->st_mode) ? 'd' : S_ISLNK(stat->st_mode) ? 'l' : link != NULL ? 'h' : '-';
+  printMember(stream, type, stat->st_mode, owner_group,
+              S_ISREG(stat->st_mode) && link == NULL ? (unsigned long long)stat->st_size : 0ULL, stat->st_mtime,
+              curr_path, link);
+  STATS_END(STATS_VERBOSE, started, 0);
+}
+
+/**
+ * Prints a member read from an archive from its header, without consulting
+ * the user and group databases
+ *
+ * @param stream the stream to print to
+ * @param member the decoded header of the member
+ */
+static void printListing(FILE* stream, const ArchiveMember* member) {
+  STATS_START(started);
+  char owner_group[NAME_SIZE * 2];
+  formatOwnerGroup(owner_group, member->uname, member->uid, member->gname, member->gid);
+  int hard_link = member->typeflag == HARD_LINK;
+  int directory = member->typeflag == DIRECTORY || member->typeflag == GNU_DUMPDIR;
+  char type = directory ? 'd' : member->typeflag == SYMBOLIC_LINK ? 'l' : hard_link ? 'h' : '-';
+  off_t size = member->sparse_size >= 0 ? member->sparse_size : member->size;
+  printMember(stream, type, member->mode, owner_group, size, member->mtime, member->path,
+              hard_link ? member->linkname : NULL);
+  STATS_END(STATS_VERBOSE, started, 0);
+}
+
+/**
+ * Writes a pax header holding extended records for the member after it, or
+ * global records for the rest of the archive
+ *
+ * @param outfile the archive being written
+ * @param path the path of the member the records describe
+ * @param stat the status of that member
+ * @param keys the keywords of the records
+ * @param values the values of the records
+ * @param num_records the number of records
+ * @param typeflag PAX_EXTENDED or PAX_GLOBAL
+ */
+static void writePax(BufferedFile* outfile, const char* path, const struct stat* stat, const char** keys,
+                     const char** values, size_t num_records, char typeflag) {
+  size_t capacity = 0, length = 0;
+  for (size_t i = 0; i < num_records; i++) { capacity += strlen(keys[i]) + strlen(values[i]) + PAX_RECORD_OVERHEAD; }
+  char* records = (char*)safeMalloc(capacity);
+  for (size_t i = 0; i < num_records; i++) { length += paxRecord(records + length, keys[i], values[i]); }
+  USTARHeader header;
+  buildPaxHeader(&header, path, stat, length, typeflag);
+  memcpy(safeBufferedReserve(outfile, sizeof(header)), &header, sizeof(header));
+  safeBufferedWrite(outfile, records, length);
+  safeBufferedZero(outfile, paddedSize(length) - length);
+  safeFree(records);
+}
+
+/**
+ * Writes the header of a single file, directory or symbolic link. The header
+ * is built in place inside the output buffer. A file already archived under
+ * another hard link is written as a link to that member, without its data,
+ * and so is a copy of an archived file, marked so that it is extracted as a
+ * copy.
+ *
+ * @param outfile the archive being written
+ * @param entry the member to archive
+ * @param options the settings of the archive operation
+ * @param index the index to record the member in, or NULL
+ * @return nonzero if the header was written and the member's data must follow
+ */
+static int writeHeader(BufferedFile* outfile, TraverseEntry* entry, const ArchiveOptions* options,
+                       IndexWriter* index) {
+  char* curr_path = entry->path;
+  struct stat* stat = &entry->st;
+  if (!S_ISREG(stat->st_mode) && !S_ISDIR(stat->st_mode) && !S_ISLNK(stat->st_mode)) {
+    fprintf(stderr, "%s: file type not supported; not dumped\n", curr_path);
+    return 0;
+  }
+  /* Symbolic links are stored as links rather than followed */
   char linkname[PATH_MAX];
-  ssize_t r = readlink(curr_path, linkname, sizeof(linkname) - 1);
-  if (!(r < 0)) {
-    linkname[r] = '\0';
-    struct stat* link_stat = safeMalloc(sizeof(struct stat));
-    safeLstat(curr_path, link_stat);
-    if (S_ISREG(link_stat->st_mode)) {
-      handleFileContents(outfile, linkname);
-    } else if (S_ISDIR(link_stat->st_mode)) {
-      handleDirContents(outfile, linkname, verbose, strict);
-    } else if (S_ISLNK(link_stat->st_mode)) {
-      handleLinkContents(outfile, linkname, verbose, strict);
+  if (S_ISLNK(stat->st_mode)) {
+    ssize_t r = readlinkat(entry->dirfd, entry->name, linkname, sizeof(linkname) - 1);
+    linkname[r < 0 ? 0 : r] = '\0';
+  }
+  USTARHeader header;
+  const char* target = S_ISLNK(stat->st_mode) ? linkname : entry->link;
+  STATS_START(started);
+  int status = buildHeader(&header, curr_path, stat, target);
+  STATS_END(STATS_HEADER, started, 0);
+  if (status != HEADER_OK && options->strict) {
+    /* Strict mode only writes members that conform to the POSIX-specified
+     * USTAR archive format */
+    if (options->verbose) {
+      fprintf(options->listing, "Error: %s cannot be represented in a USTAR header\n", curr_path);
     }
+    return 0;
   }
+  off_t header_offset = outfile->offset;
+  if ((status & (HEADER_LONG_PATH | HEADER_LONG_LINK)) || entry->duplicate) {
+    /* Names too long for the header go in a pax header before it; a
+     * directory keeps its trailing slash there too */
+    size_t length = strlen(curr_path);
+    char* path = (char*)safeMalloc(length + 2);
+    snprintf(path, length + 2, "%s%s", curr_path, S_ISDIR(stat->st_mode) && curr_path[length - 1] != '/' ? "/" : "");
+    const char* keys[3];
+    const char* values[3];
+    size_t num_records = 0;
+    if (status & HEADER_LONG_PATH) {
+      keys[num_records] = "path";
+      values[num_records++] = path;
+    }
+    if (status & HEADER_LONG_LINK) {
+      keys[num_records] = "linkpath";
+      values[num_records++] = target;
+    }
+    if (entry->duplicate) {
+      keys[num_records] = PAX_DUPLICATE_KEY;
+      values[num_records++] = "1";
+    }
+    writePax(outfile, curr_path, stat, keys, values, num_records, PAX_EXTENDED);
+    safeFree(path);
+  }
+  memcpy(safeBufferedReserve(outfile, sizeof(header)), &header, sizeof(header));
+  if (index != NULL) {
+    indexWriterAdd(index, curr_path, header_offset, header.typeflag == REGULAR_FILE ? stat->st_size : 0,
+                   header.typeflag);
+  }
+  if (options->verbose) { printVerbose(options->listing, curr_path, stat, entry->link); }
+  return entry->link == NULL;
 }
 
-void createArchiveHelper(int outfile, char* curr_path, int verbose, int strict) {
-  int passing_strict = 1;
-  int success_writing = 1;
-  uint8_t checksum = 0;
-  /* Get the stat of the file/directory */
-  struct stat* stat = safeMalloc(sizeof(struct stat));
-  safeLstat(curr_path, stat);
-  /* Store the name in a string */
-  char* header_name = (char*)safeCalloc(sizeof(char), ARCHIVE_NAME_SIZE);
-  strncpy(header_name, curr_path, ARCHIVE_NAME_SIZE);
-  checksum += strlen(header_name);
-  /* Store the mode in a string */
-  char* header_mode = (char*)safeCalloc(sizeof(char), ARCHIVE_MODE_SIZE);
-  snprintf(header_mode, ARCHIVE_MODE_SIZE, "%07o", (unsigned int)stat->st_mode & DEFAULT_PERMISSIONS);
-  checksum += strlen(header_mode);
-  /* Store the user id in a string */
-  char* header_uid = (char*)safeCalloc(sizeof(char), ARCHIVE_UID_SIZE);
-  snprintf(header_uid, ARCHIVE_UID_SIZE, "%o", stat->st_uid);
-  printf("header_uid: %s\n", header_uid);
-  if (sizeof(header_uid) > ARCHIVE_UID_SIZE - NULL_TERMINATOR_SIZE) {
-    if (strict && verbose) {
-      printf("Error: uid %d is too large to be represented in the archive\n", stat->st_uid);
-      passing_strict = 0;
+/**
+ * Archives a file with holes as a sparse member, storing only its data runs.
+ * Strict mode stores every file in full, as sparse members need pax headers.
+ *
+ * @param outfile the archive being written
+ * @param entry the member to archive
+ * @param options the settings of the archive operation
+ * @param index the index to record the member in, or NULL
+ * @return nonzero if the file was archived, zero if it has no holes and must
+ * be archived as usual
+ */
+static int writeSparse(BufferedFile* outfile, TraverseEntry* entry, const ArchiveOptions* options,
+                       IndexWriter* index) {
+  struct stat* stat = &entry->st;
+  if (options->strict || entry->link != NULL || !sparseCandidate(stat)) { return 0; }
+  int infile = safeOpenAt(entry->dirfd, entry->name, O_RDONLY, 0);
+  SparseMap map;
+  if (!sparseScan(infile, stat->st_size, &map)) {
+    sparseFree(&map);
+    safeClose(infile);
+    return 0;
+  }
+  size_t map_length;
+  char* map_text = sparseFormat(&map, &map_length);
+  /* The real name and size travel in a pax header; the member itself holds
+   * the map followed by the data runs */
+  char size_text[SPARSE_NUMBER_SIZE];
+  snprintf(size_text, sizeof(size_text), "%lld", (long long)stat->st_size);
+  const char* keys[] = {"GNU.sparse.major", "GNU.sparse.minor", "GNU.sparse.name", "GNU.sparse.realsize"};
+  const char* values[] = {"1", "0", entry->path, size_text};
+  off_t header_offset = outfile->offset;
+  writePax(outfile, entry->path, stat, keys, values, sizeof(keys) / sizeof(keys[0]), PAX_EXTENDED);
+  USTARHeader header;
+  struct stat stored = *stat;
+  stored.st_size = paddedSize(map_length) + map.data_size;
+  char name[ARCHIVE_NAME_SIZE + NULL_TERMINATOR_SIZE];
+  headerAuxName(name, entry->path, SPARSE_FILE_DIR);
+  buildHeader(&header, name, &stored, NULL);
+  memcpy(safeBufferedReserve(outfile, sizeof(header)), &header, sizeof(header));
+  if (index != NULL) { indexWriterAdd(index, entry->path, header_offset, stored.st_size, header.typeflag); }
+  if (options->verbose) { printVerbose(options->listing, entry->path, stat, NULL); }
+  safeBufferedWrite(outfile, map_text, map_length);
+  safeBufferedZero(outfile, paddedSize(map_length) - map_length);
+  for (size_t i = 0; i < map.count; i++) {
+    SparseExtent* extent = &map.extents[i];
+    off_t copied = 0;
+    if (lseek(infile, extent->offset, SEEK_SET) != FILE_ERROR) {
+      copied = safeBufferedCopy(outfile, infile, extent->length);
     }
-    if (insert_special_int(header_uid, ARCHIVE_UID_SIZE, stat->st_uid) != 0) {
-      if (strict && verbose) {
-        printf("Error: unable to insert uid %d into header\n", stat->st_uid);
-        success_writing = 0;
-      }
+    if (copied < extent->length) {
+      fprintf(stderr, "%s: file shrank by %lld bytes; padding with zeros\n", entry->path,
+              (long long)(extent->length - copied));
+      safeBufferedZero(outfile, extent->length - copied);
     }
-    printf("uid: %d\n", stat->st_uid);
-    printf("header_uid: %s\n", header_uid);
-  } else {
-    snprintf(header_uid, ARCHIVE_UID_SIZE, "%07o", stat->st_uid);
-  }
-  checksum += strlen(header_uid);
-  /* Store the group id in a string */
-  char* header_gid = (char*)safeCalloc(sizeof(char), ARCHIVE_GID_SIZE);
-  snprintf(header_gid, ARCHIVE_GID_SIZE, "%07o", stat->st_gid);
-  checksum += strlen(header_gid);
-  /* Store the size in a string */
-  char* header_size = (char*)safeCalloc(sizeof(char), ARCHIVE_SIZE_SIZE);
-  snprintf(header_size, ARCHIVE_SIZE_SIZE, "%011o", (unsigned int)stat->st_size);
-  checksum += strlen(header_size);
-  /* Store the mtime in a string */
-  char* header_mtime = (char*)safeCalloc(sizeof(char), ARCHIVE_MTIME_SIZE);
-  snprintf(header_mtime, ARCHIVE_MTIME_SIZE, "%011o", (unsigned int)stat->st_mtime);
-  checksum += strlen(header_mtime);
-  /* Store the typeflag in a string */
-  FileType header_typeflag;
-  if (S_ISREG(stat->st_mode)) {
-    header_typeflag = REGULAR_FILE;
-  } else if (S_ISLNK(stat->st_mode)) {
-    header_typeflag = SYMBOLIC_LINK;
+  }
+  safeBufferedZero(outfile, paddedSize(map.data_size) - map.data_size);
+  safeFree(map_text);
+  sparseFree(&map);
+  safeClose(infile);
+  return 1;
+}
+
+/**
+ * Archives a single file, directory or symbolic link; the children of a
+ * directory are returned separately by the traversal
+ *
+ * @param outfile the archive being written
+ * @param entry the member to archive
+ * @param options the settings of the archive operation
+ * @param index the index to record the member in, or NULL
+ */
+void createArchiveHelper(BufferedFile* outfile, TraverseEntry* entry, const ArchiveOptions* options,
+                         IndexWriter* index) {
+  STATS_START(started);
+  if (writeSparse(outfile, entry, options, index)) {
+    STATS_FILE(entry->st.st_size, started);
+    return;
+  }
+  if (writeHeader(outfile, entry, options, index) && S_ISREG(entry->st.st_mode)) {
+    handleFileContents(outfile, entry);
+    STATS_FILE(entry->st.st_size, started);
+  }
+}
+
+/**
+ * Archives a member whose contents were read ahead by the pipeline, draining
+ * its chunks in order
+ *
+ * @param outfile the archive being written
+ * @param prefetcher the pipeline that read the member
+ * @param job the member to archive
+ * @param options the settings of the archive operation
+ * @param index the index to record the member in, or NULL
+ */
+static void handlePrefetchedContents(BufferedFile* outfile, Prefetcher* prefetcher, PrefetchJob* job,
+                                     const ArchiveOptions* options, IndexWriter* index) {
+  if (job->entry.unchanged) { return; }
+  /* Files that may have holes are left to this thread, which reads only
+   * their data runs */
+  if (sparseCandidate(&job->entry.st) && job->entry.link == NULL) {
+    createArchiveHelper(outfile, &job->entry, options, index);
+    return;
+  }
+  STATS_START(started);
+  int written = writeHeader(outfile, &job->entry, options, index);
+  PrefetchChunk* chunk;
+  while ((chunk = prefetchChunk(prefetcher, job)) != NULL) {
+    if (written) { safeBufferedWrite(outfile, chunk->data, chunk->length); }
+    prefetchRelease(prefetcher, chunk);
+  }
+  if (!written || !S_ISREG(job->entry.st.st_mode)) { return; }
+  off_t file_size = job->entry.st.st_size;
+  if (job->read_offset < file_size) {
+    fprintf(stderr, "%s: file shrank by %lld bytes; padding with zeros\n", job->entry.path,
+            (long long)(file_size - job->read_offset));
+    safeBufferedZero(outfile, file_size - job->read_offset);
+  }
+  safeBufferedZero(outfile, (ARCHIVE_BLOCK_SIZE - file_size % ARCHIVE_BLOCK_SIZE) % ARCHIVE_BLOCK_SIZE);
+  STATS_FILE(file_size, started);
+}
+
+/**
+ * Opens an archive, where ARCHIVE_STDIO stands for standard input when
+ * reading and standard output when writing
+ *
+ * @param archive_name the name of the archive
+ * @param flags the flags to open the archive with
+ * @return the file descriptor of the archive
+ */
+static int openArchive(char* archive_name, int flags) {
+  int writing = (flags & O_ACCMODE) != O_RDONLY;
+  if (strcmp(archive_name, ARCHIVE_STDIO) != 0) { return safeOpen(archive_name, flags, S_IRWXU); }
+  if (writing && isatty(STDOUT_FILENO)) {
+    fprintf(stderr, "Refusing to write archive contents to a terminal\n");
+    exit(EXIT_FAILURE);
+  }
+  return writing ? STDOUT_FILENO : STDIN_FILENO;
+}
+
+/**
+ * Closes an archive opened by openArchive, leaving standard input and output
+ * open
+ *
+ * @param archive_name the name of the archive
+ * @param fd the file descriptor of the archive
+ */
+static void closeArchive(char* archive_name, int fd) {
+  if (strcmp(archive_name, ARCHIVE_STDIO) != 0) { safeClose(fd); }
+}
+
+/**
+ * Writes a collected index next to its archive
+ *
+ * @param index the index to write, which is freed
+ * @param archive_name the name of the finished archive
+ */
+static void saveIndex(IndexWriter* index, char* archive_name) {
+  /* The archive may be open for writing only, so it is read through its name */
+  int fd = safeOpen(archive_name, O_RDONLY | O_CLOEXEC, 0);
+  char* path = indexPath(archive_name);
+  indexWriterSave(index, path, fd);
+  safeFree(path);
+  safeClose(fd);
+  indexWriterClose(index);
+}
+
+/**
+ * Records the paths that disappeared since the previous snapshot in a global
+ * pax header, which extraction with a snapshot applies
+ *
+ * @param outfile the archive being written
+ * @param previous the manifest of the previous run
+ * @param snapshot the manifest of this run
+ */
+static void writeDeleted(BufferedFile* outfile, const Snapshot* previous, SnapshotWriter* snapshot) {
+  size_t length;
+  char* deleted = snapshotDeleted(previous, snapshot, &length);
+  if (deleted == NULL) { return; }
+  deleted = (char*)safeRealloc(deleted, length + NULL_TERMINATOR_SIZE);
+  deleted[length] = '\0';
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+  st.st_uid = getuid();
+  st.st_gid = getgid();
+  st.st_mtime = time(NULL);
+  const char* keys[] = {PAX_DELETED_KEY};
+  const char* values[] = {deleted};
+  writePax(outfile, PAX_GLOBAL_NAME, &st, keys, values, 1, PAX_GLOBAL);
+  safeFree(deleted);
+}
+
+/**
+ * Archives files after whatever the archive already holds, then writes the end
+ * of archive marker and pads the archive to a whole record
+ *
+ * @param outfile the archive being written
+ * @param file_count the number of files to archive
+ * @param file_names an array of file names to archive
+ * @param options the settings of the archive operation
+ * @param previous the manifest or archive contents that unchanged files are
+ * found in, or NULL to archive every file
+ * @param snapshot the manifest to record every file in, or NULL
+ * @param index the index to record the members in, or NULL
+ */
+static void writeMembers(BufferedFile* outfile, int file_count, char* file_names[], const ArchiveOptions* options,
+                         const Snapshot* previous, SnapshotWriter* snapshot, IndexWriter* index) {
+  Traversal* traversal = traverseOpen(file_names, file_count, options->threads, previous, snapshot, options->dedup);
+  if (options->readers > 0 || options->io_uring) {
+    /* Reader threads fetch upcoming files while this thread writes; io_uring
+     * needs them to gather small files into batches */
+    size_t readers = options->readers > 0 ? options->readers : 1;
+    Prefetcher* prefetcher =
+        prefetchOpen(traversal, readers, options->read_ahead, options->inflight, safeUseUring(options->io_uring));
+    PrefetchJob* job;
+    while ((job = prefetchNext(prefetcher)) != NULL) {
+      handlePrefetchedContents(outfile, prefetcher, job, options, index);
+      prefetchDone(prefetcher, job);
+    }
+    prefetchClose(prefetcher);
   } else {
-    header_typeflag = DIRECTORY;
-  }
-  printf("header_typeflag: %c\n", header_typeflag);
-  checksum++;
-  /* Store the linkname in a string */
-  char* header_linkname = (char*)safeCalloc(sizeof(char), ARCHIVE_LINKNAME_SIZE);
-  snprintf(header_linkname, ARCHIVE_LINKNAME_SIZE, "%s", "");
-  checksum += strlen(header_linkname);
-  /* Store the magic number in a string */
-  char* header_magic = (char*)safeCalloc(sizeof(char), ARCHIVE_MAGIC_SIZE + 1);
-  snprintf(header_magic, ARCHIVE_MAGIC_SIZE + 1, "%s", ARCHIVE_MAGIC);
-  checksum += strlen(header_magic);
-  /* Store the version in a string */
-  char* header_version = (char*)safeCalloc(sizeof(char), ARCHIVE_VERSION_SIZE + 1);
-  snprintf(header_version, ARCHIVE_VERSION_SIZE + 1, "%s", ARCHIVE_VERSION);
-  checksum += strlen(header_version);
-  /* Store the username in a string */
-  char* header_uname = (char*)safeCalloc(sizeof(char), ARCHIVE_UNAME_SIZE);
-  snprintf(header_uname, ARCHIVE_UNAME_SIZE, "%s", "cs537");
-  checksum += strlen(header_uname);
-  /* Store the group name in a string */
-  char* header_gname = (char*)safeCalloc(sizeof(char), ARCHIVE_GNAME_SIZE);
-  snprintf(header_gname, ARCHIVE_GNAME_SIZE, "%s", "cs537");
-  checksum += strlen(header_gname);
-  /* Store the devmajor in a string */
-  char* header_devmajor = (char*)safeCalloc(sizeof(char), ARCHIVE_DEVMAJOR_SIZE + 1);
-  snprintf(header_devmajor, ARCHIVE_DEVMAJOR_SIZE + 1, "%08o", 0);
-  checksum += strlen(header_devmajor);
-  /* Store the devminor in a string */
-  char* header_devminor = (char*)safeCalloc(sizeof(char), ARCHIVE_DEVMINOR_SIZE + 1);
-  snprintf(header_devminor, ARCHIVE_DEVMINOR_SIZE + 1, "%08o", 0);
-  checksum += strlen(header_devminor);
-  /* Store the prefix in a string */
-  char* header_prefix = (char*)safeCalloc(sizeof(char), ARCHIVE_PREFIX_SIZE);
-  snprintf(header_prefix, ARCHIVE_PREFIX_SIZE, "%s", "");
-  checksum += strlen(header_prefix);
-  /* Store the chksum in a string */
-  char* header_chksum = (char*)safeCalloc(sizeof(char), ARCHIVE_CHKSUM_SIZE + 1);
-  checksum += ARCHIVE_CHKSUM_SIZE;
-  snprintf(header_chksum, ARCHIVE_CHKSUM_SIZE + 1, "%08o", 0);
-  if ((!strict || (strict && passing_strict)) && success_writing) {
-    /* Write the file contents to the archive if strict mode enabled and the
-     * file is conforming to the POSIX-specified USTAR archive format or if
-     * strict mode is not enabled */
-    /* Write the string to the archive */
-    safeWrite(outfile, header_name, ARCHIVE_NAME_SIZE);
-    safeFree(header_name);
-    /* Write the mode to the archive */
-    safeWrite(outfile, header_mode, ARCHIVE_MODE_SIZE);
-    safeFree(header_mode);
-    /* Write the uid to the archive */
-    safeWrite(outfile, header_uid, ARCHIVE_UID_SIZE);
-    safeFree(header_uid);
-    /* Write the gid to the archive */
-    safeWrite(outfile, header_gid, ARCHIVE_GID_SIZE);
-    safeFree(header_gid);
-    /* Write the size to the archive */
-    safeWrite(outfile, header_size, ARCHIVE_SIZE_SIZE);
-    safeFree(header_size);
-    /* Write the mtime to the archive */
-    safeWrite(outfile, header_mtime, ARCHIVE_MTIME_SIZE);
-    safeFree(header_mtime);
-    /* Write the chksum to the archive */
-    safeWrite(outfile, header_chksum, ARCHIVE_CHKSUM_SIZE);
-    safeFree(header_chksum);
-    /* Write the typeflag to the archive */
-    safeWrite(outfile, &header_typeflag, ARCHIVE_TYPEFLAG_SIZE);
-    /* Write the linkname to the archive */
-    safeWrite(outfile, header_linkname, ARCHIVE_LINKNAME_SIZE);
-    safeFree(header_linkname);
-    /* Write the magic to the archive */
-    safeWrite(outfile, header_magic, ARCHIVE_MAGIC_SIZE);
-    safeFree(header_magic);
-    /* Write the version to the archive */
-    safeWrite(outfile, header_version, ARCHIVE_VERSION_SIZE);
-    safeFree(header_version);
-    /* Write the uname to the archive */
-    safeWrite(outfile, header_uname, ARCHIVE_UNAME_SIZE);
-    safeFree(header_uname);
-    /* Write the gname to the archive */
-    safeWrite(outfile, header_gname, ARCHIVE_GNAME_SIZE);
-    safeFree(header_gname);
-    /* Write the devmajor to the archive */
-    safeWrite(outfile, header_devmajor, ARCHIVE_DEVMAJOR_SIZE);
-    safeFree(header_devmajor);
-    /* Write the devminor to the archive */
-    safeWrite(outfile, header_devminor, ARCHIVE_DEVMINOR_SIZE);
-    safeFree(header_devminor);
-    /* Write the prefix to the archive */
-    safeWrite(outfile, header_prefix, ARCHIVE_PREFIX_SIZE);
-    safeFree(header_prefix);
-  }
-  /* print out file permissions, the owner/group, the size, last modification
-   * time and the filename*/
-  if (verbose) {
-    struct passwd* pwd = getpwuid(stat->st_uid);
-    struct group* grp = getgrgid(stat->st_gid);
-    char time_str[MTIME_WIDTH + 1] = {0};
-    char owner_group[OWNER_GROUP_WIDTH + 1];
-    snprintf(owner_group, OWNER_GROUP_WIDTH + 1, "%s/%s", pwd->pw_name, grp->gr_name);
-    strftime(time_str, MTIME_WIDTH + 1, "%Y-%m-%d %H:%M", localtime(&stat->st_mtime));
-    printf("%c%c%c%c%c%c%c%c%c%c ",
-           (S_ISDIR(stat->st_mode))   ? 'd'
-           : (S_ISLNK(stat->st_mode)) ? 'l'
-                                      : '-',
-           (stat->st_mode & S_IRUSR) ? 'r' : '-', (stat->st_mode & S_IWUSR) ? 'w' : '-',
-           (stat->st_mode & S_IXUSR) ? 'x' : '-', (stat->st_mode & S_IRGRP) ? 'r' : '-',
-           (stat->st_mode & S_IWGRP) ? 'w' : '-', (stat->st_mode & S_IXGRP) ? 'x' : '-',
-           (stat->st_mode & S_IROTH) ? 'r' : '-', (stat->st_mode & S_IWOTH) ? 'w' : '-',
-           (stat->st_mode & S_IXOTH) ? 'x' : '-');
-    printf("%-*s", OWNER_GROUP_WIDTH, owner_group);
-    printf(" %*lu", SIZE_WIDTH, (unsigned long)stat->st_size);
-    printf(" %-*s", MTIME_WIDTH, time_str);
-    printf(" %s\n", curr_path);
-  }
-  if (S_ISREG(stat->st_mode)) {
-    handleFileContents(outfile, curr_path);
-  } else if (S_ISDIR(stat->st_mode)) {
-    handleDirContents(outfile, curr_path, verbose, strict);
-  } else if (S_ISLNK(stat->st_mode)) {
-    handleLinkContents(outfile, curr_path, verbose, strict);
-  }
-}
-
-/**
- * Creates a tar archive
+    TraverseEntry* entry;
+    while ((entry = traverseNext(traversal)) != NULL) {
+      if (!entry->unchanged) { createArchiveHelper(outfile, entry, options, index); }
+    }
+  }
+  traverseClose(traversal);
+  if (previous != NULL && snapshot != NULL) { writeDeleted(outfile, previous, snapshot); }
+  /* Write the End of Archive marker which consists of two blocks of all zero
+   * bytes, then pad the archive to a whole record */
+  safeBufferedZero(outfile, ARCHIVE_BLOCK_SIZE * ARCHIVE_END_BLOCKS);
+  safeBufferedClose(outfile);
+}
+
+/**
+ * Creates a tar archive. With a snapshot, only files that changed since the
+ * snapshot was taken are stored, along with every directory and the list of
+ * paths that disappeared, and the snapshot is replaced by one of this run.
+ * Without an index of its own, the archive loses any index left next to it.
  *
  * @param archive_name the name of the archive to create
  * @param file_count the number of files to archive
  * @param file_names an array of file names to archive
- * @param verbose a flag to indicate whether to give verbose output while
- creating the archive
- * @param strict a flag to indicate whether to be strict on files conforming
- to the POSIX-specified USTAR archive format
- */
-void createArchive(char* archive_name, int file_count, char* file_names[], int verbose, int strict) {
-  int outfile = safeOpen(archive_name, (O_WRONLY | O_CREAT | O_TRUNC), S_IRWXU);
-  for (int i = 0; i < file_count; i++) { createArchiveHelper(outfile, file_names[i], verbose, strict); }
-  /* Write the End of Archive marker which consists of two blocks of all zero
-   * bytes */
-  char* end_padding = (char*)safeCalloc(sizeof(char), ARCHIVE_BLOCK_SIZE * 2);
-  safeWrite(outfile, end_padding, ARCHIVE_BLOCK_SIZE * 2);
-  safeFree(end_padding);
-  safeClose(outfile);
+ * @param options the settings of the archive operation
+ */
+void createArchive(char* archive_name, int file_count, char* file_names[], const ArchiveOptions* options) {
+  int fd = openArchive(archive_name, O_WRONLY | O_CREAT | O_TRUNC);
+  Compressor* compressor =
+      options->compression != COMPRESS_NONE ? compressOpen(fd, options->compression, options->compress_threads) : NULL;
+  BufferedFile* outfile = safeBufferedOpen(fd, options->blocking_factor * ARCHIVE_BLOCK_SIZE, compressor);
+  if (options->direct) { safeBufferedBypassCache(outfile); }
+  Snapshot* previous = options->snapshot != NULL ? snapshotOpen(options->snapshot) : NULL;
+  SnapshotWriter* snapshot = options->snapshot != NULL ? snapshotWriterOpen() : NULL;
+  IndexWriter* index = options->index ? indexWriterOpen() : NULL;
+  if (index == NULL && strcmp(archive_name, ARCHIVE_STDIO) != 0) {
+    /* An index left by an earlier archive of this name no longer applies */
+    char* path = indexPath(archive_name);
+    unlink(path);
+    safeFree(path);
+  }
+  writeMembers(outfile, file_count, file_names, options, previous, snapshot, index);
+  if (compressor != NULL) { compressClose(compressor); }
+  if (index != NULL) { saveIndex(index, archive_name); }
+  closeArchive(archive_name, fd);
+  /* The new snapshot only replaces the old one once the archive is complete */
+  if (snapshot != NULL) {
+    snapshotWriterSave(snapshot, options->snapshot);
+    snapshotWriterClose(snapshot);
+  }
+  if (previous != NULL) { snapshotClose(previous); }
 }
 
 /**
- * Lists the contents of a tar archive
+ * Finds where the end of archive marker of an existing archive starts. With a
+ * usable index the walk starts at the last member it records; otherwise every
+ * header is visited, skipping over the data of the members between them.
+ * Searching backwards from the end of the file is not attempted, as the data
+ * of the last member may end in zero blocks just like the marker.
+ *
+ * @param archive_name the name of the archive
+ * @param fd the file descriptor of the archive
+ * @param index where to store the index to extend, which is collected from
+ * the existing index or the walk when one exists or options ask for one, or
+ * NULL
+ * @param options the settings of the archive operation
+ * @param members the manifest to record the path and time of every member in,
+ * or NULL; the walk then visits every header
+ * @return the offset of the end of archive marker
+ */
+static off_t findArchiveEnd(char* archive_name, int fd, IndexWriter** index, const ArchiveOptions* options,
+                            SnapshotWriter* members) {
+  struct stat st;
+  safeFstat(fd, &st);
+  *index = options->index ? indexWriterOpen() : NULL;
+  if (st.st_size == 0) { return 0; }
+  ArchiveReader* reader = readerOpen(fd, 1);
+  if (reader->decompressor != NULL) {
+    fprintf(stderr, "%s: cannot append to a compressed archive\n", archive_name);
+    exit(EXIT_FAILURE);
+  }
+  /* Members up to the last one the index records are already known */
+  off_t known = -1;
+  char* path = indexPath(archive_name);
+  ArchiveIndex* existing = indexOpen(path, fd);
+  if (existing != NULL) {
+    if (*index == NULL) { *index = indexWriterOpen(); }
+    if (indexWriterMerge(*index, existing)) {
+      /* Walk the whole archive and rebuild the index from scratch */
+      fprintf(stderr, "%s: index is stale or damaged; ignoring it\n", path);
+      indexWriterClose(*index);
+      *index = indexWriterOpen();
+      indexClose(existing);
+      existing = NULL;
+    }
+  }
+  safeFree(path);
+  if (existing != NULL) {
+    for (size_t i = 0; i < existing->count; i++) {
+      if ((off_t)existing->entries[i].header_offset > known) { known = existing->entries[i].header_offset; }
+    }
+    if (members == NULL && known >= 0) { readerSeek(reader, known); }
+    indexClose(existing);
+  }
+  ArchiveMember member;
+  int status;
+  while ((status = readerNextMember(reader, &member, archive_name, options->strict)) == READER_MEMBER) {
+    if (*index != NULL && member.header_offset > known) {
+      indexWriterAdd(*index, member.path, member.header_offset, member.size, member.typeflag);
+    }
+    if (members != NULL) {
+      /* Directories are archived with a trailing slash but walked without */
+      size_t length = strlen(member.path);
+      while (length > 1 && member.path[length - 1] == '/') { member.path[--length] = '\0'; }
+      struct stat archived;
+      memset(&archived, 0, sizeof(archived));
+      archived.st_mtim.tv_sec = member.mtime;
+      snapshotWriterAdd(members, member.path, &archived);
+    }
+    readerSkip(reader, paddedSize(member.size));
+  }
+  if (status == READER_TRUNCATED) {
+    fprintf(stderr, "%s: unexpected end of archive; not appending\n", archive_name);
+    exit(EXIT_FAILURE);
+  }
+  off_t end = reader->offset - ARCHIVE_BLOCK_SIZE;
+  readerClose(reader);
+  return end;
+}
+
+/**
+ * Adds files to the end of an existing archive, or creates it if it does not
+ * exist. The new members overwrite the old end of archive marker, so only the
+ * new data is written. An index next to the archive is extended to cover them.
+ *
+ * @param archive_name the name of the archive to add to
+ * @param file_count the number of files to archive
+ * @param file_names an array of file names to archive
+ * @param options the settings of the archive operation
+ * @param update nonzero to add only files newer than their copies in the
+ * archive
+ */
+void appendArchive(char* archive_name, int file_count, char* file_names[], const ArchiveOptions* options,
+                   int update) {
+  int fd = openArchive(archive_name, O_RDWR | O_CREAT);
+  SnapshotWriter* members = update ? snapshotWriterOpen() : NULL;
+  IndexWriter* index;
+  off_t end = findArchiveEnd(archive_name, fd, &index, options, members);
+  Snapshot* archived = members != NULL ? snapshotFromWriter(members) : NULL;
+  if (lseek(fd, end, SEEK_SET) == FILE_ERROR) {
+    perror("Error seeking to the end of the archive.\n");
+    exit(EXIT_FAILURE);
+  }
+  BufferedFile* outfile = safeBufferedOpen(fd, options->blocking_factor * ARCHIVE_BLOCK_SIZE, NULL);
+  /* Offsets, and the record padding, count from the start of the archive */
+  outfile->offset = end;
+  writeMembers(outfile, file_count, file_names, options, archived, NULL, index);
+  /* Drop whatever lay past the old marker's padding */
+  off_t size = lseek(fd, 0, SEEK_CUR);
+  if (size == FILE_ERROR || ftruncate(fd, size) == FILE_ERROR) {
+    perror("Error truncating the archive.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (index != NULL) { saveIndex(index, archive_name); }
+  closeArchive(archive_name, fd);
+  if (archived != NULL) { snapshotClose(archived); }
+}
+
+/**
+ * Checks whether a member was named on the command line, either itself or
+ * through a directory containing it, and marks the names it matches
+ *
+ * @param path the path of the member
+ * @param name_count the number of names, 0 to match every member
+ * @param names the names given on the command line
+ * @param found the flags marking the names matched so far
+ * @return nonzero if the member matches
+ */
+static int matchMember(const char* path, int name_count, char* names[], int* found) {
+  int matched = name_count == 0;
+  for (int i = 0; i < name_count; i++) {
+    size_t length = strlen(names[i]);
+    while (length > 1 && names[i][length - 1] == '/') { length--; }
+    if (strncmp(path, names[i], length) == 0 && (path[length] == '\0' || path[length] == '/')) {
+      found[i] = 1;
+      matched = 1;
+    }
+  }
+  return matched;
+}
+
+/**
+ * Orders two archive offsets
+ *
+ * @param a the first offset
+ * @param b the second offset
+ * @return a negative, zero or positive number as a is less than, equal to or
+ * greater than b
+ */
+static int compareOffsets(const void* a, const void* b) {
+  off_t x = *(const off_t*)a, y = *(const off_t*)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Looks the named members up in the archive's index
+ *
+ * @param archive_name the name of the archive
+ * @param reader the reader of the archive
+ * @param name_count the number of names
+ * @param names the names given on the command line
+ * @param found the flags marking the names found
+ * @param count where to store the number of offsets
+ * @return the header offsets of the members in archive order, to be freed by
+ * the caller, or NULL if the archive has to be scanned
+ */
+static off_t* lookupMembers(char* archive_name, ArchiveReader* reader, int name_count, char* names[], int* found,
+                            size_t* count) {
+  *count = 0;
+  if (name_count == 0 || !readerCanSeek(reader) || strcmp(archive_name, ARCHIVE_STDIO) == 0) { return NULL; }
+  char* path = indexPath(archive_name);
+  ArchiveIndex* index = indexOpen(path, reader->fd);
+  if (index == NULL) {
+    safeFree(path);
+    return NULL;
+  }
+  off_t* offsets = (off_t*)safeMalloc(sizeof(off_t));
+  for (int i = 0; i < name_count; i++) {
+    off_t* matches;
+    size_t num_matches = indexFind(index, names[i], &matches);
+    if (num_matches == 0 || num_matches == INDEX_DAMAGED) {
+      /* Fall back to scanning, which finds the names again. The archive may
+       * also hold members the index was never told about, so a name the
+       * index lacks is looked for there too. */
+      if (num_matches == INDEX_DAMAGED) { fprintf(stderr, "%s: index is stale or damaged; ignoring it\n", path); }
+      memset(found, 0, name_count * sizeof(int));
+      *count = 0;
+      safeFree(offsets);
+      offsets = NULL;
+      break;
+    }
+    found[i] = 1;
+    offsets = (off_t*)safeRealloc(offsets, (*count + num_matches) * sizeof(off_t));
+    memcpy(offsets + *count, matches, num_matches * sizeof(off_t));
+    *count += num_matches;
+    safeFree(matches);
+  }
+  indexClose(index);
+  safeFree(path);
+  if (offsets == NULL) { return NULL; }
+  /* Visit the members in archive order, once each even if named twice */
+  qsort(offsets, *count, sizeof(off_t), compareOffsets);
+  size_t unique = 0;
+  for (size_t i = 0; i < *count; i++) {
+    if (unique == 0 || offsets[unique - 1] != offsets[i]) { offsets[unique++] = offsets[i]; }
+  }
+  *count = unique;
+  return offsets;
+}
+
+/**
+ * Calls a handler for each member named on the command line, or for every
+ * member if none are named. When the archive has an index and can seek, only
+ * the headers of the named members are visited; otherwise every header is.
+ *
+ * @param archive_name the name of the archive
+ * @param reader the reader of the archive
+ * @param name_count the number of names
+ * @param names the names given on the command line
+ * @param options the settings of the archive operation
+ * @param handler the function to call for each member
+ * @param context the argument passed through to the handler
+ * @return nonzero if the archive was truncated or a name was not found
+ */
+static int scanArchive(char* archive_name, ArchiveReader* reader, int name_count, char* names[],
+                       const ArchiveOptions* options, MemberHandler handler, void* context) {
+  int* found = (int*)safeCalloc(name_count > 0 ? name_count : 1, sizeof(int));
+  size_t num_offsets;
+  off_t* offsets = lookupMembers(archive_name, reader, name_count, names, found, &num_offsets);
+  ArchiveMember member;
+  int failed = 0;
+  for (size_t next = 0; offsets == NULL || next < num_offsets; next++) {
+    if (offsets != NULL) { readerSeek(reader, offsets[next]); }
+    int status = readerNextMember(reader, &member, archive_name, options->strict);
+    if (status == READER_TRUNCATED) {
+      fprintf(stderr, "%s: unexpected end of archive\n", archive_name);
+      failed = 1;
+    }
+    if (status != READER_MEMBER) { break; }
+    off_t consumed = matchMember(member.path, name_count, names, found) ? handler(reader, &member, context) : 0;
+    readerSkip(reader, paddedSize(member.size) - consumed);
+  }
+  for (int i = 0; i < name_count; i++) {
+    if (!found[i]) {
+      fprintf(stderr, "%s: not found in archive\n", names[i]);
+      failed = 1;
+    }
+  }
+  safeFree(offsets);
+  safeFree(found);
+  return failed;
+}
+
+/**
+ * Prints one member of an archive being listed
+ *
+ * @param reader the reader of the archive
+ * @param member the decoded header of the member
+ * @param context the settings of the archive operation
+ * @return 0, as the data of the member is skipped
+ */
+static off_t listMember(ArchiveReader* reader, ArchiveMember* member, void* context) {
+  const ArchiveOptions* options = (const ArchiveOptions*)context;
+  UNUSED(reader);
+  if (options->verbose) {
+    printListing(options->listing, member);
+  } else {
+    fprintf(options->listing, "%s\n", member->path);
+  }
+  return 0;
+}
+
+/**
+ * Lists the contents of a tar archive. Only headers are visited: the data of
+ * each member is skipped, so listing costs one block per member however large
+ * the members are, and with an index only the named members are visited.
  *
  * @param archive_name the name of the archive to list
- * @param verbose a flag to indicate whether to give verbose output while
- listing the archive
- * @param strict a flag to indicate whether to be strict on files conforming
- to the POSIX-specified USTAR archive format
+ * @param name_count the number of members named on the command line
+ * @param names the members to list, or every member if there are none
+ * @param options the settings of the archive operation
  */
-// void listArchive(char *archive_name, int verbose, int strict) {}
+void listArchive(char* archive_name, int name_count, char* names[], const ArchiveOptions* options) {
+  int fd = openArchive(archive_name, O_RDONLY);
+  ArchiveReader* reader = readerOpen(fd, options->compress_threads);
+  int failed = scanArchive(archive_name, reader, name_count, names, options, listMember, (void*)options);
+  readerClose(reader);
+  closeArchive(archive_name, fd);
+  if (failed) { exit(EXIT_FAILURE); }
+}
 
 /**
- * Extracts the contents of a tar archive
+ * Makes a member's path safe to extract by dropping leading slashes
+ *
+ * @param path the path stored in the archive
+ * @return the path relative to the current directory, or NULL if it climbs
+ * out of it
+ */
+static char* memberPath(char* path) {
+  while (*path == '/') { path++; }
+  for (char* c = path; *c != '\0'; c++) {
+    /* Reject any ".." component */
+    if ((c == path || c[-1] == '/') && c[0] == '.' && c[1] == '.' && (c[2] == '/' || c[2] == '\0')) { return NULL; }
+  }
+  return path;
+}
+
+/**
+ * Extracts a regular file from an archive that can only be read in order and
+ * that is too large to hand to a worker
+ *
+ * @param reader the reader positioned at the file's data
+ * @param extractor the extractor writing the files
+ * @param path the path of the file
+ * @param member the decoded header of the file
+ * @return the number of data bytes read
+ */
+static off_t extractStreamed(ArchiveReader* reader, Extractor* extractor, char* path, const ArchiveMember* member) {
+  extractAwaitPath(extractor, path);
+  int fd = extractCreateFile(extractor, path, member->mode, member->size);
+  if (fd == FILE_ERROR) { return 0; }
+  STATS_START(started);
+  off_t copied = readerCopy(reader, fd, member->size);
+  extractFinishFile(fd, member->mtime);
+  STATS_FILE(member->size, started);
+  return copied;
+}
+
+/**
+ * Extracts a sparse member, writing its data runs at their offsets and
+ * leaving the gaps between them as holes in the new file
+ *
+ * @param reader the reader positioned at the member's data
+ * @param extractor the extractor writing the files
+ * @param path the path of the file
+ * @param member the decoded header of the member
+ * @return the number of data bytes read
+ */
+static off_t extractSparse(ArchiveReader* reader, Extractor* extractor, char* path, const ArchiveMember* member) {
+  SparseMap map;
+  off_t consumed;
+  if (!sparseReadMap(reader, member, &map, &consumed)) {
+    fprintf(stderr, "%s: bad sparse map; not extracted\n", member->path);
+    sparseFree(&map);
+    return consumed;
+  }
+  /* Nothing is preallocated, so whatever is not written stays a hole */
+  extractAwaitPath(extractor, path);
+  STATS_START(started);
+  int fd = extractCreateFile(extractor, path, member->mode, 0);
+  if (fd == FILE_ERROR) {
+    sparseFree(&map);
+    return consumed;
+  }
+  for (size_t i = 0; i < map.count; i++) {
+    SparseExtent* extent = &map.extents[i];
+    if (extent->length == 0) { continue; }
+    if (lseek(fd, extent->offset, SEEK_SET) == FILE_ERROR) {
+      perror("lseek");
+      exit(EXIT_FAILURE);
+    }
+    off_t copied = readerCopy(reader, fd, extent->length);
+    consumed += copied;
+    if (copied < extent->length) {
+      fprintf(stderr, "%s: archive ended %lld bytes early\n", path, (long long)(extent->length - copied));
+      break;
+    }
+  }
+  if (ftruncate(fd, member->sparse_size) == FILE_ERROR) {
+    perror("Error setting file size.\n");
+    exit(EXIT_FAILURE);
+  }
+  extractFinishFile(fd, member->mtime);
+  STATS_FILE(member->sparse_size, started);
+  sparseFree(&map);
+  return consumed;
+}
+
+/**
+ * Restores a directory of a GNU incremental archive to what it held when the
+ * archive was made, removing the entries its dumpdir does not list
+ *
+ * @param reader the reader positioned at the dumpdir
+ * @param path the safe path of the directory
+ * @param member the decoded header of the directory
+ * @return the number of data bytes read
+ */
+static off_t pruneDirectory(ArchiveReader* reader, const char* path, ArchiveMember* member) {
+  if (member->size > PAX_RECORDS_LIMIT) {
+    fprintf(stderr, "%s: dumpdir is too large; not pruned\n", member->path);
+    return 0;
+  }
+  char* dumpdir = (char*)safeMalloc(member->size + NULL_TERMINATOR_SIZE);
+  ssize_t size = readerRead(reader, dumpdir, member->size);
+  dumpdir[size] = '\0';
+  if (size == member->size) { extractPrune(path, dumpdir, size + NULL_TERMINATOR_SIZE); }
+  safeFree(dumpdir);
+  return size;
+}
+
+/**
+ * Extracts one member of an archive. Directories and links are created here;
+ * regular files are handed to the extractor's workers.
+ *
+ * @param reader the reader positioned at the member's data
+ * @param member the decoded header of the member
+ * @param context the ExtractContext of the extraction
+ * @return the number of data bytes read
+ */
+static off_t extractMember(ArchiveReader* reader, ArchiveMember* member, void* context) {
+  ExtractContext* extract = (ExtractContext*)context;
+  char* path = memberPath(member->path);
+  if (path == NULL || *path == '\0') {
+    fprintf(stderr, "%s: member name is unsafe; not extracted\n", member->path);
+    return 0;
+  }
+  if (extract->options->verbose) { printListing(extract->options->listing, member); }
+  size_t length = strlen(path);
+  int is_regular = member->typeflag == REGULAR_FILE || member->typeflag == REGULAR_FILE_ALTERNATE;
+  if (member->typeflag == DIRECTORY || (is_regular && path[length - 1] == '/')) {
+    extractDirectory(extract->extractor, path, member->mode, member->mtime);
+  } else if (member->typeflag == GNU_DUMPDIR) {
+    extractDirectory(extract->extractor, path, member->mode, member->mtime);
+    if (extract->options->snapshot != NULL) { return pruneDirectory(reader, path, member); }
+  } else if (member->typeflag == SYMBOLIC_LINK) {
+    extractSymlink(extract->extractor, path, member->linkname);
+  } else if (member->typeflag == HARD_LINK) {
+    char* target = memberPath(member->linkname);
+    if (target == NULL || *target == '\0') {
+      fprintf(stderr, "%s: link target %s is unsafe; not extracted\n", member->path, member->linkname);
+      return 0;
+    }
+    if (member->duplicate) {
+      extractCopy(extract->extractor, path, target, member->mode, member->mtime);
+    } else {
+      extractHardLink(extract->extractor, path, target);
+    }
+  } else if (is_regular && member->sparse_size >= 0) {
+    return extractSparse(reader, extract->extractor, path, member);
+  } else if (is_regular && reader->map == NULL && member->size > EXTRACT_BUFFER_LIMIT) {
+    return extractStreamed(reader, extract->extractor, path, member);
+  } else if (is_regular) {
+    /* The path is stored right after the job, so one allocation covers both */
+    ExtractJob* job = (ExtractJob*)safeMalloc(sizeof(ExtractJob) + length + 1);
+    job->path = (char*)(job + 1);
+    memcpy(job->path, path, length + 1);
+    job->mode = member->mode;
+    job->mtime = member->mtime;
+    job->size = member->size;
+    job->offset = reader->offset;
+    job->data = NULL;
+    /* Without a mapping the data must be taken now, in archive order */
+    if (reader->map == NULL) {
+      job->data = (unsigned char*)safeMalloc(member->size > 0 ? member->size : 1);
+      job->size = readerRead(reader, job->data, member->size);
+    }
+    off_t consumed = job->data != NULL ? job->size : 0;
+    extractFile(extract->extractor, job);
+    return consumed;
+  } else {
+    fprintf(stderr, "%s: file type not supported; not extracted\n", member->path);
+  }
+  return 0;
+}
+
+/**
+ * Removes the paths an incremental archive lists as deleted since the
+ * previous archive. The list runs last path first, so a directory's contents
+ * are removed before it.
+ *
+ * @param deleted the paths, each followed by a newline
+ */
+static void removeDeleted(char* deleted) {
+  for (char* next; *deleted != '\0'; deleted = next + 1) {
+    next = strchr(deleted, '\n');
+    if (next == NULL) { break; }
+    *next = '\0';
+    char* path = memberPath(deleted);
+    if (path == NULL || *path == '\0') {
+      fprintf(stderr, "%s: member name is unsafe; not removed\n", deleted);
+    } else {
+      extractRemove(path);
+    }
+  }
+}
+
+/**
+ * Extracts the contents of a tar archive. This thread parses headers, creates
+ * directories and links, and hands regular files to the worker pool; an
+ * archive that can be mapped is copied out of directly by the workers.
  *
  * @param archive_name the name of the archive to extract
- * @param verbose a flag to indicate whether to give verbose output while
-  extracting the archive
- * @param strict a flag to indicate whether to be strict on files conforming
- to
-  the POSIX-specified USTAR archive format
-*/
-// void extractArchive(char *archive_name, int verbose, int strict) {}
+ * @param name_count the number of members named on the command line
+ * @param names the members to extract, or every member if there are none
+ * @param options the settings of the archive operation
+ */
+void extractArchive(char* archive_name, int name_count, char* names[], const ArchiveOptions* options) {
+  int fd = openArchive(archive_name, O_RDONLY);
+  ArchiveReader* reader = readerOpen(fd, options->compress_threads);
+  size_t workers = options->threads > 1 ? options->threads : 0;
+  /* Batches go through the workers, so writing inline never batches */
+  int batch = workers > 0 && options->io_uring && safeUseUring(1);
+  ExtractContext context = {.extractor = extractOpen(fd, workers, options->inflight, batch), .options = options};
+  int failed = scanArchive(archive_name, reader, name_count, names, options, extractMember, &context);
+  failed |= extractClose(context.extractor);
+  if (options->snapshot != NULL && reader->deleted != NULL) { removeDeleted(reader->deleted); }
+  readerClose(reader);
+  safeDropCache(fd, 0, 0);
+  closeArchive(archive_name, fd);
+  if (failed) { exit(EXIT_FAILURE); }
+}
+
+/**
+ * Records one member of an archive in an index
+ *
+ * @param reader the reader of the archive
+ * @param member the decoded header of the member
+ * @param context the IndexWriter collecting the index
+ * @return 0, as the data of the member is skipped
+ */
+static off_t indexMember(ArchiveReader* reader, ArchiveMember* member, void* context) {
+  UNUSED(reader);
+  indexWriterAdd((IndexWriter*)context, member->path, member->header_offset, member->size, member->typeflag);
+  return 0;
+}
+
+/**
+ * Builds the sidecar index of an existing archive in one pass over its
+ * headers
+ *
+ * @param archive_name the name of the archive to index
+ * @param options the settings of the archive operation
+ */
+void buildIndex(char* archive_name, const ArchiveOptions* options) {
+  int fd = openArchive(archive_name, O_RDONLY);
+  ArchiveReader* reader = readerOpen(fd, options->compress_threads);
+  if (reader->decompressor != NULL) {
+    fprintf(stderr, "%s: cannot index a compressed archive\n", archive_name);
+    exit(EXIT_FAILURE);
+  }
+  IndexWriter* index = indexWriterOpen();
+  if (scanArchive(archive_name, reader, 0, NULL, options, indexMember, index)) { exit(EXIT_FAILURE); }
+  readerClose(reader);
+  saveIndex(index, archive_name);
+  closeArchive(archive_name, fd);
+}
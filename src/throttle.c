@@ -0,0 +1,235 @@
+/*
+ * throttle.c - token-bucket limits on the bandwidth and operations of I/O
+ *
+ * Every read and write in safe_file pays for itself once it is done: the bytes
+ from a byte bucket and one token from an operation bucket of its direction.
+ A bucket may be overdrawn, and the thread that overdraws it sleeps for as long
+ as the rate takes to pay the debt back, so the rate holds over time however
+ large each operation is and however many threads share the budget. The limits
+ can be changed while running by editing the limit file and sending SIGHUP.
+ */
+#include "../include/throttle.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+Throttle global_throttle = {.enabled = 0, .limit_file = NULL, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* The limits given on the command line, which the limit file overrides */
+static ThrottleLimits base_limits;
+
+/* Set by SIGHUP, asking for the limit file to be read again */
+static volatile sig_atomic_t reload_pending = 0;
+
+/* The names of the limits, as written in a limit file */
+static const char* byte_keys[THROTTLE_NUM_DIRECTIONS] = {"read-limit", "write-limit"};
+static const char* op_keys[THROTTLE_NUM_DIRECTIONS] = {"read-ops", "write-ops"};
+
+/**
+ * Reads the monotonic clock
+ *
+ * @return the time in nanoseconds
+ */
+static uint64_t throttleNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Notes that the limit file should be read again; runs as a signal handler
+ *
+ * @param signum the signal received
+ */
+static void requestReload(int signum) {
+  (void)signum;
+  reload_pending = 1;
+}
+
+/**
+ * Changes the rate of a bucket, keeping what it has saved up to the new burst
+ *
+ * @param bucket the bucket to change
+ * @param rate the new rate per second, or 0 to stop limiting
+ * @param now the current time
+ */
+static void setRate(TokenBucket* bucket, uint64_t rate, uint64_t now) {
+  double burst = (double)rate * THROTTLE_BURST_SECONDS;
+  if (bucket->rate == 0 || bucket->tokens > burst) { bucket->tokens = burst; }
+  bucket->rate = (double)rate;
+  bucket->updated = now;
+}
+
+/**
+ * Sets the rates of every bucket
+ *
+ * @param limits the limits to enforce
+ */
+static void applyLimits(const ThrottleLimits* limits) {
+  uint64_t now = throttleNow();
+  for (int i = 0; i < THROTTLE_NUM_DIRECTIONS; i++) {
+    setRate(&global_throttle.bytes[i], limits->bytes[i], now);
+    setRate(&global_throttle.ops[i], limits->ops[i], now);
+  }
+}
+
+/**
+ * Parses a limit with an optional K, M or G suffix
+ *
+ * @param text the text to parse
+ * @param value where to store the limit
+ * @return nonzero if the text is a limit
+ */
+static int parseLimit(const char* text, uint64_t* value) {
+  text += strspn(text, " \t");
+  /* strtoull would accept a sign and wrap a negative limit around */
+  if (!isdigit((unsigned char)*text)) { return 0; }
+  char* end = NULL;
+  errno = 0;
+  unsigned long long parsed = strtoull(text, &end, 10);
+  if (errno != 0) { return 0; }
+  int shifts = 0;
+  switch (*end) {
+    case 'G': shifts++;
+    /* fall through */
+    case 'M': shifts++;
+    /* fall through */
+    case 'K': shifts++; end++; break;
+    default: break;
+  }
+  for (; shifts > 0; shifts--) {
+    if (parsed > ULLONG_MAX / 1024) { return 0; }
+    parsed *= 1024;
+  }
+  end += strspn(end, " \t\r\n");
+  if (*end != '\0') { return 0; }
+  *value = parsed;
+  return 1;
+}
+
+/**
+ * Reads the limit file over the limits given on the command line. A line
+ * holds a key and a limit, such as read-limit=20M; blank lines and lines
+ * starting with # are skipped. The limits are kept as they were if the file
+ * cannot be read or has a bad line.
+ */
+static void loadLimitFile(void) {
+  FILE* file = fopen(global_throttle.limit_file, "r");
+  if (file == NULL) {
+    fprintf(stderr, "%s: %s; limits unchanged\n", global_throttle.limit_file, strerror(errno));
+    return;
+  }
+  ThrottleLimits limits = base_limits;
+  char line[THROTTLE_LINE_SIZE];
+  int valid = 1;
+  for (int number = 1; valid && fgets(line, sizeof(line), file) != NULL; number++) {
+    char* key = line + strspn(line, " \t");
+    if (*key == '#' || *key == '\n' || *key == '\0') { continue; }
+    char* value = strchr(key, '=');
+    valid = 0;
+    if (value == NULL) { break; }
+    *value++ = '\0';
+    key[strcspn(key, " \t")] = '\0';
+    for (int i = 0; i < THROTTLE_NUM_DIRECTIONS && !valid; i++) {
+      if (strcmp(key, byte_keys[i]) == 0) { valid = parseLimit(value, &limits.bytes[i]); }
+      if (strcmp(key, op_keys[i]) == 0) { valid = parseLimit(value, &limits.ops[i]); }
+    }
+    if (!valid) { fprintf(stderr, "%s:%d: bad limit; limits unchanged\n", global_throttle.limit_file, number); }
+  }
+  fclose(file);
+  if (valid) { applyLimits(&limits); }
+}
+
+/**
+ * Tops up a bucket and pays an amount out of it
+ *
+ * @param bucket the bucket to pay from
+ * @param amount the tokens to pay
+ * @param now the current time
+ * @return the nanoseconds to sleep until the bucket is no longer overdrawn
+ */
+static uint64_t spend(TokenBucket* bucket, double amount, uint64_t now) {
+  if (bucket->rate == 0) { return 0; }
+  double burst = bucket->rate * THROTTLE_BURST_SECONDS;
+  bucket->tokens += (double)(now - bucket->updated) * bucket->rate / 1e9;
+  if (bucket->tokens > burst) { bucket->tokens = burst; }
+  bucket->updated = now;
+  bucket->tokens -= amount;
+  return bucket->tokens < 0 ? (uint64_t)(-bucket->tokens / bucket->rate * 1e9) : 0;
+}
+
+/**
+ * Starts throttling I/O. Does nothing if no limit is set and there is no
+ * limit file to set one later.
+ *
+ * @param limits the limits given on the command line
+ * @param limit_file the file to read limits from now and on SIGHUP, or NULL
+ */
+void throttleOpen(const ThrottleLimits* limits, const char* limit_file) {
+  base_limits = *limits;
+  global_throttle.limit_file = limit_file;
+  int limited = limit_file != NULL;
+  for (int i = 0; i < THROTTLE_NUM_DIRECTIONS; i++) { limited |= limits->bytes[i] != 0 || limits->ops[i] != 0; }
+  if (!limited) { return; }
+  global_throttle.start = throttleNow();
+  applyLimits(limits);
+  if (limit_file != NULL) {
+    loadLimitFile();
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestReload;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+  }
+  global_throttle.enabled = 1;
+}
+
+/**
+ * Pays for one operation that moved some bytes and sleeps while the budget of
+ * its direction is overdrawn
+ *
+ * @param direction THROTTLE_READ or THROTTLE_WRITE
+ * @param bytes the number of bytes the operation moved
+ */
+void throttleWait(ThrottleDirection direction, uint64_t bytes) {
+  pthread_mutex_lock(&global_throttle.lock);
+  if (reload_pending) {
+    reload_pending = 0;
+    loadLimitFile();
+  }
+  uint64_t now = throttleNow();
+  uint64_t wait = spend(&global_throttle.bytes[direction], (double)bytes, now);
+  uint64_t wait_ops = spend(&global_throttle.ops[direction], 1, now);
+  if (wait_ops > wait) { wait = wait_ops; }
+  global_throttle.moved[direction] += bytes;
+  global_throttle.done[direction]++;
+  pthread_mutex_unlock(&global_throttle.lock);
+  if (wait == 0) { return; }
+  /* Sleep to a deadline, so that signals only cut the sleep into pieces */
+  uint64_t until = now + wait;
+  struct timespec deadline = {.tv_sec = (time_t)(until / 1000000000ULL), .tv_nsec = (long)(until % 1000000000ULL)};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {}
+}
+
+/**
+ * Stops throttling and reports the throughput the run achieved, if it was
+ * throttled
+ */
+void throttleClose(void) {
+  if (!global_throttle.enabled) { return; }
+  global_throttle.enabled = 0;
+  double seconds = (double)(throttleNow() - global_throttle.start) / 1e9;
+  if (seconds <= 0) { seconds = 1e-9; }
+  const char* verbs[THROTTLE_NUM_DIRECTIONS] = {"read", "wrote"};
+  for (int i = 0; i < THROTTLE_NUM_DIRECTIONS; i++) {
+    fprintf(stderr, "Throttled: %s %.1f MiB in %llu operations over %.1f s (%.2f MiB/s, %.0f operations/s)\n", verbs[i],
+            (double)global_throttle.moved[i] / (1024 * 1024), (unsigned long long)global_throttle.done[i], seconds,
+            (double)global_throttle.moved[i] / (1024 * 1024) / seconds, (double)global_throttle.done[i] / seconds);
+  }
+}
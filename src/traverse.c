@@ -0,0 +1,534 @@
+/*
+ * traverse.c - parallel depth-first traversal of directory trees
+ *
+ * Directories are listed (getdents64, then statx of every child relative to
+ the directory) by a pool of worker threads that steal work from each other, while a single consumer
+ walks the listings in depth-first order. Each directory keeps the order in
+ which readdir returned its children, so the walk visits entries in exactly the
+ order a single-threaded recursion would, however many threads are used.
+
+ A listed directory stays open until the writer has walked it, so that its
+ subdirectories are opened and its children statted and read by name relative
+ to it. The kernel then resolves one name per file rather than every component
+ of its path, and the cost of a file does not grow with its depth. The number
+ of directories kept open is bounded; past it, paths are resolved in full. A
+ consumer that reads entries after the walk has moved on, such as the prefetch
+ pipeline, holds a reference to their directory to keep it open until then.
+
+ A listing lives in an arena owned by its directory, sized to fit it exactly,
+ so listing and releasing a directory costs one allocation and one free however
+ many children it has.
+ */
+#include "../include/traverse.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "../include/kiwitar.h"
+#include "../include/safe_alloc.h"
+#include "../include/safe_dir.h"
+#include "../include/stats.h"
+
+/**
+ * Creates a directory waiting to be listed
+ *
+ * @param path the path of the directory, owned by the caller
+ * @param parent the directory holding it, or NULL for a path being walked
+ * @param name the name of the directory within its parent, owned by the caller
+ * @return a pointer to the directory
+ */
+static TraverseDir* newDir(char* path, TraverseDir* parent, const char* name) {
+  TraverseDir* dir = (TraverseDir*)safeMalloc(sizeof(TraverseDir));
+  dir->path = path;
+  dir->parent = parent;
+  dir->name = name;
+  dir->fd = -1;
+  dir->state = DIR_PENDING;
+  dir->refs = 1;
+  dir->num_entries = 0;
+  dir->entries = NULL;
+  arenaInit(&dir->arena, 0);
+  return dir;
+}
+
+/**
+ * Drops one owner of a directory, closing and freeing it when none remain
+ *
+ * @param traversal the traversal the directory belongs to
+ * @param dir the directory to release
+ */
+static void releaseDir(Traversal* traversal, TraverseDir* dir) {
+  if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+  if (dir->fd >= 0) {
+    close(dir->fd);
+    __atomic_sub_fetch(&traversal->open_dirs, 1, __ATOMIC_RELAXED);
+  }
+  safeFree(dir);
+}
+
+/**
+ * Atomically takes responsibility for listing a directory
+ *
+ * @param dir the directory to claim
+ * @return nonzero if the caller now owns the listing
+ */
+static int claimDir(TraverseDir* dir) {
+  int expected = DIR_PENDING;
+  return __atomic_compare_exchange_n(&dir->state, &expected, DIR_CLAIMED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Adds a directory to the bottom of a queue and wakes an idle worker
+ *
+ * @param traversal the traversal the queue belongs to
+ * @param deque the queue to push to
+ * @param dir the directory to push
+ */
+static void pushDir(Traversal* traversal, TraverseDeque* deque, TraverseDir* dir) {
+  __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count == deque->capacity) {
+    /* Unroll the ring into a larger one */
+    size_t capacity = deque->capacity ? deque->capacity * 2 : TRAVERSE_INITIAL_ENTRIES;
+    TraverseDir** tasks = (TraverseDir**)safeMalloc(capacity * sizeof(TraverseDir*));
+    for (size_t i = 0; i < deque->count; i++) { tasks[i] = deque->tasks[(deque->head + i) % deque->capacity]; }
+    safeFree(deque->tasks);
+    deque->tasks = tasks;
+    deque->capacity = capacity;
+    deque->head = 0;
+  }
+  deque->tasks[(deque->head + deque->count) % deque->capacity] = dir;
+  deque->count++;
+  pthread_mutex_unlock(&deque->lock);
+  pthread_mutex_lock(&traversal->lock);
+  traversal->queued++;
+  pthread_cond_signal(&traversal->work_cond);
+  pthread_mutex_unlock(&traversal->lock);
+}
+
+/**
+ * Removes a directory from a queue. The owner takes the newest directory so
+ * that it keeps descending depth-first; thieves take the oldest.
+ *
+ * @param deque the queue to take from
+ * @param steal nonzero to take from the top rather than the bottom
+ * @return the directory taken, or NULL if the queue was empty
+ */
+static TraverseDir* takeDir(TraverseDeque* deque, int steal) {
+  TraverseDir* dir = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    if (steal) {
+      dir = deque->tasks[deque->head];
+      deque->head = (deque->head + 1) % deque->capacity;
+    } else {
+      dir = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+    }
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return dir;
+}
+
+/**
+ * Maps the type of a directory entry that is never archived to its file type
+ * bits, so that the entry need not be statted
+ *
+ * @param type the type reported by the directory, a DT_ value
+ * @return the S_IF bits of the type, or 0 if the entry must be statted
+ */
+static mode_t skippedType(unsigned char type) {
+  switch (type) {
+    case DT_FIFO: return S_IFIFO;
+    case DT_CHR: return S_IFCHR;
+    case DT_BLK: return S_IFBLK;
+    case DT_SOCK: return S_IFSOCK;
+    default: return 0;
+  }
+}
+
+/**
+ * Orders two entries to stat by inode number
+ *
+ * @param a the first entry
+ * @param b the second entry
+ * @return a negative, zero or positive number as a sorts before, with or
+ * after b
+ */
+static int compareInodes(const void* a, const void* b) {
+  uint64_t x = ((const StatOrder*)a)->inode, y = ((const StatOrder*)b)->inode;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Lists a claimed directory: reads every entry, stats those whose type does
+ * not settle how they are archived and queues the subdirectories it contains.
+ * The parent of a directory is still open while it is listed, as the writer
+ * only releases a directory once it has walked every child.
+ *
+ * @param traversal the traversal the directory belongs to
+ * @param dir the directory to list
+ * @param queue the index of the queue to push subdirectories to
+ * @param scratch the calling thread's scratch arena
+ */
+static void listDir(Traversal* traversal, TraverseDir* dir, size_t queue, Arena* scratch) {
+  STATS_START(started);
+  ArenaMark mark = arenaMark(scratch);
+  int fd = dir->parent != NULL && dir->parent->fd >= 0 ? safeOpenDirAt(dir->parent->fd, dir->name)
+                                                       : safeOpenDirAt(AT_FDCWD, dir->path);
+  DirContent* dir_contents = safeReadDir(fd, scratch);
+  int remote = safeDirRemote(fd);
+  size_t path_length = strlen(dir->path);
+  /* Avoid doubling the separator when the path already ends with one */
+  const char* separator = (path_length > 0 && dir->path[path_length - 1] == '/') ? "" : "/";
+  size_t separator_length = strlen(separator);
+  /* Size the listing's arena to hold the entries and every path at once */
+  size_t num_names = dir_contents->num_entries;
+  size_t needed = num_names * sizeof(TraverseEntry) + ARENA_ALIGNMENT +
+                  num_names * (path_length + separator_length + NULL_TERMINATOR_SIZE + ARENA_ALIGNMENT) +
+                  dir_contents->names_length;
+  arenaInit(&dir->arena, needed);
+  TraverseEntry* entries = (TraverseEntry*)arenaAlloc(&dir->arena, num_names * sizeof(TraverseEntry));
+  /* Entries are statted in inode order, which keeps the inode table reads of
+   * a large directory sequential; the listing keeps the directory's order */
+  StatOrder* order = (StatOrder*)arenaAlloc(scratch, num_names * sizeof(StatOrder));
+  size_t count = 0, num_stats = 0;
+  for (size_t i = 0; i < num_names; i++) {
+    const DirEntry* dirent = &dir_contents->entries[i];
+    const char* name = dirent->name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) { continue; }
+    size_t name_length = strlen(name);
+    TraverseEntry* entry = &entries[count];
+    entry->path = (char*)arenaAlloc(&dir->arena, path_length + separator_length + name_length + NULL_TERMINATOR_SIZE);
+    memcpy(entry->path, dir->path, path_length);
+    memcpy(entry->path + path_length, separator, separator_length);
+    memcpy(entry->path + path_length + separator_length, name, name_length + NULL_TERMINATOR_SIZE);
+    entry->name = entry->path + path_length + separator_length;
+    entry->dir = NULL;
+    mode_t type = skippedType(dirent->type);
+    if (type != 0) {
+      /* Nothing is archived for these types, so the type alone will do */
+      memset(&entry->st, 0, sizeof(entry->st));
+      entry->st.st_mode = type;
+      entry->st.st_ino = dirent->inode;
+    } else {
+      order[num_stats].inode = dirent->inode;
+      order[num_stats].index = count;
+      num_stats++;
+    }
+    count++;
+  }
+  qsort(order, num_stats, sizeof(StatOrder), compareInodes);
+  for (size_t i = 0; i < num_stats; i++) {
+    TraverseEntry* entry = &entries[order[i].index];
+    safeStatAt(fd, entry->name, &entry->st, remote);
+    if (S_ISDIR(entry->st.st_mode)) { entry->dir = newDir(entry->path, dir, entry->name); }
+  }
+  arenaReset(scratch, mark);
+  /* Keep the directory open for its children, unless too many already are */
+  if (__atomic_add_fetch(&traversal->open_dirs, 1, __ATOMIC_RELAXED) > traversal->max_open_dirs) {
+    __atomic_sub_fetch(&traversal->open_dirs, 1, __ATOMIC_RELAXED);
+    close(fd);
+    fd = -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    entries[i].dirfd = fd >= 0 ? fd : AT_FDCWD;
+    if (fd < 0) { entries[i].name = entries[i].path; }
+  }
+  dir->fd = fd;
+  dir->entries = entries;
+  dir->num_entries = count;
+  STATS_END(STATS_TRAVERSE, started, 0);
+  /* Queue subdirectories last-first so that the owner pops them in order */
+  if (traversal->num_workers > 0) {
+    for (size_t i = count; i > 0; i--) {
+      if (entries[i - 1].dir != NULL) { pushDir(traversal, &traversal->deques[queue], entries[i - 1].dir); }
+    }
+  }
+  pthread_mutex_lock(&traversal->lock);
+  traversal->pending += count;
+  __atomic_store_n(&dir->state, DIR_DONE, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&traversal->done_cond);
+  pthread_mutex_unlock(&traversal->lock);
+}
+
+/**
+ * The body of a worker thread: list queued directories, preferring the
+ * worker's own queue and stealing from the others when it runs dry
+ *
+ * @param arg the TraverseWorker describing the thread
+ * @return NULL
+ */
+static void* traverseWorker(void* arg) {
+  TraverseWorker* worker = (TraverseWorker*)arg;
+  Traversal* traversal = worker->traversal;
+  size_t num_deques = traversal->num_workers + 1;
+  for (;;) {
+    pthread_mutex_lock(&traversal->lock);
+    /* Stay a bounded distance ahead of the writer */
+    while (!traversal->shutdown && (traversal->queued == 0 || traversal->pending > TRAVERSE_MAX_PENDING)) {
+      pthread_cond_wait(traversal->queued == 0 ? &traversal->work_cond : &traversal->budget_cond, &traversal->lock);
+    }
+    if (traversal->shutdown) {
+      pthread_mutex_unlock(&traversal->lock);
+      break;
+    }
+    pthread_mutex_unlock(&traversal->lock);
+    TraverseDir* dir = takeDir(&traversal->deques[worker->index], 0);
+    for (size_t i = 1; dir == NULL && i < num_deques; i++) {
+      /* The writer never takes from its own queue, so drain it in walk order */
+      size_t victim = (worker->index + i) % num_deques;
+      dir = takeDir(&traversal->deques[victim], victim != traversal->num_workers);
+    }
+    if (dir == NULL) { continue; }
+    pthread_mutex_lock(&traversal->lock);
+    traversal->queued--;
+    pthread_mutex_unlock(&traversal->lock);
+    /* The writer may have listed the directory itself in the meantime */
+    if (claimDir(dir)) { listDir(traversal, dir, worker->index, &worker->scratch); }
+    releaseDir(traversal, dir);
+  }
+  return NULL;
+}
+
+/**
+ * Makes sure a directory has been listed, listing it on the calling thread if
+ * no worker has started on it yet
+ *
+ * @param traversal the traversal the directory belongs to
+ * @param dir the directory that must be listed
+ */
+static void awaitDir(Traversal* traversal, TraverseDir* dir) {
+  if (__atomic_load_n(&dir->state, __ATOMIC_ACQUIRE) == DIR_DONE) { return; }
+  if (claimDir(dir)) {
+    listDir(traversal, dir, traversal->num_workers, &traversal->scratch);
+    return;
+  }
+  pthread_mutex_lock(&traversal->lock);
+  while (__atomic_load_n(&dir->state, __ATOMIC_ACQUIRE) != DIR_DONE) {
+    pthread_cond_wait(&traversal->done_cond, &traversal->lock);
+  }
+  pthread_mutex_unlock(&traversal->lock);
+}
+
+/**
+ * Pushes a directory onto the walk and hands it to the workers
+ *
+ * @param traversal the traversal to descend in
+ * @param dir the directory to descend into
+ */
+static void descend(Traversal* traversal, TraverseDir* dir) {
+  if (traversal->depth == traversal->stack_capacity) {
+    traversal->stack_capacity *= 2;
+    traversal->stack =
+        (TraverseFrame*)safeRealloc(traversal->stack, traversal->stack_capacity * sizeof(TraverseFrame));
+  }
+  traversal->stack[traversal->depth].dir = dir;
+  traversal->stack[traversal->depth].index = 0;
+  traversal->depth++;
+}
+
+/**
+ * Pops the deepest directory off the walk and frees its listing. The
+ * directory is closed once nothing holds it any more.
+ *
+ * @param traversal the traversal to ascend in
+ */
+static void ascend(Traversal* traversal) {
+  TraverseDir* dir = traversal->stack[--traversal->depth].dir;
+  arenaFree(&dir->arena);
+  pthread_mutex_lock(&traversal->lock);
+  traversal->pending -= dir->num_entries;
+  pthread_cond_broadcast(&traversal->budget_cond);
+  pthread_mutex_unlock(&traversal->lock);
+  releaseDir(traversal, dir);
+}
+
+/**
+ * Starts a traversal of several paths
+ *
+ * @param roots the paths to walk, in order
+ * @param num_roots the number of paths to walk
+ * @param num_threads the number of threads listing directories; with one
+ * thread directories are listed by the caller as it walks
+ * @param previous the manifest of the previous run to compare entries to, or
+ * NULL to archive everything
+ * @param snapshot the manifest to record every entry in, or NULL
+ * @param dedup nonzero to return files identical to an earlier one as links
+ * to it
+ * @return a pointer to the traversal
+ */
+Traversal* traverseOpen(char** roots, int num_roots, size_t num_threads, const Snapshot* previous,
+                        SnapshotWriter* snapshot, int dedup) {
+  Traversal* traversal = (Traversal*)safeCalloc(1, sizeof(Traversal));
+  traversal->roots = roots;
+  traversal->num_roots = num_roots;
+  traversal->stack_capacity = TRAVERSE_INITIAL_ENTRIES;
+  traversal->stack = (TraverseFrame*)safeMalloc(traversal->stack_capacity * sizeof(TraverseFrame));
+  arenaInit(&traversal->scratch, 0);
+  linksInit(&traversal->links);
+  traversal->dedup = dedup;
+  if (dedup) { dedupInit(&traversal->contents); }
+  traversal->previous = previous;
+  traversal->snapshot = snapshot;
+  traversal->num_workers = num_threads > 1 ? num_threads : 0;
+  /* Leave most descriptors to the files being read and the archive */
+  traversal->max_open_dirs = TRAVERSE_MAX_OPEN_DIRS;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur / TRAVERSE_FD_SHARE < TRAVERSE_MAX_OPEN_DIRS) {
+    traversal->max_open_dirs = (int)(limit.rlim_cur / TRAVERSE_FD_SHARE);
+  }
+  pthread_mutex_init(&traversal->lock, NULL);
+  pthread_cond_init(&traversal->work_cond, NULL);
+  pthread_cond_init(&traversal->done_cond, NULL);
+  pthread_cond_init(&traversal->budget_cond, NULL);
+  if (traversal->num_workers > 0) {
+    traversal->deques = (TraverseDeque*)safeCalloc(traversal->num_workers + 1, sizeof(TraverseDeque));
+    for (size_t i = 0; i <= traversal->num_workers; i++) { pthread_mutex_init(&traversal->deques[i].lock, NULL); }
+    traversal->workers = (pthread_t*)safeMalloc(traversal->num_workers * sizeof(pthread_t));
+    TraverseWorker* args = (TraverseWorker*)safeMalloc(traversal->num_workers * sizeof(TraverseWorker));
+    for (size_t i = 0; i < traversal->num_workers; i++) {
+      args[i].traversal = traversal;
+      args[i].index = i;
+      arenaInit(&args[i].scratch, 0);
+      if (pthread_create(&traversal->workers[i], NULL, traverseWorker, &args[i]) != 0) {
+        perror("Failed to start traversal thread.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    traversal->worker_args = args;
+  }
+  return traversal;
+}
+
+/**
+ * Fills in what the writer needs to know about an entry beyond its status:
+ * whether it is another link to a file already returned or a copy of one,
+ * and whether it has changed since the previous snapshot or archived copy.
+ * Only files that are archived with their data can be linked to, and deciding
+ * whether a file is a copy may read it.
+ *
+ * @param traversal the traversal returning the entry
+ * @param entry the entry to return
+ * @return the entry
+ */
+static TraverseEntry* visitEntry(Traversal* traversal, TraverseEntry* entry) {
+  entry->link = linksRecord(&traversal->links, &entry->st, entry->path);
+  entry->unchanged = traversal->previous != NULL && snapshotUnchanged(traversal->previous, entry->path, &entry->st);
+  entry->duplicate = 0;
+  if (traversal->dedup && entry->link == NULL && !entry->unchanged) {
+    entry->link = dedupRecord(&traversal->contents, &entry->st, entry->path);
+    entry->duplicate = entry->link != NULL;
+  }
+  if (traversal->snapshot != NULL) { snapshotWriterAdd(traversal->snapshot, entry->path, &entry->st); }
+  return entry;
+}
+
+/**
+ * Returns the next entry of a traversal in depth-first order. Directories are
+ * returned before their children. The entry stays valid until every child of
+ * its parent directory has been returned.
+ *
+ * @param traversal the traversal to advance
+ * @return the next entry, or NULL once every path has been walked
+ */
+TraverseEntry* traverseNext(Traversal* traversal) {
+  while (traversal->depth > 0) {
+    TraverseFrame* frame = &traversal->stack[traversal->depth - 1];
+    awaitDir(traversal, frame->dir);
+    if (frame->index < frame->dir->num_entries) {
+      TraverseEntry* entry = &frame->dir->entries[frame->index++];
+      traversal->parent = frame->dir;
+      if (entry->dir != NULL) { descend(traversal, entry->dir); }
+      return visitEntry(traversal, entry);
+    }
+    ascend(traversal);
+  }
+  traversal->parent = NULL;
+  if (traversal->next_root >= traversal->num_roots) { return NULL; }
+  TraverseEntry* entry = &traversal->root_entry;
+  entry->path = traversal->roots[traversal->next_root++];
+  entry->dirfd = AT_FDCWD;
+  entry->name = entry->path;
+  safeLstat(entry->path, &entry->st);
+  entry->dir = NULL;
+  if (S_ISDIR(entry->st.st_mode)) {
+    entry->dir = newDir(entry->path, NULL, entry->path);
+    descend(traversal, entry->dir);
+    if (traversal->num_workers > 0) {
+      pushDir(traversal, &traversal->deques[traversal->num_workers], entry->dir);
+    }
+  }
+  return visitEntry(traversal, entry);
+}
+
+/**
+ * Keeps the directory of the entry traverseNext returned last open after the
+ * walk moves on, so that the entry can still be opened relative to it. Must be
+ * called before the next call to traverseNext.
+ *
+ * @param traversal the traversal that returned the entry
+ * @return the directory to pass to traverseRelease, or NULL if the entry's
+ * dirfd is AT_FDCWD and nothing needs to be held
+ */
+TraverseDir* traverseHold(Traversal* traversal) {
+  TraverseDir* dir = traversal->parent;
+  if (dir == NULL || dir->fd < 0) { return NULL; }
+  __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+  return dir;
+}
+
+/**
+ * Lets go of a directory held with traverseHold, closing it if the walk has
+ * already left it
+ *
+ * @param traversal the traversal the directory belongs to
+ * @param dir the directory to let go of
+ */
+void traverseRelease(Traversal* traversal, TraverseDir* dir) { releaseDir(traversal, dir); }
+
+/**
+ * Stops the worker threads of a traversal and frees it
+ *
+ * @param traversal the traversal to close
+ */
+void traverseClose(Traversal* traversal) {
+  pthread_mutex_lock(&traversal->lock);
+  traversal->shutdown = 1;
+  pthread_cond_broadcast(&traversal->work_cond);
+  pthread_cond_broadcast(&traversal->budget_cond);
+  pthread_mutex_unlock(&traversal->lock);
+  for (size_t i = 0; i < traversal->num_workers; i++) {
+    pthread_join(traversal->workers[i], NULL);
+    arenaFree(&traversal->worker_args[i].scratch);
+  }
+  /* Directories are only released once the workers are gone, as a worker may
+   * still be listing a child relative to one of them */
+  while (traversal->depth > 0) { ascend(traversal); }
+  if (traversal->num_workers > 0) {
+    /* Directories still queued were listed by the writer; drop the queues' references */
+    for (size_t i = 0; i <= traversal->num_workers; i++) {
+      TraverseDir* dir;
+      while ((dir = takeDir(&traversal->deques[i], 1)) != NULL) { releaseDir(traversal, dir); }
+      safeFree(traversal->deques[i].tasks);
+      pthread_mutex_destroy(&traversal->deques[i].lock);
+    }
+    safeFree(traversal->deques);
+    safeFree(traversal->workers);
+    safeFree(traversal->worker_args);
+  }
+  pthread_cond_destroy(&traversal->budget_cond);
+  pthread_cond_destroy(&traversal->done_cond);
+  pthread_cond_destroy(&traversal->work_cond);
+  pthread_mutex_destroy(&traversal->lock);
+  arenaFree(&traversal->scratch);
+  linksFree(&traversal->links);
+  if (traversal->dedup) { dedupFree(&traversal->contents); }
+  safeFree(traversal->stack);
+  safeFree(traversal);
+}
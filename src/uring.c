@@ -0,0 +1,171 @@
+/*
+ * uring.c - a minimal io_uring interface built on the raw system calls
+ *
+ * Only what the safe_file layer needs is provided: setting up a ring, queueing
+ submission entries, submitting them and reaping completions. The library is
+ not required, so the backend is available wherever the kernel headers are.
+ */
+#include "../include/uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../include/safe_alloc.h"
+
+#define URING_ERROR -1
+
+/**
+ * Sets up a ring and maps its queues
+ *
+ * @param ring the ring to set up
+ * @param entries the number of submission queue entries
+ * @return 0 on success, -1 if io_uring is unavailable
+ */
+int uringInit(Uring* ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd == URING_ERROR) { return URING_ERROR; }
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  /* Newer kernels let both rings share a single mapping */
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) { ring->sq_ring_size = ring->cq_ring_size; }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    close(ring->fd);
+    return URING_ERROR;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->fd);
+      return URING_ERROR;
+    }
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cq_ring != ring->sq_ring) { munmap(ring->cq_ring, ring->cq_ring_size); }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return URING_ERROR;
+  }
+  unsigned char* sq = (unsigned char*)ring->sq_ring;
+  unsigned char* cq = (unsigned char*)ring->cq_ring;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  ring->sq_entries = params.sq_entries;
+  return 0;
+}
+
+/**
+ * Asks the kernel whether it implements every one of a set of operations
+ *
+ * @param ring the ring to probe
+ * @param opcodes the IORING_OP_ values that are needed
+ * @param count the number of opcodes
+ * @return nonzero if every operation is supported
+ */
+int uringSupports(Uring* ring, const int* opcodes, size_t count) {
+  size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = (struct io_uring_probe*)safeCalloc(1, size);
+  int supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+  for (size_t i = 0; supported && i < count; i++) {
+    supported = opcodes[i] <= probe->last_op && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  safeFree(probe);
+  return supported;
+}
+
+/**
+ * Takes the next free submission queue entry, submitting what is queued if the
+ * queue is full
+ *
+ * @param ring the ring to queue on
+ * @return a zeroed submission queue entry
+ */
+struct io_uring_sqe* uringGetSqe(Uring* ring) {
+  if (ring->queued == ring->sq_entries) { uringSubmit(ring, 0); }
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+  return sqe;
+}
+
+/**
+ * Submits every queued entry and waits for some completions
+ *
+ * @param ring the ring to submit on
+ * @param wait_nr the number of completions to wait for
+ * @return 0 on success, -1 with errno set on failure
+ */
+int uringSubmit(Uring* ring, unsigned wait_nr) {
+  unsigned to_submit = ring->queued;
+  while (to_submit > 0 || wait_nr > 0) {
+    int r = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (r == URING_ERROR) {
+      if (errno == EINTR) { continue; }
+      return URING_ERROR;
+    }
+    to_submit -= r;
+    ring->queued -= r;
+    /* The kernel waited for the completions when it accepted the batch */
+    if (to_submit == 0) { break; }
+  }
+  return 0;
+}
+
+/**
+ * Returns the oldest unseen completion without waiting
+ *
+ * @param ring the ring to reap from
+ * @return a completion, or NULL if none is ready
+ */
+struct io_uring_cqe* uringPeek(Uring* ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) { return NULL; }
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * Marks the completion returned by uringPeek as consumed
+ *
+ * @param ring the ring to reap from
+ */
+void uringSeen(Uring* ring) { __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE); }
+
+/**
+ * Unmaps the queues of a ring and closes it
+ *
+ * @param ring the ring to tear down
+ */
+void uringExit(Uring* ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring) { munmap(ring->cq_ring, ring->cq_ring_size); }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
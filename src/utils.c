@@ -1,4 +1,7 @@
 #include "../include/utils.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -19,4 +22,37 @@ void panic(char* str) {
 void usage(char* prog_name) {
   fprintf(stderr, USAGE_STRING, prog_name);
   exit(EXIT_FAILURE);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief parseSize - A function that parses a count or a size in bytes with an
+ * optional K, M or G suffix, and prints the usage on invalid input.
+ * @param prog_name - a pointer to the program name
+ * @param str - a pointer to the string to parse
+ * @param min - the smallest value accepted
+ * @param max - the largest value accepted
+ * @return size_t - the parsed value
+ */
+size_t parseSize(char* prog_name, const char* str, size_t min, size_t max) {
+  /* strtoull would accept a sign and wrap a negative value around */
+  if (!isdigit((unsigned char)*str)) { usage(prog_name); }
+  char* end = NULL;
+  errno = 0;
+  unsigned long long value = strtoull(str, &end, 10);
+  if (errno == ERANGE) { usage(prog_name); }
+  int shifts = 0;
+  switch (*end) {
+    case 'G': shifts++;
+    /* fall through */
+    case 'M': shifts++;
+    /* fall through */
+    case 'K': shifts++; end++; break;
+    default: break;
+  }
+  for (; shifts > 0; shifts--) {
+    if (value > ULLONG_MAX / 1024) { usage(prog_name); }
+    value *= 1024;
+  }
+  if (*end != '\0' || value < min || value > max) { usage(prog_name); }
+  return value;
+}